@@ -4,7 +4,9 @@
   #include "src/define.h"
   #include "src/common.h"
   extern int runCUTE(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *random_catalog, Catalog *random_catalog2, Result *result, int verbose);
+  extern int runCUTE_batch(CatalogBatch *batch, Catalog *random_catalog, int verbose);
   extern Catalog *read_Catalog(char *fname);
+  extern void convert_catalog(char *fname_in,char *fname_out);
   extern void free_Catalog(Catalog *cat);
   extern void read_run_params(char *paramfile);
   extern Result *make_empty_result_struct();
@@ -13,6 +15,12 @@
   extern void finalize_mpi();
 
   extern Catalog *create_catalog_from_numpy(int n, double *phi, int n1, double *cth, int n2, double *red, int n3, double *weight);
+  extern void set_catalog_regions(Catalog *cat, int n, int *region);
+
+  extern CatalogBatch *make_catalog_batch(int n);
+  extern void set_batch_catalog(CatalogBatch *batch, int i, Catalog *cat);
+  extern Result *get_batch_result(CatalogBatch *batch, int i);
+  extern void free_catalog_batch(CatalogBatch *batch);
 
   extern void initialize_binner();
   extern int verify_parameters();
@@ -25,9 +33,11 @@
   extern void set_reuse_randoms(int i);
   extern void set_num_lines(char *s);
   extern void set_input_format(int i);
+  extern void set_hdf5_datasets(char *s);
   extern void set_output_filename(char *s);
   extern void set_mask_filename(char *s);
   extern void set_z_dist_filename(char *s);
+  extern void set_rr_cache_dir(char *s);
   extern void set_corr_estimator(char *s);
   extern void set_corr_type(char *s);
   extern void set_np_rand_fact(int i);
@@ -46,6 +56,12 @@
   extern void set_n_logint(int i);
   extern void set_use_pm(int i);
   extern void set_n_pix_sph(int i);
+  extern void set_pm_levels(int i);
+  extern void set_box_order(char *s);
+  extern void set_pixelization(char *s);
+  extern void set_use_tree(int i);
+  extern void set_n_jk_regions(int i);
+  extern void set_mpi_domains(int i);
 
   struct Catalog{
     int np;
@@ -53,6 +69,9 @@
   #ifdef _WITH_WEIGHTS
     double *weight;
   #endif
+    int *region;
+    void *map;
+    size_t map_size;
     np_t sum_w, sum_w2;
   };
 
@@ -63,6 +82,8 @@
          *D2D2, *D2R1, *D2R2, 
          *R1R1, *R1R2, 
          *R2R2;
+    int n_jk;
+    double *corr_jk;
   };
 %}
 
@@ -72,11 +93,14 @@ import_array();
 %}
 %apply (int DIM1, double* INPLACE_ARRAY1) {(int n0, double *a0)};
 %apply (int DIM1, double* IN_ARRAY1) {(int n, double *phi), (int n1, double *cth), (int n2, double *red), (int n3, double *weight)};
+%apply (int DIM1, int* IN_ARRAY1) {(int n, int *region)};
 
 #include "src/define.h"
 #include "src/common.h"
 extern int runCUTE(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *random_catalog, Catalog *random_catalog2, Result *result, int verbose);
+extern int runCUTE_batch(CatalogBatch *batch, Catalog *random_catalog, int verbose);
 extern Catalog *read_Catalog(char *fname);
+extern void convert_catalog(char *fname_in,char *fname_out);
 extern void free_Catalog(Catalog *cat);
 extern void read_run_params(char *paramfile);
 extern Result *make_empty_result_struct();
@@ -85,6 +109,12 @@ extern int get_corr_type();
 extern void finalize_mpi();
 
 extern Catalog *create_catalog_from_numpy(int n, double *phi, int n1, double *cth, int n2, double *red, int n3, double *weight);
+extern void set_catalog_regions(Catalog *cat, int n, int *region);
+
+extern CatalogBatch *make_catalog_batch(int n);
+extern void set_batch_catalog(CatalogBatch *batch, int i, Catalog *cat);
+extern Result *get_batch_result(CatalogBatch *batch, int i);
+extern void free_catalog_batch(CatalogBatch *batch);
 
 extern void initialize_binner();
 extern int verify_parameters();
@@ -97,9 +127,11 @@ extern void set_random_filename2(char *s);
 extern void set_reuse_randoms(int i);
 extern void set_num_lines(char *s);
 extern void set_input_format(int i);
+extern void set_hdf5_datasets(char *s);
 extern void set_output_filename(char *s);
 extern void set_mask_filename(char *s);
 extern void set_z_dist_filename(char *s);
+extern void set_rr_cache_dir(char *s);
 extern void set_corr_estimator(char *s);
 extern void set_corr_type(char *s);
 extern void set_np_rand_fact(int i);
@@ -118,6 +150,12 @@ extern void set_log_bin(int i);
 extern void set_n_logint(int i);
 extern void set_use_pm(int i);
 extern void set_n_pix_sph(int i);
+extern void set_pm_levels(int i);
+extern void set_box_order(char *s);
+extern void set_pixelization(char *s);
+extern void set_use_tree(int i);
+extern void set_n_jk_regions(int i);
+extern void set_mpi_domains(int i);
 
 struct Catalog{
   int np;
@@ -125,6 +163,9 @@ struct Catalog{
 #ifdef _WITH_WEIGHTS
   double *weight;
 #endif
+  int *region;
+  void *map;
+  size_t map_size;
   np_t sum_w, sum_w2;
 };
 
@@ -165,6 +206,8 @@ struct Result {
          *D2D2, *D2R1, *D2R2, 
          *R1R1, *R1R2, 
          *R2R2;
+  int n_jk;
+  double *corr_jk;
 };
 
 %extend Result{
@@ -225,6 +268,12 @@ struct Result {
   double get_R2R2(int i) {
     return $self->R2R2[i];
   }
+  int get_n_jk(){
+    return $self->n_jk;
+  }
+  double get_corr_jk(int i) {
+    return $self->corr_jk[i];
+  }
   ~Result(){
     free($self->x);
     free($self->y);
@@ -240,6 +289,7 @@ struct Result {
     free($self->R1R1);
     free($self->R1R2);
     free($self->R2R2);
+    free($self->corr_jk);
   }
 }
 
@@ -30,6 +30,11 @@ import numpy as np
  If paircounts are outputted then we also output (after corr)
  [ DD, DR, RR ] for corr_type < 7 and [ D1D2, D1R2, D2R1, R1R2 ] for corr_type = 7,8
 
+ If n_jk_regions > 0 (corr_type = 2, 3, 4) every object needs a jackknife
+ region (an extra column in the files, or region = ... when creating catalogs
+ from numpy) and the leave-one-out correlation functions [corr_jk] are
+ appended to the output, with corr_jk[k] the one without region k
+
  We can also fetch paircount from [result] if wanted, see CUTEPython.i for
  available functions.
 
@@ -55,6 +60,70 @@ def runCUTE(paramfile = None, galaxy_catalog = None, galaxy_catalog2 = None, ran
   result = cute.make_empty_result_struct()
   cute.runCUTE(galaxy_catalog,galaxy_catalog2,random_catalog,random_catalog2,result,verbose)
 
+  output = fetchResult(result)
+  if(result.get_n_jk() > 0):
+    output = output + (fetchJackknife(result),)
+  return output
+
+"""
+ Run CUTE on a batch of data catalogs sharing a single random catalog
+
+ The random boxes and the RR paircounts are computed only once and
+ the catalogs are correlated in parallel. Only the 3D correlation
+ functions (corr_type = 2, 3, 4) are supported.
+
+ Input:
+    * Filename of CUTE parameterfile (or parameters set by set_CUTE_parameters(...))
+    * List of catalogs in CUTE format, see readCatalog(...)
+    * Random catalog in CUTE format. If not provided it is read from file
+
+ Output:
+    * List with one entry per catalog, each the same as the output of runCUTE
+      The output file of catalog i is output_filename + "_i"
+
+ NB: as in runCUTE the positions of the catalogs are turned into
+ Cartesian coordinates in place, so they can't be reused for a new run
+"""
+def runCUTE_batch(paramfile = None, galaxy_catalogs = [], random_catalog = None, verbose = True):
+
+  if(paramfile is not None):
+    cute.read_run_params(paramfile)
+
+  # Check for errors in parameters
+  err = cute.verify_parameters()
+  if(err > 0): return
+
+  batch = cute.make_catalog_batch(len(galaxy_catalogs))
+  for i in range(len(galaxy_catalogs)):
+    cute.set_batch_catalog(batch,i,galaxy_catalogs[i])
+  err = cute.runCUTE_batch(batch,random_catalog,verbose)
+
+  # Fetch results before the batch and its results are freed
+  results = None
+  if(err == 0):
+    results = [fetchResult(cute.get_batch_result(batch,i)) for i in range(len(galaxy_catalogs))]
+  cute.free_catalog_batch(batch)
+
+  return results
+
+"""
+ Leave-one-out correlation functions of a CUTE result struct,
+ as an array of shape (n_jk, nx) or (n_jk, nx, ny)
+"""
+def fetchJackknife(result):
+  n_jk = result.get_n_jk()
+  shape = [result.get_nx()]
+  if(result.get_ny() > 0): shape.append(result.get_ny())
+  nbins = int(np.prod(shape))
+  corr_jk = np.array([result.get_corr_jk(i) for i in range(n_jk * nbins)])
+  return corr_jk.reshape([n_jk] + shape)
+
+"""
+ Convert the content of a CUTE result struct to numpy arrays,
+ see runCUTE for the output format
+"""
+def fetchResult(result):
+
   # Fetch results
   corr_type_oneD = [0,1,2,7]; corr_type_twoD   = [3,4,8]; corr_type_threeD = [5,6]
   if(cute.get_corr_type() in corr_type_oneD):
@@ -165,8 +234,10 @@ def set_CUTE_parameters(
     reuse_randoms=0,
     num_lines="all",
     input_format=2,
+    hdf5_datasets="z,dec,ra,weight,region",
     mask_filename="",
     z_dist_filename="",
+    rr_cache_dir="none",
     output_filename="",
     corr_estimator="LS",
     corr_type="monopole",
@@ -185,7 +256,13 @@ def set_CUTE_parameters(
     log_bin=0,
     n_logint=10,
     use_pm=1,
-    n_pix_sph=2048):
+    n_pix_sph=2048,
+    pm_levels=1,
+    box_order="none",
+    pixelization="grid",
+    use_tree=0,
+    n_jk_regions=0,
+    mpi_domains=0):
 
   if(paramfile is not None):
     cute.read_run_params(paramfile)
@@ -201,8 +278,12 @@ def set_CUTE_parameters(
   cute.set_output_filename(output_filename)
   cute.set_corr_type(corr_type)
   cute.set_num_lines(num_lines)
+  cute.set_box_order(box_order)
+  cute.set_pixelization(pixelization)
+  cute.set_hdf5_datasets(hdf5_datasets)
   cute.set_mask_filename(mask_filename)
   cute.set_z_dist_filename(z_dist_filename)
+  cute.set_rr_cache_dir(rr_cache_dir)
   cute.set_corr_estimator(corr_estimator)
 
   # Doubles
@@ -226,6 +307,10 @@ def set_CUTE_parameters(
   cute.set_reuse_randoms(reuse_randoms)
   cute.set_use_pm(use_pm)
   cute.set_n_pix_sph(n_pix_sph)
+  cute.set_pm_levels(pm_levels)
+  cute.set_use_tree(use_tree)
+  cute.set_n_jk_regions(n_jk_regions)
+  cute.set_mpi_domains(mpi_domains)
 
   # Check if parameters are good
   # err = cute.verify_parameters()
@@ -251,6 +336,18 @@ def readCatalog(paramfile, filename):
     cute.read_run_params(paramfile)
   return cute.read_Catalog(filename)
 
+"""
+ Use CUTE to convert catalog filename_in into the binary catalog
+ filename_out, which readCatalog and runCUTE then load by mapping it
+ into memory. The input is read according to the current parameters
+ (input_format, num_lines and n_jk_regions)
+ If paramfile = None we assume the parameters have already been set in CUTE by set_CUTE_parameters
+"""
+def convertCatalog(paramfile, filename_in, filename_out):
+  if(paramfile is not None):
+    cute.read_run_params(paramfile)
+  cute.convert_catalog(filename_in, filename_out)
+
 """
  A galaxy catalog in Python format
  Use convert_to_python to convert a catalog from C format to Python format
@@ -315,8 +412,9 @@ class PyCatalog:
 
 """
   Create a CUTE galaxy catalog in C format from numpy arrays of phi, cos(theta), redshift and weight
+  and, for jackknife runs, of the region of each object
 """
-def createCatalogFromNumpy_phicthz(phi,cth,red,weight = None):
+def createCatalogFromNumpy_phicthz(phi,cth,red,weight = None,region = None):
   ok = True
   if (type(phi)     is not np.ndarray): ok = False
   if (type(cth)     is not np.ndarray): ok = False
@@ -327,14 +425,16 @@ def createCatalogFromNumpy_phicthz(phi,cth,red,weight = None):
     print("Error: all input needs to be numpy double arrays (weight can be None)")
     return None
   if(weight is None):
-    tmp = np.ones(phi.size,dtype='float64')
-    return cute.create_catalog_from_numpy(phi,cth,red,tmp)
-  return cute.create_catalog_from_numpy(phi,cth,red,weight)
+    weight = np.ones(phi.size,dtype='float64')
+  catalog = cute.create_catalog_from_numpy(phi,cth,red,weight)
+  if((catalog is not None) and (region is not None)):
+    cute.set_catalog_regions(catalog,np.asarray(region,dtype='int32'))
+  return catalog
 
 """
   Create a CUTE galaxy catalog in C format from numpy arrays of RA, Dec, redshift, and weight (angles in degrees)
 """
-def createCatalogFromNumpy_radecz(ra, dec, red, weight=None):
+def createCatalogFromNumpy_radecz(ra, dec, red, weight=None, region=None):
   ok = True
   if (type(ra)     is not np.ndarray): ok = False
   if (type(dec)     is not np.ndarray): ok = False
@@ -346,10 +446,7 @@ def createCatalogFromNumpy_radecz(ra, dec, red, weight=None):
     return None
   phi = np.deg2rad(ra)
   cth = np.cos(np.deg2rad(90 - dec))
-  if(weight is None):
-    tmp = np.ones(ra.size,dtype='float64')
-    return cute.create_catalog_from_numpy(phi,cth,red,tmp)
-  return cute.create_catalog_from_numpy(phi,cth,red,weight)
+  return createCatalogFromNumpy_phicthz(phi,cth,red,weight,region)
 
 """
  Print CUTE parameters
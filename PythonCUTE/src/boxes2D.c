@@ -33,6 +33,251 @@ static double cth_min_bound;
 static double cth_max_bound;
 static double phi_min_bound;
 static double phi_max_bound;
+static int n_side_cth_0; //Resolution set by init_2D_params
+static int n_side_phi_0;
+
+/////////////////////////
+// HEALPix pixelization
+// With pixelization=1 the sphere is divided into the 12*nside^2
+// equal-area pixels of HEALPix (Gorski et al. 2005, ApJ 622, 759)
+// in the NESTED scheme, with nside=2^hpx_order. The 4 children of
+// pixel ipix at the next order are 4*ipix..4*ipix+3, so the pixels
+// within a disc are found by descending from the 12 base pixels,
+// only opening those that cross the edge of the disc.
+#define HPX_SLACK 1E-9 //Margin (rad) on disc radii
+
+static int hpx_order;
+static int hpx_order_0; //hpx_order set by init_2D_params
+static double hpx_pixrad[HPX_ORDER_MAX+1]; //Max. pixel radius at each order
+static double *hpx_centers=NULL; //Pixel centers at orders 0..hpx_order
+static const int hpx_jrll[12]={2,2,2,2,3,3,3,3,4,4,4,4};
+static const int hpx_jpll[12]={1,3,5,7,0,2,4,6,1,3,5,7};
+
+static int spread_bits(int v)
+{
+  //////
+  // Moves bit i of v (<2^16) to bit 2*i
+  unsigned int x=v;
+  x=(x|(x<<8))&0x00FF00FFu;
+  x=(x|(x<<4))&0x0F0F0F0Fu;
+  x=(x|(x<<2))&0x33333333u;
+  x=(x|(x<<1))&0x55555555u;
+  return (int)x;
+}
+
+static int compress_bits(int v)
+{
+  //////
+  // Inverse of spread_bits, ignoring the odd bits of v
+  unsigned int x=v&0x55555555u;
+  x=(x|(x>>1))&0x33333333u;
+  x=(x|(x>>2))&0x0F0F0F0Fu;
+  x=(x|(x>>4))&0x00FF00FFu;
+  x=(x|(x>>8))&0x0000FFFFu;
+  return (int)x;
+}
+
+static int hpx_ang2pix(int order,double cth,double phi)
+{
+  //////
+  // Returns the nested index of the pixel at order
+  // containing cth,phi
+  int nside=1<<order;
+  int face,ix,iy;
+  double za=fabs(cth);
+  double tt=wrap_phi(phi)/(0.5*M_PI); //in [0,4)
+
+  if(za<=2./3.) { //Equatorial region
+    double temp1=nside*(0.5+tt);
+    double temp2=nside*(cth*0.75);
+    int jp=(int)(temp1-temp2); //Ascending edge line
+    int jm=(int)(temp1+temp2); //Descending edge line
+    int ifp=jp>>order;
+    int ifm=jm>>order;
+    if(ifp==ifm) face=ifp|4;
+    else if(ifp<ifm) face=ifp;
+    else face=ifm+8;
+    ix=jm&(nside-1);
+    iy=nside-(jp&(nside-1))-1;
+  }
+  else { //Polar caps
+    int jp,jm;
+    int ntt=MIN((int)tt,3);
+    double tp=tt-ntt;
+    double tmp=nside*sqrt(3*(1-za));
+    jp=MIN((int)(tp*tmp),nside-1);
+    jm=MIN((int)((1.0-tp)*tmp),nside-1);
+    if(cth>=0) {
+      face=ntt;
+      ix=nside-jm-1;
+      iy=nside-jp-1;
+    }
+    else {
+      face=ntt+8;
+      ix=jp;
+      iy=jm;
+    }
+  }
+
+  return (face<<(2*order))+spread_bits(ix)+(spread_bits(iy)<<1);
+}
+
+static void hpx_pix2vec(int order,int ipix,double *u)
+{
+  //////
+  // Returns in u the unit vector to the center of
+  // pixel ipix at order
+  int nside=1<<order;
+  int face=ipix>>(2*order);
+  int ip=ipix&((1<<(2*order))-1);
+  int ix=compress_bits(ip);
+  int iy=compress_bits(ip>>1);
+  int jr=(hpx_jrll[face]<<order)-ix-iy-1; //Ring index
+  int nr,kshift,jp;
+  double z,sth,phi;
+
+  if(jr<nside) { //North polar cap
+    nr=jr;
+    z=1-nr*(double)nr/(3.0*nside*nside);
+    kshift=0;
+  }
+  else if(jr>3*nside) { //South polar cap
+    nr=4*nside-jr;
+    z=nr*(double)nr/(3.0*nside*nside)-1;
+    kshift=0;
+  }
+  else {
+    nr=nside;
+    z=(2*nside-jr)*2.0/(3.0*nside);
+    kshift=(jr-nside)&1;
+  }
+
+  jp=(hpx_jpll[face]*nr+ix-iy+1+kshift)/2;
+  if(jp>4*nside) jp-=4*nside;
+  if(jp<1) jp+=4*nside;
+  phi=(jp-0.5*(kshift+1))*0.5*M_PI/nr;
+
+  sth=sqrt((1-z)*(1+z));
+  u[0]=sth*cos(phi);
+  u[1]=sth*sin(phi);
+  u[2]=z;
+}
+
+static double hpx_max_pixrad(int order)
+{
+  //////
+  // Returns the maximum angular distance between the
+  // center of a pixel at order and any of its corners
+  int nside=1<<order;
+  double t1=1-1./nside;
+  double za=2./3.,zb=1-t1*t1/3;
+  double phia=0.25*M_PI/nside;
+  double sa=sqrt((1-za)*(1+za)),sb=sqrt((1-zb)*(1+zb));
+  double ua[3]={sa*cos(phia),sa*sin(phia),za};
+  double ub[3]={sb,0,zb};
+  double cr[3]={ua[1]*ub[2]-ua[2]*ub[1],
+		ua[2]*ub[0]-ua[0]*ub[2],
+		ua[0]*ub[1]-ua[1]*ub[0]};
+
+  return atan2(sqrt(cr[0]*cr[0]+cr[1]*cr[1]+cr[2]*cr[2]),
+	       ua[0]*ub[0]+ua[1]*ub[1]+ua[2]*ub[2]);
+}
+
+static double *hpx_center(int order,int ipix)
+{
+  //////
+  // Returns the tabulated unit vector to the center of
+  // pixel ipix at order. Orders are stored consecutively,
+  // with 4*(4^order-1) pixels before order
+  return &(hpx_centers[3*(4*((1L<<(2*order))-1)+ipix)]);
+}
+
+static void hpx_fill_centers(void)
+{
+  //////
+  // Tabulates the centers of all pixels up to hpx_order
+  int order;
+  long n_nodes=4*((1L<<(2*(hpx_order+1)))-1);
+
+  if(hpx_centers!=NULL)
+    free(hpx_centers);
+  hpx_centers=(double *)my_malloc(3*n_nodes*sizeof(double));
+
+  for(order=0;order<=hpx_order;order++) {
+    int ipix;
+    for(ipix=0;ipix<(12<<(2*order));ipix++)
+      hpx_pix2vec(order,ipix,hpx_center(order,ipix));
+  }
+}
+
+static void add_pix_range(PixRanges *pr,int ipix_lo,int ipix_hi)
+{
+  //////
+  // Appends pixels ipix_lo..ipix_hi-1 to pr
+  if((pr->n>0)&&(pr->ipix[2*pr->n-1]==ipix_lo)) {
+    pr->ipix[2*pr->n-1]=ipix_hi;
+    return;
+  }
+  if(pr->n>=pr->size) {
+    pr->size*=2;
+    pr->ipix=(int *)realloc(pr->ipix,2*pr->size*sizeof(int));
+    if(pr->ipix==NULL) {
+      fprintf(stderr,"CUTE: out of memory!\n");
+      exit(1);
+    }
+  }
+  pr->ipix[2*pr->n]=ipix_lo;
+  pr->ipix[2*pr->n+1]=ipix_hi;
+  pr->n++;
+}
+
+static void hpx_query_node(int order,int ipix,double *u0,
+			   double *cos_out,double *cos_in,PixRanges *pr)
+{
+  //////
+  // Adds to pr the pixels descending from pixel ipix at order
+  // that may overlap the disc around u0. The node is skipped if
+  // it lies outside the disc (cos_out[order]), added whole if it
+  // lies inside it or is already small compared to the disc
+  // (cos_in[order]) and opened otherwise
+  double *u=hpx_center(order,ipix);
+  double prod=u[0]*u0[0]+u[1]*u0[1]+u[2]*u0[2];
+  if(prod<cos_out[order])
+    return;
+  if((order==hpx_order)||(prod>=cos_in[order])) {
+    int shift=2*(hpx_order-order);
+    add_pix_range(pr,ipix<<shift,(ipix+1)<<shift);
+  }
+  else {
+    int ic;
+    for(ic=0;ic<4;ic++)
+      hpx_query_node(order+1,4*ipix+ic,u0,cos_out,cos_in,pr);
+  }
+}
+
+static void hpx_query_disc(int ipix,double alpha,PixRanges *pr)
+{
+  //////
+  // Returns in pr all pixels that may hold objects within
+  // alpha of any point in pixel ipix
+  int order,ib;
+  double *u0=hpx_center(hpx_order,ipix);
+  double cos_out[HPX_ORDER_MAX+1],cos_in[HPX_ORDER_MAX+1];
+  double radius=alpha+hpx_pixrad[hpx_order]+HPX_SLACK;
+
+  for(order=0;order<=hpx_order;order++) {
+    double r_out=radius+hpx_pixrad[order];
+    double r_in=radius-hpx_pixrad[order];
+    cos_out[order]=(r_out<M_PI) ? cos(r_out) : -2;
+    cos_in[order]=(r_in>0) ? cos(r_in) : 2;
+    if(hpx_pixrad[order]<0.5*radius) //Small enough: don't open
+      cos_in[order]=-2;
+  }
+
+  pr->n=0;
+  for(ib=0;ib<12;ib++)
+    hpx_query_node(0,ib,u0,cos_out,cos_in,pr);
+}
 
 static int estimate_optimal_nside_radial(void)
 {
@@ -57,6 +302,8 @@ static int sph2pix(double cth,double phi)
     fprintf(stderr,"Wrong cos(theta) = %lf \n",cth);
     exit(1);
   }
+  else if(pixelization==1)
+    return hpx_ang2pix(hpx_order,cth,phi);
   else if(cth==1)
     icth=n_side_cth-1;
   else
@@ -67,6 +314,80 @@ static int sph2pix(double cth,double phi)
   return iphi+icth*n_side_phi;
 }
 
+static void pix2vec(int ipix,double *u)
+{
+  //////
+  // Returns in u the unit vector to the center of pixel ipix
+  int icth,iphi;
+  double cth,phi,sth;
+
+  if(pixelization==1) {
+    double *uc=hpx_center(hpx_order,ipix);
+    u[0]=uc[0];
+    u[1]=uc[1];
+    u[2]=uc[2];
+    return;
+  }
+
+  icth=ipix/n_side_phi;
+  iphi=ipix%n_side_phi;
+  cth=-1.0+2.0*((double)(icth+0.5))/n_side_cth;
+  phi=2*M_PI*((double)(iphi+0.5))/n_side_phi;
+  sth=sqrt(1-cth*cth);
+  u[0]=sth*cos(phi);
+  u[1]=sth*sin(phi);
+  u[2]=cth;
+}
+
+//PixRanges
+PixRanges *mk_PixRanges(void)
+{
+  PixRanges *pr=(PixRanges *)my_malloc(sizeof(PixRanges));
+  pr->n=0;
+  pr->size=64;
+  pr->ipix=(int *)my_malloc(2*pr->size*sizeof(int));
+
+  return pr;
+}
+
+void free_PixRanges(PixRanges *pr)
+{
+  free(pr->ipix);
+  free(pr);
+}
+
+void get_neighbor_pixels(int ipix,int *bounds,double alpha,PixRanges *pr)
+{
+  //////
+  // Returns in pr the pixels that may hold objects within
+  // alpha of pixel ipix. For the (cos(theta),phi) grid these
+  // are read from the pixel bounds (see get_pix_bounds), row
+  // by row in the order of increasing phi index
+  int icth;
+
+  if(pixelization==1) {
+    hpx_query_disc(ipix,alpha,pr);
+    return;
+  }
+
+  pr->n=0;
+  for(icth=bounds[0];icth<=bounds[1];icth++) {
+    int icth_n=icth*n_side_phi;
+    if(bounds[3]-bounds[2]+1>=n_side_phi)
+      add_pix_range(pr,icth_n,icth_n+n_side_phi);
+    else {
+      int iphi_lo=(bounds[2]+n_side_phi)%n_side_phi;
+      int iphi_hi=iphi_lo+bounds[3]-bounds[2]+1;
+      if(iphi_hi<=n_side_phi)
+	add_pix_range(pr,icth_n+iphi_lo,icth_n+iphi_hi);
+      else {
+	add_pix_range(pr,icth_n+iphi_lo,icth_n+n_side_phi);
+	add_pix_range(pr,icth_n,icth_n+iphi_hi-n_side_phi);
+      }
+    }
+  }
+}
+
 //Cell2D
 void free_Cells2D(int npix,Cell2D *cells)
 {
@@ -263,25 +584,76 @@ void init_2D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
     exit(1);
   }
 
-  n_boxes2D=n_side_phi*n_side_cth;
+  if(pixelization==1) {
+    //With PM n_pix_sph is the HEALPix nside. Otherwise
+    //nside is the power of 2 giving about a quarter of the
+    //pixels of the (cos(theta),phi) grid above, since disc
+    //queries cost more than the grid's row ranges
+    int order;
+    if(use_pm&&(ctype!=0)) {
+      hpx_order=0;
+      while((1<<hpx_order)<n_side_cth) hpx_order++;
+    }
+    else if(n_side_cth<=1)
+      hpx_order=0;
+    else
+      hpx_order=(int)(floor(log(n_side_cth/sqrt(24.))/log(2.)+0.5));
+    hpx_order=CLAMP(hpx_order,0,HPX_ORDER_MAX);
+    for(order=0;order<=hpx_order;order++)
+      hpx_pixrad[order]=hpx_max_pixrad(order);
+    hpx_fill_centers();
+    n_boxes2D=12<<(2*hpx_order);
+    print_info("  Using HEALPix pixels with nside = %d\n",1<<hpx_order);
+  }
+  else
+    n_boxes2D=n_side_phi*n_side_cth;
 
-  double pixel_resolution=sqrt(4*M_PI/(n_side_phi*n_side_cth))/DTORAD;
+  n_side_cth_0=n_side_cth;
+  n_side_phi_0=n_side_phi;
+  hpx_order_0=hpx_order;
+
+  double pixel_resolution=sqrt(4*M_PI/n_boxes2D)/DTORAD;
   print_info("  There will be %d = pixels in total\n",n_boxes2D);
   print_info("  Pixel angular resolution is %.4lf deg \n",pixel_resolution);
 }
 
-static void get_pix_bounds(double alpha,int ipix,
-			   int *icth_min,int *icth_max,
-			   int *iphi_min,int *iphi_max)
+void set_2D_level(int level)
+{
+  //////
+  // Switches to the pixelization set by init_2D_params
+  // degraded level times (i.e. with pixels 2^level times
+  // larger). Level 0 restores the original pixels
+  if(pixelization==1) {
+    hpx_order=hpx_order_0-level;
+    n_boxes2D=12<<(2*hpx_order);
+  }
+  else {
+    n_side_cth=n_side_cth_0>>level;
+    n_side_phi=n_side_phi_0>>level;
+    n_boxes2D=n_side_phi*n_side_cth;
+  }
+}
+
+static void get_pix_bounds(double alpha,int ipix,int *bounds)
 {
   //////
   // Returns pixel bounds for all pixels within
-  // theta_max=alpha
+  // theta_max=alpha: icth_min, icth_max, iphi_min and
+  // iphi_max. HEALPix pixels have no bounds, and their
+  // neighbours are searched for instead (see
+  // get_neighbor_pixels)
   int icth,iphi;
+  int *icth_min=&(bounds[0]),*icth_max=&(bounds[1]);
+  int *iphi_min=&(bounds[2]),*iphi_max=&(bounds[3]);
   double theta,th_hi,th_lo;
   double phi_hi,phi_lo;
   double cth_max,cth_min;
 
+  if(pixelization==1) {
+    bounds[0]=bounds[1]=bounds[2]=bounds[3]=0;
+    return;
+  }
+
   icth=(int)(ipix/n_side_phi);
   iphi=(int)(ipix%n_side_phi);
 
@@ -351,29 +723,39 @@ static void get_pix_bounds(double alpha,int ipix,
   if(*icth_min<0) *icth_min=0;
 }
 
+static int *sort_Catalog_into_pixels(Catalog *cat,int *pix_start)
+{
+  //////
+  // Sorts the objects in cat into angular pixels (see
+  // sort_into_cells), returning the sorted list of objects.
+  int ii;
+  int *pix_id,*order;
+
+  pix_id=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+#pragma omp parallel for default(none) shared(cat,pix_id)
+  for(ii=0;ii<cat->np;ii++)
+    pix_id[ii]=sph2pix(cat->cth[ii],cat->phi[ii]);
+  order=sort_into_cells(cat->np,n_boxes2D,pix_id,pix_start);
+  free(pix_id);
+
+  return order;
+}
+
 Cell2D *mk_Cells2D_from_Catalog(Catalog *cat,int **cell_indices,int *n_cell_full)
 {
   int ii,nfull;
+  int *pix_start,*order;
   Cell2D *cells;
 
   cells=init_Cells2D(n_boxes2D);
-  
+
+  pix_start=(int *)my_malloc((n_boxes2D+1)*sizeof(int));
+  order=sort_Catalog_into_pixels(cat,pix_start);
+
   nfull=0;
-  for(ii=0;ii<cat->np;ii++) {
-    double cth=cat->cth[ii];
-    double phi=cat->phi[ii];
-    int ipix=sph2pix(cth,phi);
-    np_t np0=cells[ipix].np;
-    if(np0<0) {
+  for(ii=0;ii<n_boxes2D;ii++) {
+    if(pix_start[ii+1]>pix_start[ii])
       nfull++;
-      cells[ipix].np=0;
-    }
-
-#ifdef _WITH_WEIGHTS
-    cells[ipix].np+=cat->weight[ii];
-#else //_WITH_WEIGHTS
-    cells[ipix].np++;
-#endif //_WITH_WEIGHTS
   }
   
   *n_cell_full=nfull;
@@ -382,31 +764,7 @@ Cell2D *mk_Cells2D_from_Catalog(Catalog *cat,int **cell_indices,int *n_cell_full
 
   nfull=0;
   for(ii=0;ii<n_boxes2D;ii++) {
-    if(cells[ii].np>0) {
-      int icth_min,icth_max;
-      int iphi_min,iphi_max;
-      int icth=(int)(ii/n_side_phi);
-      int iphi=(int)(ii%n_side_phi);
-      double cth=-1.0+2.0*((double)(icth+0.5))/n_side_cth;
-      double phi=2*M_PI*((double)(iphi+0.5))/n_side_phi;
-      double sth=sqrt(1-cth*cth);
-
-      //Allocate cell info
-      cells[ii].ci=(Cell2DInfo *)my_malloc(sizeof(Cell2DInfo));
-
-      //Calculate cell bounds
-      get_pix_bounds(1/i_theta_max,ii,
-		     &icth_min,&icth_max,&iphi_min,&iphi_max);
-      (cells[ii].ci)->bounds[0]=icth_min;
-      (cells[ii].ci)->bounds[1]=icth_max;
-      (cells[ii].ci)->bounds[2]=iphi_min;
-      (cells[ii].ci)->bounds[3]=iphi_max;
-
-      //Calculate cell position
-      (cells[ii].ci)->pos[0]=sth*cos(phi);
-      (cells[ii].ci)->pos[1]=sth*sin(phi);
-      (cells[ii].ci)->pos[2]=cth;
-
+    if(pix_start[ii+1]>pix_start[ii]) {
       //Get pixel index
       (*cell_indices)[nfull]=ii;
       nfull++;
@@ -416,6 +774,35 @@ Cell2D *mk_Cells2D_from_Catalog(Catalog *cat,int **cell_indices,int *n_cell_full
     }
   }
 
+#pragma omp parallel for default(none)		\
+  shared(nfull,cell_indices,cells,cat,order,pix_start,i_theta_max)
+  for(ii=0;ii<nfull;ii++) {
+    int jj;
+    int ipix=(*cell_indices)[ii];
+
+    //Add up cell objects
+    cells[ipix].np=0;
+    for(jj=pix_start[ipix];jj<pix_start[ipix+1];jj++) {
+#ifdef _WITH_WEIGHTS
+      cells[ipix].np+=cat->weight[order[jj]];
+#else //_WITH_WEIGHTS
+      cells[ipix].np++;
+#endif //_WITH_WEIGHTS
+    }
+
+    //Allocate cell info
+    cells[ipix].ci=(Cell2DInfo *)my_malloc(sizeof(Cell2DInfo));
+
+    //Calculate cell bounds
+    get_pix_bounds(1/i_theta_max,ipix,(cells[ipix].ci)->bounds);
+
+    //Calculate cell position
+    pix2vec(ipix,(cells[ipix].ci)->pos);
+  }
+
+  free(order);
+  free(pix_start);
+
   return cells;
 }
 
@@ -461,29 +848,14 @@ Cell2D *mk_Cells2D_many_from_Catalog(Catalog *cat,int **cell_indices,
   nfull=0;
   for(ii=0;ii<n_boxes2D;ii++) {
     if(cells_total[ii].np>0) {
-      int icth_min,icth_max;
-      int iphi_min,iphi_max;
-      int icth=(int)(ii/n_side_phi);
-      int iphi=(int)(ii%n_side_phi);
-      double cth=-1.0+2.0*((double)(icth+0.5))/n_side_cth;
-      double phi=2*M_PI*((double)(iphi+0.5))/n_side_phi;
-      double sth=sqrt(1-cth*cth);
-      
       //Allocate cell info
       cells_total[ii].ci=(Cell2DInfo *)my_malloc(sizeof(Cell2DInfo));
       
       //Calculate cell bounds
-      get_pix_bounds(1/i_theta_max,ii,
-		     &icth_min,&icth_max,&iphi_min,&iphi_max);
-      (cells_total[ii].ci)->bounds[0]=icth_min;
-      (cells_total[ii].ci)->bounds[1]=icth_max;
-      (cells_total[ii].ci)->bounds[2]=iphi_min;
-      (cells_total[ii].ci)->bounds[3]=iphi_max;
+      get_pix_bounds(1/i_theta_max,ii,(cells_total[ii].ci)->bounds);
 
       //Calculate cell position
-      (cells_total[ii].ci)->pos[0]=sth*cos(phi);
-      (cells_total[ii].ci)->pos[1]=sth*sin(phi);
-      (cells_total[ii].ci)->pos[2]=cth;
+      pix2vec(ii,(cells_total[ii].ci)->pos);
 
       //Get pixel index
       (*cell_indices)[nfull]=ii;
@@ -505,21 +877,41 @@ Cell2D *mk_Cells2D_many_from_Catalog(Catalog *cat,int **cell_indices,
   return cells;
 }
 
+double *mk_Map2D_from_Catalog(Catalog *cat)
+{
+  //////
+  // Returns the map of the (weighted) number of objects
+  // of cat in each pixel
+  int ii;
+  double *map=(double *)my_calloc(n_boxes2D,sizeof(double));
+
+  for(ii=0;ii<cat->np;ii++) {
+    int ipix=sph2pix(cat->cth[ii],cat->phi[ii]);
+#ifdef _WITH_WEIGHTS
+    map[ipix]+=cat->weight[ii];
+#else //_WITH_WEIGHTS
+    map[ipix]++;
+#endif //_WITH_WEIGHTS
+  }
+
+  return map;
+}
+
 Box2D *mk_Boxes2D_from_Catalog(Catalog *cat,int **box_indices,int *n_box_full)
 {
   int ii,nfull;
+  int *pix_start,*order;
   Box2D *boxes;
 
   boxes=init_Boxes2D(n_boxes2D);
 
+  pix_start=(int *)my_malloc((n_boxes2D+1)*sizeof(int));
+  order=sort_Catalog_into_pixels(cat,pix_start);
+
   nfull=0;
-  for(ii=0;ii<cat->np;ii++) {
-    double cth=cat->cth[ii];
-    double phi=cat->phi[ii];
-    int ipix=sph2pix(cth,phi);
-    int np0=boxes[ipix].np;
-    if(np0==0) nfull++;
-    boxes[ipix].np++;
+  for(ii=0;ii<n_boxes2D;ii++) {
+    boxes[ii].np=pix_start[ii+1]-pix_start[ii];
+    if(boxes[ii].np>0) nfull++;
   }
 
   *n_box_full=nfull;
@@ -529,41 +921,44 @@ Box2D *mk_Boxes2D_from_Catalog(Catalog *cat,int **box_indices,int *n_box_full)
   nfull=0;
   for(ii=0;ii<n_boxes2D;ii++) {
     if(boxes[ii].np>0) {
-      int icth_min,icth_max,iphi_min,iphi_max;
-      
-      //Allocate box info
-      boxes[ii].bi=init_Box2DInfo(boxes[ii].np);
-      boxes[ii].np=0;
-
-      //Calculate box bounds
-      get_pix_bounds(1/i_theta_max,ii,
-		     &icth_min,&icth_max,&iphi_min,&iphi_max);
-      (boxes[ii].bi)->bounds[0]=icth_min;
-      (boxes[ii].bi)->bounds[1]=icth_max;
-      (boxes[ii].bi)->bounds[2]=iphi_min;
-      (boxes[ii].bi)->bounds[3]=iphi_max;
-
       //Get pixel index
       (*box_indices)[nfull]=ii;
       nfull++;
     }
   }
 
-  for(ii=0;ii<cat->np;ii++) {
-    double cth=cat->cth[ii];
-    double phi=cat->phi[ii];
-    double sth=sqrt(1-cth*cth);
-    int ipix=sph2pix(cth,phi);
-    int np0=boxes[ipix].np;
-    (boxes[ipix].bi)->pos[N_POS*np0]=sth*cos(phi);
-    (boxes[ipix].bi)->pos[N_POS*np0+1]=sth*sin(phi);
-    (boxes[ipix].bi)->pos[N_POS*np0+2]=cth;
+#pragma omp parallel for default(none)		\
+  shared(nfull,box_indices,boxes,cat,order,pix_start,i_theta_max)
+  for(ii=0;ii<nfull;ii++) {
+    int jj;
+    int ipix=(*box_indices)[ii];
+    Box2DInfo *bi;
+
+    //Allocate box info
+    boxes[ipix].bi=init_Box2DInfo(boxes[ipix].np);
+    bi=boxes[ipix].bi;
+
+    //Calculate box bounds
+    get_pix_bounds(1/i_theta_max,ipix,bi->bounds);
+
+    //Fill box with its objects
+    for(jj=0;jj<boxes[ipix].np;jj++) {
+      int io=order[pix_start[ipix]+jj];
+      double cth=cat->cth[io];
+      double phi=cat->phi[io];
+      double sth=sqrt(1-cth*cth);
+      bi->pos[N_POS*jj]=sth*cos(phi);
+      bi->pos[N_POS*jj+1]=sth*sin(phi);
+      bi->pos[N_POS*jj+2]=cth;
 #ifdef _WITH_WEIGHTS
-    (boxes[ipix].bi)->pos[N_POS*np0+3]=cat->weight[ii];
+      bi->pos[N_POS*jj+3]=cat->weight[io];
 #endif //_WITH_WEIGHTS
-    boxes[ipix].np++;
+    }
   }
 
+  free(order);
+  free(pix_start);
+
   return boxes;
 }
 
@@ -590,29 +985,15 @@ RadialCell *mk_RadialCells_from_Catalog(Catalog *cat)
   double aperture=1./i_theta_max;
   for(ii=0;ii<n_boxes2D;ii++) {
     if(radcell[ii].np>0) {
-      int icth_min,icth_max,iphi_min,iphi_max;
-      int icth=(int)(ii/n_side_phi);
-      int iphi=(int)(ii%n_side_phi);
-      double cth=-1.0+2.0*((double)(icth+0.5))/n_side_cth;
-      double phi=2*M_PI*((double)(iphi+0.5))/n_side_phi;
-      double sth=sqrt(1-cth*cth);
-
       //Allocate cell info
       radcell[ii].ci=init_RadialCellInfo(radcell[ii].np);
       radcell[ii].np=0;
 
       //Calculate cell bounds
-      get_pix_bounds(aperture,ii,
-		     &icth_min,&icth_max,&iphi_min,&iphi_max);
-      (radcell[ii].ci)->bounds[0]=icth_min;
-      (radcell[ii].ci)->bounds[1]=icth_max;
-      (radcell[ii].ci)->bounds[2]=iphi_min;
-      (radcell[ii].ci)->bounds[3]=iphi_max;
+      get_pix_bounds(aperture,ii,(radcell[ii].ci)->bounds);
 
       //Calculate cell position
-      (radcell[ii].ci)->pos[0]=sth*cos(phi);
-      (radcell[ii].ci)->pos[1]=sth*sin(phi);
-      (radcell[ii].ci)->pos[2]=cth;
+      pix2vec(ii,(radcell[ii].ci)->pos);
 
       nfull++;
     }
@@ -639,18 +1020,18 @@ RadialPixel *mk_RadialPixels_from_Catalog(Catalog *cat,int **pixrad_indices,
 					  int *n_pixrad_full,int ctype)
 {
   int ii,nfull;
+  int *pix_start,*order;
   RadialPixel *pixrad;
 
   pixrad=init_RadialPixels(n_boxes2D);
 
+  pix_start=(int *)my_malloc((n_boxes2D+1)*sizeof(int));
+  order=sort_Catalog_into_pixels(cat,pix_start);
+
   nfull=0;
-  for(ii=0;ii<cat->np;ii++) {
-    double cth=cat->cth[ii];
-    double phi=cat->phi[ii];
-    int ipix=sph2pix(cth,phi);
-    int np0=pixrad[ipix].np;
-    if(np0==0) nfull++;
-    pixrad[ipix].np++;
+  for(ii=0;ii<n_boxes2D;ii++) {
+    pixrad[ii].np=pix_start[ii+1]-pix_start[ii];
+    if(pixrad[ii].np>0) nfull++;
   }
 
   *n_pixrad_full=nfull;
@@ -667,42 +1048,44 @@ RadialPixel *mk_RadialPixels_from_Catalog(Catalog *cat,int **pixrad_indices,
   }
   for(ii=0;ii<n_boxes2D;ii++) {
     if(pixrad[ii].np>0) {
-      int icth_min,icth_max,iphi_min,iphi_max;
-      
-      //Allocate box info
-      pixrad[ii].pi=init_RadialPixelInfo(pixrad[ii].np);
-      pixrad[ii].np=0;
-
-      //Calculate box bounds
-      get_pix_bounds(aperture,ii,
-		     &icth_min,&icth_max,&iphi_min,&iphi_max);
-      (pixrad[ii].pi)->bounds[0]=icth_min;
-      (pixrad[ii].pi)->bounds[1]=icth_max;
-      (pixrad[ii].pi)->bounds[2]=iphi_min;
-      (pixrad[ii].pi)->bounds[3]=iphi_max;
-
       //Get pixel index
       (*pixrad_indices)[nfull]=ii;
       nfull++;
     }
   }
 
-  for(ii=0;ii<cat->np;ii++) {
-    double zz=cat->red[ii];
-    double cth=cat->cth[ii];
-    double phi=cat->phi[ii];
-    double sth=sqrt(1-cth*cth);
-    int ipix=sph2pix(cth,phi);
-    int np0=pixrad[ipix].np;
-    (pixrad[ipix].pi)->pos[N_POS*np0]=sth*cos(phi);
-    (pixrad[ipix].pi)->pos[N_POS*np0+1]=sth*sin(phi);
-    (pixrad[ipix].pi)->pos[N_POS*np0+2]=cth;
+#pragma omp parallel for default(none)				\
+  shared(nfull,pixrad_indices,pixrad,cat,order,pix_start,aperture)
+  for(ii=0;ii<nfull;ii++) {
+    int jj;
+    int ipix=(*pixrad_indices)[ii];
+    RadialPixelInfo *pi;
+
+    //Allocate box info
+    pixrad[ipix].pi=init_RadialPixelInfo(pixrad[ipix].np);
+    pi=pixrad[ipix].pi;
+
+    //Calculate box bounds
+    get_pix_bounds(aperture,ipix,pi->bounds);
+
+    //Fill pixel with its objects
+    for(jj=0;jj<pixrad[ipix].np;jj++) {
+      int io=order[pix_start[ipix]+jj];
+      double cth=cat->cth[io];
+      double phi=cat->phi[io];
+      double sth=sqrt(1-cth*cth);
+      pi->pos[N_POS*jj]=sth*cos(phi);
+      pi->pos[N_POS*jj+1]=sth*sin(phi);
+      pi->pos[N_POS*jj+2]=cth;
 #ifdef _WITH_WEIGHTS
-    (pixrad[ipix].pi)->pos[N_POS*np0+3]=cat->weight[ii];
+      pi->pos[N_POS*jj+3]=cat->weight[io];
 #endif //_WITH_WEIGHTS
-    (pixrad[ipix].pi)->redshifts[np0]=zz;
-    pixrad[ipix].np++;
+      pi->redshifts[jj]=cat->red[io];
+    }
   }
 
+  free(order);
+  free(pix_start);
+
   return pixrad;
 }
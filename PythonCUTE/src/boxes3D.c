@@ -39,6 +39,9 @@ static double y_max_bound;
 static double z_min_bound;
 static double z_max_bound;
 
+//Box planes (along z) owned by this node with MPI domains
+static int iz_domain[2]={0,0};
+
 static int optimal_nside(double lb,double rmax,int np)
 {
   //////
@@ -65,12 +68,104 @@ static int xyz2box(double x,double y,double z)
   return ix+n_side[0]*(iy+n_side[1]*iz);
 }
 
+static void morton2xyz(unsigned long d,int nbits,int *x)
+{
+  //////
+  // Decodes Morton index d into box coordinates x
+  int ib;
+  x[0]=x[1]=x[2]=0;
+  for(ib=0;ib<nbits;ib++) {
+    x[0]|=((d>>(3*ib))&1)<<ib;
+    x[1]|=((d>>(3*ib+1))&1)<<ib;
+    x[2]|=((d>>(3*ib+2))&1)<<ib;
+  }
+}
+
+static void hilbert2xyz(unsigned long d,int nbits,int *x)
+{
+  //////
+  // Decodes Hilbert index d into box coordinates x
+  // (J. Skilling, AIP Conf. Proc. 707, 381 (2004))
+  int ib,ii,q,p,t;
+
+  //Transpose index: bit ib of x[ii] is bit 3*ib+2-ii of d
+  x[0]=x[1]=x[2]=0;
+  for(ib=0;ib<nbits;ib++) {
+    for(ii=0;ii<3;ii++)
+      x[ii]|=((d>>(3*ib+2-ii))&1)<<ib;
+  }
+
+  //Gray decode
+  t=x[2]>>1;
+  for(ii=2;ii>0;ii--)
+    x[ii]^=x[ii-1];
+  x[0]^=t;
+
+  //Undo excess work
+  for(q=2;q!=(1<<nbits);q<<=1) {
+    p=q-1;
+    for(ii=2;ii>=0;ii--) {
+      if(x[ii]&q)
+	x[0]^=p;
+      else {
+	t=(x[0]^x[ii])&p;
+	x[0]^=t;
+	x[ii]^=t;
+      }
+    }
+  }
+}
+
+static int *mk_box_curve(void)
+{
+  //////
+  // Returns the list of all boxes in the order set by
+  // box_order. For Morton and Hilbert orders the curve
+  // is walked over the smallest enclosing 2^n cube,
+  // skipping the positions that fall outside the grid.
+  // Box 0 always comes first.
+  int ii,nbits,nside_max;
+  int *curve=(int *)my_malloc(n_boxes3D*sizeof(int));
+
+  if(box_order==0) {
+    for(ii=0;ii<n_boxes3D;ii++)
+      curve[ii]=ii;
+    return curve;
+  }
+
+  nside_max=MAX(MAX(n_side[0],n_side[1]),n_side[2]);
+  nbits=0;
+  while((1<<nbits)<nside_max) nbits++;
+
+  if(nbits==0)
+    curve[0]=0;
+  else {
+    unsigned long d;
+    unsigned long nd=1UL<<(3*nbits);
+    ii=0;
+    for(d=0;d<nd;d++) {
+      int x[3];
+      if(box_order==1) morton2xyz(d,nbits,x);
+      else hilbert2xyz(d,nbits,x);
+      if((x[0]<n_side[0])&&(x[1]<n_side[1])&&(x[2]<n_side[2])) {
+	curve[ii]=x[0]+n_side[0]*(x[1]+n_side[1]*x[2]);
+	ii++;
+      }
+    }
+  }
+
+  return curve;
+}
+
 void free_Boxes3D(int nbox,Box3D *boxes)
 {
-  int ii;
-  for(ii=0;ii<nbox;ii++) {
-    if(boxes[ii].np>0) 
-      free(boxes[ii].pos);
+  //////
+  // All particle data lives in a single arena starting
+  // at box 0 (see mk_Boxes3D_from_Catalog)
+  if(nbox>0) {
+    free(boxes[0].x);
+    if(boxes[0].reg!=NULL)
+      free(boxes[0].reg);
   }
 
   free(boxes);
@@ -83,32 +178,46 @@ static Box3D *init_Boxes3D(int nbox)
 
   for(ii=0;ii<nbox;ii++) {
     boxes[ii].np=0;
-    boxes[ii].pos=NULL;
+    boxes[ii].x=NULL;
+    boxes[ii].y=NULL;
+    boxes[ii].z=NULL;
+    boxes[ii].x_lo[0]=boxes[ii].x_lo[1]=boxes[ii].x_lo[2]=0;
+    boxes[ii].x_hi[0]=boxes[ii].x_hi[1]=boxes[ii].x_hi[2]=0;
+#ifdef _WITH_WEIGHTS
+    boxes[ii].w=NULL;
+    boxes[ii].w_tot=0;
+#endif //_WITH_WEIGHTS
+    boxes[ii].reg=NULL;
   }
 
   return boxes;
 }
 
-void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
+static void cat_to_cartesian(Catalog *cat,int *bounds_set)
 {
+  //////
+  // Turns the (z,cos(theta),phi) of cat into Cartesian coordinates
+  // in place and stretches the box bounds to contain them. The
+  // bounds are started from the first object if !(*bounds_set)
   int ii;
 
-  for(ii=0;ii<cat_dat->np;ii++) {
-    double cth=cat_dat->cth[ii];
-    double phi=cat_dat->phi[ii];
+  for(ii=0;ii<cat->np;ii++) {
+    double cth=cat->cth[ii];
+    double phi=cat->phi[ii];
     double sth=sqrt(1-cth*cth);
-    double rr=z2r(cat_dat->red[ii]);
+    double rr=z2r(cat->red[ii]);
     double x=rr*sth*cos(phi);
     double y=rr*sth*sin(phi);
     double z=rr*cth;
 
-    if(ii==0) {
+    if(!(*bounds_set)) {
       x_min_bound=x;
       x_max_bound=x;
       y_min_bound=y;
       y_max_bound=y;
       z_min_bound=z;
       z_max_bound=z;
+      *bounds_set=1;
     }
 
     if(x<x_min_bound) x_min_bound=x;
@@ -118,32 +227,17 @@ void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
     if(z<z_min_bound) z_min_bound=z;
     if(z>z_max_bound) z_max_bound=z;
 
-    cat_dat->red[ii]=x;
-    cat_dat->cth[ii]=y;
-    cat_dat->phi[ii]=z;
-  }
-
-  for(ii=0;ii<cat_ran->np;ii++) {
-    double cth=cat_ran->cth[ii];
-    double phi=cat_ran->phi[ii];
-    double sth=sqrt(1-cth*cth);
-    double rr=z2r(cat_ran->red[ii]);
-    double x=rr*sth*cos(phi);
-    double y=rr*sth*sin(phi);
-    double z=rr*cth;
-
-    if(x<x_min_bound) x_min_bound=x;
-    if(x>x_max_bound) x_max_bound=x;
-    if(y<y_min_bound) y_min_bound=y;
-    if(y>y_max_bound) y_max_bound=y;
-    if(z<z_min_bound) z_min_bound=z;
-    if(z>z_max_bound) z_max_bound=z;
-
-    cat_ran->red[ii]=x;  //note that despite their names red, cth and phi now actually contain Cartesian coords!
-    cat_ran->cth[ii]=y;
-    cat_ran->phi[ii]=z;
+    cat->red[ii]=x;  //note that despite their names red, cth and phi now actually contain Cartesian coords!
+    cat->cth[ii]=y;
+    cat->phi[ii]=z;
   }
+}
 
+static void init_3D_grid(int ctype,int np_dat)
+{
+  //////
+  // Sets the box grid from the current bounds, with box sizes
+  // tuned for np_dat data objects
   double ex=FRACTION_EXTEND*(x_max_bound-x_min_bound);
   double ey=FRACTION_EXTEND*(y_max_bound-y_min_bound);
   double ez=FRACTION_EXTEND*(z_max_bound-z_min_bound);
@@ -171,7 +265,7 @@ void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
     fprintf(stderr,"WTF?? \n");
     exit(1);
   }
-  nside=optimal_nside(l_box_max,rmax,cat_dat->np);
+  nside=optimal_nside(l_box_max,rmax,np_dat);
 
   n_side[0]=(int)(nside*l_box[0]/l_box_max)+1;
   n_side[1]=(int)(nside*l_box[1]/l_box_max)+1;
@@ -188,6 +282,215 @@ void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
 	 dx,dy,dz);
 }
 
+void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype)
+{
+  int bounds_set=0;
+
+  cat_to_cartesian(cat_dat,&bounds_set);
+  cat_to_cartesian(cat_ran,&bounds_set);
+  init_3D_grid(ctype,cat_dat->np);
+}
+
+#ifdef _HAVE_MPI
+static void exchange_Catalog(Catalog *cat,int *iz_need)
+{
+  //////
+  // Sends each object in cat to the nodes that need it, i.e. those
+  // with its box plane in [iz_need[2*i],iz_need[2*i+1]), and
+  // replaces the objects in cat by the ones received
+  int ii,inode;
+  int *n_send=(int *)my_calloc(NNodes,sizeof(int));
+  int *n_recv=(int *)my_malloc(NNodes*sizeof(int));
+  int *i_send=(int *)my_malloc(NNodes*sizeof(int));
+  int *i_recv=(int *)my_malloc(NNodes*sizeof(int));
+  int *nf_send=(int *)my_malloc(NNodes*sizeof(int));
+  int *nf_recv=(int *)my_malloc(NNodes*sizeof(int));
+  int *if_send=(int *)my_malloc(NNodes*sizeof(int));
+  int *if_recv=(int *)my_malloc(NNodes*sizeof(int));
+  int *plane=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+  int n_send_tot=0,n_recv_tot=0;
+
+  for(ii=0;ii<cat->np;ii++) {
+    plane[ii]=(int)((cat->phi[ii]-z_min_bound)/l_box[2]*n_side[2]);
+    for(inode=0;inode<NNodes;inode++) {
+      if((plane[ii]>=iz_need[2*inode])&&(plane[ii]<iz_need[2*inode+1]))
+	n_send[inode]++;
+    }
+  }
+  MPI_Alltoall(n_send,1,MPI_INT,n_recv,1,MPI_INT,MPI_COMM_WORLD);
+  for(inode=0;inode<NNodes;inode++) {
+    i_send[inode]=n_send_tot;
+    i_recv[inode]=n_recv_tot;
+    n_send_tot+=n_send[inode];
+    n_recv_tot+=n_recv[inode];
+    nf_send[inode]=N_POS*n_send[inode];
+    nf_recv[inode]=N_POS*n_recv[inode];
+    if_send[inode]=N_POS*i_send[inode];
+    if_recv[inode]=N_POS*i_recv[inode];
+  }
+
+  //Positions (and weights) go interleaved, regions on their own
+  double *pos_send=(double *)my_malloc(MAX(N_POS*n_send_tot,1)*sizeof(double));
+  double *pos_recv=(double *)my_malloc(MAX(N_POS*n_recv_tot,1)*sizeof(double));
+  int *reg_send=NULL,*reg_recv=NULL;
+  if(cat->region!=NULL) {
+    reg_send=(int *)my_malloc(MAX(n_send_tot,1)*sizeof(int));
+    reg_recv=(int *)my_malloc(MAX(n_recv_tot,1)*sizeof(int));
+  }
+  for(ii=0;ii<cat->np;ii++) {
+    for(inode=0;inode<NNodes;inode++) {
+      if((plane[ii]>=iz_need[2*inode])&&(plane[ii]<iz_need[2*inode+1])) {
+	int is=i_send[inode];
+	pos_send[N_POS*is]=cat->red[ii];
+	pos_send[N_POS*is+1]=cat->cth[ii];
+	pos_send[N_POS*is+2]=cat->phi[ii];
+#ifdef _WITH_WEIGHTS
+	pos_send[N_POS*is+3]=cat->weight[ii];
+#endif //_WITH_WEIGHTS
+	if(cat->region!=NULL)
+	  reg_send[is]=cat->region[ii];
+	i_send[inode]++;
+      }
+    }
+  }
+  for(inode=0;inode<NNodes;inode++)
+    i_send[inode]-=n_send[inode];
+  MPI_Alltoallv(pos_send,nf_send,if_send,MPI_DOUBLE,
+		pos_recv,nf_recv,if_recv,MPI_DOUBLE,MPI_COMM_WORLD);
+  if(cat->region!=NULL) {
+    MPI_Alltoallv(reg_send,n_send,i_send,MPI_INT,
+		  reg_recv,n_recv,i_recv,MPI_INT,MPI_COMM_WORLD);
+  }
+  free(pos_send);
+  free(reg_send);
+  free(plane);
+
+  cat->np=n_recv_tot;
+  cat->red=(double *)realloc(cat->red,MAX(cat->np,1)*sizeof(double));
+  cat->cth=(double *)realloc(cat->cth,MAX(cat->np,1)*sizeof(double));
+  cat->phi=(double *)realloc(cat->phi,MAX(cat->np,1)*sizeof(double));
+#ifdef _WITH_WEIGHTS
+  cat->weight=(double *)realloc(cat->weight,MAX(cat->np,1)*sizeof(double));
+#endif //_WITH_WEIGHTS
+  if((cat->red==NULL)||(cat->cth==NULL)||(cat->phi==NULL)) {
+    fprintf(stderr,"CUTE: out of memory!\n");
+    exit(1);
+  }
+  for(ii=0;ii<cat->np;ii++) {
+    cat->red[ii]=pos_recv[N_POS*ii];
+    cat->cth[ii]=pos_recv[N_POS*ii+1];
+    cat->phi[ii]=pos_recv[N_POS*ii+2];
+#ifdef _WITH_WEIGHTS
+    cat->weight[ii]=pos_recv[N_POS*ii+3];
+#endif //_WITH_WEIGHTS
+  }
+  free(pos_recv);
+  if(cat->region!=NULL) {
+    free(cat->region);
+    cat->region=reg_recv;
+  }
+
+  free(n_send);
+  free(n_recv);
+  free(i_send);
+  free(i_recv);
+  free(nf_send);
+  free(nf_recv);
+  free(if_send);
+  free(if_recv);
+}
+#endif //_HAVE_MPI
+
+void init_3D_params_domain(Catalog *cat_dat,Catalog *cat_ran,int ctype)
+{
+  //////
+  // init_3D_params for catalogs split between MPI nodes (mpi_domains).
+  // The grid is set from the bounds and size of the full catalogs.
+  // Its planes of boxes along z are then shared between the nodes by
+  // their number of objects, and the objects are exchanged so that
+  // each node holds those in its planes plus a halo of planes within
+  // r_max of them. That is all the correlators need from the node,
+  // as mk_Boxes3D_from_Catalog only lists the boxes in its own planes.
+  int bounds_set=0;
+
+  cat_to_cartesian(cat_dat,&bounds_set);
+  cat_to_cartesian(cat_ran,&bounds_set);
+#ifdef _HAVE_MPI
+  int ii,n_halo;
+  int np_dat=cat_dat->np;
+  double rmax;
+  double b_min[3]={HUGE_VAL,HUGE_VAL,HUGE_VAL};
+  double b_max[3]={-HUGE_VAL,-HUGE_VAL,-HUGE_VAL};
+  double *cost;
+  int *iz_need;
+
+  if(bounds_set) {
+    b_min[0]=x_min_bound; b_max[0]=x_max_bound;
+    b_min[1]=y_min_bound; b_max[1]=y_max_bound;
+    b_min[2]=z_min_bound; b_max[2]=z_max_bound;
+  }
+  MPI_Allreduce(MPI_IN_PLACE,b_min,3,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,b_max,3,MPI_DOUBLE,MPI_MAX,MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,&np_dat,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  x_min_bound=b_min[0]; x_max_bound=b_max[0];
+  y_min_bound=b_min[1]; y_max_bound=b_max[1];
+  z_min_bound=b_min[2]; z_max_bound=b_max[2];
+  init_3D_grid(ctype,np_dat);
+
+  //Planes of boxes shared by their number of objects
+  cost=(double *)my_calloc(n_side[2],sizeof(double));
+  for(ii=0;ii<cat_dat->np;ii++)
+    cost[(int)((cat_dat->phi[ii]-z_min_bound)/l_box[2]*n_side[2])]++;
+  for(ii=0;ii<cat_ran->np;ii++)
+    cost[(int)((cat_ran->phi[ii]-z_min_bound)/l_box[2]*n_side[2])]++;
+  MPI_Allreduce(MPI_IN_PLACE,cost,n_side[2],MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+  share_iters_cost(n_side[2],cost,&(iz_domain[0]),&(iz_domain[1]));
+  free(cost);
+
+  //Halo as wide as the reach of the box stencils along z
+  if(ctype==3) rmax=sqrt(1/(i_rt_max*i_rt_max)+1/(i_rl_max*i_rl_max));
+  else rmax=1/i_r_max;
+  n_halo=MIN((int)(rmax*n_side[2]/l_box[2])+1,n_side[2]-1);
+  iz_need=(int *)my_malloc(2*NNodes*sizeof(int));
+  iz_need[2*NodeThis]=iz_domain[0]-n_halo;
+  iz_need[2*NodeThis+1]=iz_domain[1]+n_halo;
+  if(iz_domain[1]<=iz_domain[0])
+    iz_need[2*NodeThis+1]=iz_need[2*NodeThis];
+  MPI_Allgather(MPI_IN_PLACE,2,MPI_INT,iz_need,2,MPI_INT,MPI_COMM_WORLD);
+
+  exchange_Catalog(cat_dat,iz_need);
+  exchange_Catalog(cat_ran,iz_need);
+  free(iz_need);
+
+  if(cute_verbose) {
+    printf("Node %d : box planes %d to %d, %d data and %d random objects with halo\n",
+	   NodeThis,iz_domain[0],iz_domain[1],cat_dat->np,cat_ran->np);
+  }
+#else //_HAVE_MPI
+  init_3D_grid(ctype,cat_dat->np);
+  iz_domain[0]=0;
+  iz_domain[1]=n_side[2];
+#endif //_HAVE_MPI
+}
+
+void init_3D_params_batch(int n_cats,Catalog **cats_dat,Catalog *cat_ran,int ctype)
+{
+  //////
+  // Same as init_3D_params for n_cats data catalogs sharing
+  // cat_ran. The grid encloses all of them and is tuned for
+  // their mean size, so that a single set of random boxes
+  // serves every data catalog.
+  int ii,bounds_set=0;
+  long np_tot=0;
+
+  for(ii=0;ii<n_cats;ii++) {
+    cat_to_cartesian(cats_dat[ii],&bounds_set);
+    np_tot+=cats_dat[ii]->np;
+  }
+  cat_to_cartesian(cat_ran,&bounds_set);
+  init_3D_grid(ctype,(int)(np_tot/MAX(n_cats,1)));
+}
+
 void init_3D_params_cross(Catalog *cat_dat1,Catalog *cat_dat2,Catalog *cat_ran1,Catalog *cat_ran2,int ctype)
 {
   int ii;
@@ -331,52 +634,146 @@ void init_3D_params_cross(Catalog *cat_dat1,Catalog *cat_dat2,Catalog *cat_ran1,
 
 Box3D *mk_Boxes3D_from_Catalog(Catalog *cat,int **box_indices,int *n_box_full)
 {
-  int ii,nfull;
+  int ii,nfull,npad;
+  int *box_id,*box_start,*order,*curve,*rank;
+  double *arena;
   Box3D *boxes;
 
   boxes=init_Boxes3D(n_boxes3D);
 
-  nfull=0;
+  //Position of each box along the box_order curve
+  curve=mk_box_curve();
+  rank=(int *)my_malloc(n_boxes3D*sizeof(int));
+  for(ii=0;ii<n_boxes3D;ii++)
+    rank[curve[ii]]=ii;
+
+  //Sort objects into boxes, with boxes laid out along the curve
+  box_id=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+  box_start=(int *)my_malloc((n_boxes3D+1)*sizeof(int));
+#pragma omp parallel for default(none) shared(cat,box_id,rank)
   for(ii=0;ii<cat->np;ii++) {
-    double x=cat->red[ii];   //this is ok because red, cth and phi are actually now Cartesian coords after init_3D_params()
-    double y=cat->cth[ii];
-    double z=cat->phi[ii];
-    int ibox=xyz2box(x,y,z);
-    int np0=boxes[ibox].np;
-    if(np0==0) nfull++;
-    boxes[ibox].np++;
+    //this is ok because red, cth and phi are actually now Cartesian coords after init_3D_params()
+    box_id[ii]=rank[xyz2box(cat->red[ii],cat->cth[ii],cat->phi[ii])];
+  }
+  if(cat->region!=NULL) {
+    //Sort by jackknife region first so that, the sort being
+    //stable, each box holds its objects in increasing region
+    int *reg_start=(int *)my_malloc((n_jk+1)*sizeof(int));
+    int *box_id_reg=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+    int *order_reg=sort_into_cells(cat->np,n_jk,cat->region,reg_start);
+    int *order_box;
+    for(ii=0;ii<cat->np;ii++)
+      box_id_reg[ii]=box_id[order_reg[ii]];
+    order_box=sort_into_cells(cat->np,n_boxes3D,box_id_reg,box_start);
+    order=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+    for(ii=0;ii<cat->np;ii++)
+      order[ii]=order_reg[order_box[ii]];
+    free(order_box);
+    free(order_reg);
+    free(box_id_reg);
+    free(reg_start);
+  }
+  else
+    order=sort_into_cells(cat->np,n_boxes3D,box_id,box_start);
+  free(box_id);
+
+  nfull=0;
+  for(ii=0;ii<n_boxes3D;ii++) {
+    boxes[ii].np=box_start[rank[ii]+1]-box_start[rank[ii]];
+    if(boxes[ii].np>0) nfull++;
   }
 
   *n_box_full=nfull;
   print_info("  There are objects in %d out of %d boxes \n",nfull,n_boxes3D);
   *box_indices=(int *)my_malloc(nfull*sizeof(int));
-  
-  nfull=0;
+
+  //All boxes share a single aligned arena holding the N_POS arrays,
+  //each padded to a whole number of SIMD_ALIGN bytes. Boxes point
+  //to their slice of each array, at the offset given by the prefix
+  //sum of the box counts along the curve, so box 0 (always first)
+  //points to the arena itself.
+  npad=SIMD_ALIGN/sizeof(double);
+  npad=npad*((cat->np+npad-1)/npad);
+  arena=(double *)my_malloc_aligned(MAX(N_POS*npad,1)*sizeof(double));
+
   for(ii=0;ii<n_boxes3D;ii++) {
-    if(boxes[ii].np>0) {
-      boxes[ii].pos=(double *)my_malloc(N_POS*boxes[ii].np*sizeof(double));
-      boxes[ii].np=0;
+    int offset=box_start[rank[ii]];
+    boxes[ii].x=arena+offset;
+    boxes[ii].y=arena+npad+offset;
+    boxes[ii].z=arena+2*npad+offset;
+#ifdef _WITH_WEIGHTS
+    boxes[ii].w=arena+3*npad+offset;
+#endif //_WITH_WEIGHTS
+  }
+
+  //Regions get an array of their own, with the same offsets
+  if(cat->region!=NULL) {
+    int *reg=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+    for(ii=0;ii<cat->np;ii++)
+      reg[ii]=cat->region[order[ii]];
+    for(ii=0;ii<n_boxes3D;ii++)
+      boxes[ii].reg=reg+box_start[rank[ii]];
+  }
 
+  //Full boxes are listed along the curve, which is
+  //also the order in which the correlators visit them.
+  //With MPI domains only this node's boxes are listed
+  nfull=0;
+  for(ii=0;ii<n_boxes3D;ii++) {
+    if(mpi_domains) {
+      int iz=curve[ii]/(n_side[0]*n_side[1]);
+      if((iz<iz_domain[0])||(iz>=iz_domain[1]))
+	continue;
+    }
+    if(boxes[curve[ii]].np>0) {
       //Get box index
-      (*box_indices)[nfull]=ii;
+      (*box_indices)[nfull]=curve[ii];
       nfull++;
     }
   }
+  *n_box_full=nfull;
 
+  //The arena is in sorted order, so just gather the objects into it
+#pragma omp parallel for default(none) shared(cat,order,arena,npad)
   for(ii=0;ii<cat->np;ii++) {
-    double x=cat->red[ii];
-    double y=cat->cth[ii];
-    double z=cat->phi[ii];
-    int ibox=xyz2box(x,y,z);
-    int np0=boxes[ibox].np;
-    boxes[ibox].pos[N_POS*np0]=x;
-    boxes[ibox].pos[N_POS*np0+1]=y;
-    boxes[ibox].pos[N_POS*np0+2]=z;
+    int io=order[ii];
+    arena[ii]=cat->red[io];
+    arena[npad+ii]=cat->cth[io];
+    arena[2*npad+ii]=cat->phi[io];
 #ifdef _WITH_WEIGHTS
-    boxes[ibox].pos[N_POS*np0+3]=cat->weight[ii];
+    arena[3*npad+ii]=cat->weight[io];
 #endif //_WITH_WEIGHTS
-    boxes[ibox].np++;
   }
 
+  //Bounding boxes of the objects in each box
+#pragma omp parallel for default(none) shared(boxes,n_boxes3D)
+  for(ii=0;ii<n_boxes3D;ii++) {
+    int jj;
+    Box3D *box=&(boxes[ii]);
+    if(box->np>0) {
+      box->x_lo[0]=box->x_hi[0]=box->x[0];
+      box->x_lo[1]=box->x_hi[1]=box->y[0];
+      box->x_lo[2]=box->x_hi[2]=box->z[0];
+    }
+    for(jj=1;jj<box->np;jj++) {
+      box->x_lo[0]=MIN(box->x_lo[0],box->x[jj]);
+      box->x_hi[0]=MAX(box->x_hi[0],box->x[jj]);
+      box->x_lo[1]=MIN(box->x_lo[1],box->y[jj]);
+      box->x_hi[1]=MAX(box->x_hi[1],box->y[jj]);
+      box->x_lo[2]=MIN(box->x_lo[2],box->z[jj]);
+      box->x_hi[2]=MAX(box->x_hi[2],box->z[jj]);
+    }
+#ifdef _WITH_WEIGHTS
+    box->w_tot=0;
+    for(jj=0;jj<box->np;jj++)
+      box->w_tot+=box->w[jj];
+#endif //_WITH_WEIGHTS
+  }
+
+  free(order);
+  free(box_start);
+  free(rank);
+  free(curve);
+
   return boxes;
 }
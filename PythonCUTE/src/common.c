@@ -29,6 +29,7 @@
 #include "define.h"
 #include "common.h"
 #include <stdarg.h>
+#include <sys/mman.h>
 
 //  Timing variables
 #ifdef _HAVE_OMP
@@ -75,6 +76,58 @@ void share_iters(int n_iters,int *iter0,int *iterf)
   *iterf=i+n;
 }
 
+static int cost_split(int n_iters,double *cost,double target)
+{
+  //////
+  // First iteration after the point where the cumulative cost
+  // reaches target, each iteration going to the closest side
+  int i;
+  double acc=0;
+
+  for(i=0;i<n_iters;i++) {
+    if(acc+0.5*cost[i]>target)
+      break;
+    acc+=cost[i];
+  }
+
+  return i;
+}
+
+void share_iters_cost(int n_iters,double *cost,int *iter0,int *iterf)
+{
+  //////
+  // Like share_iters, but each node gets a contiguous range of
+  // iterations with roughly the same total cost, cost[i] being
+  // the estimated cost of iteration i. All nodes must pass the
+  // same costs.
+  int i;
+  double cost_tot=0;
+
+  for(i=0;i<n_iters;i++)
+    cost_tot+=cost[i];
+  if((NNodes==1)||(cost_tot<=0)) {
+    share_iters(n_iters,iter0,iterf);
+    return;
+  }
+
+  if(NodeThis==0)
+    *iter0=0;
+  else
+    *iter0=cost_split(n_iters,cost,cost_tot*NodeThis/NNodes);
+  if(NodeThis==NNodes-1)
+    *iterf=n_iters;
+  else
+    *iterf=cost_split(n_iters,cost,cost_tot*(NodeThis+1)/NNodes);
+
+  if(cute_verbose) {
+    double cost_this=0;
+    for(i=*iter0;i<*iterf;i++)
+      cost_this+=cost[i];
+    printf("Node %d : %d iters, will take from %d to %d (%.1lf%% of the cost)\n",
+	   NodeThis,n_iters,*iter0,*iterf,100*cost_this/cost_tot);
+  }
+}
+
 ///////////////////////////
 //General purpose functions
 void *my_malloc(size_t size)
@@ -99,6 +152,17 @@ void *my_calloc(size_t nmemb,size_t size)
   return outptr;
 }
 
+void *my_malloc_aligned(size_t size)
+{
+  void *outptr;
+  if(posix_memalign(&outptr,SIMD_ALIGN,size)) {
+    fprintf(stderr,"CUTE: out of memory!\n");
+    exit(1);
+  }
+
+  return outptr;
+}
+
 void print_info(char *fmt,...)
 {
   if(!cute_verbose) return;
@@ -182,6 +246,155 @@ void timer(int i)
 #endif //_HAVE_OMP
 }
 
+int *sort_into_cells(int np,int ncells,int *cell_id,int *cell_start)
+{
+  //////
+  // Parallel counting sort of np objects into ncells cells,
+  // where cell_id[i] is the cell of object i. Returns the list
+  // of objects sorted by cell (keeping their relative order
+  // within each cell) and fills cell_start[c] with the position
+  // in that list of the first object in cell c, so that
+  // cell_start[ncells]=np. The objects are split into chunks with
+  // a private histogram each; their number is capped so that these
+  // histograms never take much more memory than the objects.
+  int ic,nchunk=1;
+  int *hists,*order;
+
+#ifdef _HAVE_OMP
+  nchunk=omp_get_max_threads();
+#endif //_HAVE_OMP
+  nchunk=MIN(nchunk,MAX(1,(int)(8.*np/MAX(ncells,1))));
+  hists=(int *)my_calloc((size_t)nchunk*ncells,sizeof(int));
+  order=(int *)my_malloc(MAX(np,1)*sizeof(int));
+
+  //Count objects per cell in each chunk
+#pragma omp parallel for default(none) shared(np,ncells,nchunk,cell_id,hists)
+  for(ic=0;ic<nchunk;ic++) {
+    int ii;
+    int *hist=&(hists[(size_t)ic*ncells]);
+    int i0=(int)(((long)np*ic)/nchunk);
+    int i1=(int)(((long)np*(ic+1))/nchunk);
+    for(ii=i0;ii<i1;ii++)
+      hist[cell_id[ii]]++;
+  }
+
+  //Turn each histogram into the offset of its chunk within each cell
+#pragma omp parallel for default(none) shared(ncells,nchunk,hists,cell_start)
+  for(ic=0;ic<ncells;ic++) {
+    int jc,nc=0;
+    for(jc=0;jc<nchunk;jc++) {
+      int n=hists[(size_t)jc*ncells+ic];
+      hists[(size_t)jc*ncells+ic]=nc;
+      nc+=n;
+    }
+    cell_start[ic+1]=nc;
+  }
+
+  //Prefix sum over cells
+  cell_start[0]=0;
+  for(ic=0;ic<ncells;ic++)
+    cell_start[ic+1]+=cell_start[ic];
+
+  //Scatter objects to their place in the list
+#pragma omp parallel for default(none) shared(np,ncells,nchunk,cell_id,hists,cell_start,order)
+  for(ic=0;ic<nchunk;ic++) {
+    int ii;
+    int *hist=&(hists[(size_t)ic*ncells]);
+    int i0=(int)(((long)np*ic)/nchunk);
+    int i1=(int)(((long)np*(ic+1))/nchunk);
+    for(ii=i0;ii<i1;ii++) {
+      int icell=cell_id[ii];
+      order[cell_start[icell]+hist[icell]]=ii;
+      hist[icell]++;
+    }
+  }
+
+  free(hists);
+
+  return order;
+}
+
+histo_t **mk_thread_histos(void)
+{
+  //////
+  // Returns a table with room for the private histogram
+  // of each OpenMP thread (see get_thread_histo)
+  int nthr=1;
+
+#ifdef _HAVE_OMP
+  nthr=omp_get_max_threads();
+#endif //_HAVE_OMP
+
+  return (histo_t **)my_calloc(nthr,sizeof(histo_t *));
+}
+
+histo_t *get_thread_histo(histo_t **hthreads,int nbins)
+{
+  //////
+  // Called by every thread of a parallel region. Allocates the
+  // zeroed private histogram of the calling thread and stores it
+  // in hthreads. Histograms are padded to whole cache lines so
+  // that no two threads ever write to the same line.
+  int ib,ith=0;
+  size_t size=SIMD_ALIGN*((MAX(nbins,1)*sizeof(histo_t)+SIMD_ALIGN-1)/SIMD_ALIGN);
+  histo_t *hthread=(histo_t *)my_malloc_aligned(size);
+
+  for(ib=0;ib<(int)(size/sizeof(histo_t));ib++)
+    hthread[ib]=0;
+
+#ifdef _HAVE_OMP
+  ith=omp_get_thread_num();
+#endif //_HAVE_OMP
+  hthreads[ith]=hthread;
+
+  return hthread;
+}
+
+void reduce_thread_histos(histo_t **hthreads,int nbins,histo_t *hh)
+{
+  //////
+  // Called by every thread of a parallel region once it's done
+  // with its private histogram. Adds all private histograms to hh.
+  // The bins are split in blocks between threads, and each thread
+  // sums its blocks over all private histograms, so the merge
+  // takes the same time per thread whatever the number of threads.
+  int ib,nthr=1;
+
+#ifdef _HAVE_OMP
+  nthr=omp_get_num_threads();
+#endif //_HAVE_OMP
+
+#pragma omp barrier
+#pragma omp for schedule(static)
+  for(ib=0;ib<nbins;ib+=NB_HISTO_BLOCK) {
+    int ith;
+    int ib_end=MIN(ib+NB_HISTO_BLOCK,nbins);
+    for(ith=0;ith<nthr;ith++) {
+      int jb;
+      histo_t *hthread=hthreads[ith];
+      for(jb=ib;jb<ib_end;jb++)
+	hh[jb]+=hthread[jb];
+    }
+  }
+}
+
+void free_thread_histos(histo_t **hthreads)
+{
+  //////
+  // Frees the private histograms in hthreads and the table itself
+  int ith,nthr=1;
+
+#ifdef _HAVE_OMP
+  nthr=omp_get_max_threads();
+#endif //_HAVE_OMP
+
+  for(ith=0;ith<nthr;ith++) {
+    if(hthreads[ith]!=NULL)
+      free(hthreads[ith]);
+  }
+  free(hthreads);
+}
+
 double wrap_phi(double phi)
 {
   if(phi<0)
@@ -209,19 +422,79 @@ void error_read_line(char *fname,int nlin)
   exit(1);
 }
 
+static void free_Catalog_array(Catalog *cat,void *p)
+{
+  //////
+  // Frees p unless it lives in the binary file mapped by cat
+  char *c=(char *)p;
+  char *m=(char *)(cat->map);
+  if((m!=NULL)&&(c>=m)&&(c<m+cat->map_size))
+    return;
+  free(p);
+}
+
 void free_Catalog(Catalog *cat)
 {
   if(cat->np > 0) {
-    free(cat->red);
-    free(cat->cth);
-    free(cat->phi);
+    free_Catalog_array(cat,cat->red);
+    free_Catalog_array(cat,cat->cth);
+    free_Catalog_array(cat,cat->phi);
 #ifdef _WITH_WEIGHTS
-    free(cat->weight);
+    free_Catalog_array(cat,cat->weight);
 #endif //_WITH_WEIGHTS
   }
+  if(cat->region!=NULL)
+    free_Catalog_array(cat,cat->region);
+  if(cat->map!=NULL)
+    munmap(cat->map,cat->map_size);
   free(cat);
 }
 
+int get_n_jk_pairs(void)
+{
+  //////
+  // Number of histograms kept by the jackknife correlators:
+  // one per unordered pair of regions, or a single one
+  // without jackknife
+  if(n_jk>0)
+    return (n_jk*(n_jk+1))/2;
+  else
+    return 1;
+}
+
+int jk_pair_index(int reg1,int reg2)
+{
+  //////
+  // Index of the histogram for pairs between regions reg1
+  // and reg2 (in any order), with the pairs for (0,0),
+  // (0,1), ..., (0,n_jk-1), (1,1), ... laid out in turn
+  int ra=MIN(reg1,reg2);
+  int rb=MAX(reg1,reg2);
+  return (ra*(2*n_jk-ra+1))/2+rb-ra;
+}
+
+np_t *mk_region_sums(Catalog *cat)
+{
+  //////
+  // Returns the sums of weights (first n_jk entries) and of
+  // squared weights (last n_jk entries) in each region of cat
+  int ii;
+  np_t *sums=(np_t *)my_calloc(2*n_jk,sizeof(np_t));
+
+  for(ii=0;ii<cat->np;ii++) {
+    int ir=cat->region[ii];
+#ifdef _WITH_WEIGHTS
+    sums[ir]+=cat->weight[ii];
+    sums[n_jk+ir]+=cat->weight[ii]*cat->weight[ii];
+#else //_WITH_WEIGHTS
+    sums[ir]++;
+    sums[n_jk+ir]++;
+#endif //_WITH_WEIGHTS
+  }
+
+  return sums;
+}
+
 void free_Catalog_f(Catalog_f cat)
 {
   if(cat.np>0)
@@ -319,9 +592,11 @@ void write_Boxes3D(int num_boxes,Box3D *boxes,char *fn)
       if(boxes[ii].np>0) {
 	int jj;
 	for(jj=0;jj<boxes[ii].np;jj++) {
-	  int kk;
-	  for(kk=0;kk<N_POS;kk++)
-	    fprintf(fr,"%lf ",boxes[ii].pos[N_POS*jj+kk]);
+	  fprintf(fr,"%lf %lf %lf ",boxes[ii].x[jj],
+		  boxes[ii].y[jj],boxes[ii].z[jj]);
+#ifdef _WITH_WEIGHTS
+	  fprintf(fr,"%lf ",boxes[ii].w[jj]);
+#endif //_WITH_WEIGHTS
 	  fprintf(fr,"\n");
 	}
       }
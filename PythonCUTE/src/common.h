@@ -27,6 +27,7 @@ extern int NodeThis;
 extern int NNodes;
 void mpi_init(int* p_argc,char*** p_argv);
 void share_iters(int n_iters,int *iter0,int *niter_this);
+void share_iters_cost(int n_iters,double *cost,int *iter0,int *iterf);
 
 //General-purpose functions
 void print_info(char *fmt,...);
@@ -35,10 +36,22 @@ void *my_malloc(size_t size);
 
 void *my_calloc(size_t nmemb,size_t size);
 
+void *my_malloc_aligned(size_t size);
+
 int linecount(FILE *f);
 
 void timer(int i);
 
+int *sort_into_cells(int np,int ncells,int *cell_id,int *cell_start);
+
+histo_t **mk_thread_histos(void);
+
+histo_t *get_thread_histo(histo_t **hthreads,int nbins);
+
+void reduce_thread_histos(histo_t **hthreads,int nbins,histo_t *hh);
+
+void free_thread_histos(histo_t **hthreads);
+
 double wrap_phi(double phi);
 
 void error_open_file(char *fname);
@@ -47,6 +60,12 @@ void error_read_line(char *fname,int nlin);
 
 void free_Catalog(Catalog *cat);
 
+int get_n_jk_pairs(void);
+
+int jk_pair_index(int reg1,int reg2);
+
+np_t *mk_region_sums(Catalog *cat);
+
 void free_Catalog_f(Catalog_f cat);
 
 
@@ -61,12 +80,22 @@ void free_RadialCells(int npix,RadialCell *radcell);
 
 void init_2D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype);
 
+void set_2D_level(int level);
+
+PixRanges *mk_PixRanges(void);
+
+void free_PixRanges(PixRanges *pr);
+
+void get_neighbor_pixels(int ipix,int *bounds,double alpha,PixRanges *pr);
+
 Cell2D *mk_Cells2D_from_Catalog(Catalog *cat,int **cell_indices,
 				int *n_cell_full);
 
 Cell2D *mk_Cells2D_many_from_Catalog(Catalog *cat,int **cell_indices,
 				     Cell2D **cells_total_out,int *n_cell_full);
 
+double *mk_Map2D_from_Catalog(Catalog *cat);
+
 RadialCell *mk_RadialCells_from_Catalog(Catalog *cat);
 
 Box2D *mk_Boxes2D_from_Catalog(Catalog *cat,int **box_indices,
@@ -93,6 +122,10 @@ void init_3D_params(Catalog *cat_dat,Catalog *cat_ran,int ctype);
 
 void init_3D_params_cross(Catalog *cat_dat1,Catalog *cat_dat2,Catalog *cat_ran1,Catalog *cat_ran2,int ctype);
 
+void init_3D_params_batch(int n_cats,Catalog **cats_dat,Catalog *cat_ran,int ctype);
+
+void init_3D_params_domain(Catalog *cat_dat,Catalog *cat_ran,int ctype);
+
 Box3D *mk_Boxes3D_from_Catalog(Catalog *cat,int **box_indices,int *n_box_full);
 
 void init_3D_params_f(float pox_min[],Catalog_f cat_dat,Catalog_f cat_ran,int ctype);
@@ -101,6 +134,12 @@ void mk_Boxes3D_from_Catalog_f(Catalog_f cat,float **box_pos,
 			       int **box_np,int **box_ind);
 
 
+//k-d trees
+void free_KDTree(KDTree *tree);
+
+KDTree *mk_KDTree_from_Catalog(Catalog *cat);
+
+
 //Distance-redshift relation
 void end_r_z(void);
 
@@ -125,6 +164,10 @@ Catalog_f mk_random_cat_f(int np);
 void write_CF(char *fname,histo_t *DD,histo_t *DR,histo_t *RR,
 	      np_t sum_wd,np_t sum_wd2,np_t sum_wr,np_t sum_wr2);
 
+void write_CF_jk(char *fname,histo_t *DD,histo_t *DR,histo_t *RR,
+		 np_t *sums_wd,np_t *sums_wr,
+		 np_t sum_wd,np_t sum_wd2,np_t sum_wr,np_t sum_wr2);
+
 void write_CCF(char *fname,histo_t *D1D2,histo_t *D1R,histo_t *D2R,histo_t *RR,
 	      np_t sum_wd1,np_t sum_wd2,np_t sum_wr1,np_t sum_wr2,int reuse_ran);
 
@@ -136,17 +179,32 @@ void read_run_params(char *fname);
 
 Catalog *read_catalog(char *fname,np_t *sum_w,np_t *sum_w2);
 
+void write_catalog_bin(char *fname,Catalog *cat);
+
+void convert_catalog(char *fname_in,char *fname_out);
+
 Catalog_f read_catalog_f(char *fname,int *np);
 
+int read_RR_cache(Catalog *cat_ran,histo_t *RR);
+
+void write_RR_cache(histo_t *RR);
+
 
 //Correlators
+#ifdef _BIN_TABLES
+void init_bin_tables(void);
+void end_bin_tables(void);
+#endif //_BIN_TABLES
+
 void auto_angular_cross_bf(int npix_full,int *indices,
 			   RadialPixel *pixrad,histo_t *hh);
 void cross_angular_cross_bf(int npix_full,int *indices,
 			    RadialPixel *pixrad1,RadialPixel *pixrad2,
 			    histo_t *hh);
+double get_th_bin_edge(int ith);
+int get_pm_level_bins(int level,int *ith_lo,int *ith_hi);
 void corr_angular_cross_pm(Cell2D *cellsD,Cell2D *cellsD_total,
-			   Cell2D *cellsR,Cell2D *cellsR_total,
+			   Cell2D *cellsR,Cell2D *cellsR_total,int level,
 			   histo_t *DD,histo_t *DR,histo_t *RR);
 
 void auto_full_bf(int npix_full,int *indices,RadialPixel *pixrad,
@@ -169,7 +227,7 @@ void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
 void cross_ang_bf(int npix_full,int *indices,
 		  Box2D *boxes1,Box2D *boxes2,
 		  histo_t *hh);
-void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,
+void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,int level,
 		 histo_t *DD,histo_t *DR,
 		 histo_t *RR);
 
@@ -196,6 +254,18 @@ void cross_3d_rm_special_bf(int nbox_full,int *indices,
 		    Box3D *boxes1,Box3D *boxes2,
 		    histo_t *hh);
 
+void corr_3d_bf(int nfull_dat,int *indices_dat,
+		int nfull_ran,int *indices_ran,
+		Box3D *boxes_dat,Box3D *boxes_ran,
+		histo_t *DD,histo_t *DR,histo_t *RR);
+
+void auto_3d_tree(KDTree *tree,histo_t *hh);
+void cross_3d_tree(KDTree *tree1,KDTree *tree2,histo_t *hh);
+
+//Harmonic-space correlators
+void corr_ang_harmonic(double *mapD,double *mapR,
+		       histo_t *DD,histo_t *DR,histo_t *RR);
+
 #ifdef _DEBUG
 //Debug files output
 void write_Cells2D(int num_cells,Cell2D *cellmap,char *fn);
@@ -242,6 +312,12 @@ void set_result_3d(Result *res,
     double R2R2);
 
 Catalog *create_catalog_from_numpy(int n, double *phi, int n1, double *cth, int n2, double *red, int n3, double *weight);
+void set_catalog_regions(Catalog *cat, int n, int *region);
+
+CatalogBatch *make_catalog_batch(int n);
+void set_batch_catalog(CatalogBatch *batch, int i, Catalog *cat);
+Result *get_batch_result(CatalogBatch *batch, int i);
+void free_catalog_batch(CatalogBatch *batch);
     
 void initialize_binner();
 int verify_parameters();
@@ -252,9 +328,11 @@ void set_random_filename2(char *s);
 void set_reuse_randoms(int i);
 void set_num_lines(char *s);
 void set_input_format(int i);
+void set_hdf5_datasets(char *s);
 void set_output_filename(char *s);
 void set_mask_filename(char *s);
 void set_z_dist_filename(char *s);
+void set_rr_cache_dir(char *s);
 void set_corr_estimator(char *s);
 void set_corr_type(char *s);
 void set_np_rand_fact(int i);
@@ -273,6 +351,12 @@ void set_log_bin(int i);
 void set_n_logint(int i);
 void set_use_pm(int i);
 void set_n_pix_sph(int i);
+void set_pm_levels(int i);
+void set_box_order(char *s);
+void set_pixelization(char *s);
+void set_use_tree(int i);
+void set_n_jk_regions(int i);
+void set_mpi_domains(int i);
 
 #endif
 
@@ -32,7 +32,7 @@
 #include "define.h"
 #include "common.h"
 
-static inline int r2bin(double r2)
+static inline int r2bin_direct(double r2)
 {
   int ir;
 
@@ -49,7 +49,7 @@ static inline int r2bin(double r2)
   return ir;
 }
 
-static inline int th2bin(double cth)
+static inline int th2bin_direct(double cth)
 {
   int ith;
   cth=(MIN((1.),(cth)));
@@ -81,6 +81,393 @@ static inline int th2bin(double cth)
   return ith;
 }
 
+#ifdef _BIN_TABLES
+/*********************************************************************/
+//                        Tabulated binning                          //
+/*********************************************************************/
+// With _BIN_TABLES, r2bin and th2bin look up the bin of r^2 (resp.
+// 1-cos(theta)) in a table of bin edges in that same variable, so no
+// pair needs a sqrt or log10. The edges are found by bisecting the
+// direct formulas above, so both give exactly the same bins. With
+// _TRUE_ACOS th2bin keeps the direct formula, since acos(1-(1-cth))
+// may differ from acos(cth) in the last bit. The
+// search starts from a hashed guess: the top bits of a positive
+// double grow monotonically with its value (exponent plus leading
+// mantissa bits), so they index a table of starting bins with a
+// fixed number of entries per octave.
+#define NB_HASH_MAX 65536
+
+typedef struct {
+  int nb;         //Number of bins
+  double *edge;   //Lower edges of bins 0 to nb (nb is the upper edge)
+  int shift;      //Bits dropped from the key to get its hash
+  long hash_lo;   //Hash of the first positive edge
+  long nhash;     //Number of hash entries
+  int *hash;      //Lowest bin reachable from each hash entry
+} BinTable;
+
+static BinTable *table_r=NULL;
+static BinTable *table_th=NULL;
+
+static inline unsigned long long dbl2bits(double x)
+{
+  union {double d; unsigned long long u;} b;
+  b.d=x;
+  return b.u;
+}
+
+static inline double bits2dbl(unsigned long long u)
+{
+  union {double d; unsigned long long u;} b;
+  b.u=u;
+  return b.d;
+}
+
+static inline int table_bin(BinTable *tab,double x)
+{
+  int ib;
+  long ih;
+
+  if(x<tab->edge[0]) return -1;
+  if(x>=tab->edge[tab->nb]) return tab->nb;
+
+  ih=(long)(dbl2bits(x)>>tab->shift)-tab->hash_lo;
+  if(ih<0) ib=0;
+  else ib=tab->hash[MIN(ih,tab->nhash-1)];
+  while(x>=tab->edge[ib+1]) ib++;
+
+  return ib;
+}
+
+#ifndef _TRUE_ACOS
+static int u2bin_th(double u)
+{
+  //////
+  // th2bin_direct as a function of u=1-cos(theta)
+  int ith;
+
+  if(logbin) {
+    if(u>0) {
+      u=0.5*log10(2*u+0.3333333*u*u+
+		  0.0888888889*u*u*u);
+      ith=(int)(n_logint*(u-log_th_max)+nb_theta);
+    }
+    else ith=-1;
+  }
+  else {
+    u=sqrt(2*u+0.333333333*u*u+
+	   0.08888888889*u*u*u);
+    ith=(int)(u*nb_theta*i_theta_max);
+  }
+
+  return ith;
+}
+#endif //_TRUE_ACOS
+
+static BinTable *mk_BinTable(int nb,int (*bin_f)(double),double x_max)
+{
+  //////
+  // Tabulates the edges of the monotonic binning function bin_f
+  // for keys in [0,x_max]. Edges beyond x_max are set to infinity.
+  int ib,m;
+  long ih;
+  double x_lo,x_hi,rel_min;
+  unsigned long long bmax=dbl2bits(x_max);
+  BinTable *tab=(BinTable *)my_malloc(sizeof(BinTable));
+
+  tab->nb=nb;
+  tab->edge=(double *)my_malloc((nb+1)*sizeof(double));
+  for(ib=0;ib<=nb;ib++) {
+    if(bin_f(x_max)<ib)
+      tab->edge[ib]=HUGE_VAL;
+    else {
+      //Smallest non-negative double with bin_f>=ib
+      unsigned long long b0=0,b1=bmax;
+      if(bin_f(0)>=ib)
+	b1=0;
+      while(b1-b0>1) {
+	unsigned long long bm=b0+(b1-b0)/2;
+	if(bin_f(bits2dbl(bm))>=ib) b1=bm;
+	else b0=bm;
+      }
+      tab->edge[ib]=bits2dbl(b1);
+    }
+  }
+
+  //Hash covers the positive, finite edges
+  x_lo=-1; x_hi=0; rel_min=1;
+  for(ib=0;ib<=nb;ib++) {
+    double e=tab->edge[ib];
+    if((e>0)&&(e<HUGE_VAL)) {
+      if(x_lo<0) x_lo=e;
+      else rel_min=MIN(rel_min,(e-tab->edge[ib-1])/e);
+      x_hi=e;
+    }
+  }
+  if(x_lo<0) x_lo=x_hi=x_max;
+
+  //Aim for at most one edge per hash entry
+  m=0;
+  while((m<20)&&(ldexp(1.,-m)>rel_min)) m++;
+  while(1) {
+    tab->shift=52-m;
+    tab->hash_lo=(long)(dbl2bits(x_lo)>>tab->shift);
+    tab->nhash=(long)(dbl2bits(x_hi)>>tab->shift)-tab->hash_lo+1;
+    if((tab->nhash<=NB_HASH_MAX)||(m==0))
+      break;
+    m--;
+  }
+
+  tab->hash=(int *)my_malloc(tab->nhash*sizeof(int));
+  ib=0;
+  for(ih=0;ih<tab->nhash;ih++) {
+    double x=bits2dbl((unsigned long long)(ih+tab->hash_lo)<<tab->shift);
+    while((ib<nb-1)&&(x>=tab->edge[ib+1]))
+      ib++;
+    tab->hash[ih]=ib;
+  }
+
+  return tab;
+}
+
+static void free_BinTable(BinTable *tab)
+{
+  if(tab!=NULL) {
+    free(tab->edge);
+    free(tab->hash);
+    free(tab);
+  }
+}
+
+void init_bin_tables(void)
+{
+  //////
+  // Tabulates the radial and angular bin edges for the
+  // current binning parameters
+  end_bin_tables();
+  //Radial keys go up to twice the maximum separation
+  table_r=mk_BinTable(nb_r,r2bin_direct,4/(i_r_max*i_r_max));
+#ifndef _TRUE_ACOS
+  //Angular keys go up to 1-cos(pi)
+  table_th=mk_BinTable(nb_theta,u2bin_th,2.);
+#endif //_TRUE_ACOS
+}
+
+void end_bin_tables(void)
+{
+  free_BinTable(table_r);
+  free_BinTable(table_th);
+  table_r=NULL;
+  table_th=NULL;
+}
+
+static inline int r2bin(double r2)
+{
+  return table_bin(table_r,r2);
+}
+
+static inline int th2bin(double cth)
+{
+#ifdef _TRUE_ACOS
+  return th2bin_direct(cth);
+#else //_TRUE_ACOS
+  return table_bin(table_th,1-MIN(1,cth));
+#endif //_TRUE_ACOS
+}
+#else //_BIN_TABLES
+#define r2bin r2bin_direct
+#define th2bin th2bin_direct
+#endif //_BIN_TABLES
+
+static inline void get_pos_Box3D(Box3D *box,int ii,double *pos)
+{
+  //////
+  // Copies position (and weight) of particle ii in box into pos
+  pos[0]=box->x[ii];
+  pos[1]=box->y[ii];
+  pos[2]=box->z[ii];
+#ifdef _WITH_WEIGHTS
+  pos[3]=box->w[ii];
+#endif //_WITH_WEIGHTS
+}
+
+/*********************************************************************/
+//                 Vectorized monopole pair kernels                  //
+/*********************************************************************/
+// These bin the pairs formed by one particle (pos1) and particles
+// j0 to np-1 of box into the monopole histogram hthread. The
+// AVX2/AVX-512 versions compute 4/8 distances at a time from the
+// contiguous x/y/z arrays of the box; the version used is chosen at
+// run time by select_mono_kernel according to what the CPU supports.
+typedef void (*mono_kernel_t)(double *,Box3D *,int,double,histo_t *);
+
+static void mono_pairs_scalar(double *pos1,Box3D *box,int j0,
+			      double r2_max,histo_t *hthread)
+{
+  int jj;
+  for(jj=j0;jj<box->np;jj++) {
+    double r2;
+    double xr[3];
+    xr[0]=pos1[0]-box->x[jj];
+    xr[1]=pos1[1]-box->y[jj];
+    xr[2]=pos1[2]-box->z[jj];
+    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+    if(r2<r2_max) {
+      int ir=r2bin(r2);
+      if((ir<nb_r)&&(ir>=0)) {
+#ifdef _WITH_WEIGHTS
+	hthread[ir]+=pos1[3]*box->w[jj];
+#else //_WITH_WEIGHTS
+	hthread[ir]++;
+#endif //_WITH_WEIGHTS
+      }
+    }
+  }
+}
+
+#if defined(_HAVE_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define _SIMD_X86
+
+__attribute__((target("avx2")))
+static void mono_pairs_avx2(double *pos1,Box3D *box,int j0,
+			    double r2_max,histo_t *hthread)
+{
+  int jj;
+  const __m256d x1=_mm256_set1_pd(pos1[0]);
+  const __m256d y1=_mm256_set1_pd(pos1[1]);
+  const __m256d z1=_mm256_set1_pd(pos1[2]);
+  const __m256d r2m=_mm256_set1_pd(r2_max);
+  const __m256d fac=_mm256_set1_pd(i_r_max*nb_r);
+
+  for(jj=j0;jj+4<=box->np;jj+=4) {
+    int mask,k;
+    __m256d dx=_mm256_sub_pd(x1,_mm256_loadu_pd(&(box->x[jj])));
+    __m256d dy=_mm256_sub_pd(y1,_mm256_loadu_pd(&(box->y[jj])));
+    __m256d dz=_mm256_sub_pd(z1,_mm256_loadu_pd(&(box->z[jj])));
+    __m256d r2=_mm256_add_pd(_mm256_mul_pd(dx,dx),
+			     _mm256_add_pd(_mm256_mul_pd(dy,dy),
+					   _mm256_mul_pd(dz,dz)));
+    mask=_mm256_movemask_pd(_mm256_cmp_pd(r2,r2m,_CMP_LT_OQ));
+    if(!mask) continue;
+
+    if(logbin) { //No vector log10, bin the surviving lanes one by one
+      double r2s[4];
+      _mm256_storeu_pd(r2s,r2);
+      for(k=0;k<4;k++) {
+	if(mask&(1<<k)) {
+	  int ir=r2bin(r2s[k]);
+	  if((ir<nb_r)&&(ir>=0)) {
+#ifdef _WITH_WEIGHTS
+	    hthread[ir]+=pos1[3]*box->w[jj+k];
+#else //_WITH_WEIGHTS
+	    hthread[ir]++;
+#endif //_WITH_WEIGHTS
+	  }
+	}
+      }
+    }
+    else {
+      int irs[4];
+      _mm_storeu_si128((__m128i *)irs,
+		       _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_sqrt_pd(r2),fac)));
+      for(k=0;k<4;k++) {
+	if(mask&(1<<k)) {
+	  int ir=irs[k];
+	  if((ir<nb_r)&&(ir>=0)) {
+#ifdef _WITH_WEIGHTS
+	    hthread[ir]+=pos1[3]*box->w[jj+k];
+#else //_WITH_WEIGHTS
+	    hthread[ir]++;
+#endif //_WITH_WEIGHTS
+	  }
+	}
+      }
+    }
+  }
+
+  if(jj<box->np)
+    mono_pairs_scalar(pos1,box,jj,r2_max,hthread);
+}
+
+__attribute__((target("avx512f")))
+static void mono_pairs_avx512(double *pos1,Box3D *box,int j0,
+			      double r2_max,histo_t *hthread)
+{
+  int jj;
+  const __m512d x1=_mm512_set1_pd(pos1[0]);
+  const __m512d y1=_mm512_set1_pd(pos1[1]);
+  const __m512d z1=_mm512_set1_pd(pos1[2]);
+  const __m512d r2m=_mm512_set1_pd(r2_max);
+  const __m512d fac=_mm512_set1_pd(i_r_max*nb_r);
+
+  for(jj=j0;jj+8<=box->np;jj+=8) {
+    int k;
+    __mmask8 mask;
+    __m512d dx=_mm512_sub_pd(x1,_mm512_loadu_pd(&(box->x[jj])));
+    __m512d dy=_mm512_sub_pd(y1,_mm512_loadu_pd(&(box->y[jj])));
+    __m512d dz=_mm512_sub_pd(z1,_mm512_loadu_pd(&(box->z[jj])));
+    __m512d r2=_mm512_add_pd(_mm512_mul_pd(dx,dx),
+			     _mm512_add_pd(_mm512_mul_pd(dy,dy),
+					   _mm512_mul_pd(dz,dz)));
+    mask=_mm512_cmp_pd_mask(r2,r2m,_CMP_LT_OQ);
+    if(!mask) continue;
+
+    if(logbin) {
+      double r2s[8];
+      _mm512_storeu_pd(r2s,r2);
+      for(k=0;k<8;k++) {
+	if(mask&(1<<k)) {
+	  int ir=r2bin(r2s[k]);
+	  if((ir<nb_r)&&(ir>=0)) {
+#ifdef _WITH_WEIGHTS
+	    hthread[ir]+=pos1[3]*box->w[jj+k];
+#else //_WITH_WEIGHTS
+	    hthread[ir]++;
+#endif //_WITH_WEIGHTS
+	  }
+	}
+      }
+    }
+    else {
+      int irs[8];
+      _mm256_storeu_si256((__m256i *)irs,
+			  _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_sqrt_pd(r2),fac)));
+      for(k=0;k<8;k++) {
+	if(mask&(1<<k)) {
+	  int ir=irs[k];
+	  if((ir<nb_r)&&(ir>=0)) {
+#ifdef _WITH_WEIGHTS
+	    hthread[ir]+=pos1[3]*box->w[jj+k];
+#else //_WITH_WEIGHTS
+	    hthread[ir]++;
+#endif //_WITH_WEIGHTS
+	  }
+	}
+      }
+    }
+  }
+
+  if(jj<box->np)
+    mono_pairs_avx2(pos1,box,jj,r2_max,hthread);
+}
+#endif //_HAVE_SIMD
+
+static mono_kernel_t select_mono_kernel(void)
+{
+  //////
+  // Returns the fastest monopole pair kernel
+  // supported by this CPU
+#ifdef _SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    return mono_pairs_avx512;
+  if(__builtin_cpu_supports("avx2"))
+    return mono_pairs_avx2;
+#endif //_SIMD_X86
+  return mono_pairs_scalar;
+}
+
 void auto_angular_cross_bf(int npix_full,int *indices,
 			   RadialPixel *pixrad,histo_t *hh)
 {
@@ -92,14 +479,16 @@ void auto_angular_cross_bf(int npix_full,int *indices,
   for(i=0;i<(nb_red*(nb_red+1)*nb_theta)/2;i++) 
     hh[i]=0;
   
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(npix_full,indices,pixrad,hh,n_side_phi)	\
+  shared(npix_full,indices,pixrad,hh,hthreads)	\
   shared(nb_red,nb_theta,ipix_0,ipix_f)		\
   shared(i_red_interval,red_0,i_theta_max)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,(nb_red*(nb_red+1)*nb_theta)/2);
     double cth_aperture=cos(1./i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -107,10 +496,10 @@ void auto_angular_cross_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=pixrad[ip1].np;
       RadialPixelInfo *pi1=pixrad[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,1./i_theta_max,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int jj,icth;
+	int jj,ir,ip2;
 	double *pos1=&(pi1->pos[N_POS*ii]);
 	int iz1=(int)((pi1->redshifts[ii]-red_0)*i_red_interval*nb_red);
 	if((iz1>=0)&&(iz1<nb_red)) {
@@ -137,12 +526,8 @@ void auto_angular_cross_bf(int npix_full,int *indices,
 	    }
 	  }
 
-	  for(icth=bounds[0];icth<=bounds[1];icth++) {
-	    int iphi;
-	    int icth_n=icth*n_side_phi;
-	    for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	      int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	      int ip2=iphi_true+icth_n;
+	  for(ir=0;ir<pr->n;ir++) {
+	    for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	      if(pixrad[ip2].np>0) {
 		if(ip2>ip1) {
 		  int np2=pixrad[ip2].np;
@@ -177,14 +562,11 @@ void auto_angular_cross_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<(nb_red*(nb_red+1)*nb_theta)/2;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,(nb_red*(nb_red+1)*nb_theta)/2,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void cross_angular_cross_bf(int npix_full,int *indices,
@@ -199,14 +581,16 @@ void cross_angular_cross_bf(int npix_full,int *indices,
   for(i=0;i<(nb_red*(nb_red+1)*nb_theta)/2;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(npix_full,indices,pixrad1,pixrad2,hh,n_side_phi)	\
+  shared(npix_full,indices,pixrad1,pixrad2,hh,hthreads)	\
   shared(nb_red,nb_theta,ipix_0,ipix_f)		\
   shared(i_red_interval,red_0,i_theta_max)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,(nb_red*(nb_red+1)*nb_theta)/2);
     double cth_aperture=cos(1./i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -214,19 +598,15 @@ void cross_angular_cross_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=pixrad1[ip1].np;
       RadialPixelInfo *pi1=pixrad1[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,1./i_theta_max,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int icth;
+	int ir,ip2;
 	int iz1=(int)((pi1->redshifts[ii]-red_0)*i_red_interval*nb_red);
 	if((iz1>=0)&&(iz1<nb_red)) {
 	  double *pos1=&(pi1->pos[N_POS*ii]);
-	  for(icth=bounds[0];icth<=bounds[1];icth++) {
-	    int iphi;
-	    int icth_n=icth*n_side_phi;
-	    for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	      int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	      int ip2=iphi_true+icth_n;
+	  for(ir=0;ir<pr->n;ir++) {
+	    for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	      if(pixrad2[ip2].np>0) {
 		int jj;
 		int np2=pixrad2[ip2].np;
@@ -260,14 +640,11 @@ void cross_angular_cross_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<(nb_red*(nb_red+1)*nb_theta)/2;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,(nb_red*(nb_red+1)*nb_theta)/2,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void auto_full_bf(int npix_full,int *indices,
@@ -281,14 +658,16 @@ void auto_full_bf(int npix_full,int *indices,
   for(i=0;i<nb_red*nb_dz*nb_theta;i++) 
     hh[i]=0;
   
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(npix_full,indices,pixrad,hh,n_side_phi)	\
+  shared(npix_full,indices,pixrad,hh,hthreads)	\
   shared(nb_red,nb_dz,nb_theta,ipix_0,ipix_f)	\
   shared(i_red_interval,red_0,i_dz_max,i_theta_max)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_red*nb_dz*nb_theta,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_red*nb_dz*nb_theta);
     double cth_aperture=cos(1./i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -296,10 +675,10 @@ void auto_full_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=pixrad[ip1].np;
       RadialPixelInfo *pi1=pixrad[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,1./i_theta_max,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int jj,icth;
+	int jj,ir,ip2;
 	double *pos1=&(pi1->pos[N_POS*ii]);
 	double redshift1=pi1->redshifts[ii];
 
@@ -328,12 +707,8 @@ void auto_full_bf(int npix_full,int *indices,
 	  }
 	}
 
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(pixrad[ip2].np>0) {
 	      if(ip2>ip1) {
 		int np2=pixrad[ip2].np;
@@ -369,14 +744,11 @@ void auto_full_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_red*nb_dz*nb_theta;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_red*nb_dz*nb_theta,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void cross_full_bf(int npix_full,int *indices,
@@ -391,14 +763,16 @@ void cross_full_bf(int npix_full,int *indices,
   for(i=0;i<nb_red*nb_dz*nb_theta;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(npix_full,indices,pixrad1,pixrad2,hh,n_side_phi)	\
+  shared(npix_full,indices,pixrad1,pixrad2,hh,hthreads)	\
   shared(nb_red,nb_dz,nb_theta,ipix_0,ipix_f)		\
   shared(i_red_interval,red_0,i_dz_max,i_theta_max)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_red*nb_dz*nb_theta,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_red*nb_dz*nb_theta);
     double cth_aperture=cos(1./i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -406,19 +780,15 @@ void cross_full_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=pixrad1[ip1].np;
       RadialPixelInfo *pi1=pixrad1[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,1./i_theta_max,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int icth;
+	int ir,ip2;
 	double *pos1=&(pi1->pos[N_POS*ii]);
 	double redshift1=pi1->redshifts[ii];
 
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(pixrad2[ip2].np>0) {
 	      int jj;
 	      int np2=pixrad2[ip2].np;
@@ -453,14 +823,11 @@ void cross_full_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_red*nb_dz*nb_theta;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_red*nb_dz*nb_theta,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void corr_full_pm(RadialCell *cellsD,RadialCell *cellsR,
@@ -486,22 +853,27 @@ void corr_full_pm(RadialCell *cellsD,RadialCell *cellsR,
   }
   share_iters(npix_full,&ipix_0,&ipix_f);
 
+  histo_t **DDthreads=mk_thread_histos();
+  histo_t **DRthreads=mk_thread_histos();
+  histo_t **RRthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(cellsD,cellsR,DD,DR,RR,n_side_phi,n_boxes2D)		\
+  shared(cellsD,cellsR,DD,DR,RR,n_boxes2D)		\
+  shared(DDthreads,DRthreads,RRthreads)		\
   shared(nb_red,nb_dz,nb_theta,ipix_0,ipix_f,ipix_full)	\
   shared(i_red_interval,red_0,i_dz_max,i_theta_max)
   {
     int j;
-    histo_t *DDthread=(histo_t *)my_calloc(nb_red*nb_dz*nb_theta,sizeof(histo_t));
-    histo_t *DRthread=(histo_t *)my_calloc(nb_red*nb_dz*nb_theta,sizeof(histo_t));
-    histo_t *RRthread=(histo_t *)my_calloc(nb_red*nb_dz*nb_theta,sizeof(histo_t));
+    histo_t *DDthread=get_thread_histo(DDthreads,nb_red*nb_dz*nb_theta);
+    histo_t *DRthread=get_thread_histo(DRthreads,nb_red*nb_dz*nb_theta);
+    histo_t *RRthread=get_thread_histo(RRthreads,nb_red*nb_dz*nb_theta);
     double cth_max=cos(1/i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
       int *bounds;
       double *pos1;
-      int icth;
+      int ir,ip2;
       int ip1=ipix_full[j];
       int nD1=cellsD[ip1].np;
       int nR1=cellsR[ip1].np;
@@ -562,14 +934,11 @@ void corr_full_pm(RadialCell *cellsD,RadialCell *cellsR,
 	}
       }
 
-      for(icth=bounds[0];icth<=bounds[1];icth++) {
-	int iphi;
-	int icth_n=icth*n_side_phi;
-	for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
+      get_neighbor_pixels(ip1,bounds,1./i_theta_max,pr);
+      for(ir=0;ir<pr->n;ir++) {
+	for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	  double *pos2;
 	  double prod;
-	  int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	  int ip2=iphi_true+icth_n;
 	  int nD2=cellsD[ip2].np;
 	  int nR2=cellsR[ip2].np;
 	  
@@ -663,19 +1032,15 @@ void corr_full_pm(RadialCell *cellsD,RadialCell *cellsR,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_red*nb_dz*nb_theta;j++) {
-	DD[j]+=DDthread[j];
-	DR[j]+=DRthread[j];
-	RR[j]+=RRthread[j];
-      }
-    }
+    free_PixRanges(pr);
 
-    free(DDthread);
-    free(DRthread);
-    free(RRthread);
+    reduce_thread_histos(DDthreads,nb_red*nb_dz*nb_theta,DD);
+    reduce_thread_histos(DRthreads,nb_red*nb_dz*nb_theta,DR);
+    reduce_thread_histos(RRthreads,nb_red*nb_dz*nb_theta,RR);
   } //end omp parallel
+  free_thread_histos(DDthreads);
+  free_thread_histos(DRthreads);
+  free_thread_histos(RRthreads);
   free(ipix_full);
 }
 
@@ -690,13 +1055,15 @@ void auto_rad_bf(int npix_full,int *indices,RadialPixel *pixrad,
   for(i=0;i<nb_dz;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(npix_full,indices,pixrad,hh,n_side_phi,aperture_los)	\
+  shared(npix_full,indices,pixrad,hh,aperture_los,hthreads)	\
   shared(nb_dz,i_dz_max,ipix_0,ipix_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_dz,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_dz);
     double cth_aperture=cos(aperture_los);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -704,10 +1071,10 @@ void auto_rad_bf(int npix_full,int *indices,RadialPixel *pixrad,
       int ip1=indices[j];
       int np1=pixrad[ip1].np;
       RadialPixelInfo *pi1=pixrad[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,aperture_los,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int jj,icth;
+	int jj,ir,ip2;
 	double *pos1=&(pi1->pos[N_POS*ii]);
 	double redshift1=pi1->redshifts[ii];
 
@@ -728,12 +1095,8 @@ void auto_rad_bf(int npix_full,int *indices,RadialPixel *pixrad,
 	  }
 	}
 
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(pixrad[ip2].np>0) {
 	      if(ip2>ip1) {
 		int np2=pixrad[ip2].np;
@@ -761,14 +1124,11 @@ void auto_rad_bf(int npix_full,int *indices,RadialPixel *pixrad,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_dz;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_dz,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void cross_rad_bf(int npix_full,int *indices,
@@ -783,13 +1143,15 @@ void cross_rad_bf(int npix_full,int *indices,
   for(i=0;i<nb_dz;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)					\
-  shared(npix_full,indices,pixrad1,pixrad2,hh,n_side_phi,aperture_los)	\
+  shared(npix_full,indices,pixrad1,pixrad2,hh,aperture_los,hthreads)	\
   shared(nb_dz,i_dz_max,ipix_0,ipix_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_dz,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_dz);
     double cth_aperture=cos(aperture_los);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -797,18 +1159,14 @@ void cross_rad_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=pixrad1[ip1].np;
       RadialPixelInfo *pi1=pixrad1[ip1].pi;
-      int *bounds=pi1->bounds;
+      get_neighbor_pixels(ip1,pi1->bounds,aperture_los,pr);
 
       for(ii=0;ii<np1;ii++) {
-	int icth;
+	int ir,ip2;
 	double *pos1=&(pi1->pos[N_POS*ii]);
 	double redshift1=pi1->redshifts[ii];
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(pixrad2[ip2].np>0) {
 	      int jj;
 	      int np2=pixrad2[ip2].np;
@@ -835,14 +1193,11 @@ void cross_rad_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_dz;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_dz,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
@@ -856,13 +1211,15 @@ void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
   for(i=0;i<nb_theta;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)		\
-  shared(npix_full,indices,boxes,hh,n_side_phi)	\
+  shared(npix_full,indices,boxes,hh,hthreads)	\
   shared(nb_theta,i_theta_max,ipix_0,ipix_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_theta);
     double cth_max=cos(1/i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -870,7 +1227,7 @@ void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
       int ip1=indices[j];
       int np1=boxes[ip1].np;
       Box2DInfo *bi1=boxes[ip1].bi;
-      int *bounds=bi1->bounds;
+      get_neighbor_pixels(ip1,bi1->bounds,1./i_theta_max,pr);
       for(ii=0;ii<np1;ii++) {
 	double *pos1=&(bi1->pos[N_POS*ii]);
 	
@@ -891,13 +1248,9 @@ void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
 	  }
 	}
 
-	int icth;
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	int ir,ip2;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(boxes[ip2].np>0) {
 	      if(ip2>ip1) {
 		int np2=boxes[ip2].np;
@@ -924,14 +1277,11 @@ void auto_ang_bf(int npix_full,int *indices,Box2D *boxes,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_theta;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_theta,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
 }
 
 void cross_ang_bf(int npix_full,int *indices,
@@ -946,13 +1296,15 @@ void cross_ang_bf(int npix_full,int *indices,
   for(i=0;i<nb_theta;i++) 
     hh[i]=0;
 
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(npix_full,indices,boxes1,boxes2,hh,n_side_phi)	\
+  shared(npix_full,indices,boxes1,boxes2,hh,hthreads)	\
   shared(nb_theta,i_theta_max,ipix_0,ipix_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_theta);
     double cth_max=cos(1/i_theta_max);
+    PixRanges *pr=mk_PixRanges();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
@@ -960,16 +1312,12 @@ void cross_ang_bf(int npix_full,int *indices,
       int ip1=indices[j];
       int np1=boxes1[ip1].np;
       Box2DInfo *bi1=boxes1[ip1].bi;
-      int *bounds=bi1->bounds;
+      get_neighbor_pixels(ip1,bi1->bounds,1./i_theta_max,pr);
       for(ii=0;ii<np1;ii++) {
-	int icth;
+	int ir,ip2;
 	double *pos1=&(bi1->pos[N_POS*ii]);
-	for(icth=bounds[0];icth<=bounds[1];icth++) {
-	  int iphi;
-	  int icth_n=icth*n_side_phi;
-	  for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	    int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	    int ip2=iphi_true+icth_n;
+	for(ir=0;ir<pr->n;ir++) {
+	  for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
 	    if(boxes2[ip2].np>0) {
 	      int jj;
 	      int np2=boxes2[ip2].np;
@@ -995,148 +1343,503 @@ void cross_ang_bf(int npix_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_theta;j++)
-	hh[j]+=hthread[j];
-    }
+    free_PixRanges(pr);
 
-    free(hthread);
+    reduce_thread_histos(hthreads,nb_theta,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+}
+
+/*********************************************************************/
+//                    Multi-resolution angular PM                    //
+/*********************************************************************/
+// With pm_levels>1 the angular PM correlators are run once per
+// resolution level, the pixels of level l being 2^l times larger
+// than those of level 0 (see set_2D_level). Each angular bin is
+// filled by the coarsest level whose pixels are PM_LEVEL_RES times
+// smaller than both the lower edge and the width of the bin, so only
+// the small-angle bins are correlated with the finest pixels, and
+// with a short neighbour search. Pairs are binned by pixel centres,
+// so a bin only a few pixels wide would get pairs of its neighbours.
+// On the (cos(theta),phi) grid the bin of a pair of pixel centres
+// only depends on their rows and on the difference of their phi
+// indices, so it is tabulated once per level (PMPairTable) and
+// shared by DD, DR and RR. Tables are kept for later runs with the
+// same pixels and binning.
+#define PM_LEVEL_RES 8. //Minimum bin edge and width on coarse levels (in pixels)
+#define PM_TABLE_MAX 16777216 //Maximum number of tabulated pixel pairs
+
+typedef struct {
+  int n_side_cth;   //Pixels and bins the table was made for
+  int n_side_phi;
+  double cth_max;
+  int ith_lo;
+  int ith_hi;
+  int nb_theta;
+  int logbin;
+  int n_logint;
+  double i_theta_max;
+  double log_th_max;
+  int *row0;        //First neighbour row of each row
+  int *nrow;        //Number of neighbour rows of each row
+  long *irow;       //First pair of rows of each row in nd and off
+  int *nd;          //Number of phi offsets of each pair of rows
+  long *off;        //Start of each pair of rows in ith
+  int *ith;         //Bin of each pair of pixels (-1 if not in the level)
+} PMPairTable;
+
+typedef struct {
+  int ith_lo;       //Bins filled by the level
+  int ith_hi;
+  double aperture;  //Neighbour search radius
+  double cth_max;
+  PMPairTable *tab; //Tabulated bins (NULL if not tabulated)
+} PMLevel;
+
+typedef struct {
+  int n;
+  int size;
+  int *ip2;         //Neighbour pixels
+  int *ith;         //Bin of each pair
+} PMPairs;
+
+static PMPairTable *pm_tables[PM_LEVELS_MAX];
+
+double get_th_bin_edge(int ith)
+{
+  //////
+  // Lower edge (rad) of angular bin ith
+  if(logbin)
+    return pow(10,(double)(ith-nb_theta)/n_logint+log_th_max);
+  else
+    return ith/(nb_theta*i_theta_max);
+}
+
+static int pm_bin_resolved(int ith,double th_pix)
+{
+  //////
+  // Returns 1 if both the lower edge and the width of angular
+  // bin ith span PM_LEVEL_RES pixels of size th_pix
+  double edge=get_th_bin_edge(ith);
+  double width;
+
+  if(logbin)
+    width=edge*(pow(10,1./n_logint)-1);
+  else
+    width=1./(nb_theta*i_theta_max);
+
+  return (edge>=PM_LEVEL_RES*th_pix)&&(width>=PM_LEVEL_RES*th_pix);
+}
+
+int get_pm_level_bins(int level,int *ith_lo,int *ith_hi)
+{
+  //////
+  // Returns in ith_lo and ith_hi the range of angular bins
+  // filled by PM resolution level with the current pixels (see
+  // set_2D_level). Returns 0 if the level fills no bins
+  double th_pix=sqrt(4*M_PI/n_boxes2D);
+
+  *ith_lo=0;
+  if(level>0) {
+    while((*ith_lo<nb_theta)&&(!pm_bin_resolved(*ith_lo,th_pix)))
+      (*ith_lo)++;
+  }
+  *ith_hi=nb_theta;
+  if(level<pm_levels-1) {
+    *ith_hi=*ith_lo;
+    while((*ith_hi<nb_theta)&&(!pm_bin_resolved(*ith_hi,2*th_pix)))
+      (*ith_hi)++;
+  }
+
+  return *ith_hi>*ith_lo;
+}
+
+static void free_PMPairTable(PMPairTable *tab)
+{
+  if(tab!=NULL) {
+    free(tab->row0);
+    free(tab->nrow);
+    free(tab->irow);
+    free(tab->nd);
+    free(tab->off);
+    free(tab->ith);
+    free(tab);
+  }
+}
+
+static int match_PMPairTable(PMPairTable *tab,PMLevel *lv)
+{
+  return (tab!=NULL)&&
+    (tab->n_side_cth==n_side_cth)&&(tab->n_side_phi==n_side_phi)&&
+    (tab->cth_max==lv->cth_max)&&
+    (tab->ith_lo==lv->ith_lo)&&(tab->ith_hi==lv->ith_hi)&&
+    (tab->nb_theta==nb_theta)&&(tab->logbin==logbin)&&
+    (tab->n_logint==n_logint)&&(tab->i_theta_max==i_theta_max)&&
+    (tab->log_th_max==log_th_max);
+}
+
+static PMPairTable *mk_PMPairTable(PMLevel *lv)
+{
+  //////
+  // Tabulates the bins of all pairs of grid pixels closer than
+  // the level aperture. Pixel (icth2,iphi1+d) is paired with
+  // (icth1,iphi1) through entry |d| of the pair of rows
+  // (icth1,icth2). Returns NULL if the table is too large
+  int icth;
+  int nd_max=n_side_phi/2+1;
+  long n_rows,n_pairs,ii;
+  double cth_max=lv->cth_max;
+  double *cth=(double *)my_malloc(n_side_cth*sizeof(double));
+  double *sth=(double *)my_malloc(n_side_cth*sizeof(double));
+  double *cdphi=(double *)my_malloc(nd_max*sizeof(double));
+  PMPairTable *tab=(PMPairTable *)my_malloc(sizeof(PMPairTable));
+
+  for(icth=0;icth<n_side_cth;icth++) {
+    cth[icth]=-1.0+2.0*((double)(icth+0.5))/n_side_cth;
+    sth[icth]=sqrt(1-cth[icth]*cth[icth]);
+  }
+  for(ii=0;ii<nd_max;ii++)
+    cdphi[ii]=cos(2*M_PI*ii/n_side_phi);
+
+  tab->n_side_cth=n_side_cth;
+  tab->n_side_phi=n_side_phi;
+  tab->cth_max=cth_max;
+  tab->ith_lo=lv->ith_lo;
+  tab->ith_hi=lv->ith_hi;
+  tab->nb_theta=nb_theta;
+  tab->logbin=logbin;
+  tab->n_logint=n_logint;
+  tab->i_theta_max=i_theta_max;
+  tab->log_th_max=log_th_max;
+
+  //Neighbour rows: centres closer than the aperture at d=0
+  tab->row0=(int *)my_malloc(n_side_cth*sizeof(int));
+  tab->nrow=(int *)my_malloc(n_side_cth*sizeof(int));
+  tab->irow=(long *)my_malloc(n_side_cth*sizeof(long));
+  n_rows=0;
+  for(icth=0;icth<n_side_cth;icth++) {
+    int lo=icth,hi=icth;
+    while((lo>0)&&
+	  (cth[icth]*cth[lo-1]+sth[icth]*sth[lo-1]>cth_max))
+      lo--;
+    while((hi<n_side_cth-1)&&
+	  (cth[icth]*cth[hi+1]+sth[icth]*sth[hi+1]>cth_max))
+      hi++;
+    tab->row0[icth]=lo;
+    tab->nrow[icth]=hi-lo+1;
+    tab->irow[icth]=n_rows;
+    n_rows+=hi-lo+1;
+  }
+
+  //Phi offsets: the separation grows with |d|
+  tab->nd=(int *)my_malloc(n_rows*sizeof(int));
+  tab->off=(long *)my_malloc(n_rows*sizeof(long));
+#pragma omp parallel for default(none) schedule(dynamic)	\
+  shared(tab,cth,sth,cdphi,cth_max,nd_max,n_side_cth,n_side_phi)
+  for(icth=0;icth<n_side_cth;icth++) {
+    int ir;
+    for(ir=0;ir<tab->nrow[icth];ir++) {
+      int icth2=tab->row0[icth]+ir;
+      double cc=cth[icth]*cth[icth2],ss=sth[icth]*sth[icth2];
+      double x=(cth_max-cc)/ss;
+      int nd;
+      if(x<=-1) nd=nd_max;
+      else nd=CLAMP((int)(acos(MIN(1,x))*n_side_phi/(2*M_PI))+1,1,nd_max);
+      while((nd<nd_max)&&(cc+ss*cdphi[nd]>cth_max))
+	nd++;
+      while((nd>1)&&(cc+ss*cdphi[nd-1]<=cth_max))
+	nd--;
+      tab->nd[tab->irow[icth]+ir]=nd;
+    }
+  }
+  n_pairs=0;
+  for(ii=0;ii<n_rows;ii++) {
+    tab->off[ii]=n_pairs;
+    n_pairs+=tab->nd[ii];
+  }
+  if(n_pairs>PM_TABLE_MAX) {
+    tab->ith=NULL;
+    free_PMPairTable(tab);
+    free(cth);
+    free(sth);
+    free(cdphi);
+    return NULL;
+  }
+
+  tab->ith=(int *)my_malloc(n_pairs*sizeof(int));
+#pragma omp parallel for default(none) schedule(dynamic)	\
+  shared(tab,cth,sth,cdphi,cth_max,n_side_cth)
+  for(icth=0;icth<n_side_cth;icth++) {
+    int ir;
+    for(ir=0;ir<tab->nrow[icth];ir++) {
+      long irr=tab->irow[icth]+ir;
+      int icth2=tab->row0[icth]+ir;
+      double cc=cth[icth]*cth[icth2],ss=sth[icth]*sth[icth2];
+      int *ith=&(tab->ith[tab->off[irr]]);
+      int d;
+      for(d=0;d<tab->nd[irr];d++) {
+	double prod=cc+ss*cdphi[d];
+	int ib=th2bin(prod);
+	if((prod>cth_max)&&(ib>=tab->ith_lo)&&(ib<tab->ith_hi))
+	  ith[d]=ib;
+	else
+	  ith[d]=-1;
+      }
+    }
+  }
+  print_info("  %ld pixel pairs tabulated\n",n_pairs);
+
+  free(cth);
+  free(sth);
+  free(cdphi);
+
+  return tab;
+}
+
+static int mk_PMLevel(int level,PMLevel *lv)
+{
+  //////
+  // Sets the bins, aperture and pixel-pair table of PM
+  // resolution level. Returns 0 if the level fills no bins
+  if(!get_pm_level_bins(level,&(lv->ith_lo),&(lv->ith_hi)))
+    return 0;
+
+  //The margin covers the approximate arccos of th2bin
+  if(lv->ith_hi>=nb_theta)
+    lv->aperture=1./i_theta_max;
+  else
+    lv->aperture=MIN(1./i_theta_max,1.1*get_th_bin_edge(lv->ith_hi));
+  lv->cth_max=cos(lv->aperture);
+
+  //HEALPix pixels are searched for directly
+  lv->tab=NULL;
+  if(pixelization==0) {
+    if(!match_PMPairTable(pm_tables[level],lv)) {
+      free_PMPairTable(pm_tables[level]);
+      pm_tables[level]=mk_PMPairTable(lv);
+    }
+    lv->tab=pm_tables[level];
+  }
+
+  return 1;
+}
+
+static PMPairs *mk_PMPairs(void)
+{
+  PMPairs *pp=(PMPairs *)my_malloc(sizeof(PMPairs));
+  pp->n=0;
+  pp->size=256;
+  pp->ip2=(int *)my_malloc(pp->size*sizeof(int));
+  pp->ith=(int *)my_malloc(pp->size*sizeof(int));
+
+  return pp;
+}
+
+static void free_PMPairs(PMPairs *pp)
+{
+  free(pp->ip2);
+  free(pp->ith);
+  free(pp);
+}
+
+static inline void add_pm_pair(PMPairs *pp,int ip2,int ith)
+{
+  if(pp->n>=pp->size) {
+    pp->size*=2;
+    pp->ip2=(int *)realloc(pp->ip2,pp->size*sizeof(int));
+    pp->ith=(int *)realloc(pp->ith,pp->size*sizeof(int));
+    if((pp->ip2==NULL)||(pp->ith==NULL)) {
+      fprintf(stderr,"CUTE: out of memory!\n");
+      exit(1);
+    }
+  }
+  pp->ip2[pp->n]=ip2;
+  pp->ith[pp->n]=ith;
+  pp->n++;
+}
+
+static void get_pm_pairs(PMLevel *lv,int ip1,Cell2DInfo *ci1,
+			 Cell2D *cells1,Cell2D *cells2,
+			 PixRanges *pr,PMPairs *pp)
+{
+  //////
+  // Returns in pp the pixels occupied in cells1 or cells2
+  // that pair with pixel ip1 in the bins of level lv, and
+  // the bin of each pair
+  pp->n=0;
+
+  if(lv->tab!=NULL) {
+    PMPairTable *tab=lv->tab;
+    int icth1=ip1/n_side_phi;
+    int iphi1=ip1%n_side_phi;
+    int ir;
+    for(ir=0;ir<tab->nrow[icth1];ir++) {
+      long irr=tab->irow[icth1]+ir;
+      int nd=tab->nd[irr];
+      int *ith=&(tab->ith[tab->off[irr]]);
+      int icth_n=(tab->row0[icth1]+ir)*n_side_phi;
+      int d,d_min=-(nd-1);
+      if(2*(nd-1)>=n_side_phi) //d=-n_side_phi/2 is d=n_side_phi/2
+	d_min++;
+      for(d=d_min;d<nd;d++) {
+	int ib=ith[ABS(d)];
+	if(ib>=0) {
+	  int ip2,iphi2=iphi1+d;
+	  if(iphi2<0) iphi2+=n_side_phi;
+	  else if(iphi2>=n_side_phi) iphi2-=n_side_phi;
+	  ip2=icth_n+iphi2;
+	  if((cells1[ip2].np>0)||(cells2[ip2].np>0))
+	    add_pm_pair(pp,ip2,ib);
+	}
+      }
+    }
+  }
+  else {
+    int ir,ip2;
+    double *pos1=ci1->pos;
+    get_neighbor_pixels(ip1,ci1->bounds,lv->aperture,pr);
+    for(ir=0;ir<pr->n;ir++) {
+      for(ip2=pr->ipix[2*ir];ip2<pr->ipix[2*ir+1];ip2++) {
+	double *pos2;
+	double prod;
+
+	if(cells1[ip2].np>0)
+	  pos2=(cells1[ip2].ci)->pos;
+	else if(cells2[ip2].np>0)
+	  pos2=(cells2[ip2].ci)->pos;
+	else continue;
+
+	prod=pos1[0]*pos2[0]+
+	  pos1[1]*pos2[1]+pos1[2]*pos2[2];
+
+	if(prod>lv->cth_max) {
+	  int ith=th2bin(prod);
+	  if((ith<lv->ith_hi)&&(ith>=lv->ith_lo))
+	    add_pm_pair(pp,ip2,ith);
+	}
+      }
+    }
+  }
 }
 
 void corr_angular_cross_pm(Cell2D *cellsD,Cell2D *cellsD_total,
-			   Cell2D *cellsR,Cell2D *cellsR_total,
+			   Cell2D *cellsR,Cell2D *cellsR_total,int level,
 			   histo_t *DD,histo_t *DR,histo_t *RR)
 {
   //////
-  // PM angular correlator
+  // PM angular correlator. Fills the bins of resolution
+  // level (see get_pm_level_bins) with the current pixels
 
   int i,ipix_0,ipix_f,npix_full;
   int *ipix_full;
-  for(i=0;i<(nb_red*(nb_red+1)*nb_theta)/2;i++) {
-    DD[i]=0;
-    DR[i]=0;
-    RR[i]=0;
-  }
+  PMLevel lv;
+  if(!mk_PMLevel(level,&lv))
+    return;
   ipix_full=my_calloc(n_boxes2D,sizeof(int));
   npix_full=0;
   for(i=0;i<n_boxes2D;i++) {
-    if((cellsD[i].np>0) || (cellsR[i].np)) {
+    if((cellsD_total[i].np>0) || (cellsR_total[i].np>0)) {
       ipix_full[npix_full]=i;
       npix_full++;
     }
   }
   share_iters(npix_full,&ipix_0,&ipix_f);
 
+  histo_t **DDthreads=mk_thread_histos();
+  histo_t **DRthreads=mk_thread_histos();
+  histo_t **RRthreads=mk_thread_histos();
+  //Totals are summed in thread order and reordered into DD, DR and RR below
+  histo_t *DDtot=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
+  histo_t *DRtot=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
+  histo_t *RRtot=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
 #pragma omp parallel default(none)					\
-  shared(cellsD,cellsD_total,cellsR,cellsR_total)			\
-  shared(DD,DR,RR,n_side_phi,n_boxes2D)					\
-  shared(nb_theta,nb_red,i_theta_max,ipix_0,ipix_f,ipix_full)
+  shared(cellsD,cellsD_total,cellsR,cellsR_total)		\
+  shared(DDthreads,DRthreads,RRthreads,DDtot,DRtot,RRtot)		\
+  shared(nb_theta,nb_red,ipix_0,ipix_f,ipix_full,lv)
   {
     int j;
-    histo_t *DDthread=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
-    histo_t *DRthread=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
-    histo_t *RRthread=(histo_t *)my_calloc((nb_red*(nb_red+1)*nb_theta)/2,sizeof(histo_t));
-    double cth_max=cos(1/i_theta_max);
+    histo_t *DDthread=get_thread_histo(DDthreads,(nb_red*(nb_red+1)*nb_theta)/2);
+    histo_t *DRthread=get_thread_histo(DRthreads,(nb_red*(nb_red+1)*nb_theta)/2);
+    histo_t *RRthread=get_thread_histo(RRthreads,(nb_red*(nb_red+1)*nb_theta)/2);
+    PixRanges *pr=mk_PixRanges();
+    PMPairs *pp=mk_PMPairs();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
       Cell2DInfo *ci1;
-      int *bounds;
-      double *pos1;
-      int icth;
+      int k;
       int ip1=ipix_full[j];
       if(cellsD_total[ip1].np>0)
 	ci1=cellsD_total[ip1].ci;
       else if(cellsR_total[ip1].np>0)
 	ci1=cellsR_total[ip1].ci;
       else continue;
-      bounds=ci1->bounds;
-      pos1=ci1->pos;
-      for(icth=bounds[0];icth<=bounds[1];icth++) {
-	int iphi;
-	int icth_n=icth*n_side_phi;
-	for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	  double *pos2;
-	  double prod;
-	  int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	  int ip2=iphi_true+icth_n;
-	  
-	  if(cellsD_total[ip2].np>0)
-	    pos2=(cellsD_total[ip2].ci)->pos;
-	  else if(cellsR_total[ip2].np>0)
-	    pos2=(cellsR_total[ip2].ci)->pos;
-	  else continue;
-
-	  prod=pos1[0]*pos2[0]+
-	    pos1[1]*pos2[1]+pos1[2]*pos2[2];
-	  
-	  if(prod>cth_max) {
-	    int iz1;
-	    int ith=th2bin(prod);
-	    if((ith<nb_theta)&&(ith>=0)) {
-	      for(iz1=0;iz1<nb_red;iz1++) {
-		int iz2;
-		np_t nD1=cellsD[ip1*nb_red+iz1].np;
-		np_t nR1=cellsR[ip1*nb_red+iz1].np;
-		for(iz2=0;iz2<nb_red;iz2++) {
-		  np_t nD2=cellsD[ip2*nb_red+iz2].np;
-		  np_t nR2=cellsR[ip2*nb_red+iz2].np;
-		  int imin=MIN(iz1,iz2);
-		  int imax=MAX(iz1,iz2);
-		  //		  int index=ith+nb_theta*((imin*(2*nb_red-imin-1))/2+imax);
-		  //		  int index=iz1+nb_red*(iz2+nb_red*ith);		  
-		  int index=imax+(imin*(2*nb_red-imin-1))/2+ith*(nb_red*(nb_red+1))/2;
-		  DDthread[index]+=nD1*nD2;
-		  DRthread[index]+=nD1*nR2;
-		  RRthread[index]+=nR1*nR2;
-		}
-	      }
-	    }
-	  }
-	}
-      }
-    } // end omp for
-
-#pragma omp critical
-    {
-      for(j=0;j<nb_theta;j++) {
+      get_pm_pairs(&lv,ip1,ci1,cellsD_total,cellsR_total,pr,pp);
+      for(k=0;k<pp->n;k++) {
 	int iz1;
+	int ip2=pp->ip2[k];
+	int ith=pp->ith[k];
 	for(iz1=0;iz1<nb_red;iz1++) {
 	  int iz2;
-	  for(iz2=iz1;iz2<nb_red;iz2++) {
-	    int index_a=j+nb_theta*((iz1*(2*nb_red-iz1-1))/2+iz2);
-	    int index_b=iz2+(iz1*(2*nb_red-iz1-1))/2+j*(nb_red*(nb_red+1))/2;
-	    DD[index_a]+=DDthread[index_b];
-	    DR[index_a]+=DRthread[index_b];
-	    RR[index_a]+=RRthread[index_b];
+	  np_t nD1=cellsD[ip1*nb_red+iz1].np;
+	  np_t nR1=cellsR[ip1*nb_red+iz1].np;
+	  for(iz2=0;iz2<nb_red;iz2++) {
+	    np_t nD2=cellsD[ip2*nb_red+iz2].np;
+	    np_t nR2=cellsR[ip2*nb_red+iz2].np;
+	    int imin=MIN(iz1,iz2);
+	    int imax=MAX(iz1,iz2);
+	    int index=imax+(imin*(2*nb_red-imin-1))/2+ith*(nb_red*(nb_red+1))/2;
+	    DDthread[index]+=nD1*nD2;
+	    DRthread[index]+=nD1*nR2;
+	    RRthread[index]+=nR1*nR2;
 	  }
 	}
       }
-    }
+    } // end omp for
 
-    free(DDthread);
-    free(DRthread);
-    free(RRthread);
-  } //end omp parallel
+    free_PixRanges(pr);
+    free_PMPairs(pp);
 
-  for(i=0;i<(nb_red*(nb_red+1)*nb_theta)/2;i++) {
-    DD[i]/=2;
-    RR[i]/=2;
+    reduce_thread_histos(DDthreads,(nb_red*(nb_red+1)*nb_theta)/2,DDtot);
+    reduce_thread_histos(DRthreads,(nb_red*(nb_red+1)*nb_theta)/2,DRtot);
+    reduce_thread_histos(RRthreads,(nb_red*(nb_red+1)*nb_theta)/2,RRtot);
+  } //end omp parallel
+  free_thread_histos(DDthreads);
+  free_thread_histos(DRthreads);
+  free_thread_histos(RRthreads);
+
+  for(i=lv.ith_lo;i<lv.ith_hi;i++) {
+    int iz1;
+    for(iz1=0;iz1<nb_red;iz1++) {
+      int iz2;
+      for(iz2=iz1;iz2<nb_red;iz2++) {
+	int index_a=i+nb_theta*((iz1*(2*nb_red-iz1-1))/2+iz2);
+	int index_b=iz2+(iz1*(2*nb_red-iz1-1))/2+i*(nb_red*(nb_red+1))/2;
+	DD[index_a]=DDtot[index_b]/2;
+	DR[index_a]=DRtot[index_b];
+	RR[index_a]=RRtot[index_b]/2;
+      }
+    }
   }
+  free(DDtot);
+  free(DRtot);
+  free(RRtot);
   free(ipix_full);
 }
 
-void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,
+void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,int level,
 		 histo_t *DD,histo_t *DR,histo_t *RR)
 {
   //////
-  // PM angular correlator
+  // PM angular correlator. Fills the bins of resolution
+  // level (see get_pm_level_bins) with the current pixels
 
   int i,ipix_0,ipix_f,npix_full;
   int *ipix_full;
-  for(i=0;i<nb_theta;i++) {
+  PMLevel lv;
+  if(!mk_PMLevel(level,&lv))
+    return;
+  for(i=lv.ith_lo;i<lv.ith_hi;i++) {
     DD[i]=0;
     DR[i]=0;
     RR[i]=0;
@@ -1151,22 +1854,25 @@ void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,
   }
   share_iters(npix_full,&ipix_0,&ipix_f);
 
+  histo_t **DDthreads=mk_thread_histos();
+  histo_t **DRthreads=mk_thread_histos();
+  histo_t **RRthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(cellsD,cellsR,DD,DR,RR,n_side_phi,n_boxes2D)		\
-  shared(nb_theta,i_theta_max,ipix_0,ipix_f,ipix_full)
+  shared(cellsD,cellsR,DD,DR,RR)		\
+  shared(DDthreads,DRthreads,RRthreads)		\
+  shared(nb_theta,ipix_0,ipix_f,ipix_full,lv)
   {
     int j;
-    histo_t *DDthread=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
-    histo_t *DRthread=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
-    histo_t *RRthread=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
-    double cth_max=cos(1/i_theta_max);
+    histo_t *DDthread=get_thread_histo(DDthreads,nb_theta);
+    histo_t *DRthread=get_thread_histo(DRthreads,nb_theta);
+    histo_t *RRthread=get_thread_histo(RRthreads,nb_theta);
+    PixRanges *pr=mk_PixRanges();
+    PMPairs *pp=mk_PMPairs();
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ipix_0;j<ipix_f;j++) {
       Cell2DInfo *ci1;
-      int *bounds;
-      double *pos1;
-      int icth;
+      int k;
       int ip1=ipix_full[j];
       np_t nD1=cellsD[ip1].np;
       np_t nR1=cellsR[ip1].np;
@@ -1175,83 +1881,332 @@ void corr_ang_pm(Cell2D *cellsD,Cell2D *cellsR,
       else if(nR1>0)
 	ci1=cellsR[ip1].ci;
       else continue;
-      bounds=ci1->bounds;
-      pos1=ci1->pos;
-      for(icth=bounds[0];icth<=bounds[1];icth++) {
-	int iphi;
-	int icth_n=icth*n_side_phi;
-	for(iphi=bounds[2];iphi<=bounds[3];iphi++) {
-	  double *pos2;
-	  double prod;
-	  int iphi_true=(iphi+n_side_phi)%n_side_phi;
-	  int ip2=iphi_true+icth_n;
-	  
-	  if(cellsD[ip2].np>0)
-	    pos2=(cellsD[ip2].ci)->pos;
-	  else if(cellsR[ip2].np>0)
-	    pos2=(cellsR[ip2].ci)->pos;
-	  else continue;
-
-	  prod=pos1[0]*pos2[0]+
-	    pos1[1]*pos2[1]+pos1[2]*pos2[2];
-	  
-	  if(prod>cth_max) {
-	    int ith=th2bin(prod);
-	    if((ith<nb_theta)&&(ith>=0)) {
-	      DDthread[ith]+=nD1*cellsD[ip2].np;
-	      DRthread[ith]+=nD1*cellsR[ip2].np;
-	      RRthread[ith]+=nR1*cellsR[ip2].np;
-	    }
-	  }
-	}
+      get_pm_pairs(&lv,ip1,ci1,cellsD,cellsR,pr,pp);
+      for(k=0;k<pp->n;k++) {
+	int ip2=pp->ip2[k];
+	int ith=pp->ith[k];
+	DDthread[ith]+=nD1*cellsD[ip2].np;
+	DRthread[ith]+=nD1*cellsR[ip2].np;
+	RRthread[ith]+=nR1*cellsR[ip2].np;
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_theta;j++) {
-	DD[j]+=DDthread[j];
-	DR[j]+=DRthread[j];
-	RR[j]+=RRthread[j];
-      }
-    }
+    free_PixRanges(pr);
+    free_PMPairs(pp);
 
-    free(DDthread);
-    free(DRthread);
-    free(RRthread);
+    reduce_thread_histos(DDthreads,nb_theta,DD);
+    reduce_thread_histos(DRthreads,nb_theta,DR);
+    reduce_thread_histos(RRthreads,nb_theta,RR);
   } //end omp parallel
+  free_thread_histos(DDthreads);
+  free_thread_histos(DRthreads);
+  free_thread_histos(RRthreads);
 
-  for(i=0;i<nb_theta;i++) {
+  for(i=lv.ith_lo;i<lv.ith_hi;i++) {
     DD[i]/=2;
     RR[i]/=2;
   }
   free(ipix_full);
 }
 
+/*********************************************************************/
+//                 Neighbour stencils for 3D boxes                   //
+/*********************************************************************/
+// Instead of walking the whole cube of boxes within r_max of each box,
+// the 3D correlators walk a precomputed list of box offsets, keeping
+// only boxes that can hold pairs with separations in [r_min,r_max).
+// The auto-correlators use half of it, so each pair of boxes is only
+// visited once.
+#define BOX_DIST_SLACK 1E-6 //Relative margin on box-to-box distances
+
+static int *mk_box_stencil(double r_min,double r_max,int half,int *n_stencil)
+{
+  //////
+  // Returns the offsets (3 per entry, in box units) of the boxes
+  // that can hold particles at a distance in [r_min,r_max) from a
+  // particle in the central box, and their number in n_stencil.
+  // If half!=0 only the offsets with ip2>ip1 are kept, i.e. those
+  // with (dz,dy,dx)>0 in lexicographic order, and the central box
+  // is left out.
+  int j,n,dx,dy,dz;
+  int irange[3];
+  double l_cell[3];
+  int *stencil;
+
+  for(j=0;j<3;j++) {
+    l_cell[j]=l_box[j]/n_side[j];
+    irange[j]=MIN((int)(r_max/l_cell[j])+1,n_side[j]-1);
+  }
+
+  stencil=(int *)my_malloc(3*(2*irange[0]+1)*(2*irange[1]+1)*
+			   (2*irange[2]+1)*sizeof(int));
+  n=0;
+  for(dz=-irange[2];dz<=irange[2];dz++) {
+    for(dy=-irange[1];dy<=irange[1];dy++) {
+      for(dx=-irange[0];dx<=irange[0];dx++) {
+	int d[3]={dx,dy,dz};
+	double d2_min=0,d2_max=0;
+
+	if(half) {
+	  if((dz<0)||((dz==0)&&((dy<0)||((dy==0)&&(dx<=0)))))
+	    continue;
+	}
+
+	//Closest and farthest points of both boxes along each axis
+	for(j=0;j<3;j++) {
+	  double ad=ABS(d[j]);
+	  double dmin=MAX(ad-1-BOX_DIST_SLACK,0)*l_cell[j];
+	  double dmax=(ad+1+BOX_DIST_SLACK)*l_cell[j];
+	  d2_min+=dmin*dmin;
+	  d2_max+=dmax*dmax;
+	}
+	if((d2_min>=r_max*r_max)||(d2_max<r_min*r_min))
+	  continue;
+
+	stencil[3*n]=dx;
+	stencil[3*n+1]=dy;
+	stencil[3*n+2]=dz;
+	n++;
+      }
+    }
+  }
+
+  *n_stencil=n;
+  return stencil;
+}
+
+static inline int get_box_neighbors(Box3D *boxes,int ip1,
+				    int n_stencil,int *stencil,int *ngb)
+{
+  //////
+  // Fills ngb with the non-empty boxes at the stencil offsets
+  // from box ip1 and returns their number
+  int is,n=0;
+  int ix1=ip1%n_side[0];
+  int iz1=ip1/(n_side[0]*n_side[1]);
+  int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
+
+  for(is=0;is<n_stencil;is++) {
+    int ix=ix1+stencil[3*is];
+    int iy=iy1+stencil[3*is+1];
+    int iz=iz1+stencil[3*is+2];
+    if((ix>=0)&&(ix<n_side[0])&&(iy>=0)&&(iy<n_side[1])&&
+       (iz>=0)&&(iz<n_side[2])) {
+      int ip2=ix+n_side[0]*(iy+n_side[1]*iz);
+      if(boxes[ip2].np>0) {
+	ngb[n]=ip2;
+	n++;
+      }
+    }
+  }
+
+  return n;
+}
+
+static void share_boxes(int nbox_full,int *indices,
+			Box3D *boxes1,Box3D *boxes2,int self,
+			int n_stencil,int *stencil,int *ibox_0,int *ibox_f)
+{
+  //////
+  // Splits the filled boxes between the MPI nodes so that all get
+  // roughly the same number of pairs to compute, counted from box
+  // ip1 to its stencil neighbours (and to itself if self!=0).
+  int j;
+  double *cost;
+  int *ngb;
+
+  if(NNodes==1) {
+    share_iters(nbox_full,ibox_0,ibox_f);
+    return;
+  }
+
+  cost=(double *)my_malloc(MAX(nbox_full,1)*sizeof(double));
+  ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
+  for(j=0;j<nbox_full;j++) {
+    int ingb;
+    int ip1=indices[j];
+    double np1=boxes1[ip1].np;
+    double np2=0;
+    int n_ngb=get_box_neighbors(boxes2,ip1,n_stencil,stencil,ngb);
+    for(ingb=0;ingb<n_ngb;ingb++)
+      np2+=boxes2[ngb[ingb]].np;
+    if(self)
+      np2+=0.5*(np1-1);
+    cost[j]=np1*np2;
+  }
+  share_iters_cost(nbox_full,cost,ibox_0,ibox_f);
+  free(ngb);
+  free(cost);
+}
+
+static double r2_min_bins(void)
+{
+  //////
+  // Smallest separation squared that r2bin puts in a bin. Under
+  // log binning bin 0 also gets the separations that truncate to
+  // it from below.
+#ifdef _BIN_TABLES
+  return table_r->edge[0];
+#else //_BIN_TABLES
+  if(logbin)
+    return pow(10,2*(log_r_max-(nb_r+1.)/n_logint));
+  else
+    return 0;
+#endif //_BIN_TABLES
+}
+
+static inline void limit_dist2_box2box(Box3D *b1,Box3D *b2,
+				       double *d2_l,double *d2_h)
+{
+  //////
+  // Returns, in d2_l and d2_h, the minimum and maximum distance
+  // squared between objects in boxes b1 and b2, from their
+  // bounding boxes
+  int ii;
+  double d_l[3],d_h[3];
+
+  for(ii=0;ii<3;ii++) {
+    if(b2->x_lo[ii]>b1->x_hi[ii]) {
+      d_l[ii]=b2->x_lo[ii]-b1->x_hi[ii];
+      d_h[ii]=b2->x_hi[ii]-b1->x_lo[ii];
+    }
+    else if(b1->x_lo[ii]>b2->x_hi[ii]) {
+      d_l[ii]=b1->x_lo[ii]-b2->x_hi[ii];
+      d_h[ii]=b1->x_hi[ii]-b2->x_lo[ii];
+    }
+    else {
+      d_l[ii]=0;
+      d_h[ii]=MAX(b2->x_hi[ii]-b1->x_lo[ii],b1->x_hi[ii]-b2->x_lo[ii]);
+    }
+  }
+
+  *d2_l=d_l[0]*d_l[0]+d_l[1]*d_l[1]+d_l[2]*d_l[2];
+  *d2_h=d_h[0]*d_h[0]+d_h[1]*d_h[1]+d_h[2]*d_h[2];
+}
+
+static inline void limit_dist2_point2box(double *x,Box3D *box,
+					 double *d2_l,double *d2_h)
+{
+  //////
+  // Returns, in d2_l and d2_h, the minimum and maximum distance
+  // squared from point x[3] to the objects in box
+  int ii;
+  double d_l[3],d_h[3];
+
+  for(ii=0;ii<3;ii++) {
+    if(x[ii]<box->x_lo[ii]) {
+      d_l[ii]=box->x_lo[ii]-x[ii];
+      d_h[ii]=box->x_hi[ii]-x[ii];
+    }
+    else if(x[ii]>box->x_hi[ii]) {
+      d_l[ii]=x[ii]-box->x_hi[ii];
+      d_h[ii]=x[ii]-box->x_lo[ii];
+    }
+    else {
+      d_l[ii]=0;
+      d_h[ii]=MAX(box->x_hi[ii]-x[ii],x[ii]-box->x_lo[ii]);
+    }
+  }
+
+  *d2_l=d_l[0]*d_l[0]+d_l[1]*d_l[1]+d_l[2]*d_l[2];
+  *d2_h=d_h[0]*d_h[0]+d_h[1]*d_h[1]+d_h[2]*d_h[2];
+}
+
+static int prune_box_pairs(Box3D *boxes1,int ip1,Box3D *boxes2,
+			   int n_ngb,int *ngb,double r2_min,double r2_max,
+			   histo_t *hmono)
+{
+  //////
+  // Removes from the neighbours ngb of box ip1 those boxes whose
+  // objects are all farther than r2_max or closer than r2_min
+  // from the objects in ip1, and returns how many are left.
+  // If hmono is not NULL, box pairs that fall entirely in one
+  // monopole bin are also binned in bulk into hmono and removed.
+  int in,n=0;
+  Box3D *b1=&(boxes1[ip1]);
+
+  for(in=0;in<n_ngb;in++) {
+    double d2_l,d2_h;
+    Box3D *b2=&(boxes2[ngb[in]]);
+
+    limit_dist2_box2box(b1,b2,&d2_l,&d2_h);
+    if((d2_l>=r2_max)||(d2_h<r2_min))
+      continue;
+
+    if((hmono!=NULL)&&(d2_h<r2_max)) {
+      int ir=r2bin(d2_l);
+      if((ir>=0)&&(ir<nb_r)&&(ir==r2bin(d2_h))) {
+#ifdef _WITH_WEIGHTS
+	hmono[ir]+=b1->w_tot*b2->w_tot;
+#else //_WITH_WEIGHTS
+	hmono[ir]+=(histo_t)(b1->np)*b2->np;
+#endif //_WITH_WEIGHTS
+	continue;
+      }
+    }
+
+    ngb[n]=ngb[in];
+    n++;
+  }
+
+  return n;
+}
+
+static inline void mono_box(mono_kernel_t mono_pairs,double *pos1,
+			    Box3D *box,double r2_max,histo_t *hthread)
+{
+  //////
+  // Bins the pairs formed by pos1 and the objects in box into
+  // the monopole histogram hthread. Skips the box if it's out
+  // of range and bins it in bulk if it falls in a single bin.
+  double d2_l,d2_h;
+
+  limit_dist2_point2box(pos1,box,&d2_l,&d2_h);
+  if(d2_l>=r2_max)
+    return;
+
+  if(d2_h<r2_max) {
+    int ir=r2bin(d2_h);
+    if(ir<0)
+      return;
+    if((ir<nb_r)&&(ir==r2bin(d2_l))) {
+#ifdef _WITH_WEIGHTS
+      hthread[ir]+=pos1[3]*box->w_tot;
+#else //_WITH_WEIGHTS
+      hthread[ir]+=box->np;
+#endif //_WITH_WEIGHTS
+      return;
+    }
+  }
+
+  mono_pairs(pos1,box,0,r2_max,hthread);
+}
+
 void auto_mono_bf(int nbox_full,int *indices,Box3D *boxes,
 		  histo_t *hh)
 {
   //////
   // Monopole auto-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);   //this splits the filled boxes between the MPI threads
+  mono_kernel_t mono_pairs=select_mono_kernel();
 
   for(i=0;i<nb_r;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,1,&n_stencil);
+  share_boxes(nbox_full,indices,boxes,boxes,1,n_stencil,stencil,&ibox_0,&ibox_f);   //this splits the filled boxes between the MPI threads
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(nbox_full,indices,boxes,hh,n_side,l_box)	\
-  shared(i_r_max,nb_r,ibox_0,ibox_f)
+  shared(nbox_full,indices,boxes,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
+  shared(i_r_max,nb_r,ibox_0,ibox_f,mono_pairs)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(1/(i_r_max*dx))+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {    //loop over the boxes assigned to this MPI thread
@@ -1260,88 +2215,30 @@ void auto_mono_bf(int nbox_full,int *indices,Box3D *boxes,
 
       int np1=boxes[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes,ip1,boxes,n_ngb,ngb,r2_min,r2_max,hthread);
 
       for(ii=0;ii<np1;ii++) {   //loop over the particles in box ip1
-	double *pos1=&(boxes[ip1].pos[N_POS*ii]);
-	
-	int jj;
-	for(jj=ii+1;jj<np1;jj++) { //loop to calculate pairs within box ip1 without double-counting
-	  double r2;
-	  double *pos2=&(boxes[ip1].pos[N_POS*jj]);
-	  double xr[3];
-	  xr[0]=pos1[0]-pos2[0];
-	  xr[1]=pos1[1]-pos2[1];
-	  xr[2]=pos1[2]-pos2[2];
-	  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-	  if(r2<r2_max) {
-	    int ir=r2bin(r2);
-	    if((ir<nb_r)&&(ir>=0)) {
-#ifdef _WITH_WEIGHTS
-	      hthread[ir]+=pos1[3]*pos2[3]; //increment by product of weights
-#else //_WITH_WEIGHTS
-	      hthread[ir]++;                //or increment by 1 if not using weights
-#endif //_WITH_WEIGHTS
-	    }
-	  }
-	}
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes[ip1]),ii,pos1);
 
-	int iz;
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;     //ip2 is the index corresponding to the 'neighbouring' box
-	      if(boxes[ip2].np>0) {     //if box ip2 contains any particles...
-		if(ip2>ip1) {               //AND if it is different to ip1 (ip2>ip1 to avoid double-counting)...
-		  int np2=boxes[ip2].np;
-		  for(jj=0;jj<np2;jj++) {   //...loop over the particles of ip2 calculating distances and counting pairs
-		    double r2;
-		    double *pos2=&(boxes[ip2].pos[N_POS*jj]);
-		    double xr[3];
-		    xr[0]=pos1[0]-pos2[0];
-		    xr[1]=pos1[1]-pos2[1];
-		    xr[2]=pos1[2]-pos2[2];
-		    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		    if(r2<r2_max) {
-		      int ir=r2bin(r2);
-		      if((ir<nb_r)&&(ir>=0)) {
-#ifdef _WITH_WEIGHTS
-			hthread[ir]+=pos1[3]*pos2[3];
-#else //_WITH_WEIGHTS
-			hthread[ir]++;
-#endif //_WITH_WEIGHTS
-		      }
-		    }
-		  }
-		}
-	      }
-	    }
-	  }
+	//pairs within box ip1 without double-counting
+	mono_pairs(pos1,&(boxes[ip1]),ii+1,r2_max,hthread);
+
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  //loop over the particles of ip2 calculating distances and counting pairs
+	  mono_box(mono_pairs,pos1,&(boxes[ip2]),r2_max,hthread);
 	}
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void cross_mono_bf(int nbox_full,int *indices,
@@ -1351,24 +2248,25 @@ void cross_mono_bf(int nbox_full,int *indices,
   //////
   // Monopole cross-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
+  mono_kernel_t mono_pairs=select_mono_kernel();
 
   for(i=0;i<nb_r;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,0,&n_stencil);
+  share_boxes(nbox_full,indices,boxes1,boxes2,0,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box)	\
-  shared(nb_r,i_r_max,ibox_0,ibox_f)
+  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
+  shared(nb_r,i_r_max,ibox_0,ibox_f,mono_pairs)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(1/(i_r_max*dx))+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1377,65 +2275,25 @@ void cross_mono_bf(int nbox_full,int *indices,
 
       int np1=boxes1[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes2,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes1,ip1,boxes2,n_ngb,ngb,r2_min,r2_max,hthread);
 
       for(ii=0;ii<np1;ii++) {
-	int iz;
-	double *pos1=&(boxes1[ip1].pos[N_POS*ii]);
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes2[ip2].np>0) {
-		int jj;
-		int np2=boxes2[ip2].np;
-		for(jj=0;jj<np2;jj++) {
-		  double r2;
-		  double *pos2=&(boxes2[ip2].pos[N_POS*jj]);
-		  double xr[3];
-		  xr[0]=pos1[0]-pos2[0];
-		  xr[1]=pos1[1]-pos2[1];
-		  xr[2]=pos1[2]-pos2[2];
-		  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		  if(r2<r2_max) {
-		    int ir=r2bin(r2);
-		    if((ir<nb_r)&&(ir>=0)) {
-#ifdef _WITH_WEIGHTS
-		      hthread[ir]+=pos1[3]*pos2[3];
-#else //_WITH_WEIGHTS
-		      hthread[ir]++;
-#endif //_WITH_WEIGHTS
-		    }
-		  }
-		}
-	      }
-	    }
-	  }
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes1[ip1]),ii,pos1);
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  mono_box(mono_pairs,pos1,&(boxes2[ip2]),r2_max,hthread);
 	}
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void auto_3d_ps_bf(int nbox_full,int *indices,Box3D *boxes,
@@ -1444,25 +2302,24 @@ void auto_3d_ps_bf(int nbox_full,int *indices,Box3D *boxes,
   //////
   // Monopole auto-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_rl*nb_rt;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(0,sqrt(1./(i_rt_max*i_rt_max)+1./(i_rl_max*i_rl_max)),1,&n_stencil);
+  share_boxes(nbox_full,indices,boxes,boxes,1,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(nbox_full,indices,boxes,hh,n_side,l_box)		\
+  shared(nbox_full,indices,boxes,hh,n_side,l_box,hthreads)		\
+  shared(n_stencil,stencil)				\
   shared(i_rt_max,nb_rt,i_rl_max,nb_rl,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_rl*nb_rt,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_rl*nb_rt);
     double r2_max=1./(i_rt_max*i_rt_max)+1./(i_rl_max*i_rl_max);
     double rt2_max=1./(i_rt_max*i_rt_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1471,24 +2328,18 @@ void auto_3d_ps_bf(int nbox_full,int *indices,Box3D *boxes,
 
       int np1=boxes[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes,ip1,boxes,n_ngb,ngb,0,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	double *pos1=&(boxes[ip1].pos[N_POS*ii]);
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes[ip1]),ii,pos1);
 	
 	int jj;
 	for(jj=ii+1;jj<np1;jj++) {
 	  double r2;
-	  double *pos2=&(boxes[ip1].pos[N_POS*jj]);
+	  double pos2[N_POS];
+	  get_pos_Box3D(&(boxes[ip1]),jj,pos2);
 	  double xr[3],xcm[3];
 	  xr[0]=pos1[0]-pos2[0];
 	  xr[1]=pos1[1]-pos2[1];
@@ -1517,47 +2368,40 @@ void auto_3d_ps_bf(int nbox_full,int *indices,Box3D *boxes,
 	  }
 	}
 
-	int iz;
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes[ip2].np>0) {
-		if(ip2>ip1) {
-		  int np2=boxes[ip2].np;
-		  for(jj=0;jj<np2;jj++) {
-		    double r2;
-		    double *pos2=&(boxes[ip2].pos[N_POS*jj]);
-		    double xr[3],xcm[3];
-		    xr[0]=pos1[0]-pos2[0];
-		    xr[1]=pos1[1]-pos2[1];
-		    xr[2]=pos1[2]-pos2[2];
-		    xcm[0]=0.5*(pos1[0]+pos2[0]);
-		    xcm[1]=0.5*(pos1[1]+pos2[1]);
-		    xcm[2]=0.5*(pos1[2]+pos2[2]);
-		    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		    if(r2<r2_max) {
-		      double rl=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
-			sqrt(xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2]);
-		      int irl=(int)(rl*i_rl_max*nb_rl);
-		      if((irl<nb_rl)&&(irl>=0)) {
-			double rt2=r2-rl*rl;
-			if(rt2<rt2_max) {
-			  int irt=(int)(sqrt(rt2)*i_rt_max*nb_rt);
-			  if((irt<nb_rt)&&(irt>=0)) {
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes[ip2]),&d2_l,&d2_h);
+	  if(d2_l>=r2_max)
+	    continue;
+	  int np2=boxes[ip2].np;
+	  for(jj=0;jj<np2;jj++) {
+	    double r2;
+	    double pos2[N_POS];
+	    get_pos_Box3D(&(boxes[ip2]),jj,pos2);
+	    double xr[3],xcm[3];
+	    xr[0]=pos1[0]-pos2[0];
+	    xr[1]=pos1[1]-pos2[1];
+	    xr[2]=pos1[2]-pos2[2];
+	    xcm[0]=0.5*(pos1[0]+pos2[0]);
+	    xcm[1]=0.5*(pos1[1]+pos2[1]);
+	    xcm[2]=0.5*(pos1[2]+pos2[2]);
+	    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+	    if(r2<r2_max) {
+	      double rl=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+		sqrt(xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2]);
+	      int irl=(int)(rl*i_rl_max*nb_rl);
+	      if((irl<nb_rl)&&(irl>=0)) {
+		double rt2=r2-rl*rl;
+		if(rt2<rt2_max) {
+		  int irt=(int)(sqrt(rt2)*i_rt_max*nb_rt);
+		  if((irt<nb_rt)&&(irt>=0)) {
 #ifdef _WITH_WEIGHTS
-			    hthread[irl+nb_rl*irt]+=pos1[3]*pos2[3];
+		    hthread[irl+nb_rl*irt]+=pos1[3]*pos2[3];
 #else //_WITH_WEIGHTS
-			    hthread[irl+nb_rl*irt]++;
+		    hthread[irl+nb_rl*irt]++;
 #endif //_WITH_WEIGHTS
-			  }
-			}
-		      }
-		    }
 		  }
 		}
 	      }
@@ -1567,14 +2411,11 @@ void auto_3d_ps_bf(int nbox_full,int *indices,Box3D *boxes,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_rl*nb_rt;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_rl*nb_rt,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void cross_3d_ps_bf(int nbox_full,int *indices,
@@ -1584,25 +2425,24 @@ void cross_3d_ps_bf(int nbox_full,int *indices,
   //////
   // Monopole auto-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_rl*nb_rt;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(0,sqrt(1./(i_rt_max*i_rt_max)+1./(i_rl_max*i_rl_max)),0,&n_stencil);
+  share_boxes(nbox_full,indices,boxes1,boxes2,0,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box)	\
+  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
   shared(i_rt_max,nb_rt,i_rl_max,nb_rl,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_rl*nb_rt,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_rl*nb_rt);
     double r2_max=1./(i_rt_max*i_rt_max)+1./(i_rl_max*i_rl_max);
     double rt2_max=1./(i_rt_max*i_rt_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1611,59 +2451,47 @@ void cross_3d_ps_bf(int nbox_full,int *indices,
 
       int np1=boxes1[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes2,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes1,ip1,boxes2,n_ngb,ngb,0,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	int iz;
-	double *pos1=&(boxes1[ip1].pos[N_POS*ii]);
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes2[ip2].np>0) {
-		int jj;
-		int np2=boxes2[ip2].np;
-		for(jj=0;jj<np2;jj++) {
-		  double r2;
-		  double *pos2=&(boxes2[ip2].pos[N_POS*jj]);
-		  double xr[3],xcm[3];
-		  xr[0]=pos1[0]-pos2[0];
-		  xr[1]=pos1[1]-pos2[1];
-		  xr[2]=pos1[2]-pos2[2];
-		  xcm[0]=0.5*(pos1[0]+pos2[0]);
-		  xcm[1]=0.5*(pos1[1]+pos2[1]);
-		  xcm[2]=0.5*(pos1[2]+pos2[2]);
-		  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		  if(r2<r2_max) {
-		    double rl=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
-		      sqrt(xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2]);
-		    int irl=(int)(rl*i_rl_max*nb_rl);
-		    if((irl<nb_rl)&&(irl>=0)) {
-		      double rt2=r2-rl*rl;
-		      if(rt2<rt2_max) {
-			int irt=(int)(sqrt(rt2)*i_rt_max*nb_rt);
-			if((irt<nb_rt)&&(irt>=0)) {
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes1[ip1]),ii,pos1);
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes2[ip2]),&d2_l,&d2_h);
+	  if(d2_l>=r2_max)
+	    continue;
+	  int jj;
+	  int np2=boxes2[ip2].np;
+	  for(jj=0;jj<np2;jj++) {
+	    double r2;
+	    double pos2[N_POS];
+	    get_pos_Box3D(&(boxes2[ip2]),jj,pos2);
+	    double xr[3],xcm[3];
+	    xr[0]=pos1[0]-pos2[0];
+	    xr[1]=pos1[1]-pos2[1];
+	    xr[2]=pos1[2]-pos2[2];
+	    xcm[0]=0.5*(pos1[0]+pos2[0]);
+	    xcm[1]=0.5*(pos1[1]+pos2[1]);
+	    xcm[2]=0.5*(pos1[2]+pos2[2]);
+	    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+	    if(r2<r2_max) {
+	      double rl=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+		sqrt(xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2]);
+	      int irl=(int)(rl*i_rl_max*nb_rl);
+	      if((irl<nb_rl)&&(irl>=0)) {
+		double rt2=r2-rl*rl;
+		if(rt2<rt2_max) {
+		  int irt=(int)(sqrt(rt2)*i_rt_max*nb_rt);
+		  if((irt<nb_rt)&&(irt>=0)) {
 #ifdef _WITH_WEIGHTS
-			  hthread[irl+nb_rl*irt]+=pos1[3]*pos2[3];
+		    hthread[irl+nb_rl*irt]+=pos1[3]*pos2[3];
 #else //_WITH_WEIGHTS
-			  hthread[irl+nb_rl*irt]++;
+		    hthread[irl+nb_rl*irt]++;
 #endif //_WITH_WEIGHTS
-			}
-		      }
-		    }
 		  }
 		}
 	      }
@@ -1673,14 +2501,11 @@ void cross_3d_ps_bf(int nbox_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_rl*nb_rt;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_rl*nb_rt,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void auto_3d_rm_bf(int nbox_full,int *indices,Box3D *boxes,
@@ -1689,24 +2514,24 @@ void auto_3d_rm_bf(int nbox_full,int *indices,Box3D *boxes,
   //////
   // r-mu auto-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_r*nb_mu;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,1,&n_stencil);
+  share_boxes(nbox_full,indices,boxes,boxes,1,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(nbox_full,indices,boxes,hh,n_side,l_box)	\
+  shared(nbox_full,indices,boxes,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
   shared(i_r_max,nb_r,nb_mu,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r*nb_mu);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1715,24 +2540,18 @@ void auto_3d_rm_bf(int nbox_full,int *indices,Box3D *boxes,
 
       int np1=boxes[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes,ip1,boxes,n_ngb,ngb,r2_min,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	double *pos1=&(boxes[ip1].pos[N_POS*ii]);
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes[ip1]),ii,pos1);
 	
 	int jj;
 	for(jj=ii+1;jj<np1;jj++) {
 	  double r2;
-	  double *pos2=&(boxes[ip1].pos[N_POS*jj]);
+	  double pos2[N_POS];
+	  get_pos_Box3D(&(boxes[ip1]),jj,pos2);
 	  double xr[3],xcm[3];
 	  xr[0]=pos1[0]-pos2[0];
 	  xr[1]=pos1[1]-pos2[1];
@@ -1762,49 +2581,42 @@ void auto_3d_rm_bf(int nbox_full,int *indices,Box3D *boxes,
 	  }
 	}
 
-	int iz;
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes[ip2].np>0) {
-		if(ip2>ip1) {
-		  int np2=boxes[ip2].np;
-		  for(jj=0;jj<np2;jj++) {
-		    double r2;
-		    double *pos2=&(boxes[ip2].pos[N_POS*jj]);
-		    double xr[3],xcm[3];
-		    xr[0]=pos1[0]-pos2[0];
-		    xr[1]=pos1[1]-pos2[1];
-		    xr[2]=pos1[2]-pos2[2];
-		    xcm[0]=0.5*(pos1[0]+pos2[0]);
-		    xcm[1]=0.5*(pos1[1]+pos2[1]);
-		    xcm[2]=0.5*(pos1[2]+pos2[2]);
-		    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		    if(r2<r2_max) {
-		      int ir=r2bin(r2);
-		      if((ir<nb_r)&&(ir>=0)) {
-			int icth;
-			if(r2==0) icth=0;
-			else {
-			  double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
-			    sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
-			  icth=(int)(cth*nb_mu);
-			}
-			if((icth<nb_mu)&&(icth>=0)) {
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes[ip2]),&d2_l,&d2_h);
+	  if((d2_l>=r2_max)||(d2_h<r2_min))
+	    continue;
+	  int np2=boxes[ip2].np;
+	  for(jj=0;jj<np2;jj++) {
+	    double r2;
+	    double pos2[N_POS];
+	    get_pos_Box3D(&(boxes[ip2]),jj,pos2);
+	    double xr[3],xcm[3];
+	    xr[0]=pos1[0]-pos2[0];
+	    xr[1]=pos1[1]-pos2[1];
+	    xr[2]=pos1[2]-pos2[2];
+	    xcm[0]=0.5*(pos1[0]+pos2[0]);
+	    xcm[1]=0.5*(pos1[1]+pos2[1]);
+	    xcm[2]=0.5*(pos1[2]+pos2[2]);
+	    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+	    if(r2<r2_max) {
+	      int ir=r2bin(r2);
+	      if((ir<nb_r)&&(ir>=0)) {
+		int icth;
+		if(r2==0) icth=0;
+		else {
+		  double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+		    sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
+		  icth=(int)(cth*nb_mu);
+		}
+		if((icth<nb_mu)&&(icth>=0)) {
 #ifdef _WITH_WEIGHTS
-			  hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
+		  hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
 #else //_WITH_WEIGHTS
-			  hthread[icth+nb_mu*ir]++;
+		  hthread[icth+nb_mu*ir]++;
 #endif //_WITH_WEIGHTS
-			}
-		      }
-		    }
-		  }
 		}
 	      }
 	    }
@@ -1813,14 +2625,11 @@ void auto_3d_rm_bf(int nbox_full,int *indices,Box3D *boxes,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r*nb_mu;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r*nb_mu,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void auto_3d_rm_special_bf(int nbox_full,int *indices,Box3D *boxes,
@@ -1829,24 +2638,24 @@ void auto_3d_rm_special_bf(int nbox_full,int *indices,Box3D *boxes,
   //////
   // r-mu auto-correlator with special condition on l-o-s
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_r*nb_mu;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,1,&n_stencil);
+  share_boxes(nbox_full,indices,boxes,boxes,1,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)			\
-  shared(nbox_full,indices,boxes,hh,n_side,l_box)	\
+  shared(nbox_full,indices,boxes,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
   shared(i_r_max,nb_r,nb_mu,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r*nb_mu);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1855,24 +2664,18 @@ void auto_3d_rm_special_bf(int nbox_full,int *indices,Box3D *boxes,
 
       int np1=boxes[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes,ip1,boxes,n_ngb,ngb,r2_min,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	double *pos1=&(boxes[ip1].pos[N_POS*ii]);
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes[ip1]),ii,pos1);
 	
 	int jj;
 	for(jj=ii+1;jj<np1;jj++) {
 	  double r2;
-	  double *pos2=&(boxes[ip1].pos[N_POS*jj]);
+	  double pos2[N_POS];
+	  get_pos_Box3D(&(boxes[ip1]),jj,pos2);
 	  double xr[3],xcm[3];
 	  xr[0]=pos1[0]-pos2[0];
 	  xr[1]=pos1[1]-pos2[1];
@@ -1903,49 +2706,42 @@ void auto_3d_rm_special_bf(int nbox_full,int *indices,Box3D *boxes,
 	  }
 	}
 
-	int iz;
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes[ip2].np>0) {
-		if(ip2>ip1) {
-		  int np2=boxes[ip2].np;
-		  for(jj=0;jj<np2;jj++) {
-		    double r2;
-		    double *pos2=&(boxes[ip2].pos[N_POS*jj]);
-		    double xr[3],xcm[3];
-		    xr[0]=pos1[0]-pos2[0];
-		    xr[1]=pos1[1]-pos2[1];
-		    xr[2]=pos1[2]-pos2[2];
-		    xcm[0]=0.5*(pos1[0]+pos2[0]);
-		    xcm[1]=0.5*(pos1[1]+pos2[1]);
-		    xcm[2]=0.5*(pos1[2]+pos2[2]);
-		    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		    if(r2<r2_max) {
-		      int ir=r2bin(r2);
-		      if((ir<nb_r)&&(ir>=0)) {
-			int icth;
-			if(r2==0) icth=0;
-			else {
-			  double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
-			    sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
-			  icth=(int)(cth*nb_mu);
-			}
-			if((icth<nb_mu)&&(icth>=0)) {
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes[ip2]),&d2_l,&d2_h);
+	  if((d2_l>=r2_max)||(d2_h<r2_min))
+	    continue;
+	  int np2=boxes[ip2].np;
+	  for(jj=0;jj<np2;jj++) {
+	    double r2;
+	    double pos2[N_POS];
+	    get_pos_Box3D(&(boxes[ip2]),jj,pos2);
+	    double xr[3],xcm[3];
+	    xr[0]=pos1[0]-pos2[0];
+	    xr[1]=pos1[1]-pos2[1];
+	    xr[2]=pos1[2]-pos2[2];
+	    xcm[0]=0.5*(pos1[0]+pos2[0]);
+	    xcm[1]=0.5*(pos1[1]+pos2[1]);
+	    xcm[2]=0.5*(pos1[2]+pos2[2]);
+	    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+	    if(r2<r2_max) {
+	      int ir=r2bin(r2);
+	      if((ir<nb_r)&&(ir>=0)) {
+		int icth;
+		if(r2==0) icth=0;
+		else {
+		  double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+		    sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
+		  icth=(int)(cth*nb_mu);
+		}
+		if((icth<nb_mu)&&(icth>=0)) {
 #ifdef _WITH_WEIGHTS
-			  hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
+		  hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
 #else //_WITH_WEIGHTS
-			  hthread[icth+nb_mu*ir]++;
+		  hthread[icth+nb_mu*ir]++;
 #endif //_WITH_WEIGHTS
-			}
-		      }
-		    }
-		  }
 		}
 	      }
 	    }
@@ -1954,14 +2750,11 @@ void auto_3d_rm_special_bf(int nbox_full,int *indices,Box3D *boxes,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r*nb_mu;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r*nb_mu,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void cross_3d_rm_bf(int nbox_full,int *indices,
@@ -1971,24 +2764,24 @@ void cross_3d_rm_bf(int nbox_full,int *indices,
   //////
   // 3D r-mu cross-correlator
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_r*nb_mu;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,0,&n_stencil);
+  share_boxes(nbox_full,indices,boxes1,boxes2,0,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box)	\
+  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
   shared(nb_r,nb_mu,i_r_max,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r*nb_mu);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -1997,61 +2790,49 @@ void cross_3d_rm_bf(int nbox_full,int *indices,
 
       int np1=boxes1[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes2,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes1,ip1,boxes2,n_ngb,ngb,r2_min,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	int iz;
-	double *pos1=&(boxes1[ip1].pos[N_POS*ii]);
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes2[ip2].np>0) {
-		int jj;
-		int np2=boxes2[ip2].np;
-		for(jj=0;jj<np2;jj++) {
-		  double r2;
-		  double *pos2=&(boxes2[ip2].pos[N_POS*jj]);
-		  double xr[3],xcm[3];
-		  xr[0]=pos1[0]-pos2[0];
-		  xr[1]=pos1[1]-pos2[1];
-		  xr[2]=pos1[2]-pos2[2];
-		  xcm[0]=0.5*(pos1[0]+pos2[0]);
-		  xcm[1]=0.5*(pos1[1]+pos2[1]);
-		  xcm[2]=0.5*(pos1[2]+pos2[2]);
-		  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
-		  if(r2<r2_max) {
-		    int ir=r2bin(r2);
-		    if((ir<nb_r)&&(ir>=0)) {
-		      int icth;
-		      if(r2==0) icth=0;
-		      else {
-			double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
-			  sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
-			icth=(int)(cth*nb_mu);
-		      }
-		      if((icth<nb_mu)&&(icth>=0)) {
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes1[ip1]),ii,pos1);
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes2[ip2]),&d2_l,&d2_h);
+	  if((d2_l>=r2_max)||(d2_h<r2_min))
+	    continue;
+	  int jj;
+	  int np2=boxes2[ip2].np;
+	  for(jj=0;jj<np2;jj++) {
+	    double r2;
+	    double pos2[N_POS];
+	    get_pos_Box3D(&(boxes2[ip2]),jj,pos2);
+	    double xr[3],xcm[3];
+	    xr[0]=pos1[0]-pos2[0];
+	    xr[1]=pos1[1]-pos2[1];
+	    xr[2]=pos1[2]-pos2[2];
+	    xcm[0]=0.5*(pos1[0]+pos2[0]);
+	    xcm[1]=0.5*(pos1[1]+pos2[1]);
+	    xcm[2]=0.5*(pos1[2]+pos2[2]);
+	    r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+	    if(r2<r2_max) {
+	      int ir=r2bin(r2);
+	      if((ir<nb_r)&&(ir>=0)) {
+		int icth;
+		if(r2==0) icth=0;
+		else {
+		  double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+		    sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
+		  icth=(int)(cth*nb_mu);
+		}
+		if((icth<nb_mu)&&(icth>=0)) {
 #ifdef _WITH_WEIGHTS
-			hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
+		  hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
 #else //_WITH_WEIGHTS
-			hthread[icth+nb_mu*ir]++;
+		  hthread[icth+nb_mu*ir]++;
 #endif //_WITH_WEIGHTS
-		      }
-		    }
-		  }
 		}
 	      }
 	    }
@@ -2060,14 +2841,11 @@ void cross_3d_rm_bf(int nbox_full,int *indices,
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r*nb_mu;j++)
-	hh[j]+=hthread[j];
-    }
-
-    free(hthread);
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r*nb_mu,hh);
   } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
 }
 
 void cross_3d_rm_special_bf(int nbox_full,int *indices,
@@ -2078,24 +2856,24 @@ void cross_3d_rm_special_bf(int nbox_full,int *indices,
   // 3D r-mu cross-correlator that uses a special line-of-sight condition
   // designed for the cross-correlation of voids with galaxies
   int i,ibox_0,ibox_f;
-  share_iters(nbox_full,&ibox_0,&ibox_f);
 
   for(i=0;i<nb_r*nb_mu;i++) 
     hh[i]=0;
 
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(r2_min_bins()),1./i_r_max,0,&n_stencil);
+  share_boxes(nbox_full,indices,boxes1,boxes2,0,n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads=mk_thread_histos();
 #pragma omp parallel default(none)				\
-  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box)	\
+  shared(nbox_full,indices,boxes1,boxes2,hh,n_side,l_box,hthreads)	\
+  shared(n_stencil,stencil)				\
   shared(nb_r,nb_mu,i_r_max,ibox_0,ibox_f)
   {
     int j;
-    histo_t *hthread=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
+    histo_t *hthread=get_thread_histo(hthreads,nb_r*nb_mu);
     double r2_max=1./(i_r_max*i_r_max);
-    int irange[3];
-    
-    for(j=0;j<3;j++) {
-      double dx=l_box[j]/n_side[j];
-      irange[j]=(int)(sqrt(r2_max)/dx)+1;
-    }
+    double r2_min=r2_min_bins();
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
 
 #pragma omp for nowait schedule(dynamic)
     for(j=ibox_0;j<ibox_f;j++) {
@@ -2104,39 +2882,30 @@ void cross_3d_rm_special_bf(int nbox_full,int *indices,
 
       int np1=boxes1[ip1].np;
 
-      int ix1=ip1%n_side[0];
-      int iz1=ip1/(n_side[0]*n_side[1]);
-      int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
-
-      int ixmin=MAX(ix1-irange[0],0);
-      int ixmax=MIN(ix1+irange[0],n_side[0]-1);
-      int iymin=MAX(iy1-irange[1],0);
-      int iymax=MIN(iy1+irange[1],n_side[1]-1);
-      int izmin=MAX(iz1-irange[2],0);
-      int izmax=MIN(iz1+irange[2],n_side[2]-1);
+      int n_ngb=get_box_neighbors(boxes2,ip1,n_stencil,stencil,ngb);
+      n_ngb=prune_box_pairs(boxes1,ip1,boxes2,n_ngb,ngb,r2_min,r2_max,NULL);
 
       for(ii=0;ii<np1;ii++) {
-	int iz;
-	double *pos1=&(boxes1[ip1].pos[N_POS*ii]);
-	for(iz=izmin;iz<=izmax;iz++) {
-	  int iy;
-	  int iz_n=iz*n_side[0]*n_side[1];
-	  for(iy=iymin;iy<=iymax;iy++) {
-	    int ix;
-	    int iy_n=iy*n_side[0];
-	    for(ix=ixmin;ix<=ixmax;ix++) {
-	      int ip2=ix+iy_n+iz_n;
-	      if(boxes2[ip2].np>0) {
+	double pos1[N_POS];
+	get_pos_Box3D(&(boxes1[ip1]),ii,pos1);
+	int ingb;
+	for(ingb=0;ingb<n_ngb;ingb++) {
+	  int ip2=ngb[ingb];
+	  double d2_l,d2_h;
+	  limit_dist2_point2box(pos1,&(boxes2[ip2]),&d2_l,&d2_h);
+	  if((d2_l>=r2_max)||(d2_h<r2_min))
+	    continue;
 		int jj;
 		int np2=boxes2[ip2].np;
 		for(jj=0;jj<np2;jj++) {
 		  double r2;
-		  double *pos2=&(boxes2[ip2].pos[N_POS*jj]);
+		  double pos2[N_POS];
+		  get_pos_Box3D(&(boxes2[ip2]),jj,pos2);
 		  double xr[3],xcm[3];
 		  xr[0]=pos1[0]-pos2[0];
 		  xr[1]=pos1[1]-pos2[1];
 		  xr[2]=pos1[2]-pos2[2];
-          // xcm = pos1 so that angle is measured wrt l-o-s direction to void centre, not centre of mass
+	  // xcm = pos1 so that angle is measured wrt l-o-s direction to void centre, not centre of mass
 		  xcm[0]=pos1[0];
 		  xcm[1]=pos1[1];
 		  xcm[2]=pos1[2];
@@ -2161,19 +2930,619 @@ void cross_3d_rm_special_bf(int nbox_full,int *indices,
 		    }
 		  }
 		}
-	      }
-	    }
-	  }
 	}
       }
     } // end omp for
 
-#pragma omp critical
-    {
-      for(j=0;j<nb_r*nb_mu;j++)
-	hh[j]+=hthread[j];
+    free(ngb);
+    reduce_thread_histos(hthreads,nb_r*nb_mu,hh);
+  } //end omp parallel
+  free_thread_histos(hthreads);
+  free(stencil);
+}
+
+/*********************************************************************/
+//               Pair binning for 3D boxes and tree nodes            //
+/*********************************************************************/
+// Shared by the dual-tree and fused box correlators. A PairBinner
+// holds the range and histogram for one kind of pair (DD, DR or RR)
+// of the 3D 2PCF given by corr_type.
+typedef struct {
+  double r2_min,r2_max,rt2_max;
+  mono_kernel_t mono_pairs;
+  histo_t *hthread;
+} PairBinner;
+
+static void init_PairBinner(PairBinner *pb)
+{
+  //////
+  // Sets the range of separations for corr_type
+  pb->mono_pairs=select_mono_kernel();
+  pb->hthread=NULL;
+  if(corr_type==3) {
+    pb->r2_min=0;
+    pb->r2_max=1./(i_rt_max*i_rt_max)+1./(i_rl_max*i_rl_max);
+    pb->rt2_max=1./(i_rt_max*i_rt_max);
+  }
+  else {
+    pb->r2_min=r2_min_bins();
+    pb->r2_max=1./(i_r_max*i_r_max);
+    pb->rt2_max=0;
+  }
+}
+
+static int get_nbins_3d(void)
+{
+  //////
+  // Histogram size for corr_type
+  if(corr_type==2) return nb_r;
+  else if(corr_type==3) return nb_rl*nb_rt;
+  else return nb_r*nb_mu;
+}
+
+static inline void ps_pair(double *pos1,double *pos2,double r2_max,
+			   double rt2_max,histo_t *hthread)
+{
+  double r2;
+  double xr[3],xcm[3];
+  xr[0]=pos1[0]-pos2[0];
+  xr[1]=pos1[1]-pos2[1];
+  xr[2]=pos1[2]-pos2[2];
+  xcm[0]=0.5*(pos1[0]+pos2[0]);
+  xcm[1]=0.5*(pos1[1]+pos2[1]);
+  xcm[2]=0.5*(pos1[2]+pos2[2]);
+  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+  if(r2<r2_max) {
+    double rl=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+      sqrt(xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2]);
+    int irl=(int)(rl*i_rl_max*nb_rl);
+    if((irl<nb_rl)&&(irl>=0)) {
+      double rt2=r2-rl*rl;
+      if(rt2<rt2_max) {
+	int irt=(int)(sqrt(rt2)*i_rt_max*nb_rt);
+	if((irt<nb_rt)&&(irt>=0)) {
+#ifdef _WITH_WEIGHTS
+	  hthread[irl+nb_rl*irt]+=pos1[3]*pos2[3];
+#else //_WITH_WEIGHTS
+	  hthread[irl+nb_rl*irt]++;
+#endif //_WITH_WEIGHTS
+	}
+      }
+    }
+  }
+}
+
+static inline void rm_pair(double *pos1,double *pos2,double r2_max,
+			   histo_t *hthread)
+{
+  double r2;
+  double xr[3],xcm[3];
+  xr[0]=pos1[0]-pos2[0];
+  xr[1]=pos1[1]-pos2[1];
+  xr[2]=pos1[2]-pos2[2];
+  xcm[0]=0.5*(pos1[0]+pos2[0]);
+  xcm[1]=0.5*(pos1[1]+pos2[1]);
+  xcm[2]=0.5*(pos1[2]+pos2[2]);
+  r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
+  if(r2<r2_max) {
+    int ir=r2bin(r2);
+    if((ir<nb_r)&&(ir>=0)) {
+      int icth;
+      if(r2==0) icth=0;
+      else {
+	double cth=fabs(xr[0]*xcm[0]+xr[1]*xcm[1]+xr[2]*xcm[2])/
+	  sqrt((xcm[0]*xcm[0]+xcm[1]*xcm[1]+xcm[2]*xcm[2])*r2);
+	icth=(int)(cth*nb_mu);
+      }
+      if((icth<nb_mu)&&(icth>=0)) {
+#ifdef _WITH_WEIGHTS
+	hthread[icth+nb_mu*ir]+=pos1[3]*pos2[3];
+#else //_WITH_WEIGHTS
+	hthread[icth+nb_mu*ir]++;
+#endif //_WITH_WEIGHTS
+      }
+    }
+  }
+}
+
+static int bin_box_bulk(PairBinner *pb,Box3D *b1,Box3D *b2)
+{
+  //////
+  // Returns 1 if the pairs between the objects of b1 and b2 need
+  // no further work: either one box is empty, all separations are
+  // out of range or, for the monopole, they all fall in one bin
+  // (in which case they are binned in bulk).
+  double d2_l,d2_h;
+
+  if((b1->np==0)||(b2->np==0))
+    return 1;
+
+  limit_dist2_box2box(b1,b2,&d2_l,&d2_h);
+  if((d2_l>=pb->r2_max)||(d2_h<pb->r2_min))
+    return 1;
+
+  if((corr_type==2)&&(d2_h<pb->r2_max)) {
+    int ir=r2bin(d2_l);
+    if((ir>=0)&&(ir<nb_r)&&(ir==r2bin(d2_h))) {
+#ifdef _WITH_WEIGHTS
+      pb->hthread[ir]+=b1->w_tot*b2->w_tot;
+#else //_WITH_WEIGHTS
+      pb->hthread[ir]+=(histo_t)(b1->np)*b2->np;
+#endif //_WITH_WEIGHTS
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void bin_box_pairs(PairBinner *pb,Box3D *b1,Box3D *b2,int self)
+{
+  //////
+  // Correlates the objects of b1 and b2 one by one. If self!=0
+  // b1 and b2 are the same box and each pair is counted once.
+  int ii;
+
+  for(ii=0;ii<b1->np;ii++) {
+    int jj,j0=self ? ii+1 : 0;
+    double pos1[N_POS];
+    get_pos_Box3D(b1,ii,pos1);
+
+    if(corr_type==2) {
+      if(self)
+	pb->mono_pairs(pos1,b2,j0,pb->r2_max,pb->hthread);
+      else
+	mono_box(pb->mono_pairs,pos1,b2,pb->r2_max,pb->hthread);
+      continue;
+    }
+
+    if(!self) {
+      double d2_l,d2_h;
+      limit_dist2_point2box(pos1,b2,&d2_l,&d2_h);
+      if((d2_l>=pb->r2_max)||(d2_h<pb->r2_min))
+	continue;
+    }
+    if(corr_type==3) {
+      for(jj=j0;jj<b2->np;jj++) {
+	double pos2[N_POS];
+	get_pos_Box3D(b2,jj,pos2);
+	ps_pair(pos1,pos2,pb->r2_max,pb->rt2_max,pb->hthread);
+      }
+    }
+    else {
+      for(jj=j0;jj<b2->np;jj++) {
+	double pos2[N_POS];
+	get_pos_Box3D(b2,jj,pos2);
+	rm_pair(pos1,pos2,pb->r2_max,pb->hthread);
+      }
+    }
+  }
+}
+
+/*********************************************************************/
+//                     Dual-tree 3D correlators                      //
+/*********************************************************************/
+// The k-d trees of both catalogs are walked together, starting from
+// all pairs of nodes at depth TREE_TOP_DEPTH, which are shared out
+// between MPI nodes and threads. Node pairs out of range are pruned
+// and, for the monopole, node pairs that fall in a single bin are
+// binned in bulk. Only pairs of leaves are correlated object by object.
+#define TREE_TOP_DEPTH 6 //Depth of the nodes whose pairs make up the work list
+
+typedef struct {
+  KDTree *tree1,*tree2;
+  PairBinner pb;
+} TreeWalk;
+
+static void walk_node_pair(TreeWalk *tw,int in1,int in2)
+{
+  //////
+  // Correlates node in1 of tree1 with node in2 of tree2.
+  // For auto-correlations (tree1==tree2) in1==in2 means
+  // the pairs within a single node.
+  KDNode *n1=&(tw->tree1->nodes[in1]);
+  KDNode *n2=&(tw->tree2->nodes[in2]);
+  int leaf1=(n1->sons[0]<0);
+  int leaf2=(n2->sons[0]<0);
+
+  if((tw->tree1==tw->tree2)&&(in1==in2)) {
+    if(leaf1)
+      bin_box_pairs(&(tw->pb),&(n1->box),&(n1->box),1);
+    else {
+      walk_node_pair(tw,n1->sons[0],n1->sons[0]);
+      walk_node_pair(tw,n1->sons[0],n1->sons[1]);
+      walk_node_pair(tw,n1->sons[1],n1->sons[1]);
+    }
+    return;
+  }
+
+  if(bin_box_bulk(&(tw->pb),&(n1->box),&(n2->box)))
+    return;
+
+  if(leaf1&&leaf2)
+    bin_box_pairs(&(tw->pb),&(n1->box),&(n2->box),0);
+  else if(leaf2||((!leaf1)&&(n1->box.np>=n2->box.np))) {
+    walk_node_pair(tw,n1->sons[0],in2);
+    walk_node_pair(tw,n1->sons[1],in2);
+  }
+  else {
+    walk_node_pair(tw,in1,n2->sons[0]);
+    walk_node_pair(tw,in1,n2->sons[1]);
+  }
+}
+
+static void get_top_nodes(KDTree *tree,int inode,int depth,
+			  int *top,int *n_top)
+{
+  //////
+  // Lists the nodes at depth TREE_TOP_DEPTH below inode,
+  // or the leaves above it
+  KDNode *node=&(tree->nodes[inode]);
+
+  if((depth==TREE_TOP_DEPTH)||(node->sons[0]<0)) {
+    top[*n_top]=inode;
+    (*n_top)++;
+  }
+  else {
+    get_top_nodes(tree,node->sons[0],depth+1,top,n_top);
+    get_top_nodes(tree,node->sons[1],depth+1,top,n_top);
+  }
+}
+
+static void corr_3d_tree(KDTree *tree1,KDTree *tree2,histo_t *hh)
+{
+  //////
+  // Dual-tree correlator for the 3D 2PCF given by corr_type.
+  // The pairs of top nodes are the units of work.
+  int i,n_top1,n_top2,n_pairs,ipair_0,ipair_f;
+  int nbins=get_nbins_3d();
+  int *top1,*top2,*pairs;
+  double *cost;
+  TreeWalk tw0;
+
+  for(i=0;i<nbins;i++)
+    hh[i]=0;
+
+  tw0.tree1=tree1;
+  tw0.tree2=tree2;
+  init_PairBinner(&(tw0.pb));
+
+  top1=(int *)my_malloc((1<<TREE_TOP_DEPTH)*sizeof(int));
+  top2=(int *)my_malloc((1<<TREE_TOP_DEPTH)*sizeof(int));
+  n_top1=n_top2=0;
+  get_top_nodes(tree1,0,0,top1,&n_top1);
+  get_top_nodes(tree2,0,0,top2,&n_top2);
+
+  //Auto-correlations only take each pair of top nodes once.
+  //Nodes are shared between MPI nodes by their number of pairs,
+  //pairs of top nodes further apart than r_max costing nothing
+  pairs=(int *)my_malloc(2*n_top1*n_top2*sizeof(int));
+  cost=(double *)my_malloc(MAX(n_top1*n_top2,1)*sizeof(double));
+  n_pairs=0;
+  for(i=0;i<n_top1;i++) {
+    int j;
+    for(j=(tree1==tree2) ? i : 0;j<n_top2;j++) {
+      double d2_l,d2_h;
+      Box3D *b1=&(tree1->nodes[top1[i]].box);
+      Box3D *b2=&(tree2->nodes[top2[j]].box);
+      limit_dist2_box2box(b1,b2,&d2_l,&d2_h);
+      pairs[2*n_pairs]=top1[i];
+      pairs[2*n_pairs+1]=top2[j];
+      if(d2_l>=tw0.pb.r2_max)
+	cost[n_pairs]=0;
+      else if(b1==b2)
+	cost[n_pairs]=0.5*b1->np*(b1->np-1.);
+      else
+	cost[n_pairs]=(double)(b1->np)*b2->np;
+      n_pairs++;
+    }
+  }
+  share_iters_cost(n_pairs,cost,&ipair_0,&ipair_f);
+  free(cost);
+
+  histo_t **hthreads=mk_thread_histos();
+#pragma omp parallel default(none)			\
+  shared(tw0,pairs,ipair_0,ipair_f,nbins,hh,hthreads)
+  {
+    int ip;
+    TreeWalk tw=tw0;
+    tw.pb.hthread=get_thread_histo(hthreads,nbins);
+
+#pragma omp for nowait schedule(dynamic)
+    for(ip=ipair_0;ip<ipair_f;ip++)
+      walk_node_pair(&tw,pairs[2*ip],pairs[2*ip+1]);
+
+    reduce_thread_histos(hthreads,nbins,hh);
+  } //end omp parallel
+  free_thread_histos(hthreads);
+  free(pairs);
+  free(top1);
+  free(top2);
+}
+
+void auto_3d_tree(KDTree *tree,histo_t *hh)
+{
+  //////
+  // Dual-tree auto-correlator for corr_type 2, 3 and 4
+  corr_3d_tree(tree,tree,hh);
+}
+
+void cross_3d_tree(KDTree *tree1,KDTree *tree2,histo_t *hh)
+{
+  //////
+  // Dual-tree cross-correlator for corr_type 2, 3 and 4
+  corr_3d_tree(tree1,tree2,hh);
+}
+
+/*********************************************************************/
+//                     Fused DD/DR/RR 3D correlator                  //
+/*********************************************************************/
+// Data and randoms are boxed on the same grid, so a single walk over
+// the boxes and their stencil neighbours can fill the three histograms,
+// as corr_full_pm does for the full 2PCF.
+
+static inline int get_box_neighbors_dr(Box3D *boxes_dat,Box3D *boxes_ran,
+				       int ip1,int n_stencil,int *stencil,
+				       int *ngb)
+{
+  //////
+  // Fills ngb with the boxes at the stencil offsets from box
+  // ip1, other than ip1 itself, holding data or randoms, and
+  // returns their number
+  int is,n=0;
+  int ix1=ip1%n_side[0];
+  int iz1=ip1/(n_side[0]*n_side[1]);
+  int iy1=(ip1-ix1-iz1*n_side[0]*n_side[1])/n_side[0];
+
+  for(is=0;is<n_stencil;is++) {
+    int ix=ix1+stencil[3*is];
+    int iy=iy1+stencil[3*is+1];
+    int iz=iz1+stencil[3*is+2];
+    if((ix>=0)&&(ix<n_side[0])&&(iy>=0)&&(iy<n_side[1])&&
+       (iz>=0)&&(iz<n_side[2])) {
+      int ip2=ix+n_side[0]*(iy+n_side[1]*iz);
+      if((ip2!=ip1)&&((boxes_dat[ip2].np>0)||(boxes_ran[ip2].np>0))) {
+	ngb[n]=ip2;
+	n++;
+      }
     }
+  }
+
+  return n;
+}
+
+static void share_boxes_dr(int n_list,int *list,
+			   Box3D *boxes_dat,Box3D *boxes_ran,int do_rr,
+			   int n_stencil,int *stencil,int *ibox_0,int *ibox_f)
+{
+  //////
+  // share_boxes for corr_3d_bf: the cost of each box in list is
+  // the number of DD, DR and (if do_rr) RR pairs it computes
+  int j;
+  double *cost;
+  int *ngb;
+
+  if(NNodes==1) {
+    share_iters(n_list,ibox_0,ibox_f);
+    return;
+  }
+  //With MPI domains list only holds this node's boxes
+  if(mpi_domains) {
+    *ibox_0=0;
+    *ibox_f=n_list;
+    return;
+  }
+
+  cost=(double *)my_malloc(MAX(n_list,1)*sizeof(double));
+  ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
+  for(j=0;j<n_list;j++) {
+    int ingb;
+    int ip1=list[j];
+    double nd1=boxes_dat[ip1].np,nr1=boxes_ran[ip1].np;
+    double nd2=0.5*(nd1-1),nr2=0.5*(nr1-1),nr2_all=nr1;
+    int n_ngb=get_box_neighbors_dr(boxes_dat,boxes_ran,ip1,n_stencil,stencil,ngb);
+    for(ingb=0;ingb<n_ngb;ingb++) {
+      int ip2=ngb[ingb];
+      if(ip2>ip1) {
+	nd2+=boxes_dat[ip2].np;
+	nr2+=boxes_ran[ip2].np;
+      }
+      nr2_all+=boxes_ran[ip2].np;
+    }
+    cost[j]=nd1*nd2+nd1*nr2_all;
+    if(do_rr)
+      cost[j]+=nr1*nr2;
+  }
+  share_iters_cost(n_list,cost,ibox_0,ibox_f);
+  free(ngb);
+  free(cost);
+}
+
+static int get_region_runs(Box3D *box,Box3D *runs,int *regs)
+{
+  //////
+  // Splits box into runs of objects in the same jackknife region,
+  // each stored in runs as a box of its own (with its own bounds)
+  // and its region in regs. Returns the number of runs. Without
+  // regions a non-empty box is a single run in region 0.
+  int i0=0,n=0;
+
+  if(box->reg==NULL) {
+    if(box->np==0)
+      return 0;
+    runs[0]=*box;
+    regs[0]=0;
+    return 1;
+  }
+
+  while(i0<box->np) {
+    int ii,i1=i0;
+    Box3D *run=&(runs[n]);
+    while((i1<box->np)&&(box->reg[i1]==box->reg[i0]))
+      i1++;
+
+    run->np=i1-i0;
+    run->x=box->x+i0;
+    run->y=box->y+i0;
+    run->z=box->z+i0;
+    run->reg=box->reg+i0;
+    run->x_lo[0]=run->x_hi[0]=run->x[0];
+    run->x_lo[1]=run->x_hi[1]=run->y[0];
+    run->x_lo[2]=run->x_hi[2]=run->z[0];
+    for(ii=1;ii<run->np;ii++) {
+      run->x_lo[0]=MIN(run->x_lo[0],run->x[ii]);
+      run->x_hi[0]=MAX(run->x_hi[0],run->x[ii]);
+      run->x_lo[1]=MIN(run->x_lo[1],run->y[ii]);
+      run->x_hi[1]=MAX(run->x_hi[1],run->y[ii]);
+      run->x_lo[2]=MIN(run->x_lo[2],run->z[ii]);
+      run->x_hi[2]=MAX(run->x_hi[2],run->z[ii]);
+    }
+#ifdef _WITH_WEIGHTS
+    run->w=box->w+i0;
+    run->w_tot=0;
+    for(ii=0;ii<run->np;ii++)
+      run->w_tot+=run->w[ii];
+#endif //_WITH_WEIGHTS
+    regs[n]=box->reg[i0];
+    n++;
+    i0=i1;
+  }
+
+  return n;
+}
+
+static void bin_run_pairs(PairBinner *pb,int nbins,
+			  int n1,Box3D *runs1,int *regs1,
+			  int n2,Box3D *runs2,int *regs2,int self)
+{
+  //////
+  // Bins the pairs between the runs of two boxes (see
+  // get_region_runs), each pair of runs into the histogram
+  // of its pair of regions within pb->hthread. If self!=0
+  // both are the runs of the same box and each pair of
+  // objects is counted once.
+  int i1,i2;
+
+  for(i1=0;i1<n1;i1++) {
+    for(i2=self ? i1 : 0;i2<n2;i2++) {
+      PairBinner pb_run=*pb;
+      pb_run.hthread=pb->hthread+jk_pair_index(regs1[i1],regs2[i2])*nbins;
+      if(self&&(i1==i2))
+	bin_box_pairs(&pb_run,&(runs1[i1]),&(runs1[i1]),1);
+      else if(!bin_box_bulk(&pb_run,&(runs1[i1]),&(runs2[i2])))
+	bin_box_pairs(&pb_run,&(runs1[i1]),&(runs2[i2]),0);
+    }
+  }
+}
+
+void corr_3d_bf(int nfull_dat,int *indices_dat,
+		int nfull_ran,int *indices_ran,
+		Box3D *boxes_dat,Box3D *boxes_ran,
+		histo_t *DD,histo_t *DR,histo_t *RR)
+{
+  //////
+  // DD, DR and RR for the 3D 2PCF given by corr_type in a single
+  // pass over the boxes holding data or randoms. Each box pair is
+  // visited once: DD and RR take the neighbours with ip2>ip1,
+  // DR takes all of them. RR is skipped if NULL. With jackknife
+  // regions each of DD, DR and RR holds get_n_jk_pairs() histograms,
+  // one per pair of regions (see jk_pair_index).
+  int i,n_list,ibox_0,ibox_f;
+  int nbins=get_nbins_3d();
+  int nbins_jk=nbins*get_n_jk_pairs();
+  int n_runs=MAX(n_jk,1);
+  int *list;
+  PairBinner pb0;
+
+  int do_rr=(RR!=NULL);
+  for(i=0;i<nbins_jk;i++) {
+    DD[i]=0;
+    DR[i]=0;
+  }
+  if(do_rr) {
+    for(i=0;i<nbins_jk;i++)
+      RR[i]=0;
+  }
+
+  //Boxes with randoms, in curve order, followed by those with data only
+  list=(int *)my_malloc((nfull_dat+nfull_ran)*sizeof(int));
+  n_list=0;
+  for(i=0;i<nfull_ran;i++) {
+    list[n_list]=indices_ran[i];
+    n_list++;
+  }
+  for(i=0;i<nfull_dat;i++) {
+    if(boxes_ran[indices_dat[i]].np==0) {
+      list[n_list]=indices_dat[i];
+      n_list++;
+    }
+  }
+
+  init_PairBinner(&pb0);
+  int n_stencil;
+  int *stencil=mk_box_stencil(sqrt(pb0.r2_min),sqrt(pb0.r2_max),0,&n_stencil);
+  share_boxes_dr(n_list,list,boxes_dat,boxes_ran,do_rr,
+		 n_stencil,stencil,&ibox_0,&ibox_f);
+  histo_t **hthreads_dd=mk_thread_histos();
+  histo_t **hthreads_dr=mk_thread_histos();
+  histo_t **hthreads_rr=mk_thread_histos();
+#pragma omp parallel default(none)					\
+  shared(list,ibox_0,ibox_f,boxes_dat,boxes_ran,DD,DR,RR,nbins,nbins_jk,pb0) \
+  shared(n_stencil,stencil,hthreads_dd,hthreads_dr,hthreads_rr,do_rr,n_runs)
+  {
+    int j;
+    PairBinner pb_dd=pb0,pb_dr=pb0,pb_rr=pb0;
+    int *ngb=(int *)my_malloc(MAX(n_stencil,1)*sizeof(int));
+    //Region runs of the data and randoms in boxes ip1 and ip2
+    Box3D *runs=(Box3D *)my_malloc(4*n_runs*sizeof(Box3D));
+    int *regs=(int *)my_malloc(4*n_runs*sizeof(int));
+    Box3D *runs_d1=runs,*runs_r1=runs+n_runs;
+    Box3D *runs_d2=runs+2*n_runs,*runs_r2=runs+3*n_runs;
+    int *regs_d1=regs,*regs_r1=regs+n_runs;
+    int *regs_d2=regs+2*n_runs,*regs_r2=regs+3*n_runs;
+    pb_dd.hthread=get_thread_histo(hthreads_dd,nbins_jk);
+    pb_dr.hthread=get_thread_histo(hthreads_dr,nbins_jk);
+    pb_rr.hthread=get_thread_histo(hthreads_rr,nbins_jk);
+
+#pragma omp for nowait schedule(dynamic)
+    for(j=ibox_0;j<ibox_f;j++) {
+      int ip1=list[j];
+      int n_d1=get_region_runs(&(boxes_dat[ip1]),runs_d1,regs_d1);
+      int n_r1=get_region_runs(&(boxes_ran[ip1]),runs_r1,regs_r1);
+
+      //Pairs within box ip1
+      bin_run_pairs(&pb_dd,nbins,n_d1,runs_d1,regs_d1,n_d1,runs_d1,regs_d1,1);
+      if(do_rr)
+	bin_run_pairs(&pb_rr,nbins,n_r1,runs_r1,regs_r1,n_r1,runs_r1,regs_r1,1);
+      bin_run_pairs(&pb_dr,nbins,n_d1,runs_d1,regs_d1,n_r1,runs_r1,regs_r1,0);
+
+      int ingb;
+      int n_ngb=get_box_neighbors_dr(boxes_dat,boxes_ran,ip1,n_stencil,stencil,ngb);
+      for(ingb=0;ingb<n_ngb;ingb++) {
+	int ip2=ngb[ingb];
+	int n_d2=get_region_runs(&(boxes_dat[ip2]),runs_d2,regs_d2);
+	int n_r2=get_region_runs(&(boxes_ran[ip2]),runs_r2,regs_r2);
+
+	if(ip2>ip1) {
+	  bin_run_pairs(&pb_dd,nbins,n_d1,runs_d1,regs_d1,n_d2,runs_d2,regs_d2,0);
+	  if(do_rr)
+	    bin_run_pairs(&pb_rr,nbins,n_r1,runs_r1,regs_r1,n_r2,runs_r2,regs_r2,0);
+	}
+	bin_run_pairs(&pb_dr,nbins,n_d1,runs_d1,regs_d1,n_r2,runs_r2,regs_r2,0);
+      }
+    } // end omp for
 
-    free(hthread);
+    free(ngb);
+    free(runs);
+    free(regs);
+    reduce_thread_histos(hthreads_dd,nbins_jk,DD);
+    reduce_thread_histos(hthreads_dr,nbins_jk,DR);
+    if(do_rr)
+      reduce_thread_histos(hthreads_rr,nbins_jk,RR);
   } //end omp parallel
+  free_thread_histos(hthreads_dd);
+  free_thread_histos(hthreads_dr);
+  free_thread_histos(hthreads_rr);
+  free(stencil);
+  free(list);
 }
@@ -36,6 +36,7 @@ char fnameRandom2[128]="default"; //Second random catalog filename
 char fnameOut[128]="default";    //Output filename
 char fnameMask[128]="default";   //Mask filename
 char fnamedNdz[128]="default";   //z-distribution filename
+char fnameRRCache[128]="none";   //RR cache directory
 
 //Correlation
 int corr_type=-1; //Type of CF
@@ -57,6 +58,22 @@ int cute_verbose = 1;   // Verbosity flag - default prints everything
 
 //PM stuff
 int use_pm=-1;
+int pm_levels=1; //Resolution levels of the angular PM
+
+//3D box ordering (0 -> lexicographic, 1 -> Morton, 2 -> Hilbert)
+int box_order=0;
+
+//2D pixelization (0 -> (cos(theta),phi) grid, 1 -> HEALPix)
+int pixelization=0;
+
+//Dual-tree pair counting for 3D 2PCFs
+int use_tree=0;
+
+//Jackknife regions (0 -> no jackknife)
+int n_jk=0;
+
+//Split 3D catalogs between MPI nodes by slabs of boxes
+int mpi_domains=0;
 ///
 //////////////////////////////////////
 
@@ -23,6 +23,8 @@
 #ifndef _CUTE_DEFINE_
 #define _CUTE_DEFINE_
 
+#include <stddef.h>
+
 #ifdef _HAVE_MPI
 #include <mpi.h>
 #endif //_HAVE_MPI
@@ -34,6 +36,7 @@ extern char fnameRandom2[128];
 extern char fnameOut[128];
 extern char fnameMask[128];
 extern char fnamedNdz[128];
+extern char fnameRRCache[128];
 
 extern int corr_type;
 
@@ -44,6 +47,17 @@ extern double weos;
 extern double aperture_los;
 
 extern int use_pm;
+extern int pm_levels;
+
+extern int box_order;
+
+extern int pixelization;
+
+extern int use_tree;
+
+extern int n_jk;
+
+extern int mpi_domains;
 
 extern int fact_n_rand;
 extern int gen_ran;
@@ -79,12 +93,17 @@ extern int cute_verbose;
 
 /*                MACROS            */
 // Other possible macros
-//_DEBUG, _VERBOSE, _TRUE_ACOS
+//_DEBUG, _VERBOSE, _TRUE_ACOS, _HAVE_SIMD, _BIN_TABLES
 
 #define DTORAD 0.017453292519943295 // x deg = x*DTORAD rad
 #define MAX(a, b) (((a) > (b)) ? (a) : (b)) //Maximum of two numbers
 #define MIN(a, b) (((a) < (b)) ? (a) : (b)) //Minimum of two numbers
 #define ABS(a)   (((a) < 0) ? -(a) : (a)) //Absolute value
+#define SIMD_ALIGN 64 //Alignment (bytes) of 3D box particle arrays and per-thread histograms
+#define NB_HISTO_BLOCK 512 //Bins per block when merging per-thread histograms
+#define TREE_LEAF_NP 32 //Maximum #objects in a k-d tree leaf
+#define HPX_ORDER_MAX 13 //Maximum HEALPix order (12*4^13 pixels still fit in an int)
+#define PM_LEVELS_MAX 8 //Maximum number of angular PM resolution levels
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x))) //min(max(a,low),high)
 
 /////////////////////////////
@@ -115,6 +134,7 @@ typedef double histo_t;
 typedef double np_t;
 #ifdef _HAVE_MPI
 #define HISTO_T_MPI MPI_DOUBLE
+#define NP_T_MPI MPI_DOUBLE
 #endif //_HAVE_MPI
 #else //_WITH_WEIGHTS
 #define N_RW 1
@@ -123,6 +143,7 @@ typedef unsigned long long histo_t;
 typedef int np_t;
 #ifdef _HAVE_MPI
 #define HISTO_T_MPI MPI_UNSIGNED_LONG_LONG
+#define NP_T_MPI MPI_INT
 #endif //_HAVE_MPI
 #endif //_WITH_WEIGHTS
 
@@ -163,6 +184,14 @@ typedef struct {
 } RadialPixel;
 
 
+//Neighbour pixels of a 2D pixel, as ranges of pixel indices
+typedef struct {
+  int n;     //#ranges
+  int size;  //#ranges allocated
+  int *ipix; //First and last+1 pixel of each range
+} PixRanges;
+
+
 //Cell for radial 2PCF
 typedef struct {
   int bounds[4];
@@ -177,12 +206,35 @@ typedef struct {
 
 
 //Box for 3D 2PCFs
+//Positions (and weights) are stored as separate arrays. These
+//are slices of a single SIMD_ALIGN-aligned arena shared by all
+//boxes, in box order (see mk_Boxes3D_from_Catalog)
 typedef struct {
   int np;
-  double *pos;
+  double *x,*y,*z;
+  double x_lo[3],x_hi[3]; //Bounding box of the objects
+#ifdef _WITH_WEIGHTS
+  double *w;
+  double w_tot; //Sum of weights
+#endif //_WITH_WEIGHTS
+  int *reg; //Jackknife regions, in increasing order (NULL if n_jk==0)
 } Box3D; //3D cell
 
 
+//k-d tree for 3D 2PCFs
+//The objects of each node are a contiguous slice of the tree's
+//arena, held as a Box3D so the box kernels work on nodes as well
+typedef struct {
+  Box3D box;   //Objects in the node and their bounding box
+  int sons[2]; //Indices of the two sub-nodes (-1 for leaves)
+} KDNode;
+
+typedef struct {
+  int n_nodes;
+  KDNode *nodes; //Nodes in depth-first order, the root first
+} KDTree;
+
+
 //Mask cube
 typedef struct {
   double z0,zf;
@@ -198,6 +250,9 @@ typedef struct {
 #ifdef _WITH_WEIGHTS
   double *weight;
 #endif //_WITH_WEIGHTS
+  int *region; //Jackknife region of each object (NULL if n_jk==0)
+  void *map; //Mapped binary catalog holding the arrays (NULL if none)
+  size_t map_size;
 #ifdef _CUTE_AS_PYTHON_MODULE
   np_t sum_w, sum_w2;
 #endif
@@ -212,8 +267,18 @@ typedef struct {
          *D2D2, *D2R1, *D2R2, 
          *R1R1, *R1R2, 
          *R2R2;
+  int n_jk;
+  double *corr_jk; //Leave-one-out CFs, n_jk blocks laid out as corr
 } Result;
 
+//Data catalogs correlated against a common random catalog
+//by runCUTE_batch. results[i] holds the output for cats[i]
+typedef struct {
+  int n;
+  Catalog **cats;
+  Result **results;
+} CatalogBatch;
+
 extern Result *global_result;
 extern Catalog *global_galaxy_catalog;
 extern Catalog *global_galaxy_catalog2;
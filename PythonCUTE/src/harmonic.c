@@ -0,0 +1,406 @@
+///////////////////////////////////////////////////////////////////////
+//                                                                   //
+//   Copyright 2012 David Alonso                                     //
+//                                                                   //
+//                                                                   //
+// This file is part of CUTE.                                        //
+//                                                                   //
+// CUTE is free software: you can redistribute it and/or modify it   //
+// under the terms of the GNU General Public License as published by //
+// the Free Software Foundation, either version 3 of the License, or //
+// (at your option) any later version.                               //
+//                                                                   //
+// CUTE is distributed in the hope that it will be useful, but       //
+// WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU //
+// General Public License for more details.                          //
+//                                                                   //
+// You should have received a copy of the GNU General Public License //
+// along with CUTE.  If not, see <http://www.gnu.org/licenses/>.     //
+//                                                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*********************************************************************/
+//              Harmonic-space angular correlations                  //
+/*********************************************************************/
+// With use_pm==2 the pixel-pair sums of the angular PM are computed in
+// harmonic space. For the maps D and R of data and randoms on the
+// (cos(theta),phi) grid, a_lm=sum_p D_p Y*_lm(n_p) and the addition
+// theorem give
+//   sum_{p,q in bin} D_p R_q = sum_l (2l+1) C^DR_l K_l(bin),
+// with C^DR_l=sum_m a^D_lm a^R*_lm/(2l+1) and
+// K_l(bin)=2*pi*int_bin P_l(mu) dmu. The grid rings are equally spaced
+// in cos(theta), so the a_lm are found by transforming each ring in
+// phi with an FFT and projecting the result onto the associated
+// Legendre functions, at a cost ~n_side_cth*l_max^2 instead of the
+// N_pix^2 of the pixel pairs. Bins below the pixel resolution are
+// ringing of the band limit rather than correlations, so they are set
+// to zero.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _HAVE_OMP
+#include <omp.h>
+#endif //_HAVE_OMP
+#include <gsl/gsl_fft_complex.h>
+#include "define.h"
+#include "common.h"
+
+#define HARM_SCALE 600 //log2 of the rescaling of tiny Legendre functions
+#define HARM_NRING 4 //Pairs of rings recursed together
+
+static double *mk_ring_transforms(double *mapD,double *mapR,int lmax)
+{
+  //////
+  // Returns F^D_m(r)=sum_j D_rj exp(-i*m*phi_j) and the same for R
+  // for every ring r of the grid and 0<=m<=lmax, stored as
+  // (Re D,Im D,Re R,Im R) at 4*(r*(lmax+1)+m). Both maps are real,
+  // so they are transformed together as D+i*R. Pixel centres are
+  // at phi_j=2*pi*(j+1/2)/N, so F_m=exp(-i*pi*m/N)*FFT_{m mod N}
+  int nphi=n_side_phi;
+  int nm=lmax+1;
+  double *fring=(double *)my_malloc(4*(size_t)n_side_cth*nm*sizeof(double));
+  gsl_fft_complex_wavetable *wt=gsl_fft_complex_wavetable_alloc(nphi);
+
+#pragma omp parallel default(none)		\
+  shared(mapD,mapR,fring,wt,nphi,nm,n_side_cth)
+  {
+    int ir;
+    double *z=(double *)my_malloc(2*nphi*sizeof(double));
+    gsl_fft_complex_workspace *work=gsl_fft_complex_workspace_alloc(nphi);
+
+#pragma omp for schedule(static)
+    for(ir=0;ir<n_side_cth;ir++) {
+      int j,m;
+      double *fr=&(fring[4*(size_t)ir*nm]);
+      for(j=0;j<nphi;j++) {
+	z[2*j]=mapD[j+ir*nphi];
+	z[2*j+1]=mapR[j+ir*nphi];
+      }
+      gsl_fft_complex_forward(z,1,nphi,wt,work);
+      for(m=0;m<nm;m++) {
+	int k=m%nphi;
+	int kc=(nphi-k)%nphi;
+	double sr=0.5*(z[2*k]+z[2*kc]);
+	double si=0.5*(z[2*k+1]-z[2*kc+1]);
+	double dr=0.5*(z[2*k+1]+z[2*kc+1]);
+	double di=-0.5*(z[2*k]-z[2*kc]);
+	double cs=cos(M_PI*m/nphi),sn=-sin(M_PI*m/nphi);
+	fr[4*m+0]=sr*cs-si*sn;
+	fr[4*m+1]=sr*sn+si*cs;
+	fr[4*m+2]=dr*cs-di*sn;
+	fr[4*m+3]=dr*sn+di*cs;
+      }
+    } //end omp for
+
+    free(z);
+    gsl_fft_complex_workspace_free(work);
+  } //end omp parallel
+
+  gsl_fft_complex_wavetable_free(wt);
+
+  return fring;
+}
+
+static void get_harmonic_spectra(double *fring,int lmax,double *cl)
+{
+  //////
+  // Adds to cl[3*l+(0,1,2)] the sums over m of a^D_lm a^D*_lm,
+  // a^D_lm a^R*_lm and a^R_lm a^R*_lm, i.e. (2l+1) times the
+  // spectra. Rings cth and -cth are taken together, using
+  // lambda_lm(-x)=(-1)^(l+m)*lambda_lm(x), and HARM_NRING pairs of
+  // rings are recursed at once, since each recursion on its own is
+  // bound by the latency of its arithmetic. Near the poles
+  // lambda_mm underflows for large m while lambda_lm grows back to
+  // O(1) at high l, so it is carried with an extra factor
+  // 2^(HARM_SCALE*nscale) until it becomes large enough.
+  // Each MPI node only sums its own range of m.
+  int m,m_0,m_f,nm=lmax+1;
+  int nrh=(n_side_cth+1)/2;
+  double *cost=(double *)my_malloc(nm*sizeof(double));
+
+  //The recursion for m runs over lmax-m+1 multipoles
+  for(m=0;m<=lmax;m++)
+    cost[m]=lmax-m+1;
+  share_iters_cost(nm,cost,&m_0,&m_f);
+  free(cost);
+
+#pragma omp parallel default(none)		\
+  shared(fring,lmax,nm,nrh,n_side_cth,m_0,m_f)	\
+  reduction(+:cl[:3*nm])
+  {
+    int l;
+    double *alm=(double *)my_malloc(4*nm*sizeof(double));
+    double *alm_r=(double *)my_malloc(4*HARM_NRING*nm*sizeof(double));
+    double *rec_a=(double *)my_malloc(nm*sizeof(double));
+    double *rec_b=(double *)my_malloc(nm*sizeof(double));
+
+#pragma omp for schedule(dynamic)
+    for(m=m_0;m<m_f;m++) {
+      int ir0;
+      double wm=(m==0) ? 1 : 2;
+      double lnpre=0.5*(log((2*m+1)/(4*M_PI))+lgamma(2*m+1.)-
+			2*lgamma(m+1.)-m*log(4.));
+
+      for(l=m;l<=lmax;l++) {
+	int j;
+	alm[4*l+0]=0; alm[4*l+1]=0;
+	alm[4*l+2]=0; alm[4*l+3]=0;
+	for(j=0;j<4*HARM_NRING;j++)
+	  alm_r[4*HARM_NRING*(size_t)l+j]=0;
+      }
+      for(l=m+2;l<=lmax;l++) {
+	rec_a[l]=sqrt((4.*l*l-1)/((double)l*l-(double)m*m));
+	rec_b[l]=sqrt(((l-1.)*(l-1.)-(double)m*m)/(4.*(l-1.)*(l-1.)-1));
+      }
+
+      for(ir0=0;ir0<nrh;ir0+=HARM_NRING) {
+	int k,j,nsc;
+	int nscale[HARM_NRING];
+	double x[HARM_NRING],lam0[HARM_NRING],lam1[HARM_NRING];
+	double use[HARM_NRING],big[HARM_NRING];
+	double f[2][4][HARM_NRING]; //Symmetric and antisymmetric ring sums
+
+	for(k=0;k<HARM_NRING;k++) {
+	  int ir=ir0+k;
+	  int irn=n_side_cth-1-ir;
+	  double e2;
+	  double *fn,*fs;
+
+	  if(ir>=nrh) {
+	    //Padding
+	    x[k]=0; lam0[k]=0; lam1[k]=0;
+	    use[k]=0; big[k]=HUGE_VAL; nscale[k]=0;
+	    for(j=0;j<4;j++) {
+	      f[0][j][k]=0;
+	      f[1][j][k]=0;
+	    }
+	    continue;
+	  }
+
+	  fn=&(fring[4*((size_t)irn*nm+m)]);
+	  fs=&(fring[4*((size_t)ir*nm+m)]);
+	  for(j=0;j<4;j++) {
+	    if(irn==ir) {
+	      f[0][j][k]=fn[j];
+	      f[1][j][k]=fn[j];
+	    }
+	    else {
+	      f[0][j][k]=fn[j]+fs[j];
+	      f[1][j][k]=fn[j]-fs[j];
+	    }
+	  }
+
+	  //lambda_mm and lambda_(m+1)m in units of 2^(-HARM_SCALE*nscale)
+	  x[k]=-1.0+2.0*((double)(irn+0.5))/n_side_cth;
+	  e2=(lnpre+0.5*m*log(1-x[k]*x[k]))/M_LN2;
+	  nscale[k]=0;
+	  if(e2<-HARM_SCALE/2)
+	    nscale[k]=(int)ceil((-HARM_SCALE/2-e2)/HARM_SCALE);
+	  lam0[k]=pow(2.,e2+HARM_SCALE*nscale[k]);
+	  lam1[k]=x[k]*sqrt(2*m+3.)*lam0[k];
+	  if(nscale[k]==0) {
+	    use[k]=1;
+	    big[k]=HUGE_VAL;
+	    for(j=0;j<4;j++) {
+	      alm[4*m+j]+=lam0[k]*f[0][j][k];
+	      if(m+1<=lmax)
+		alm[4*(m+1)+j]+=lam1[k]*f[1][j][k];
+	    }
+	  }
+	  else {
+	    use[k]=0;
+	    big[k]=ldexp(1.,HARM_SCALE/2);
+	  }
+	}
+
+	//Recursion with rescaling while any ring needs it
+	nsc=0;
+	for(k=0;k<HARM_NRING;k++)
+	  nsc+=nscale[k];
+	for(l=m+2;(nsc>0)&&(l<=lmax);l++) {
+	  int par=(l-m)&1;
+	  double al=rec_a[l],bl=rec_b[l];
+	  for(k=0;k<HARM_NRING;k++) {
+	    double lam2=al*(x[k]*lam1[k]-bl*lam0[k]);
+	    lam0[k]=lam1[k];
+	    lam1[k]=lam2;
+	    if(fabs(lam2)>big[k]) {
+	      lam0[k]=ldexp(lam0[k],-HARM_SCALE);
+	      lam1[k]=ldexp(lam1[k],-HARM_SCALE);
+	      nscale[k]--;
+	      nsc--;
+	      if(nscale[k]==0) {
+		use[k]=1;
+		big[k]=HUGE_VAL;
+	      }
+	    }
+	    for(j=0;j<4;j++)
+	      alm[4*l+j]+=use[k]*lam1[k]*f[par][j][k];
+	  }
+	}
+
+	//Plain recursion for the rest. Each ring adds to its own
+	//copy of the a_lm, so that the rings can be vectorized
+	for(;l<=lmax;l++) {
+	  int par=(l-m)&1;
+	  double al=rec_a[l],bl=rec_b[l];
+	  double *ar=&(alm_r[4*HARM_NRING*(size_t)l]);
+	  for(k=0;k<HARM_NRING;k++) {
+	    double lam2=al*(x[k]*lam1[k]-bl*lam0[k]);
+	    lam0[k]=lam1[k];
+	    lam1[k]=lam2;
+	    ar[k]+=lam2*f[par][0][k];
+	    ar[HARM_NRING+k]+=lam2*f[par][1][k];
+	    ar[2*HARM_NRING+k]+=lam2*f[par][2][k];
+	    ar[3*HARM_NRING+k]+=lam2*f[par][3][k];
+	  }
+	}
+      }
+      for(l=m;l<=lmax;l++) {
+	int j;
+	for(j=0;j<4;j++) {
+	  int k;
+	  double *ar=&(alm_r[4*HARM_NRING*(size_t)l+HARM_NRING*j]);
+	  for(k=0;k<HARM_NRING;k++)
+	    alm[4*l+j]+=ar[k];
+	}
+      }
+
+      for(l=m;l<=lmax;l++) {
+	double *a=&(alm[4*l]);
+	cl[3*l+0]+=wm*(a[0]*a[0]+a[1]*a[1]);
+	cl[3*l+1]+=wm*(a[0]*a[2]+a[1]*a[3]);
+	cl[3*l+2]+=wm*(a[2]*a[2]+a[3]*a[3]);
+      }
+    } //end omp for
+
+    free(alm);
+    free(alm_r);
+    free(rec_a);
+    free(rec_b);
+  } //end omp parallel
+}
+
+static void legendre_integrals(double mu,int lmax,double *ip)
+{
+  //////
+  // Returns in ip[l] the integral of P_l from mu to 1
+  // for 0<=l<=lmax
+  int l;
+  double p0=1,p1=mu;
+
+  ip[0]=1-mu;
+  for(l=1;l<=lmax;l++) {
+    //int_mu^1 P_l=(P_(l-1)(mu)-P_(l+1)(mu))/(2l+1)
+    double p2=((2*l+1)*mu*p1-l*p0)/(l+1);
+    ip[l]=(p0-p2)/(2*l+1);
+    p0=p1;
+    p1=p2;
+  }
+}
+
+static inline histo_t harm2histo(double x)
+{
+#ifdef _WITH_WEIGHTS
+  return x;
+#else //_WITH_WEIGHTS
+  return (histo_t)(MAX(x,0)+0.5);
+#endif //_WITH_WEIGHTS
+}
+
+void corr_ang_harmonic(double *mapD,double *mapR,
+		       histo_t *DD,histo_t *DR,histo_t *RR)
+{
+  //////
+  // Harmonic-space angular correlator. Fills DD, DR and RR with
+  // the sums over pairs of pixels of the grid maps mapD and mapR,
+  // as corr_ang_pm would do with a single resolution level.
+  // The spectra are split between MPI nodes and summed on the
+  // root node, the others returning zeros so that the MPI
+  // reduction in write_CF is unaffected
+  int i,ip,lmax=n_side_phi;
+  int nm=lmax+1;
+  int nb_unres=0;
+  double th_pix=sqrt(4*M_PI/n_boxes2D);
+  double sself[3]={0,0,0};
+  double *fring,*cl,*ip_lo,*ip_hi;
+
+  print_info("  Harmonic transforms up to l_max = %d\n",lmax);
+
+  //Pixels paired with themselves, only at theta=0
+  for(ip=0;ip<n_boxes2D;ip++) {
+    sself[0]+=mapD[ip]*mapD[ip];
+    sself[1]+=mapD[ip]*mapR[ip];
+    sself[2]+=mapR[ip]*mapR[ip];
+  }
+
+  fring=mk_ring_transforms(mapD,mapR,lmax);
+  cl=(double *)my_calloc(3*nm,sizeof(double));
+  get_harmonic_spectra(fring,lmax,cl);
+  free(fring);
+#ifdef _HAVE_MPI
+  if(NodeThis==0)
+    MPI_Reduce(MPI_IN_PLACE,cl,3*nm,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+  else
+    MPI_Reduce(cl,NULL,3*nm,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+#endif //_HAVE_MPI
+  if(NodeThis!=0) {
+    for(i=0;i<nb_theta;i++) {
+      DD[i]=0;
+      DR[i]=0;
+      RR[i]=0;
+    }
+    free(cl);
+    return;
+  }
+
+  //The band limit would smear the self-pairs over the smallest
+  //bins, so their harmonic contribution sum_l (2l+1)/(4*pi) K_l
+  //is replaced by the exact one
+  ip_lo=(double *)my_malloc(nm*sizeof(double));
+  ip_hi=(double *)my_malloc(nm*sizeof(double));
+  legendre_integrals(cos(MIN(get_th_bin_edge(0),M_PI)),lmax,ip_hi);
+  for(i=0;i<nb_theta;i++) {
+    int l;
+    double *tmp;
+    double sum[3]={0,0,0};
+    double kself=0;
+
+    tmp=ip_lo;
+    ip_lo=ip_hi;
+    ip_hi=tmp;
+    legendre_integrals(cos(MIN(get_th_bin_edge(i+1),M_PI)),lmax,ip_hi);
+    for(l=0;l<=lmax;l++) {
+      double kl=2*M_PI*(ip_hi[l]-ip_lo[l]);
+      sum[0]+=kl*cl[3*l+0];
+      sum[1]+=kl*cl[3*l+1];
+      sum[2]+=kl*cl[3*l+2];
+      kself+=kl*(2*l+1)/(4*M_PI);
+    }
+    for(l=0;l<3;l++) {
+      sum[l]-=kself*sself[l];
+      if(get_th_bin_edge(i)<=0)
+	sum[l]+=sself[l];
+    }
+    if(get_th_bin_edge(i+1)<=th_pix) {
+      nb_unres++;
+      DD[i]=0;
+      DR[i]=0;
+      RR[i]=0;
+    }
+    else {
+      DD[i]=harm2histo(0.5*sum[0]);
+      DR[i]=harm2histo(sum[1]);
+      RR[i]=harm2histo(0.5*sum[2]);
+    }
+  }
+  if(nb_unres>0) {
+    fprintf(stderr,"CUTE: %d angular bins are below the pixel resolution ",nb_unres);
+    fprintf(stderr,"(%.4lf deg) and are set to zero\n",th_pix/DTORAD);
+  }
+
+  free(ip_lo);
+  free(ip_hi);
+  free(cl);
+}
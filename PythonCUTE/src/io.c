@@ -27,6 +27,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#ifdef _HAVE_OMP
+#include <omp.h>
+#endif //_HAVE_OMP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef _HAVE_HDF5
+#include <hdf5.h>
+#endif //_HAVE_HDF5
 #include "define.h"
 #include "common.h"
 
@@ -36,33 +47,250 @@ static int param_errors = 0;
 static int n_objects=-1;
 static int estimator=-1;
 static int input_format=-1;
+static char hdf5_datasets[256]="z,dec,ra,weight,region";
+
+/////////////////////////
+// Parallel ASCII reader
+// The file is mapped into memory (or read into it if it can't be
+// mapped) and split into chunks at line boundaries. The lines in
+// each chunk are counted in parallel, so that every thread then
+// knows where the objects in its chunks go.
+typedef struct {
+  char *buf;           //File contents
+  size_t size;
+  int mapped;          //Whether buf is a mapping
+  int n_chunks;
+  size_t *chunk_start; //Offset of the first line of each chunk (n_chunks+1)
+  long *chunk_line0;   //Index of the first line of each chunk (n_chunks+1)
+  long n_lines;
+} AsciiFile;
+
+static const double pow10_exact[23]={
+  1E0,1E1,1E2,1E3,1E4,1E5,1E6,1E7,1E8,1E9,1E10,1E11,
+  1E12,1E13,1E14,1E15,1E16,1E17,1E18,1E19,1E20,1E21,1E22};
+
+static int is_blank(char c)
+{
+  return (c==' ')||(c=='\t')||(c=='\r')||(c=='\v')||(c=='\f');
+}
 
-static int read_line(FILE *fi,double *zz,double *cth,
-    double *phi,double *weight)
+static char *next_token(char *s,char *end,char **tok_end)
 {
   //////
-  // Reads source positions and weight in each line
-  double x0,x1,x2;
-  char s0[1024];
-  int sr;
-  if(fgets(s0,sizeof(s0),fi)==NULL) return 1;
+  // Returns the start of the first token in [s,end),
+  // or NULL if there is none, and sets tok_end to its end
+  while((s<end)&&is_blank(*s)) s++;
+  if(s>=end) return NULL;
+  *tok_end=s;
+  while((*tok_end<end)&&(!is_blank(**tok_end))) (*tok_end)++;
+  return s;
+}
 
-#ifdef _WITH_WEIGHTS
-  double x3;
-  sr=sscanf(s0,"%lf %lf %lf %lf",&x0,&x1,&x2,&x3);
-  if(sr!=4) return 1;
-  *weight=x3;
-#else //_WITH_WEIGHTS
-  sr=sscanf(s0,"%lf %lf %lf",&x0,&x1,&x2);
-  if(sr!=3) return 1;
-  *weight=1;
-#endif //_WITH_WEIGHTS
+static int parse_double_slow(char *s,char *end,double *x)
+{
+  //////
+  // strtod on a null-terminated copy of the token
+  char tok[64],*tend;
+  size_t len=end-s;
+  if(len>=sizeof(tok)) return 1;
+  memcpy(tok,s,len);
+  tok[len]='\0';
+  *x=strtod(tok,&tend);
+  return (tend!=tok+len);
+}
 
+static int parse_double(char *s,char *end,double *x)
+{
+  //////
+  // Parses the token [s,end) into x, returning 0 on success.
+  // Decimal numbers with at most 19 significant digits whose
+  // mantissa and power of ten are exact doubles need a single
+  // correctly rounded operation, so they come out the same as
+  // with strtod. strtod takes care of anything else.
+  char *p=s;
+  unsigned long long m=0;
+  int neg=0,nd=0,ndig=0,e=0;
+
+  if((p<end)&&((*p=='-')||(*p=='+'))) {
+    neg=(*p=='-');
+    p++;
+  }
+  while((p<end)&&(*p>='0')&&(*p<='9')) {
+    if(m||(*p!='0')) {
+      if(nd==19) return parse_double_slow(s,end,x);
+      m=10*m+(*p-'0');
+      nd++;
+    }
+    ndig++;
+    p++;
+  }
+  if((p<end)&&(*p=='.')) {
+    p++;
+    while((p<end)&&(*p>='0')&&(*p<='9')) {
+      if(m||(*p!='0')) {
+	if(nd==19) return parse_double_slow(s,end,x);
+	m=10*m+(*p-'0');
+	nd++;
+      }
+      ndig++;
+      e--;
+      p++;
+    }
+  }
+  if(ndig==0) return parse_double_slow(s,end,x);
+  if((p<end)&&((*p=='e')||(*p=='E'))) {
+    int es=1,ev=0,ned=0;
+    p++;
+    if((p<end)&&((*p=='-')||(*p=='+'))) {
+      es=(*p=='-') ? -1 : 1;
+      p++;
+    }
+    while((p<end)&&(*p>='0')&&(*p<='9')) {
+      if(ev<100000) ev=10*ev+(*p-'0');
+      ned++;
+      p++;
+    }
+    if(ned==0) return parse_double_slow(s,end,x);
+    e+=es*ev;
+  }
+  if(p!=end) return parse_double_slow(s,end,x);
+
+  if(m==0)
+    *x=0;
+  else if((m<=(1ULL<<53))&&(e>=-22)&&(e<=22)) {
+    if(e<0)
+      *x=(double)m/pow10_exact[-e];
+    else
+      *x=(double)m*pow10_exact[e];
+  }
+  else
+    return parse_double_slow(s,end,x);
+  if(neg) *x=-(*x);
+
+  return 0;
+}
+
+static int parse_int(char *s,char *end,int *i)
+{
+  //////
+  // Parses the token [s,end) into i, returning 0 on success
+  int neg=0;
+  long v=0;
+  if((s<end)&&((*s=='-')||(*s=='+'))) {
+    neg=(*s=='-');
+    s++;
+  }
+  if(s>=end) return 1;
+  while(s<end) {
+    if((*s<'0')||(*s>'9')) return 1;
+    v=10*v+(*s-'0');
+    if(v>INT_MAX) return 1;
+    s++;
+  }
+  *i=(int)(neg ? -v : v);
+
+  return 0;
+}
+
+static AsciiFile *open_ascii(char *fname)
+{
+  //////
+  // Loads fname and counts its lines
+  int fd,ic;
+  struct stat st;
+  AsciiFile *af=my_malloc(sizeof(AsciiFile));
+
+  fd=open(fname,O_RDONLY);
+  if(fd<0) error_open_file(fname);
+  if(fstat(fd,&st)<0) error_open_file(fname);
+  af->size=(S_ISREG(st.st_mode)) ? st.st_size : 0;
+  af->buf=NULL;
+  af->mapped=0;
+  if(af->size>0) {
+    af->buf=mmap(NULL,af->size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(af->buf==MAP_FAILED)
+      af->buf=NULL;
+    else
+      af->mapped=1;
+  }
+  if(af->buf==NULL) {
+    //Not a regular file (e.g. a pipe) or couldn't be mapped
+    size_t n_alloc=1<<20;
+    ssize_t nr;
+    af->size=0;
+    af->buf=my_malloc(n_alloc);
+    while((nr=read(fd,af->buf+af->size,n_alloc-af->size))!=0) {
+      if(nr<0) error_read_line(fname,1);
+      af->size+=nr;
+      if(af->size==n_alloc) {
+	n_alloc*=2;
+	af->buf=realloc(af->buf,n_alloc);
+	if(af->buf==NULL) {
+	  fprintf(stderr,"CUTE: out of memory!\n");
+	  exit(1);
+	}
+      }
+    }
+  }
+  close(fd);
+
+  //Split into chunks at line boundaries
+  af->n_chunks=1;
+#ifdef _HAVE_OMP
+  af->n_chunks=8*omp_get_max_threads();
+#endif //_HAVE_OMP
+  af->n_chunks=(int)(MIN((size_t)(af->n_chunks),af->size/65536+1));
+  af->chunk_start=my_malloc((af->n_chunks+1)*sizeof(size_t));
+  af->chunk_line0=my_malloc((af->n_chunks+1)*sizeof(long));
+  af->chunk_start[0]=0;
+  for(ic=1;ic<af->n_chunks;ic++) {
+    size_t i=MAX((af->size*ic)/af->n_chunks,af->chunk_start[ic-1]);
+    char *nl=(i<af->size) ? memchr(af->buf+i,'\n',af->size-i) : NULL;
+    af->chunk_start[ic]=(nl==NULL) ? af->size : (size_t)(nl-af->buf)+1;
+  }
+  af->chunk_start[af->n_chunks]=af->size;
+
+  //Count lines in each chunk (the last one may have no newline)
+#pragma omp parallel for default(none) shared(af) schedule(dynamic)
+  for(ic=0;ic<af->n_chunks;ic++) {
+    long nl=0;
+    char *p=af->buf+af->chunk_start[ic];
+    char *end=af->buf+af->chunk_start[ic+1];
+    while(p<end) {
+      char *q=memchr(p,'\n',end-p);
+      nl++;
+      if(q==NULL) break;
+      p=q+1;
+    }
+    af->chunk_line0[ic+1]=nl;
+  }
+  af->chunk_line0[0]=0;
+  for(ic=0;ic<af->n_chunks;ic++)
+    af->chunk_line0[ic+1]+=af->chunk_line0[ic];
+  af->n_lines=af->chunk_line0[af->n_chunks];
+
+  return af;
+}
+
+static void close_ascii(AsciiFile *af)
+{
+  if(af->mapped)
+    munmap(af->buf,af->size);
+  else
+    free(af->buf);
+  free(af->chunk_start);
+  free(af->chunk_line0);
+  free(af);
+}
+
+static int get_position(int format,double x0,double x1,double x2,
+			double *zz,double *cth,double *phi)
+{
   //////
   // Modify here to add other formats
   // x0, x1, x2 are the first columns
   // in the data file
-  if(input_format==0) {
+  if(format==0) {
     // z  cos(theta)  phi
     if((x1>1)||(x1<-1)) {
       fprintf(stderr,"CUTE: wrong cos(theta) = %lf \n",x1);
@@ -72,7 +300,7 @@ static int read_line(FILE *fi,double *zz,double *cth,
     *cth=x1;
     *phi=x2;
   }
-  else if(input_format==1) {
+  else if(format==1) {
     // z  dec  ra
     if((x1<-90)||(x1>90)) {
       fprintf(stderr,"CUTE: wrong declination: %lf \n",x1);
@@ -82,7 +310,7 @@ static int read_line(FILE *fi,double *zz,double *cth,
     *cth=cos(DTORAD*(90-x1));
     *phi=DTORAD*x2;
   }
-  else if(input_format==2) {
+  else if(format==2) {
     // ra  dec  z
     if((x1<-90)||(x1>90)) {
       fprintf(stderr,"CUTE: wrong declination: %lf \n",x1);
@@ -92,7 +320,7 @@ static int read_line(FILE *fi,double *zz,double *cth,
     *cth=cos(DTORAD*(90-x1));
     *phi=DTORAD*x0;
   }
-  else if(input_format==3) {
+  else if(format==3) {
     // z ra  dec
     if((x2<-90)||(x2>90)) {
       fprintf(stderr,"CUTE: wrong declination: %lf \n",x1);
@@ -104,7 +332,7 @@ static int read_line(FILE *fi,double *zz,double *cth,
   }
   else {
     fprintf(stderr,"CUTE: wrong input format %d \n",
-        input_format);
+        format);
     exit(1);
   }
 
@@ -117,6 +345,90 @@ static int read_line(FILE *fi,double *zz,double *cth,
   return 0;
 }
 
+static int read_line(char *s0,char *end,double *zz,double *cth,
+    double *phi,double *weight,int *region)
+{
+  //////
+  // Reads source positions and weight in the line [s0,end),
+  // followed by the jackknife region if n_jk>0
+  double x0,x1,x2;
+  char *s,*tend=s0;
+
+  if((s=next_token(tend,end,&tend))==NULL) return 1;
+  if(parse_double(s,tend,&x0)) return 1;
+  if((s=next_token(tend,end,&tend))==NULL) return 1;
+  if(parse_double(s,tend,&x1)) return 1;
+  if((s=next_token(tend,end,&tend))==NULL) return 1;
+  if(parse_double(s,tend,&x2)) return 1;
+#ifdef _WITH_WEIGHTS
+  if((s=next_token(tend,end,&tend))==NULL) return 1;
+  if(parse_double(s,tend,weight)) return 1;
+#else //_WITH_WEIGHTS
+  *weight=1;
+#endif //_WITH_WEIGHTS
+
+  *region=0;
+  if(n_jk>0) {
+    if((s=next_token(tend,end,&tend))==NULL) return 1;
+    if(parse_int(s,tend,region)) return 1;
+    if((*region<0)||(*region>=n_jk)) {
+      fprintf(stderr,"CUTE: wrong jackknife region %d \n",*region);
+      return 1;
+    }
+  }
+
+  return get_position(input_format,x0,x1,x2,zz,cth,phi);
+}
+
+
+static void read_ascii_catalog(AsciiFile *af,char *fname,int il_0,int il_f,
+			       double *red,double *cth,double *phi,
+			       double *weight,int *region)
+{
+  //////
+  // Parses lines il_0 to il_f-1 of af in parallel, storing line
+  // il in position il-il_0 of each array. weight and region can
+  // be NULL if they are not needed.
+  int ic;
+  long il_bad=il_f;
+
+#pragma omp parallel for default(none)				\
+  shared(af,il_0,il_f,red,cth,phi,weight,region)		\
+  reduction(min:il_bad) schedule(dynamic)
+  for(ic=0;ic<af->n_chunks;ic++) {
+    long il=af->chunk_line0[ic];
+    char *p=af->buf+af->chunk_start[ic];
+    char *end=af->buf+af->chunk_start[ic+1];
+
+    if((af->chunk_line0[ic+1]<=il_0)||(il>=il_f))
+      continue;
+    while((p<end)&&(il<il_f)) {
+      char *eol=memchr(p,'\n',end-p);
+      if(eol==NULL) eol=end;
+      if(il>=il_0) {
+	double zz,cth_l,phi_l,weight_l;
+	int region_l;
+	if(read_line(p,eol,&zz,&cth_l,&phi_l,&weight_l,&region_l)) {
+	  il_bad=MIN(il_bad,il);
+	  break;
+	}
+	red[il-il_0]=zz;
+	cth[il-il_0]=cth_l;
+	phi[il-il_0]=phi_l;
+	if(weight!=NULL)
+	  weight[il-il_0]=weight_l;
+	if(region!=NULL)
+	  region[il-il_0]=region_l;
+      }
+      il++;
+      p=eol+1;
+    }
+  }
+
+  if(il_bad<il_f)
+    error_read_line(fname,(int)(il_bad+1));
+}
+
 static void make_CF(histo_t DD,histo_t DR,histo_t RR,
     np_t sum_wd,np_t sum_wd2,
     np_t sum_wr,np_t sum_wr2,
@@ -219,30 +531,186 @@ static void make_CCF(histo_t D1D2,histo_t D1R,histo_t D2R,histo_t RR,
   *ercorr=ec;
 }
 
-void write_CF(char *fname,
-    histo_t *DD,histo_t *DR,histo_t *RR,
-    np_t sum_wd,np_t sum_wd2,
-    np_t sum_wr,np_t sum_wr2)
+static int get_n_bins_all(void)
 {
   //////
-  // Writes correlation function to file fname
-#ifdef _HAVE_MPI
-  int n_bins_all=0;
-
+  // Returns the total number of bins for corr_type
   if(corr_type==0)
-    n_bins_all=nb_dz;
+    return nb_dz;
   else if(corr_type==1)
-    n_bins_all=nb_theta;
+    return nb_theta;
   else if(corr_type==2)
-    n_bins_all=nb_r;
+    return nb_r;
   else if(corr_type==3)
-    n_bins_all=nb_rt*nb_rl;
+    return nb_rt*nb_rl;
   else if(corr_type==4)
-    n_bins_all=nb_r*nb_mu;
+    return nb_r*nb_mu;
   else if(corr_type==5)
-    n_bins_all=nb_red*nb_dz*nb_theta;
+    return nb_red*nb_dz*nb_theta;
   else if(corr_type==6)
-    n_bins_all=nb_theta*((nb_red*(nb_red+1))/2);
+    return nb_theta*((nb_red*(nb_red+1))/2);
+  else
+    return 0;
+}
+
+/*********************************************************************/
+//                             RR cache                              //
+/*********************************************************************/
+// RR only depends on the randoms, the binning and the cosmology, so
+// it can be stored in rr_cache_dir under a hash of all of these and
+// reused by later runs with the same randoms. A run that finds no
+// cached RR computes it and, once it has been reduced over MPI nodes
+// in write_CF, writes it to the cache.
+#define RR_CACHE_MAGIC "CUTE_RR1"
+
+static unsigned long long rr_cache_key=0;
+static int rr_cache_pending=0;
+
+static unsigned long long hash_bytes(unsigned long long h,void *p,size_t n)
+{
+  //////
+  // 64-bit FNV-1a hash of n bytes at p, starting from h
+  size_t ii;
+  unsigned char *c=(unsigned char *)p;
+
+  for(ii=0;ii<n;ii++) {
+    h^=c[ii];
+    h*=1099511628211ULL;
+  }
+
+  return h;
+}
+
+static unsigned long long get_RR_key(Catalog *cat_ran)
+{
+  //////
+  // Hash of the random catalog, corr_type, binning and cosmology
+  unsigned long long h=14695981039346656037ULL;
+  int iparams[13]={corr_type,logbin,n_logint,nb_red,nb_dz,nb_theta,
+		   nb_r,nb_rl,nb_rt,nb_mu,(int)sizeof(histo_t),N_POS,0};
+  double dparams[13]={i_red_interval,red_0,i_dz_max,i_theta_max,
+		      log_th_max,i_r_max,log_r_max,i_rl_max,i_rt_max,
+		      aperture_los,omega_M,omega_L,weos};
+#ifdef _TRUE_ACOS
+  iparams[12]=1;
+#endif //_TRUE_ACOS
+
+  h=hash_bytes(h,iparams,sizeof(iparams));
+  h=hash_bytes(h,dparams,sizeof(dparams));
+  h=hash_bytes(h,&(cat_ran->np),sizeof(int));
+  h=hash_bytes(h,cat_ran->red,cat_ran->np*sizeof(double));
+  h=hash_bytes(h,cat_ran->cth,cat_ran->np*sizeof(double));
+  h=hash_bytes(h,cat_ran->phi,cat_ran->np*sizeof(double));
+#ifdef _WITH_WEIGHTS
+  h=hash_bytes(h,cat_ran->weight,cat_ran->np*sizeof(double));
+#endif //_WITH_WEIGHTS
+
+  return h;
+}
+
+static void get_RR_cache_fname(char *fname)
+{
+  sprintf(fname,"%s/RR_%016llx.dat",fnameRRCache,rr_cache_key);
+}
+
+int read_RR_cache(Catalog *cat_ran,histo_t *RR)
+{
+  //////
+  // Looks for RR for the random catalog cat_ran in the cache.
+  // Must be called before the catalog is boxed. If RR is found
+  // it's loaded on the root node (the others get zeros, so the
+  // MPI reduction in write_CF is unaffected) and 1 is returned.
+  // Otherwise returns 0, and write_CF will cache RR.
+  int ii,nbins,nb_file,size_file;
+  char fname[256],magic[8];
+  unsigned long long key_file;
+  FILE *fi;
+
+  rr_cache_pending=0;
+  //Jackknife runs need RR for each pair of regions, which isn't cached,
+  //with MPI domains no node holds the whole random catalog, and
+  //generated randoms are new on every run, so their RR never matches
+  if((!strcmp(fnameRRCache,"none"))||(n_jk>0)||mpi_domains||gen_ran)
+    return 0;
+
+  nbins=get_n_bins_all();
+  rr_cache_key=get_RR_key(cat_ran);
+  get_RR_cache_fname(fname);
+
+  fi=fopen(fname,"rb");
+  if(fi==NULL) {
+    rr_cache_pending=1;
+    return 0;
+  }
+  if((fread(magic,1,8,fi)!=8)||strncmp(magic,RR_CACHE_MAGIC,8)||
+     (fread(&key_file,sizeof(key_file),1,fi)!=1)||(key_file!=rr_cache_key)||
+     (fread(&nb_file,sizeof(int),1,fi)!=1)||(nb_file!=nbins)||
+     (fread(&size_file,sizeof(int),1,fi)!=1)||(size_file!=(int)sizeof(histo_t))||
+     (fread(RR,sizeof(histo_t),nbins,fi)!=(size_t)nbins)) {
+    fprintf(stderr,"CUTE: RR cache file %s is not valid, recomputing RR\n",fname);
+    fclose(fi);
+    rr_cache_pending=1;
+    return 0;
+  }
+  fclose(fi);
+
+  if(NodeThis!=0) {
+    for(ii=0;ii<nbins;ii++)
+      RR[ii]=0;
+  }
+  print_info("  Using cached RR from %s\n",fname);
+
+  return 1;
+}
+
+void write_RR_cache(histo_t *RR)
+{
+  //////
+  // Writes RR to the cache if read_RR_cache didn't find it.
+  // RR must already be reduced over MPI nodes.
+  if(rr_cache_pending&&(NodeThis==0)) {
+    int nbins=get_n_bins_all();
+    int size=(int)sizeof(histo_t);
+    char fname[256],fname_tmp[300];
+    FILE *fo;
+
+    //The file is written under a temporary name and renamed into
+    //place, so that runs sharing the cache never see it half-written
+    get_RR_cache_fname(fname);
+    snprintf(fname_tmp,sizeof(fname_tmp),"%s.tmp%ld",fname,(long)getpid());
+    fo=fopen(fname_tmp,"wb");
+    if(fo==NULL)
+      fprintf(stderr,"CUTE: couldn't write RR cache file %s\n",fname);
+    else {
+      int ok=1;
+      ok&=(fwrite(RR_CACHE_MAGIC,1,8,fo)==8);
+      ok&=(fwrite(&rr_cache_key,sizeof(rr_cache_key),1,fo)==1);
+      ok&=(fwrite(&nbins,sizeof(int),1,fo)==1);
+      ok&=(fwrite(&size,sizeof(int),1,fo)==1);
+      ok&=(fwrite(RR,sizeof(histo_t),nbins,fo)==(size_t)nbins);
+      ok&=(fclose(fo)==0);
+      if(ok)
+        ok=(rename(fname_tmp,fname)==0);
+      if(ok)
+        print_info("  RR written to cache file %s\n",fname);
+      else {
+        fprintf(stderr,"CUTE: couldn't write RR cache file %s\n",fname);
+        remove(fname_tmp);
+      }
+    }
+  }
+  rr_cache_pending=0;
+}
+
+void write_CF(char *fname,
+    histo_t *DD,histo_t *DR,histo_t *RR,
+    np_t sum_wd,np_t sum_wd2,
+    np_t sum_wr,np_t sum_wr2)
+{
+  //////
+  // Writes correlation function to file fname
+#ifdef _HAVE_MPI
+  int n_bins_all=get_n_bins_all();
 
   if(NodeThis==0)
     MPI_Reduce(MPI_IN_PLACE,DD,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
@@ -258,6 +726,8 @@ void write_CF(char *fname,
     MPI_Reduce(RR,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
 #endif //_HAVE_MPI
 
+  write_RR_cache(RR);
+
   if(NodeThis==0) {
     FILE *fo;
     int ii;
@@ -483,6 +953,129 @@ void write_CF(char *fname,
   }
 }
 
+void write_CF_jk(char *fname,
+    histo_t *DD,histo_t *DR,histo_t *RR,
+    np_t *sums_wd,np_t *sums_wr,
+    np_t sum_wd,np_t sum_wd2,
+    np_t sum_wr,np_t sum_wr2)
+{
+  //////
+  // DD, DR and RR hold one histogram per pair of jackknife regions
+  // (see jk_pair_index). Writes the n_jk leave-one-out correlation
+  // functions to fname_jk, each obtained by removing all pairs with
+  // an object in one region, and its objects from the normalization.
+  // sums_wd and sums_wr are the per-region sums of weights (see
+  // mk_region_sums). DD, DR and RR are then summed over regions into
+  // their first histogram, so they are ready for write_CF.
+  int ii,ir,ib;
+  int nbins=get_n_bins_all();
+  int n_pairs=get_n_jk_pairs();
+  histo_t *hh[3]={DD,DR,RR};
+
+#ifdef _HAVE_MPI
+  for(ii=0;ii<3;ii++) {
+    if(NodeThis==0)
+      MPI_Reduce(MPI_IN_PLACE,hh[ii],nbins*n_pairs,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+    else
+      MPI_Reduce(hh[ii],NULL,nbins*n_pairs,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+  }
+#endif //_HAVE_MPI
+
+  if(NodeThis!=0) {
+    //write_CF reduces the totals again, so only the root keeps them
+    for(ii=0;ii<3;ii++) {
+      for(ib=0;ib<nbins;ib++)
+	hh[ii][ib]=0;
+    }
+    return;
+  }
+
+  //Pairs touching each region (loo), then totals
+  histo_t *loo=(histo_t *)my_calloc(3*n_jk*nbins,sizeof(histo_t));
+  for(ii=0;ii<3;ii++) {
+    for(ir=0;ir<n_jk;ir++) {
+      int ir2;
+      histo_t *h_loo=&(loo[(ii*n_jk+ir)*nbins]);
+      for(ir2=0;ir2<n_jk;ir2++) {
+	histo_t *h=&(hh[ii][jk_pair_index(ir,ir2)*nbins]);
+	for(ib=0;ib<nbins;ib++)
+	  h_loo[ib]+=h[ib];
+      }
+    }
+    for(ir=1;ir<n_pairs;ir++) {
+      for(ib=0;ib<nbins;ib++)
+	hh[ii][ib]+=hh[ii][ir*nbins+ib];
+    }
+  }
+
+  FILE *fo;
+  char fname_jk[256];
+  sprintf(fname_jk,"%s_jk",fname);
+  print_info("*** Writing jackknife output file ");
+#ifdef _VERBOSE
+  print_info("%s ",fname_jk);
+#endif
+  print_info("\n");
+  fo=fopen(fname_jk,"w");
+  if(fo==NULL) error_open_file(fname_jk);
+
+#ifdef _CUTE_AS_PYTHON_MODULE
+  free(global_result->corr_jk);
+  global_result->n_jk=n_jk;
+  global_result->corr_jk=(double *)my_malloc(n_jk*nbins*sizeof(double));
+#endif
+
+  //Columns are the region left out followed by those of write_CF
+  for(ir=0;ir<n_jk;ir++) {
+    np_t swd=sum_wd-sums_wd[ir],swd2=sum_wd2-sums_wd[n_jk+ir];
+    np_t swr=sum_wr-sums_wr[ir],swr2=sum_wr2-sums_wr[n_jk+ir];
+    for(ib=0;ib<nbins;ib++) {
+      double corr,ercorr;
+      histo_t dd=DD[ib]-loo[ir*nbins+ib];
+      histo_t dr=DR[ib]-loo[(n_jk+ir)*nbins+ib];
+      histo_t rr=RR[ib]-loo[(2*n_jk+ir)*nbins+ib];
+      make_CF(dd,dr,rr,swd,swd2,swr,swr2,&corr,&ercorr);
+
+      fprintf(fo,"%d ",ir);
+      if(corr_type==2) {
+	double r;
+	if(logbin)
+	  r=pow(10,((ib+0.5)-nb_r)/n_logint+log_r_max);
+	else
+	  r=(ib+0.5)/(nb_r*i_r_max);
+	fprintf(fo,"%lE ",r);
+      }
+      else if(corr_type==3) {
+	double rt=(ib/nb_rl+0.5)/(nb_rt*i_rt_max);
+	double rl=(ib%nb_rl+0.5)/(nb_rl*i_rl_max);
+	fprintf(fo,"%lE %lE ",rl,rt);
+      }
+      else {
+	double r;
+	double mu=(ib%nb_mu+0.5)/(nb_mu);
+	if(logbin)
+	  r=pow(10,((ib/nb_mu+0.5)-nb_r)/n_logint+log_r_max);
+	else
+	  r=(ib/nb_mu+0.5)/(nb_r*i_r_max);
+	fprintf(fo,"%lE %lE ",mu,r);
+      }
+      fprintf(fo,"%lE %lE ",corr,ercorr);
+#ifdef _WITH_WEIGHTS
+      fprintf(fo,"%lE %lE %lE\n",dd,dr,rr);
+#else //_WITH_WEIGHTS
+      fprintf(fo,"%llu %llu %llu\n",dd,dr,rr);
+#endif //_WITH_WEIGHTS
+#ifdef _CUTE_AS_PYTHON_MODULE
+      global_result->corr_jk[ir*nbins+ib]=corr;
+#endif
+    }
+  }
+  fclose(fo);
+  free(loo);
+
+  print_info("\n");
+}
+
 void write_CCF(char *fname,
     histo_t *D1D2,histo_t *D1R,histo_t *D2R,histo_t *RR,
     np_t sum_wd1,np_t sum_wd2,np_t sum_wr1,np_t sum_wr2,int reuse_ran)
@@ -501,13 +1094,17 @@ void write_CCF(char *fname,
     exit(1);
   }
   if(NodeThis==0)
-    MPI_Reduce(MPI_IN_PLACE,DD,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE,D1D2,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
   else
-    MPI_Reduce(DD,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+    MPI_Reduce(D1D2,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
   if(NodeThis==0)
-    MPI_Reduce(MPI_IN_PLACE,DR,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE,D1R,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
   else
-    MPI_Reduce(DR,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+    MPI_Reduce(D1R,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+  if(NodeThis==0)
+    MPI_Reduce(MPI_IN_PLACE,D2R,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
+  else
+    MPI_Reduce(D2R,NULL,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
   if(NodeThis==0)
     MPI_Reduce(MPI_IN_PLACE,RR,n_bins_all,HISTO_T_MPI,MPI_SUM,0,MPI_COMM_WORLD);
   else
@@ -714,6 +1311,16 @@ static void check_params(void)
     param_errors++;
 #endif
   }
+#ifndef _HAVE_HDF5
+  if(input_format==4) {
+    fprintf(stderr,"CUTE: HDF5 catalogs need CUTE compiled with HDF5 \n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+    exit(1);
+#else
+    param_errors++;
+#endif
+  }
+#endif //_HAVE_HDF5
 
   //vital files
   if(!strcmp(fnameData,"default")) {
@@ -802,12 +1409,20 @@ static void check_params(void)
   //PM options for angular correlation function
   if((corr_type==1)||(corr_type==6)) {
     //PM option
-    if((use_pm!=0)&&(use_pm!=1)) {
+    if((use_pm!=0)&&(use_pm!=1)&&(use_pm!=2)) {
       fprintf(stderr,"CUTE: No pixel option for angular correlations was given\n");
 #ifndef _CUTE_AS_PYTHON_MODULE   
       exit(1);
 #else
       param_errors++;
+#endif
+    }
+    if((use_pm==2)&&(corr_type!=1)) {
+      fprintf(stderr,"CUTE: spherical harmonics (use_pm=2) are only used for corr_type 1\n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
 #endif
     }
     if(use_pm) {
@@ -820,6 +1435,105 @@ static void check_params(void)
     }
   }
 
+  //HEALPix pixels for angular and radial correlations
+  if((pixelization!=0)&&(pixelization!=1)) {
+    fprintf(stderr,"CUTE: wrong pixelization %d, using a (cos(theta),phi) grid\n",
+	    pixelization);
+    pixelization=0;
+  }
+  if(pixelization&&(use_pm==2)&&(corr_type==1)) {
+    fprintf(stderr,"CUTE: spherical harmonics need the (cos(theta),phi) grid, ");
+    fprintf(stderr,"not using HEALPix\n");
+    pixelization=0;
+  }
+  if(pixelization&&use_pm&&(n_side_cth>0)&&
+     ((corr_type==1)||(corr_type==5)||(corr_type==6))) {
+    if((n_side_cth&(n_side_cth-1))||(n_side_cth>(1<<HPX_ORDER_MAX))) {
+      fprintf(stderr,"CUTE: n_pix_sph is the HEALPix nside, and must be a power of 2 ");
+      fprintf(stderr,"up to %d \n",1<<HPX_ORDER_MAX);
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+  }
+
+  //Resolution levels of the angular PM
+  if((pm_levels<1)||(pm_levels>PM_LEVELS_MAX)) {
+    fprintf(stderr,"CUTE: wrong number of PM levels %d, using 1\n",pm_levels);
+    pm_levels=1;
+  }
+  if(pm_levels>1) {
+    if((use_pm!=1)||((corr_type!=1)&&(corr_type!=6))) {
+      fprintf(stderr,"CUTE: PM levels are only used by the angular PM ");
+      fprintf(stderr,"for corr_type 1 and 6\n");
+    }
+    else if(n_side_cth%(1<<(pm_levels-1))) {
+      fprintf(stderr,"CUTE: n_pix_sph must be a multiple of %d for %d PM levels\n",
+	      1<<(pm_levels-1),pm_levels);
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+  }
+
+  //Dual-tree option for 3D correlations
+  if((use_tree!=0)&&(use_tree!=1)) {
+    fprintf(stderr,"CUTE: wrong tree option %d, using boxes\n",use_tree);
+    use_tree=0;
+  }
+  if(use_tree&&((corr_type<2)||(corr_type>4)))
+    fprintf(stderr,"CUTE: trees are only used for corr_type 2, 3 and 4\n");
+
+  //Jackknife regions
+  if(n_jk<0) {
+    fprintf(stderr,"CUTE: wrong number of jackknife regions %d, not using them\n",n_jk);
+    n_jk=0;
+  }
+  if(n_jk>0) {
+    if((corr_type<2)||(corr_type>4)||use_tree) {
+      fprintf(stderr,"CUTE: jackknife regions are only supported for corr_type 2, 3 and 4 with boxes\n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+    if(gen_ran) {
+      fprintf(stderr,"CUTE: jackknife regions need a random catalog with its regions\n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+  }
+
+  //MPI domain decomposition
+  if((mpi_domains!=0)&&(mpi_domains!=1)) {
+    fprintf(stderr,"CUTE: wrong domain option %d, not using domains\n",mpi_domains);
+    mpi_domains=0;
+  }
+  if(mpi_domains) {
+#ifdef _HAVE_MPI
+    if((corr_type<2)||(corr_type>4)||use_tree||gen_ran) {
+      fprintf(stderr,"CUTE: MPI domains are only supported for corr_type 2, 3 and 4 "
+	      "with boxes and a random catalog\n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+#else //_HAVE_MPI
+    fprintf(stderr,"CUTE: MPI domains need MPI, not using them\n");
+    mpi_domains=0;
+#endif //_HAVE_MPI
+  }
+
 }
 
 typedef struct {
@@ -990,9 +1704,11 @@ void print_parameters(){
   print_info(" reuse_randoms    = %i\n", reuse_ran);
   print_info(" num_lines        = %i\n", n_objects);
   print_info(" input_format     = %i\n", input_format);
+  print_info(" hdf5_datasets    = %s\n", hdf5_datasets);
   print_info(" output_filename  = %s\n", fnameOut);
   print_info(" fnameMask        = %s\n", fnameMask);
   print_info(" z_dist_filename  = %s\n", fnamedNdz);
+  print_info(" rr_cache_dir     = %s\n", fnameRRCache);
   print_info(" corr_estimator   = %i\n", estimator);
   print_info(" corr_type        = %i\n", corr_type);
   print_info(" omega_M          = %f\n", omega_M);
@@ -1010,6 +1726,12 @@ void print_parameters(){
   print_info(" n_logint         = %i\n", global_binner.n_logint);
   print_info(" use_pm           = %i\n", use_pm);
   print_info(" n_pix_sph        = [%i, %i]\n", n_side_cth, n_side_phi);
+  print_info(" pm_levels        = %i\n", pm_levels);
+  print_info(" box_order        = %i\n", box_order);
+  print_info(" pixelization     = %i\n", pixelization);
+  print_info(" use_tree         = %i\n", use_tree);
+  print_info(" n_jk_regions     = %i\n", n_jk);
+  print_info(" mpi_domains      = %i\n", mpi_domains);
   print_info("===================================\n\n");
 }
 #endif
@@ -1066,12 +1788,18 @@ void read_run_params(char *fname)
     }
     else if(!strcmp(s1,"input_format="))
       input_format=atoi(s2);
+    else if(!strcmp(s1,"hdf5_datasets="))
+      snprintf(hdf5_datasets,sizeof(hdf5_datasets),"%s",s2);
     else if(!strcmp(s1,"output_filename="))
       sprintf(fnameOut,"%s",s2);
     else if(!strcmp(s1,"mask_filename="))
       sprintf(fnameMask,"%s",s2);
     else if(!strcmp(s1,"z_dist_filename="))
       sprintf(fnamedNdz,"%s",s2);
+    else if(!strcmp(s1,"rr_cache_dir=")) {
+      if(snprintf(fnameRRCache,sizeof(fnameRRCache),"%s",s2)>=(int)sizeof(fnameRRCache))
+        fprintf(stderr,"CUTE: rr_cache_dir is too long, truncated to %s\n",fnameRRCache);
+    }
     else if(!strcmp(s1,"corr_estimator=")) {
       sprintf(estim,"%s",s2);
       if(!strcmp(estim,"PH"))
@@ -1139,6 +1867,31 @@ void read_run_params(char *fname)
       n_side_cth=atoi(s2);
       n_side_phi=2*n_side_cth;
     }
+    else if(!strcmp(s1,"pm_levels="))
+      pm_levels=atoi(s2);
+    else if(!strcmp(s1,"box_order=")) {
+      if(!strcmp(s2,"none")) box_order=0;
+      else if(!strcmp(s2,"morton")) box_order=1;
+      else if(!strcmp(s2,"hilbert")) box_order=2;
+      else {
+        fprintf(stderr,"CUTE: wrong box order %s.",s2);
+        fprintf(stderr," Possible orders are \"none\", \"morton\" and \"hilbert\".\n");
+      }
+    }
+    else if(!strcmp(s1,"pixelization=")) {
+      if(!strcmp(s2,"grid")) pixelization=0;
+      else if(!strcmp(s2,"healpix")) pixelization=1;
+      else {
+        fprintf(stderr,"CUTE: wrong pixelization %s.",s2);
+        fprintf(stderr," Possible pixelizations are \"grid\" and \"healpix\".\n");
+      }
+    }
+    else if(!strcmp(s1,"use_tree="))
+      use_tree=atoi(s2);
+    else if(!strcmp(s1,"n_jk_regions="))
+      n_jk=atoi(s2);
+    else if(!strcmp(s1,"mpi_domains="))
+      mpi_domains=atoi(s2);
     else
       fprintf(stderr,"CUTE: Unknown parameter %s\n",s1);
   }
@@ -1164,110 +1917,568 @@ void read_run_params(char *fname)
   print_info("\n");
 }
 
-Catalog *read_catalog(char *fname,np_t *sum_w,np_t *sum_w2)
+static void sum_catalog_weights(Catalog *cat,np_t *sum_w,np_t *sum_w2)
 {
   //////
-  // Creates catalog from file fname
-  FILE *fd;
-  int ng;
+  // Computes the sum of weights and of squared weights of cat
+  // (of the whole catalog with MPI domains) and prints them
   int ii;
   double z_mean=0;
-  Catalog *cat = malloc(sizeof(Catalog));
 
-  print_info("*** Reading catalog ");
-#ifdef _VERBOSE
-  print_info("from file %s",fname);
+  *sum_w=0;
+  *sum_w2=0;
+  for(ii=0;ii<cat->np;ii++) {
+    z_mean+=cat->red[ii];
+#ifdef _WITH_WEIGHTS
+    (*sum_w)+=cat->weight[ii];
+    (*sum_w2)+=cat->weight[ii]*cat->weight[ii];
+#else //_WITH_WEIGHTS
+    (*sum_w)++;
+    (*sum_w2)++;
+#endif //_WITH_WEIGHTS
+  }
+#ifdef _HAVE_MPI
+  if(mpi_domains) {
+    MPI_Allreduce(MPI_IN_PLACE,sum_w,1,NP_T_MPI,MPI_SUM,MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE,sum_w2,1,NP_T_MPI,MPI_SUM,MPI_COMM_WORLD);
+  }
+#endif //_HAVE_MPI
+#ifdef _CUTE_AS_PYTHON_MODULE
+  cat->sum_w = *sum_w;
+  cat->sum_w2 = *sum_w2;
 #endif
+
+  z_mean/=MAX(cat->np,1);
+#ifdef _VERBOSE
+  print_info("  The average redshift is %lf\n",z_mean);
+#endif //_VERBOSE
+
+#ifdef _WITH_WEIGHTS
+  print_info("  Effective n. of particles: %lf\n",(*sum_w));
+#else //_WITH_WEIGHTS
+  print_info("  Total n. of particles read: %d\n",(*sum_w));
+#endif //_WITH_WEIGHTS
+
   print_info("\n");
+}
+
+/////////////////////////
+// Binary catalogs
+// A 64-byte header (magic, number of objects and flags for the
+// optional columns) followed by the columns red, cth and phi
+// (in the internal units: redshift, cos(theta) and phi in
+// radians), then the weights and the jackknife regions if
+// present. Doubles and ints are stored in native endianness.
+#define CATALOG_BIN_MAGIC "CUTECAT1"
+#define CATALOG_BIN_HSIZE 64
+
+typedef struct {
+  char magic[8];
+  long long np;
+  int has_weight;
+  int has_region;
+} CatalogBinHeader;
 
-  //Open file and count lines
-  fd=fopen(fname,"r");
+static int is_catalog_bin(char *fname)
+{
+  //////
+  // Checks whether fname starts with the binary catalog magic.
+  // Only regular files are checked, so that nothing is consumed
+  // from pipes
+  char magic[8];
+  struct stat st;
+  FILE *fd;
+  if((stat(fname,&st)<0)||(!S_ISREG(st.st_mode)))
+    return 0;
+  fd=fopen(fname,"rb");
   if(fd==NULL) error_open_file(fname);
-  if(n_objects==-1) 
-    ng=linecount(fd);
-  else
+  if(fread(magic,1,8,fd)!=8) {
+    fclose(fd);
+    return 0;
+  }
+  fclose(fd);
+
+  return !memcmp(magic,CATALOG_BIN_MAGIC,8);
+}
+
+static void *copy_slice(char *p,int i0,int n,size_t size)
+{
+  void *out=my_malloc(MAX(n,1)*size);
+  memcpy(out,p+i0*size,n*size);
+  return out;
+}
+
+static Catalog *read_catalog_bin(char *fname,np_t *sum_w,np_t *sum_w2)
+{
+  //////
+  // Maps binary catalog fname into memory. The mapping is
+  // private, so that the catalog can still be modified in place
+  // without touching the file. With MPI domains each node only
+  // copies its share of the objects.
+  int fd,ii,ng,ig_0,ig_f;
+  struct stat st;
+  size_t size_expected;
+  CatalogBinHeader head;
+  char *map,*col;
+  Catalog *cat=my_malloc(sizeof(Catalog));
+
+  fd=open(fname,O_RDONLY);
+  if(fd<0) error_open_file(fname);
+  if((fstat(fd,&st)<0)||(st.st_size<CATALOG_BIN_HSIZE)) {
+    fprintf(stderr,"CUTE: error reading binary catalog %s\n",fname);
+    exit(1);
+  }
+  map=mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(map==MAP_FAILED) {
+    fprintf(stderr,"CUTE: couldn't map binary catalog %s\n",fname);
+    exit(1);
+  }
+
+  memcpy(&head,map,sizeof(CatalogBinHeader));
+  size_expected=CATALOG_BIN_HSIZE+head.np*(3+(head.has_weight!=0))*sizeof(double);
+  if(head.has_region)
+    size_expected+=head.np*sizeof(int);
+  if((head.np<0)||(head.np>INT_MAX)||(size_expected!=(size_t)st.st_size)) {
+    fprintf(stderr,"CUTE: corrupted binary catalog %s\n",fname);
+    exit(1);
+  }
+  if((n_jk>0)&&(!head.has_region)) {
+    fprintf(stderr,"CUTE: binary catalog %s has no jackknife regions\n",fname);
+    exit(1);
+  }
+  print_info("  Binary catalog with %lld objects\n",head.np);
+
+  if(n_objects==-1)
+    ng=(int)(head.np);
+  else {
+    if(n_objects>head.np)
+      error_read_line(fname,(int)(head.np)+1);
     ng=n_objects;
-  rewind(fd);
-  print_info("  %d lines in the catalog\n",ng);
+  }
+  if(mpi_domains)
+    share_iters(ng,&ig_0,&ig_f);
+  else {
+    ig_0=0;
+    ig_f=ng;
+  }
 
-  //Allocate catalog memory
-  cat->np=ng;
-  cat->red=(double *)my_malloc(cat->np*sizeof(double));
-  cat->cth=(double *)my_malloc(cat->np*sizeof(double));
-  cat->phi=(double *)my_malloc(cat->np*sizeof(double));
+  cat->np=ig_f-ig_0;
+  col=map+CATALOG_BIN_HSIZE;
+  if(mpi_domains) {
+    cat->red=copy_slice(col,ig_0,cat->np,sizeof(double));
+    col+=head.np*sizeof(double);
+    cat->cth=copy_slice(col,ig_0,cat->np,sizeof(double));
+    col+=head.np*sizeof(double);
+    cat->phi=copy_slice(col,ig_0,cat->np,sizeof(double));
+    col+=head.np*sizeof(double);
 #ifdef _WITH_WEIGHTS
-  cat->weight=(double *)my_malloc(cat->np*sizeof(double));
+    if(head.has_weight)
+      cat->weight=copy_slice(col,ig_0,cat->np,sizeof(double));
+#endif //_WITH_WEIGHTS
+    if(head.has_weight)
+      col+=head.np*sizeof(double);
+    if(n_jk>0)
+      cat->region=copy_slice(col,ig_0,cat->np,sizeof(int));
+    else
+      cat->region=NULL;
+    munmap(map,st.st_size);
+    cat->map=NULL;
+    cat->map_size=0;
+  }
+  else {
+    cat->red=(double *)col;
+    col+=head.np*sizeof(double);
+    cat->cth=(double *)col;
+    col+=head.np*sizeof(double);
+    cat->phi=(double *)col;
+    col+=head.np*sizeof(double);
+#ifdef _WITH_WEIGHTS
+    if(head.has_weight)
+      cat->weight=(double *)col;
+#endif //_WITH_WEIGHTS
+    if(head.has_weight)
+      col+=head.np*sizeof(double);
+    if(n_jk>0)
+      cat->region=(int *)col;
+    else
+      cat->region=NULL;
+    cat->map=map;
+    cat->map_size=st.st_size;
+  }
+#ifdef _WITH_WEIGHTS
+  if(!head.has_weight) {
+    cat->weight=(double *)my_malloc(MAX(cat->np,1)*sizeof(double));
+    for(ii=0;ii<cat->np;ii++)
+      cat->weight[ii]=1;
+  }
 #endif //_WITH_WEIGHTS
 
-  rewind(fd);
-  //Read galaxies in mask
-  int i_dat=0;
-  *sum_w=0;
-  *sum_w2=0;
-  for(ii=0;ii<ng;ii++) {
-    double zz,cth,phi,weight;
-    int st=read_line(fd,&zz,&cth,&phi,&weight);
+  for(ii=0;ii<cat->np;ii++) {
+    if((cat->red[ii]<0)||(cat->cth[ii]>1)||(cat->cth[ii]<-1)||
+       ((cat->region!=NULL)&&((cat->region[ii]<0)||(cat->region[ii]>=n_jk)))) {
+      fprintf(stderr,"CUTE: wrong object %d in binary catalog %s\n",
+	      ig_0+ii+1,fname);
+      exit(1);
+    }
+  }
 
-    if(st) error_read_line(fname,ii+1);
-    z_mean+=zz;
+  sum_catalog_weights(cat,sum_w,sum_w2);
+  return cat;
+}
 
-    if(zz<0) {
-      fprintf(stderr,"Wrong redshift = %lf %d\n",zz,ii+1);
+void write_catalog_bin(char *fname,Catalog *cat)
+{
+  //////
+  // Writes cat into fname as a binary catalog
+  FILE *fo;
+  char hbuf[CATALOG_BIN_HSIZE];
+  CatalogBinHeader head;
+  size_t np=cat->np;
+  int st=0;
+
+  memset(hbuf,0,CATALOG_BIN_HSIZE);
+  memset(&head,0,sizeof(CatalogBinHeader));
+  memcpy(head.magic,CATALOG_BIN_MAGIC,8);
+  head.np=cat->np;
+#ifdef _WITH_WEIGHTS
+  head.has_weight=1;
+#endif //_WITH_WEIGHTS
+  head.has_region=(cat->region!=NULL);
+  memcpy(hbuf,&head,sizeof(CatalogBinHeader));
+
+  fo=fopen(fname,"wb");
+  if(fo==NULL) error_open_file(fname);
+  st|=(fwrite(hbuf,1,CATALOG_BIN_HSIZE,fo)!=CATALOG_BIN_HSIZE);
+  st|=(fwrite(cat->red,sizeof(double),np,fo)!=np);
+  st|=(fwrite(cat->cth,sizeof(double),np,fo)!=np);
+  st|=(fwrite(cat->phi,sizeof(double),np,fo)!=np);
+#ifdef _WITH_WEIGHTS
+  st|=(fwrite(cat->weight,sizeof(double),np,fo)!=np);
+#endif //_WITH_WEIGHTS
+  if(cat->region!=NULL)
+    st|=(fwrite(cat->region,sizeof(int),np,fo)!=np);
+  st|=fclose(fo);
+  if(st) {
+    fprintf(stderr,"CUTE: error writing binary catalog %s\n",fname);
+    exit(1);
+  }
+}
+
+/////////////////////////
+// HDF5 catalogs
+// input_format 4 reads one-dimensional datasets with the redshift,
+// declination and right ascension (in degrees) of each object,
+// followed by its weight and jackknife region. Their names are
+// given by hdf5_datasets as a comma-separated list. The weights
+// are optional (taken as 1 if absent or "none") and the regions
+// are only read if n_jk>0.
+#ifdef _HAVE_HDF5
+//#rows read at once from each dataset
+#define HDF5_CHUNK 1048576
+
+static hid_t open_hdf5_dataset(hid_t file,char *fname,char *dname,
+			       hsize_t *n_rows)
+{
+  //////
+  // Opens one-dimensional dataset dname and gets its length
+  hid_t dset,space;
+  int rank;
+
+  dset=H5Dopen2(file,dname,H5P_DEFAULT);
+  if(dset<0) {
+    fprintf(stderr,"CUTE: can't find dataset %s in %s\n",dname,fname);
+    exit(1);
+  }
+  space=H5Dget_space(dset);
+  rank=H5Sget_simple_extent_ndims(space);
+  if(rank!=1) {
+    fprintf(stderr,"CUTE: dataset %s in %s should be one-dimensional\n",
+	    dname,fname);
+    exit(1);
+  }
+  H5Sget_simple_extent_dims(space,n_rows,NULL);
+  H5Sclose(space);
+
+  return dset;
+}
+
+static void read_hdf5_rows(hid_t dset,hid_t type,hsize_t i0,hsize_t n,
+			   void *buf,char *fname)
+{
+  //////
+  // Reads rows i0 to i0+n-1 of dset into buf, converting
+  // them to type, through a hyperslab selection
+  hid_t fspace,mspace;
+  herr_t st;
+
+  if(n==0) return;
+  fspace=H5Dget_space(dset);
+  H5Sselect_hyperslab(fspace,H5S_SELECT_SET,&i0,NULL,&n,NULL);
+  mspace=H5Screate_simple(1,&n,NULL);
+  st=H5Dread(dset,type,mspace,fspace,H5P_DEFAULT,buf);
+  H5Sclose(mspace);
+  H5Sclose(fspace);
+  if(st<0) {
+    fprintf(stderr,"CUTE: error reading HDF5 catalog %s\n",fname);
+    exit(1);
+  }
+}
+
+static Catalog *read_catalog_hdf5(char *fname,np_t *sum_w,np_t *sum_w2)
+{
+  //////
+  // Reads HDF5 catalog fname in chunks of HDF5_CHUNK rows.
+  // With MPI domains each node only reads its share of the rows.
+  char names[5][256],list[256];
+  char *tok,*saveptr;
+  int ii,n_names=0,ng,ig_0,ig_f,i_first=-1;
+  hid_t file,dset[5];
+  hsize_t n_rows=0;
+  double *dec,*ra;
+  Catalog *cat=my_malloc(sizeof(Catalog));
+
+  //Dataset names
+  sprintf(list,"%s",hdf5_datasets);
+  tok=strtok_r(list,",",&saveptr);
+  while((tok!=NULL)&&(n_names<5)) {
+    sprintf(names[n_names],"%s",tok);
+    n_names++;
+    tok=strtok_r(NULL,",",&saveptr);
+  }
+  for(ii=n_names;ii<5;ii++)
+    sprintf(names[ii],"none");
+  if(n_names<3) {
+    fprintf(stderr,"CUTE: hdf5_datasets needs at least redshift, dec and ra\n");
+    exit(1);
+  }
+  for(ii=0;ii<3;ii++) {
+    if(!strcmp(names[ii],"none")) {
+      fprintf(stderr,"CUTE: hdf5_datasets can't skip redshift, dec or ra\n");
+      exit(1);
+    }
+  }
+  if((n_jk>0)&&(!strcmp(names[4],"none"))) {
+    fprintf(stderr,"CUTE: hdf5_datasets has no jackknife regions\n");
+    exit(1);
+  }
+
+  file=H5Fopen(fname,H5F_ACC_RDONLY,H5P_DEFAULT);
+  if(file<0) error_open_file(fname);
+  for(ii=0;ii<5;ii++) {
+    hsize_t n;
+    dset[ii]=-1;
+    if(!strcmp(names[ii],"none"))
+      continue;
+#ifndef _WITH_WEIGHTS
+    if(ii==3) continue;
+#endif //_WITH_WEIGHTS
+    if((ii==4)&&(n_jk<=0)) continue;
+    dset[ii]=open_hdf5_dataset(file,fname,names[ii],&n);
+    if(i_first<0) {
+      i_first=ii;
+      n_rows=n;
+    }
+    else if(n!=n_rows) {
+      fprintf(stderr,"CUTE: datasets %s and %s in %s have different lengths\n",
+	      names[i_first],names[ii],fname);
       exit(1);
     }
-    if((cth>1)||(cth<-1)) {
-      fprintf(stderr,"Wrong cos(theta) = %lf %d\n",cth,ii+1);
+  }
+  print_info("  %llu rows in the catalog\n",(unsigned long long)n_rows);
+
+  if(n_objects==-1) {
+    if(n_rows>INT_MAX) {
+      fprintf(stderr,"CUTE: too many rows in %s\n",fname);
       exit(1);
     }
-    phi=wrap_phi(phi);
+    ng=(int)n_rows;
+  }
+  else {
+    if(n_objects>n_rows)
+      error_read_line(fname,(int)(n_rows+1));
+    ng=n_objects;
+  }
+  if(mpi_domains)
+    share_iters(ng,&ig_0,&ig_f);
+  else {
+    ig_0=0;
+    ig_f=ng;
+  }
 
-    cat->red[i_dat]=zz;
-    cat->cth[i_dat]=cth;
-    cat->phi[i_dat]=phi;
+  //Allocate catalog memory
+  cat->np=ig_f-ig_0;
+  cat->red=(double *)my_malloc(MAX(cat->np,1)*sizeof(double));
+  cat->cth=(double *)my_malloc(MAX(cat->np,1)*sizeof(double));
+  cat->phi=(double *)my_malloc(MAX(cat->np,1)*sizeof(double));
 #ifdef _WITH_WEIGHTS
-    cat->weight[i_dat]=weight;
-    (*sum_w)+=weight;
-    (*sum_w2)+=weight*weight;
-#else //_WITH_WEIGHTS
-    (*sum_w)++;
-    (*sum_w2)++;
+  cat->weight=(double *)my_malloc(MAX(cat->np,1)*sizeof(double));
+#endif //_WITH_WEIGHTS
+  if(n_jk>0)
+    cat->region=(int *)my_malloc(MAX(cat->np,1)*sizeof(int));
+  else
+    cat->region=NULL;
+  cat->map=NULL;
+  cat->map_size=0;
+
+  //Read in chunks. Redshifts, weights and regions go straight
+  //into the catalog, while angles are converted chunk by chunk
+  dec=(double *)my_malloc(MIN(MAX(cat->np,1),HDF5_CHUNK)*sizeof(double));
+  ra=(double *)my_malloc(MIN(MAX(cat->np,1),HDF5_CHUNK)*sizeof(double));
+  for(ii=0;ii<cat->np;ii+=HDF5_CHUNK) {
+    int jj,n=MIN(HDF5_CHUNK,cat->np-ii);
+    int i_bad=n;
+
+    read_hdf5_rows(dset[0],H5T_NATIVE_DOUBLE,ig_0+ii,n,&(cat->red[ii]),fname);
+    read_hdf5_rows(dset[1],H5T_NATIVE_DOUBLE,ig_0+ii,n,dec,fname);
+    read_hdf5_rows(dset[2],H5T_NATIVE_DOUBLE,ig_0+ii,n,ra,fname);
+#ifdef _WITH_WEIGHTS
+    if(dset[3]>=0)
+      read_hdf5_rows(dset[3],H5T_NATIVE_DOUBLE,ig_0+ii,n,&(cat->weight[ii]),fname);
+    else {
+      for(jj=0;jj<n;jj++)
+	cat->weight[ii+jj]=1;
+    }
 #endif //_WITH_WEIGHTS
-    i_dat++;
+    if(cat->region!=NULL)
+      read_hdf5_rows(dset[4],H5T_NATIVE_INT,ig_0+ii,n,&(cat->region[ii]),fname);
+
+#pragma omp parallel for default(none)			\
+  shared(cat,ii,n,dec,ra,n_jk) reduction(min:i_bad)
+    for(jj=0;jj<n;jj++) {
+      int st=get_position(1,cat->red[ii+jj],dec[jj],ra[jj],&(cat->red[ii+jj]),
+			  &(cat->cth[ii+jj]),&(cat->phi[ii+jj]));
+      if((cat->region!=NULL)&&
+	 ((cat->region[ii+jj]<0)||(cat->region[ii+jj]>=n_jk)))
+	st=1;
+      if(st)
+	i_bad=MIN(i_bad,jj);
+    }
+    if(i_bad<n) {
+      fprintf(stderr,"CUTE: wrong object %d in HDF5 catalog %s\n",
+	      ig_0+ii+i_bad+1,fname);
+      exit(1);
+    }
   }
-#ifdef _CUTE_AS_PYTHON_MODULE
-  cat->sum_w = *sum_w;
-  cat->sum_w2 = *sum_w2;
-#endif
-  fclose(fd);
+  free(dec);
+  free(ra);
 
-  if(i_dat!=ng) {
-    fprintf(stderr,"CUTE: Something went wrong !!\n");
-    exit(1);
+  for(ii=0;ii<5;ii++) {
+    if(dset[ii]>=0)
+      H5Dclose(dset[ii]);
   }
+  H5Fclose(file);
 
-  z_mean/=ng;
+  sum_catalog_weights(cat,sum_w,sum_w2);
+  return cat;
+}
+#endif //_HAVE_HDF5
+
+Catalog *read_catalog(char *fname,np_t *sum_w,np_t *sum_w2)
+{
+  //////
+  // Creates catalog from file fname. With MPI domains each
+  // node only keeps its share of the lines (the sums of
+  // weights are still those of the whole catalog). Binary
+  // catalogs are recognized by their magic and mapped instead,
+  // and input_format 4 reads HDF5 catalogs
+  AsciiFile *af;
+  int ng,ig_0,ig_f;
+  Catalog *cat;
+
+  print_info("*** Reading catalog ");
 #ifdef _VERBOSE
-  print_info("  The average redshift is %lf\n",z_mean);
-#endif //_VERBOSE
+  print_info("from file %s",fname);
+#endif
+  print_info("\n");
+
+  if(is_catalog_bin(fname))
+    return read_catalog_bin(fname,sum_w,sum_w2);
+#ifdef _HAVE_HDF5
+  if(input_format==4)
+    return read_catalog_hdf5(fname,sum_w,sum_w2);
+#endif //_HAVE_HDF5
+  cat=my_malloc(sizeof(Catalog));
+
+  //Load file and count lines
+  af=open_ascii(fname);
+  if(n_objects==-1) {
+    if(af->n_lines>INT_MAX) {
+      fprintf(stderr,"CUTE: too many lines in %s\n",fname);
+      exit(1);
+    }
+    ng=(int)(af->n_lines);
+  }
+  else {
+    if(n_objects>af->n_lines)
+      error_read_line(fname,(int)(af->n_lines+1));
+    ng=n_objects;
+  }
+  print_info("  %d lines in the catalog\n",ng);
+  if(mpi_domains)
+    share_iters(ng,&ig_0,&ig_f);
+  else {
+    ig_0=0;
+    ig_f=ng;
+  }
 
+  //Allocate catalog memory
+  cat->np=ig_f-ig_0;
+  cat->red=(double *)my_malloc(cat->np*sizeof(double));
+  cat->cth=(double *)my_malloc(cat->np*sizeof(double));
+  cat->phi=(double *)my_malloc(cat->np*sizeof(double));
 #ifdef _WITH_WEIGHTS
-  print_info("  Effective n. of particles: %lf\n",(*sum_w));
+  cat->weight=(double *)my_malloc(cat->np*sizeof(double));
+#endif //_WITH_WEIGHTS
+  if(n_jk>0)
+    cat->region=(int *)my_malloc(cat->np*sizeof(int));
+  else
+    cat->region=NULL;
+  cat->map=NULL;
+  cat->map_size=0;
+
+  //Read galaxies in mask
+#ifdef _WITH_WEIGHTS
+  read_ascii_catalog(af,fname,ig_0,ig_f,cat->red,cat->cth,cat->phi,
+		     cat->weight,cat->region);
 #else //_WITH_WEIGHTS
-  print_info("  Total n. of particles read: %d\n",(*sum_w));
+  read_ascii_catalog(af,fname,ig_0,ig_f,cat->red,cat->cth,cat->phi,
+		     NULL,cat->region);
 #endif //_WITH_WEIGHTS
+  close_ascii(af);
 
-  print_info("\n");
+  sum_catalog_weights(cat,sum_w,sum_w2);
   return cat;
 }
 
+void convert_catalog(char *fname_in,char *fname_out)
+{
+  //////
+  // Reads catalog fname_in (with the current input_format,
+  // n_objects and n_jk) and writes it into fname_out as a
+  // binary catalog
+  np_t sum_w,sum_w2;
+  int mpi_domains_save=mpi_domains;
+  Catalog *cat;
+
+  mpi_domains=0;
+  cat=read_catalog(fname_in,&sum_w,&sum_w2);
+  mpi_domains=mpi_domains_save;
+  print_info("*** Writing binary catalog %s\n",fname_out);
+  if(NodeThis==0)
+    write_catalog_bin(fname_out,cat);
+  free_Catalog(cat);
+}
+
 Catalog_f read_catalog_f(char *fname,int *np)
 {
   //////
   // Creates catalog from file fname
-  FILE *fd;
+  AsciiFile *af;
   int ng;
   int ii;
   double z_mean=0;
+  double *red,*cth,*phi;
   Catalog_f cat;
 
   print_info("*** Reading catalog ");
@@ -1276,46 +2487,44 @@ Catalog_f read_catalog_f(char *fname,int *np)
 #endif
   print_info("\n");
 
-  //Open file and count lines
-  fd=fopen(fname,"r");
-  if(fd==NULL) error_open_file(fname);
+  //Load file and count lines
+  af=open_ascii(fname);
   if(n_objects==-1) 
-    ng=linecount(fd);
-  else
+    ng=(int)(af->n_lines);
+  else {
+    if(n_objects>af->n_lines)
+      error_read_line(fname,(int)(af->n_lines+1));
     ng=n_objects;
+  }
   *np=ng;
-  rewind(fd);
 
   //Allocate catalog memory
   cat.np=ng;
   cat.pos=(float *)my_malloc(3*cat.np*sizeof(float));
 
-  rewind(fd);
   //Read galaxies in mask
-  int i_dat=0;
+  red=(double *)my_malloc(MAX(ng,1)*sizeof(double));
+  cth=(double *)my_malloc(MAX(ng,1)*sizeof(double));
+  phi=(double *)my_malloc(MAX(ng,1)*sizeof(double));
+  read_ascii_catalog(af,fname,0,ng,red,cth,phi,NULL,NULL);
+  close_ascii(af);
   for(ii=0;ii<ng;ii++) {
-    double zz,cth,phi,rr,sth,dum_weight;
-    int st=read_line(fd,&zz,&cth,&phi,&dum_weight);
-    if(st) error_read_line(fname,ii+1);
-    z_mean+=zz;
+    double rr,sth;
+    z_mean+=red[ii];
 
-    sth=sqrt(1-cth*cth);
+    sth=sqrt(1-cth[ii]*cth[ii]);
     if(corr_type!=1)
-      rr=z2r(zz);
+      rr=z2r(red[ii]);
     else
       rr=1;
 
-    cat.pos[3*i_dat]=(float)(rr*sth*cos(phi));
-    cat.pos[3*i_dat+1]=(float)(rr*sth*sin(phi));
-    cat.pos[3*i_dat+2]=(float)(rr*cth);
-    i_dat++;
-  }
-  fclose(fd);
-
-  if(i_dat!=ng) {
-    fprintf(stderr,"CUTE: Something went wrong !!\n");
-    exit(1);
+    cat.pos[3*ii]=(float)(rr*sth*cos(phi[ii]));
+    cat.pos[3*ii+1]=(float)(rr*sth*sin(phi[ii]));
+    cat.pos[3*ii+2]=(float)(rr*cth[ii]);
   }
+  free(red);
+  free(cth);
+  free(phi);
 
   z_mean/=ng;
 #ifdef _VERBOSE
@@ -1365,6 +2574,9 @@ void set_random_filename2(char *s){
 void set_input_format(int i){
   input_format=i;
 }
+void set_hdf5_datasets(char *s){
+  snprintf(hdf5_datasets,sizeof(hdf5_datasets),"%s",s);
+}
 void set_output_filename(char *s){
   sprintf(fnameOut,"%s",s);
 }
@@ -1427,6 +2639,35 @@ void set_n_pix_sph(int i){
   n_side_cth=i;
   n_side_phi=2*n_side_cth;
 }
+void set_pm_levels(int i){
+  pm_levels=i;
+}
+void set_box_order(char *s){
+  if(!strcmp(s,"none")) box_order=0;
+  else if(!strcmp(s,"morton")) box_order=1;
+  else if(!strcmp(s,"hilbert")) box_order=2;
+  else {
+    fprintf(stderr,"CUTE: wrong box order %s.",s);
+    fprintf(stderr," Possible orders are \"none\", \"morton\" and \"hilbert\".\n");
+  }
+}
+void set_pixelization(char *s){
+  if(!strcmp(s,"grid")) pixelization=0;
+  else if(!strcmp(s,"healpix")) pixelization=1;
+  else {
+    fprintf(stderr,"CUTE: wrong pixelization %s.",s);
+    fprintf(stderr," Possible pixelizations are \"grid\" and \"healpix\".\n");
+  }
+}
+void set_use_tree(int i){
+  use_tree=i;
+}
+void set_n_jk_regions(int i){
+  n_jk=i;
+}
+void set_mpi_domains(int i){
+  mpi_domains=i;
+}
 void set_reuse_randoms(int i){
   reuse_ran = i;
 }
@@ -1442,6 +2683,10 @@ void set_mask_filename(char *s){
 void set_z_dist_filename(char *s){
   sprintf(fnamedNdz,"%s",s);
 }
+void set_rr_cache_dir(char *s){
+  if(snprintf(fnameRRCache,sizeof(fnameRRCache),"%s",s)>=(int)sizeof(fnameRRCache))
+    fprintf(stderr,"CUTE: rr_cache_dir is too long, truncated to %s\n",fnameRRCache);
+}
 void set_np_rand_fact(int i){
   fact_n_rand = i;
 }
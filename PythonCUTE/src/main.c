@@ -34,35 +34,22 @@
 #include "define.h"
 #include "common.h"
 
-void read_dr_catalogs(Catalog **cat_d,Catalog **cat_r,
-    np_t *sum_wd,np_t *sum_wd2,
-    np_t *sum_wr,np_t *sum_wr2)
+static Catalog *read_ran_catalog(int np_dat,np_t *sum_wr,np_t *sum_wr2)
 {
   //////
-  // Reads or creates random and data catalogs
-  Catalog *cat_dat, *cat_ran;
+  // Reads or creates the random catalog for np_dat data objects
+  Catalog *cat_ran;
 
-#ifdef _CUTE_AS_PYTHON_MODULE
-  if(global_galaxy_catalog == NULL){
-    cat_dat=read_catalog(fnameData,sum_wd,sum_wd2);
-  } else {
-    cat_dat=global_galaxy_catalog;
-    *sum_wd = cat_dat->sum_w;
-    *sum_wd2 = cat_dat->sum_w2;
-  }
-#else
-  cat_dat=read_catalog(fnameData,sum_wd,sum_wd2);
-#endif
   if(gen_ran) {
     read_mask();
     if(corr_type!=1)
       read_red_dist();
     timer(0);
-    cat_ran=mk_random_cat(fact_n_rand*(cat_dat->np));
+    cat_ran=mk_random_cat(fact_n_rand*np_dat);
     timer(1);
     end_mask();
-    *sum_wr=(np_t)(fact_n_rand*(cat_dat->np));
-    *sum_wr2=(np_t)(fact_n_rand*(cat_dat->np));
+    *sum_wr=(np_t)(fact_n_rand*np_dat);
+    *sum_wr2=(np_t)(fact_n_rand*np_dat);
   }
   else{
 #ifdef _CUTE_AS_PYTHON_MODULE
@@ -78,6 +65,30 @@ void read_dr_catalogs(Catalog **cat_d,Catalog **cat_r,
 #endif
   }
 
+  return cat_ran;
+}
+
+void read_dr_catalogs(Catalog **cat_d,Catalog **cat_r,
+    np_t *sum_wd,np_t *sum_wd2,
+    np_t *sum_wr,np_t *sum_wr2)
+{
+  //////
+  // Reads or creates random and data catalogs
+  Catalog *cat_dat, *cat_ran;
+
+#ifdef _CUTE_AS_PYTHON_MODULE
+  if(global_galaxy_catalog == NULL){
+    cat_dat=read_catalog(fnameData,sum_wd,sum_wd2);
+  } else {
+    cat_dat=global_galaxy_catalog;
+    *sum_wd = cat_dat->sum_w;
+    *sum_wd2 = cat_dat->sum_w2;
+  }
+#else
+  cat_dat=read_catalog(fnameData,sum_wd,sum_wd2);
+#endif
+  cat_ran=read_ran_catalog(cat_dat->np,sum_wr,sum_wr2);
+
 #ifdef _DEBUG
   write_Catalog(cat_d,"debug_DatCat.dat");
   write_Catalog(cat_r,"debug_RanCat.dat");
@@ -87,6 +98,31 @@ void read_dr_catalogs(Catalog **cat_d,Catalog **cat_r,
   *cat_r=cat_ran;
 }
 
+static void get_jk_sums(Catalog *cat_dat,Catalog *cat_ran,
+    np_t **sums_wd,np_t **sums_wr)
+{
+  //////
+  // Per-region sums of weights of data and randoms
+  // for jackknife runs (NULL if n_jk==0)
+  *sums_wd=NULL;
+  *sums_wr=NULL;
+  if(n_jk<=0)
+    return;
+
+  if((cat_dat->region==NULL)||(cat_ran->region==NULL)) {
+    fprintf(stderr,"CUTE: jackknife regions were not provided for all catalogs\n");
+    exit(1);
+  }
+  *sums_wd=mk_region_sums(cat_dat);
+  *sums_wr=mk_region_sums(cat_ran);
+#ifdef _HAVE_MPI
+  if(mpi_domains) {
+    MPI_Allreduce(MPI_IN_PLACE,*sums_wd,2*n_jk,NP_T_MPI,MPI_SUM,MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE,*sums_wr,2*n_jk,NP_T_MPI,MPI_SUM,MPI_COMM_WORLD);
+  }
+#endif //_HAVE_MPI
+}
+
 void read_ddrr_catalogs(Catalog **cat_d1,Catalog **cat_d2,Catalog **cat_r1,Catalog **cat_r2,
     np_t *sum_wd1,np_t *sum_wd2,np_t *sum_wr1,np_t *sum_wr2,np_t *junk)
 {
@@ -182,6 +218,7 @@ void run_angular_cross_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,5);
@@ -207,9 +244,11 @@ void run_angular_cross_corr_bf(void)
   timer(0);
   auto_angular_cross_bf(nfull_dat,indices_dat,pixrad_dat,DD);
   timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_angular_cross_bf(nfull_ran,indices_ran,pixrad_ran,RR);
-  timer(2);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    auto_angular_cross_bf(nfull_ran,indices_ran,pixrad_ran,RR);
+    timer(2);
+  }
   print_info(" - Cross-correlating \n");
   cross_angular_cross_bf(nfull_dat,indices_dat,
       pixrad_dat,pixrad_ran,DR);
@@ -238,7 +277,7 @@ void run_angular_cross_corr_pm(void)
 
   Cell2D *cells_dat,*cells_ran,*cells_dat_total,*cells_ran_total;
   int *indices_dat,*indices_ran;
-  int nfull_dat,nfull_ran;
+  int nfull_dat,nfull_ran,level;
 
   histo_t *DD=(histo_t *)my_calloc(nb_red*(nb_red+1)*nb_theta/2,sizeof(histo_t));
   histo_t *DR=(histo_t *)my_calloc(nb_red*(nb_red+1)*nb_theta/2,sizeof(histo_t));
@@ -274,41 +313,56 @@ void run_angular_cross_corr_pm(void)
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,1);
-  cells_dat=mk_Cells2D_many_from_Catalog(cat_dat,&indices_dat,&cells_dat_total,&nfull_dat);
+  print_info("\n");
+
+  //Each resolution level is boxed and correlated in turn
+  print_info("*** Correlating \n");
+  timer(0);
+  for(level=0;level<pm_levels;level++) {
+    int ith_lo,ith_hi;
+    set_2D_level(level);
+    if(!get_pm_level_bins(level,&ith_lo,&ith_hi))
+      continue;
+    if(pm_levels>1) {
+      print_info(" - Level %d: bins %d to %d with %d pixels\n",
+          level,ith_lo,ith_hi-1,n_boxes2D);
+    }
+    cells_dat=mk_Cells2D_many_from_Catalog(cat_dat,&indices_dat,&cells_dat_total,&nfull_dat);
+    free(indices_dat);
+    cells_ran=mk_Cells2D_many_from_Catalog(cat_ran,&indices_ran,&cells_ran_total,&nfull_ran);
+    free(indices_ran);
+
+#ifdef _DEBUG
+    if(level==0) {
+      write_Cells2D(n_boxes2D,cells_dat_total,"debug_Cell2DDat.dat");
+      write_Cells2D(n_boxes2D,cells_ran_total,"debug_Cell2DRan.dat");
+    }
+#endif //_DEBUG
+
+    corr_angular_cross_pm(cells_dat,cells_dat_total,
+        cells_ran,cells_ran_total,level,
+        DD,DR,RR);
+    free_Cells2D(nb_red*n_boxes2D,cells_dat);
+    free_Cells2D(nb_red*n_boxes2D,cells_ran);
+    free_Cells2D(n_boxes2D,cells_dat_total);
+    free_Cells2D(n_boxes2D,cells_ran_total);
+  }
+  set_2D_level(0);
+  timer(1);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_galaxy_catalog == NULL)
 #endif
     free_Catalog(cat_dat);
-  free(indices_dat);
-  cells_ran=mk_Cells2D_many_from_Catalog(cat_ran,&indices_ran,&cells_ran_total,&nfull_ran);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_random_catalog == NULL)
 #endif
     free_Catalog(cat_ran);
-  free(indices_ran);
-  print_info("\n");
-
-#ifdef _DEBUG
-  write_Cells2D(n_boxes2D,cells_dat_total,"debug_Cell2DDat.dat");
-  write_Cells2D(n_boxes2D,cells_ran_total,"debug_Cell2DRan.dat");
-#endif //_DEBUG
-
-  print_info("*** Correlating \n");
-  timer(0);
-  corr_angular_cross_pm(cells_dat,cells_dat_total,
-      cells_ran,cells_ran_total,
-      DD,DR,RR);
-  timer(1);
 
   print_info("\n");
   write_CF(fnameOut,DD,DR,RR,
       sum_wd,sum_wd2,sum_wr,sum_wr2);
 
   print_info("*** Cleaning up\n");
-  free_Cells2D(nb_red*n_boxes2D,cells_dat);
-  free_Cells2D(nb_red*n_boxes2D,cells_ran);
-  free_Cells2D(n_boxes2D,cells_dat_total);
-  free_Cells2D(n_boxes2D,cells_ran_total);
   free(DD);
   free(DR);
   free(RR);
@@ -362,6 +416,7 @@ void run_full_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,5);
@@ -387,9 +442,11 @@ void run_full_corr_bf(void)
   timer(0);
   auto_full_bf(nfull_dat,indices_dat,pixrad_dat,DD);
   timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_full_bf(nfull_ran,indices_ran,pixrad_ran,RR);
-  timer(2);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    auto_full_bf(nfull_ran,indices_ran,pixrad_ran,RR);
+    timer(2);
+  }
   print_info(" - Cross-correlating \n");
   cross_full_bf(nfull_dat,indices_dat,
       pixrad_dat,pixrad_ran,DR);
@@ -519,6 +576,7 @@ void run_radial_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,0);
@@ -544,9 +602,11 @@ void run_radial_corr_bf(void)
   timer(0);
   auto_rad_bf(nfull_dat,indices_dat,pixrad_dat,DD);
   timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_rad_bf(nfull_ran,indices_ran,pixrad_ran,RR);
-  timer(2);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    auto_rad_bf(nfull_ran,indices_ran,pixrad_ran,RR);
+    timer(2);
+  }
   print_info(" - Cross-correlating \n");
   cross_rad_bf(nfull_dat,indices_dat,
       pixrad_dat,pixrad_ran,DR);
@@ -602,6 +662,7 @@ void run_angular_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,1);
@@ -627,9 +688,11 @@ void run_angular_corr_bf(void)
   timer(0);
   auto_ang_bf(nfull_dat,indices_dat,boxes_dat,DD);
   timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_ang_bf(nfull_ran,indices_ran,boxes_ran,RR);
-  timer(2);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    auto_ang_bf(nfull_ran,indices_ran,boxes_ran,RR);
+    timer(2);
+  }
   print_info(" - Cross-correlating \n");
   cross_ang_bf(nfull_dat,indices_dat,
       boxes_dat,boxes_ran,DR);
@@ -658,7 +721,7 @@ void run_angular_corr_pm(void)
 
   Cell2D *cells_dat,*cells_ran;
   int *indices_dat,*indices_ran;
-  int nfull_dat,nfull_ran;
+  int nfull_dat,nfull_ran,level;
 
   histo_t *DD=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
   histo_t *DR=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
@@ -688,28 +751,108 @@ void run_angular_corr_pm(void)
 
   print_info("*** Boxing catalogs \n");
   init_2D_params(cat_dat,cat_ran,1);
-  cells_dat=mk_Cells2D_from_Catalog(cat_dat,&indices_dat,&nfull_dat);
+  print_info("\n");
+
+  //Each resolution level is boxed and correlated in turn
+  print_info("*** Correlating \n");
+  timer(0);
+  for(level=0;level<pm_levels;level++) {
+    int ith_lo,ith_hi;
+    set_2D_level(level);
+    if(!get_pm_level_bins(level,&ith_lo,&ith_hi))
+      continue;
+    if(pm_levels>1) {
+      print_info(" - Level %d: bins %d to %d with %d pixels\n",
+          level,ith_lo,ith_hi-1,n_boxes2D);
+    }
+    cells_dat=mk_Cells2D_from_Catalog(cat_dat,&indices_dat,&nfull_dat);
+    free(indices_dat);
+    cells_ran=mk_Cells2D_from_Catalog(cat_ran,&indices_ran,&nfull_ran);
+    free(indices_ran);
+
+#ifdef _DEBUG
+    if(level==0) {
+      write_Cells2D(n_boxes2D,cells_dat,"debug_Cell2DDat.dat");
+      write_Cells2D(n_boxes2D,cells_ran,"debug_Cell2DRan.dat");
+    }
+#endif //_DEBUG
+
+    corr_ang_pm(cells_dat,cells_ran,level,DD,DR,RR);
+    free_Cells2D(n_boxes2D,cells_dat);
+    free_Cells2D(n_boxes2D,cells_ran);
+  }
+  set_2D_level(0);
+  timer(1);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_galaxy_catalog == NULL)
 #endif
     free_Catalog(cat_dat);
-  free(indices_dat);
-  cells_ran=mk_Cells2D_from_Catalog(cat_ran,&indices_ran,&nfull_ran);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_random_catalog == NULL)
 #endif
     free_Catalog(cat_ran);
-  free(indices_ran);
+
   print_info("\n");
+  write_CF(fnameOut,DD,DR,RR,
+      sum_wd,sum_wd2,sum_wr,sum_wr2);
 
-#ifdef _DEBUG
-  write_Cells2D(n_boxes2D,cells_dat,"debug_Cell2DDat.dat");
-  write_Cells2D(n_boxes2D,cells_ran,"debug_Cell2DRan.dat");
-#endif //_DEBUG
+  print_info("*** Cleaning up\n");
+  free(DD);
+  free(DR);
+  free(RR);
+}
+
+void run_angular_corr_harmonic(void)
+{
+  //////
+  // Runs w(theta) in harmonic space
+  np_t sum_wd,sum_wd2,sum_wr,sum_wr2;
+  Catalog *cat_dat,*cat_ran;
+  double *map_dat,*map_ran;
+
+  histo_t *DD=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nb_theta,sizeof(histo_t));
+
+  timer(4);
+
+#ifdef _VERBOSE
+  print_info("*** Angular correlation function: \n");
+  print_info(" - Range: %.3lf < theta < %.3lf (deg)\n",
+      0.,1/(i_theta_max*DTORAD));
+  print_info(" - #bins: %d\n",nb_theta);
+  if(logbin) {
+    print_info(" - Logarithmic binning with %d bins per decade\n",
+        n_logint);
+  }
+  else {
+    print_info(" - Resolution: D(theta) = %.3lf \n",
+        1./(i_theta_max*nb_theta*DTORAD));
+  }
+  print_info(" - Using spherical harmonics \n");
+  print_info("\n");
+#endif
+
+  read_dr_catalogs(&cat_dat,&cat_ran,
+      &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+
+  print_info("*** Pixelizing catalogs \n");
+  init_2D_params(cat_dat,cat_ran,1);
+  map_dat=mk_Map2D_from_Catalog(cat_dat);
+  map_ran=mk_Map2D_from_Catalog(cat_ran);
+#ifdef _CUTE_AS_PYTHON_MODULE
+  if(global_galaxy_catalog == NULL)
+#endif
+    free_Catalog(cat_dat);
+#ifdef _CUTE_AS_PYTHON_MODULE
+  if(global_random_catalog == NULL)
+#endif
+    free_Catalog(cat_ran);
+  print_info("\n");
 
   print_info("*** Correlating \n");
   timer(0);
-  corr_ang_pm(cells_dat,cells_ran,DD,DR,RR);
+  corr_ang_harmonic(map_dat,map_ran,DD,DR,RR);
   timer(1);
 
   print_info("\n");
@@ -717,8 +860,8 @@ void run_angular_corr_pm(void)
       sum_wd,sum_wd2,sum_wr,sum_wr2);
 
   print_info("*** Cleaning up\n");
-  free_Cells2D(n_boxes2D,cells_dat);
-  free_Cells2D(n_boxes2D,cells_ran);
+  free(map_dat);
+  free(map_ran);
   free(DD);
   free(DR);
   free(RR);
@@ -730,14 +873,15 @@ void run_monopole_corr_bf(void)
   // Runs xi(r) in brute-force mode
   np_t sum_wd,sum_wd2,sum_wr,sum_wr2;
   Catalog *cat_dat,*cat_ran;
+  np_t *sums_wd,*sums_wr;
 
   Box3D *boxes_dat,*boxes_ran;
   int *indices_dat,*indices_ran;
   int nfull_dat,nfull_ran;
 
-  histo_t *DD=(histo_t *)my_calloc(nb_r,sizeof(histo_t));
-  histo_t *DR=(histo_t *)my_calloc(nb_r,sizeof(histo_t));
-  histo_t *RR=(histo_t *)my_calloc(nb_r,sizeof(histo_t));
+  histo_t *DD=(histo_t *)my_calloc(nb_r*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(nb_r*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nb_r*get_n_jk_pairs(),sizeof(histo_t));
 
   timer(4);
 
@@ -762,9 +906,14 @@ void run_monopole_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
+  get_jk_sums(cat_dat,cat_ran,&sums_wd,&sums_wr);
 
   print_info("*** Boxing catalogs \n");
-  init_3D_params(cat_dat,cat_ran,2);
+  if(mpi_domains)
+    init_3D_params_domain(cat_dat,cat_ran,2);
+  else
+    init_3D_params(cat_dat,cat_ran,2);
   boxes_dat=mk_Boxes3D_from_Catalog(cat_dat,&indices_dat,&nfull_dat);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_galaxy_catalog == NULL)
@@ -783,19 +932,16 @@ void run_monopole_corr_bf(void)
 #endif //_DEBUG
 
   print_info("*** Correlating \n");
-  print_info(" - Auto-correlating data \n");
+  print_info(" - Correlating data and randoms \n");
   timer(0);
-  auto_mono_bf(nfull_dat,indices_dat,boxes_dat,DD);
-  timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_mono_bf(nfull_ran,indices_ran,boxes_ran,RR);
-  timer(2);
-  print_info(" - Cross-correlating \n");
-  cross_mono_bf(nfull_dat,indices_dat,
-      boxes_dat,boxes_ran,DR);
+  corr_3d_bf(nfull_dat,indices_dat,nfull_ran,indices_ran,
+      boxes_dat,boxes_ran,DD,DR,rr_cached ? NULL : RR);
   timer(1);
 
   print_info("\n");
+  if(n_jk>0)
+    write_CF_jk(fnameOut,DD,DR,RR,sums_wd,sums_wr,
+        sum_wd,sum_wd2,sum_wr,sum_wr2);
   write_CF(fnameOut,DD,DR,RR,
       sum_wd,sum_wd2,sum_wr,sum_wr2);
 
@@ -808,6 +954,8 @@ void run_monopole_corr_bf(void)
   free(DD);
   free(DR);
   free(RR);
+  free(sums_wd);
+  free(sums_wr);
 }
 
 
@@ -818,14 +966,15 @@ void run_3d_ps_corr_bf(void)
   // Runs xi(pi,sigma) in brute-force mode
   np_t sum_wd,sum_wd2,sum_wr,sum_wr2;
   Catalog *cat_dat,*cat_ran;
+  np_t *sums_wd,*sums_wr;
 
   Box3D *boxes_dat,*boxes_ran;
   int *indices_dat,*indices_ran;
   int nfull_dat,nfull_ran;
 
-  histo_t *DD=(histo_t *)my_calloc(nb_rt*nb_rl,sizeof(histo_t));
-  histo_t *DR=(histo_t *)my_calloc(nb_rt*nb_rl,sizeof(histo_t));
-  histo_t *RR=(histo_t *)my_calloc(nb_rt*nb_rl,sizeof(histo_t));
+  histo_t *DD=(histo_t *)my_calloc(nb_rt*nb_rl*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(nb_rt*nb_rl*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nb_rt*nb_rl*get_n_jk_pairs(),sizeof(histo_t));
 
   timer(4);
 
@@ -844,9 +993,14 @@ void run_3d_ps_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
+  get_jk_sums(cat_dat,cat_ran,&sums_wd,&sums_wr);
 
   print_info("*** Boxing catalogs \n");
-  init_3D_params(cat_dat,cat_ran,3);
+  if(mpi_domains)
+    init_3D_params_domain(cat_dat,cat_ran,3);
+  else
+    init_3D_params(cat_dat,cat_ran,3);
   boxes_dat=mk_Boxes3D_from_Catalog(cat_dat,&indices_dat,&nfull_dat);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_galaxy_catalog == NULL)
@@ -865,19 +1019,16 @@ void run_3d_ps_corr_bf(void)
 #endif //_DEBUG
 
   print_info("*** Correlating \n");
-  print_info(" - Auto-correlating data \n");
+  print_info(" - Correlating data and randoms \n");
   timer(0);
-  auto_3d_ps_bf(nfull_dat,indices_dat,boxes_dat,DD);
-  timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_3d_ps_bf(nfull_ran,indices_ran,boxes_ran,RR);
-  timer(2);
-  print_info(" - Cross-correlating \n");
-  cross_3d_ps_bf(nfull_dat,indices_dat,
-      boxes_dat,boxes_ran,DR);
+  corr_3d_bf(nfull_dat,indices_dat,nfull_ran,indices_ran,
+      boxes_dat,boxes_ran,DD,DR,rr_cached ? NULL : RR);
   timer(1);
 
   print_info("\n");
+  if(n_jk>0)
+    write_CF_jk(fnameOut,DD,DR,RR,sums_wd,sums_wr,
+        sum_wd,sum_wd2,sum_wr,sum_wr2);
   write_CF(fnameOut,DD,DR,RR,
       sum_wd,sum_wd2,sum_wr,sum_wr2);
 
@@ -890,6 +1041,8 @@ void run_3d_ps_corr_bf(void)
   free(DD);
   free(DR);
   free(RR);
+  free(sums_wd);
+  free(sums_wr);
 }
 
 void run_3d_rm_corr_bf(void)
@@ -898,14 +1051,15 @@ void run_3d_rm_corr_bf(void)
   // Runs xi(r,mu) in brute-force mode
   np_t sum_wd,sum_wd2,sum_wr,sum_wr2;
   Catalog *cat_dat,*cat_ran;
+  np_t *sums_wd,*sums_wr;
 
   Box3D *boxes_dat,*boxes_ran;
   int *indices_dat,*indices_ran;
   int nfull_dat,nfull_ran;
 
-  histo_t *DD=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
-  histo_t *DR=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
-  histo_t *RR=(histo_t *)my_calloc(nb_r*nb_mu,sizeof(histo_t));
+  histo_t *DD=(histo_t *)my_calloc(nb_r*nb_mu*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(nb_r*nb_mu*get_n_jk_pairs(),sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nb_r*nb_mu*get_n_jk_pairs(),sizeof(histo_t));
 
   timer(4);
 
@@ -932,9 +1086,14 @@ void run_3d_rm_corr_bf(void)
 
   read_dr_catalogs(&cat_dat,&cat_ran,
       &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
+  get_jk_sums(cat_dat,cat_ran,&sums_wd,&sums_wr);
 
   print_info("*** Boxing catalogs \n");
-  init_3D_params(cat_dat,cat_ran,4);
+  if(mpi_domains)
+    init_3D_params_domain(cat_dat,cat_ran,4);
+  else
+    init_3D_params(cat_dat,cat_ran,4);
   boxes_dat=mk_Boxes3D_from_Catalog(cat_dat,&indices_dat,&nfull_dat);
 #ifdef _CUTE_AS_PYTHON_MODULE
   if(global_galaxy_catalog == NULL)
@@ -953,19 +1112,16 @@ void run_3d_rm_corr_bf(void)
 #endif //_DEBUG
 
   print_info("*** Correlating \n");
-  print_info(" - Auto-correlating data \n");
+  print_info(" - Correlating data and randoms \n");
   timer(0);
-  auto_3d_rm_bf(nfull_dat,indices_dat,boxes_dat,DD);
-  timer(2);
-  print_info(" - Auto-correlating random \n");
-  auto_3d_rm_bf(nfull_ran,indices_ran,boxes_ran,RR);
-  timer(2);
-  print_info(" - Cross-correlating \n");
-  cross_3d_rm_bf(nfull_dat,indices_dat,
-      boxes_dat,boxes_ran,DR);
+  corr_3d_bf(nfull_dat,indices_dat,nfull_ran,indices_ran,
+      boxes_dat,boxes_ran,DD,DR,rr_cached ? NULL : RR);
   timer(1);
 
   print_info("\n");
+  if(n_jk>0)
+    write_CF_jk(fnameOut,DD,DR,RR,sums_wd,sums_wr,
+        sum_wd,sum_wd2,sum_wr,sum_wr2);
   write_CF(fnameOut,DD,DR,RR,
       sum_wd,sum_wd2,sum_wr,sum_wr2);
 
@@ -978,6 +1134,87 @@ void run_3d_rm_corr_bf(void)
   free(DD);
   free(DR);
   free(RR);
+  free(sums_wd);
+  free(sums_wr);
+}
+
+void run_3d_corr_tree(void)
+{
+  //////
+  // Runs xi(r), xi(pi,sigma) or xi(r,mu) using dual trees
+  np_t sum_wd,sum_wd2,sum_wr,sum_wr2;
+  Catalog *cat_dat,*cat_ran;
+
+  KDTree *tree_dat,*tree_ran;
+
+  int nbins;
+  if(corr_type==2) nbins=nb_r;
+  else if(corr_type==3) nbins=nb_rt*nb_rl;
+  else nbins=nb_r*nb_mu;
+
+  histo_t *DD=(histo_t *)my_calloc(nbins,sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(nbins,sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nbins,sizeof(histo_t));
+
+  timer(4);
+
+  set_r_z();
+
+#ifdef _VERBOSE
+  if(corr_type==2)
+    print_info("*** Monopole correlation function: \n");
+  else if(corr_type==3)
+    print_info("*** 3D correlation function (pi,sigma): \n");
+  else
+    print_info("*** 3D correlation function (r,mu): \n");
+  print_info(" - #bins: %d\n",nbins);
+  print_info(" - Using a dual-tree approach \n");
+  print_info("\n");
+#endif
+
+  read_dr_catalogs(&cat_dat,&cat_ran,
+      &sum_wd,&sum_wd2,&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
+
+  print_info("*** Building trees \n");
+  init_3D_params(cat_dat,cat_ran,corr_type);
+  tree_dat=mk_KDTree_from_Catalog(cat_dat);
+#ifdef _CUTE_AS_PYTHON_MODULE
+  if(global_galaxy_catalog == NULL)
+#endif
+    free_Catalog(cat_dat);
+  tree_ran=mk_KDTree_from_Catalog(cat_ran);
+#ifdef _CUTE_AS_PYTHON_MODULE
+  if(global_random_catalog == NULL)
+#endif
+    free_Catalog(cat_ran);
+  print_info("\n");
+
+  print_info("*** Correlating \n");
+  print_info(" - Auto-correlating data \n");
+  timer(0);
+  auto_3d_tree(tree_dat,DD);
+  timer(2);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    auto_3d_tree(tree_ran,RR);
+    timer(2);
+  }
+  print_info(" - Cross-correlating \n");
+  cross_3d_tree(tree_dat,tree_ran,DR);
+  timer(1);
+
+  print_info("\n");
+  write_CF(fnameOut,DD,DR,RR,
+      sum_wd,sum_wd2,sum_wr,sum_wr2);
+
+  print_info("*** Cleaning up\n");
+  free_KDTree(tree_dat);
+  free_KDTree(tree_ran);
+  end_r_z();
+  free(DD);
+  free(DR);
+  free(RR);
 }
 
 void run_monopole_cross_corr_bf(int reuse_ran)
@@ -1230,6 +1467,196 @@ void finalize_mpi(){
 #endif //_HAVE_MPI
 }
 
+void run_3d_corr_batch(CatalogBatch *batch)
+{
+  //////
+  // Runs the 3D 2PCF given by corr_type in brute-force mode for
+  // every data catalog in batch against a single random catalog.
+  // The random boxes and RR are computed once. Catalogs are
+  // spread over the OpenMP threads and each catalog gets the
+  // remaining threads for its own DD and DR.
+  int ii,nbins,n_outer=1;
+  long np_tot=0;
+  np_t sum_wr,sum_wr2;
+  Catalog *cat_ran;
+
+  Box3D *boxes_ran;
+  int *indices_ran;
+  int nfull_ran;
+
+  if(corr_type==2) nbins=nb_r;
+  else if(corr_type==3) nbins=nb_rt*nb_rl;
+  else nbins=nb_r*nb_mu;
+
+  histo_t *DD=(histo_t *)my_calloc(batch->n*nbins,sizeof(histo_t));
+  histo_t *DR=(histo_t *)my_calloc(batch->n*nbins,sizeof(histo_t));
+  histo_t *RR=(histo_t *)my_calloc(nbins,sizeof(histo_t));
+  histo_t *RR_out=(histo_t *)my_malloc(nbins*sizeof(histo_t));
+
+  timer(4);
+
+  set_r_z();
+
+#ifdef _VERBOSE
+  print_info("*** Batch of 3D correlation functions: \n");
+  print_info(" - %d data catalogs against a common random catalog\n",
+      batch->n);
+  print_info(" - Using a brute-force approach \n");
+  print_info("\n");
+#endif
+
+  for(ii=0;ii<batch->n;ii++)
+    np_tot+=batch->cats[ii]->np;
+  cat_ran=read_ran_catalog((int)(np_tot/batch->n),&sum_wr,&sum_wr2);
+  int rr_cached=read_RR_cache(cat_ran,RR);
+
+  print_info("*** Boxing catalogs \n");
+  init_3D_params_batch(batch->n,batch->cats,cat_ran,corr_type);
+  boxes_ran=mk_Boxes3D_from_Catalog(cat_ran,&indices_ran,&nfull_ran);
+  if(global_random_catalog == NULL)
+    free_Catalog(cat_ran);
+  print_info("\n");
+
+  print_info("*** Correlating \n");
+  timer(0);
+  if(!rr_cached) {
+    print_info(" - Auto-correlating random \n");
+    if(corr_type==2)
+      auto_mono_bf(nfull_ran,indices_ran,boxes_ran,RR);
+    else if(corr_type==3)
+      auto_3d_ps_bf(nfull_ran,indices_ran,boxes_ran,RR);
+    else
+      auto_3d_rm_bf(nfull_ran,indices_ran,boxes_ran,RR);
+    timer(2);
+  }
+
+#ifdef _HAVE_OMP
+  int max_levels=omp_get_max_active_levels();
+  n_outer=MIN(batch->n,omp_get_max_threads());
+  int n_inner=MAX(omp_get_max_threads()/n_outer,1);
+  omp_set_max_active_levels(2);
+#endif //_HAVE_OMP
+  print_info(" - Correlating data and randoms, %d catalogs at a time \n",
+      n_outer);
+  //Per-catalog output from the concurrent runs would interleave
+  int verbose=cute_verbose;
+  if(n_outer>1)
+    cute_verbose=0;
+#pragma omp parallel for num_threads(n_outer) schedule(dynamic)	\
+  default(none) shared(batch,nbins,n_inner,DD,DR)		\
+  shared(nfull_ran,indices_ran,boxes_ran,n_boxes3D)
+  for(ii=0;ii<batch->n;ii++) {
+    Box3D *boxes_dat;
+    int *indices_dat;
+    int nfull_dat;
+
+#ifdef _HAVE_OMP
+    omp_set_num_threads(n_inner);
+#endif //_HAVE_OMP
+    boxes_dat=mk_Boxes3D_from_Catalog(batch->cats[ii],&indices_dat,&nfull_dat);
+    corr_3d_bf(nfull_dat,indices_dat,nfull_ran,indices_ran,
+	       boxes_dat,boxes_ran,&(DD[ii*nbins]),&(DR[ii*nbins]),NULL);
+    free_Boxes3D(n_boxes3D,boxes_dat);
+    free(indices_dat);
+  }
+  cute_verbose=verbose;
+#ifdef _HAVE_OMP
+  omp_set_max_active_levels(max_levels);
+#endif //_HAVE_OMP
+  timer(1);
+
+  print_info("\n");
+  for(ii=0;ii<batch->n;ii++) {
+    //write_CF reduces RR over MPI nodes in place, so each
+    //catalog gets its own copy of this node's RR
+    char fname[256];
+    sprintf(fname,"%s_%d",fnameOut,ii);
+    memcpy(RR_out,RR,nbins*sizeof(histo_t));
+    global_result=batch->results[ii];
+    write_CF(fname,&(DD[ii*nbins]),&(DR[ii*nbins]),RR_out,
+	batch->cats[ii]->sum_w,batch->cats[ii]->sum_w2,sum_wr,sum_wr2);
+  }
+
+  print_info("*** Cleaning up\n");
+  free_Boxes3D(n_boxes3D,boxes_ran);
+  free(indices_ran);
+  end_r_z();
+  free(DD);
+  free(DR);
+  free(RR);
+  free(RR_out);
+}
+
+int runCUTE_batch(CatalogBatch *batch, Catalog *random_catalog, int verbose){
+  //////
+  // Correlates every data catalog in batch against random_catalog
+  // (read from random_filename if NULL). Only the 3D correlation
+  // functions (corr_type 2, 3 and 4) are supported. The results
+  // are left in batch, see get_batch_result.
+  int ii;
+  cute_verbose = verbose;
+
+  // We can only call MPI_Init once
+  if(mpi_init_called == 0){
+    mpi_init(NULL,NULL);
+    mpi_init_called = 1;
+  }
+
+  setbuf(stdout, NULL);
+
+  if((corr_type<2)||(corr_type>4)) {
+    fprintf(stderr,"CUTE: batch runs are only supported for 3D correlation functions.\n");
+    return 1;
+  }
+  if(n_jk>0) {
+    fprintf(stderr,"CUTE: batch runs don't support jackknife regions.\n");
+    return 1;
+  }
+  if(mpi_domains) {
+    fprintf(stderr,"CUTE: batch runs don't support MPI domains.\n");
+    return 1;
+  }
+  if(batch->n<=0) {
+    fprintf(stderr,"CUTE: empty catalog batch.\n");
+    return 1;
+  }
+  for(ii=0;ii<batch->n;ii++) {
+    if(batch->cats[ii]==NULL) {
+      fprintf(stderr,"CUTE: catalog %d of the batch was never set.\n",ii);
+      return 1;
+    }
+  }
+
+  global_galaxy_catalog  = NULL;
+  global_galaxy_catalog2 = NULL;
+  global_random_catalog  = random_catalog;
+  global_random_catalog2 = NULL;
+
+  print_info("Using a batch of %d external data catalogs\n",batch->n);
+  if(random_catalog != NULL){
+    print_info("Using external random catalog with np = %d  w = %0.1f  w2 = %0.1f\n", 
+        random_catalog->np, random_catalog->sum_w, random_catalog->sum_w2);
+  }
+
+  for(ii=0;ii<batch->n;ii++) {
+    free_result_struct(batch->results[ii]);
+    batch->results[ii]=make_empty_result_struct();
+  }
+
+#ifdef _BIN_TABLES
+  init_bin_tables();
+#endif //_BIN_TABLES
+
+  run_3d_corr_batch(batch);
+
+#ifdef _BIN_TABLES
+  end_bin_tables();
+#endif //_BIN_TABLES
+  print_info("             Done !!!             \n");
+
+  return 0;
+}
+
 int runCUTE(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *random_catalog, Catalog *random_catalog2, Result *result, int verbose){
 
   int ii;
@@ -1248,11 +1675,20 @@ int main(int argc,char **argv){
   // Main routine
   int ii;
   char fnameIn[128];
-  if(argc!=2) {
+  char *fname_cat_in=NULL,*fname_cat_out=NULL;
+  if((argc==5)&&(!strcmp(argv[1],"-c"))) {
+    //Convert a catalog into binary format
+    sprintf(fnameIn,"%s",argv[2]);
+    fname_cat_in=argv[3];
+    fname_cat_out=argv[4];
+  }
+  else if(argc==2)
+    sprintf(fnameIn,"%s",argv[1]);
+  else {
     print_info("Usage ./CUTE <input file>\n");
+    print_info("   or ./CUTE -c <input file> <catalog> <binary catalog>\n");
     exit(1);
   }
-  sprintf(fnameIn,"%s",argv[1]);
 
   mpi_init(&argc,&argv);
 
@@ -1293,6 +1729,19 @@ int main(int argc,char **argv){
 
   global_result = result;
 
+  if(n_jk>0) {
+    if(((galaxy_catalog!=NULL)&&(galaxy_catalog->region==NULL))||
+       ((random_catalog!=NULL)&&(random_catalog->region==NULL))) {
+      fprintf(stderr,"CUTE: jackknife runs need the region of every object (region=...)\n");
+      return 1;
+    }
+  }
+  //Each node would hold the whole catalog, which domains are meant to avoid
+  if(mpi_domains&&((galaxy_catalog!=NULL)||(random_catalog!=NULL))) {
+    fprintf(stderr,"CUTE: MPI domains need the catalogs to be read from files\n");
+    return 1;
+  }
+
 #ifdef _HAVE_MPI
   print_info("Running MPI with %i tasks\n",NNodes);
 #endif
@@ -1324,16 +1773,32 @@ int main(int argc,char **argv){
 
 #ifndef _CUTE_AS_PYTHON_MODULE
   read_run_params(fnameIn);
+  if(fname_cat_in!=NULL) {
+    convert_catalog(fname_cat_in,fname_cat_out);
+    print_info("             Done !!!             \n");
+#ifdef _HAVE_MPI
+    MPI_Finalize();
+#endif //_HAVE_MPI
+    return 0;
+  }
 #endif
 
+#ifdef _BIN_TABLES
+  init_bin_tables();
+#endif //_BIN_TABLES
+
   if(corr_type==0)
     run_radial_corr_bf();
   else if(corr_type==1) {
     if(use_pm==1)
       run_angular_corr_pm();
+    else if(use_pm==2)
+      run_angular_corr_harmonic();
     else
       run_angular_corr_bf();
   }
+  else if((corr_type>=2)&&(corr_type<=4)&&(use_tree==1))
+    run_3d_corr_tree();
   else if(corr_type==2)
     run_monopole_corr_bf();
   else if(corr_type==3)
@@ -1365,6 +1830,9 @@ int main(int argc,char **argv){
     fprintf(stderr,"CUTE: wrong correlation type.\n");
     exit(0);
   }
+#ifdef _BIN_TABLES
+  end_bin_tables();
+#endif //_BIN_TABLES
   print_info("             Done !!!             \n");
 
 #ifndef _CUTE_AS_PYTHON_MODULE
@@ -68,6 +68,8 @@ Result *make_empty_result_struct(){
   res->R1R1 = malloc(sizeof(double)*n_bins_all);
   res->R1R2 = malloc(sizeof(double)*n_bins_all);
   res->R2R2 = malloc(sizeof(double)*n_bins_all);
+  res->n_jk = 0;
+  res->corr_jk = NULL;
   return res;
 }
 
@@ -139,10 +141,67 @@ void free_result_struct(Result *res){
     free(res->R1R1);
     free(res->R1R2);
     free(res->R2R2);
+    free(res->corr_jk);
     free(res);
   }
 }
 
+void set_catalog_regions(Catalog *cat, int n, int *region){
+  int i;
+  if(n != cat->np){
+    print_info("Error: set_catalog_regions inconsistent sizes of the arrays [%i %i]\n", cat->np, n); 
+    return;
+  }
+  for(i = 0; i < n; i++){
+    if((region[i] < 0) || (region[i] >= n_jk)){
+      print_info("Error: set_catalog_regions region %i out of range [0,%i)\n", region[i], n_jk); 
+      return;
+    }
+  }
+  if(cat->region == NULL)
+    cat->region = (int *)my_malloc(MAX(n,1)*sizeof(int));
+  for(i = 0; i < n; i++)
+    cat->region[i] = region[i];
+}
+
+CatalogBatch *make_catalog_batch(int n){
+  int i;
+  CatalogBatch *batch = malloc(sizeof(CatalogBatch));
+  batch->n = n;
+  batch->cats = (Catalog **)my_malloc(n*sizeof(Catalog *));
+  batch->results = (Result **)my_malloc(n*sizeof(Result *));
+  for(i = 0; i < n; i++){
+    batch->cats[i] = NULL;
+    batch->results[i] = NULL;
+  }
+  return batch;
+}
+
+void set_batch_catalog(CatalogBatch *batch, int i, Catalog *cat){
+  if(i < 0 || i >= batch->n){
+    print_info("Error: set_batch_catalog index %i out of range [0,%i)\n", i, batch->n);
+    return;
+  }
+  batch->cats[i] = cat;
+}
+
+Result *get_batch_result(CatalogBatch *batch, int i){
+  if(i < 0 || i >= batch->n) return NULL;
+  return batch->results[i];
+}
+
+void free_catalog_batch(CatalogBatch *batch){
+  // The catalogs belong to the caller, the results to the batch
+  if(batch != NULL){
+    int i;
+    for(i = 0; i < batch->n; i++)
+      free_result_struct(batch->results[i]);
+    free(batch->cats);
+    free(batch->results);
+    free(batch);
+  }
+}
+
 Catalog *create_catalog_from_numpy(int n, double *phi, int n1, double *cth, int n2, double *red, int n3, double *weight){
 #ifdef _WITH_WEIGHTS
   if(! ((n == n1) && (n1 == n2) && (n2 == n3))){
@@ -161,6 +220,9 @@ Catalog *create_catalog_from_numpy(int n, double *phi, int n1, double *cth, int
 #ifdef _WITH_WEIGHTS
   cat->weight=(double *)my_malloc(cat->np*sizeof(double));
 #endif
+  cat->region = NULL;
+  cat->map = NULL;
+  cat->map_size = 0;
   int i;
   cat->sum_w = 0;
   cat->sum_w2 = 0;
@@ -282,6 +282,9 @@ Catalog *mk_random_cat(int np)
 #ifdef _WITH_WEIGHTS
   cat->weight=(double *)my_malloc(cat->np*sizeof(double));
 #endif //_WITH_WEIGHTS
+  cat->region=NULL;
+  cat->map=NULL;
+  cat->map_size=0;
 
   //Generate positions
   ir=0;
@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////
+//                                                                   //
+//   Copyright 2012 David Alonso                                     //
+//                                                                   //
+//                                                                   //
+// This file is part of CUTE.                                        //
+//                                                                   //
+// CUTE is free software: you can redistribute it and/or modify it   //
+// under the terms of the GNU General Public License as published by //
+// the Free Software Foundation, either version 3 of the License, or //
+// (at your option) any later version.                               //
+//                                                                   //
+// CUTE is distributed in the hope that it will be useful, but       //
+// WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU //
+// General Public License for more details.                          //
+//                                                                   //
+// You should have received a copy of the GNU General Public License //
+// along with CUTE.  If not, see <http://www.gnu.org/licenses/>.     //
+//                                                                   //
+///////////////////////////////////////////////////////////////////////
+
+/*********************************************************************/
+//                            k-d trees                              //
+/*********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "define.h"
+#include "common.h"
+
+static inline void swap_objects(Box3D *box,int i,int j)
+{
+  double tmp;
+  tmp=box->x[i]; box->x[i]=box->x[j]; box->x[j]=tmp;
+  tmp=box->y[i]; box->y[i]=box->y[j]; box->y[j]=tmp;
+  tmp=box->z[i]; box->z[i]=box->z[j]; box->z[j]=tmp;
+#ifdef _WITH_WEIGHTS
+  tmp=box->w[i]; box->w[i]=box->w[j]; box->w[j]=tmp;
+#endif //_WITH_WEIGHTS
+}
+
+static void select_median(Box3D *box,int dim)
+{
+  //////
+  // Reorders the objects in box so that those with index
+  // lower than np/2 have coordinate dim smaller than or equal
+  // to that of object np/2, and the rest larger or equal
+  double *c;
+  int lo=0,hi=box->np-1,k=box->np/2;
+
+  if(dim==0) c=box->x;
+  else if(dim==1) c=box->y;
+  else c=box->z;
+
+  while(hi>lo) {
+    int i,j,mid=lo+(hi-lo)/2;
+    double pivot;
+
+    //Median of three as pivot, left at lo
+    if(c[mid]<c[lo]) swap_objects(box,mid,lo);
+    if(c[hi]<c[lo]) swap_objects(box,hi,lo);
+    if(c[hi]<c[mid]) swap_objects(box,hi,mid);
+    swap_objects(box,lo,mid);
+    pivot=c[lo];
+
+    //Hoare partition
+    i=lo;
+    j=hi+1;
+    while(1) {
+      do i++; while((i<=hi)&&(c[i]<pivot));
+      do j--; while(c[j]>pivot);
+      if(i>=j) break;
+      swap_objects(box,i,j);
+    }
+    swap_objects(box,lo,j);
+
+    if(j==k) break;
+    else if(j<k) lo=j+1;
+    else hi=j-1;
+  }
+}
+
+static void get_box_bounds(Box3D *box)
+{
+  //////
+  // Computes the bounding box and total weight of the objects in box
+  int jj;
+
+  box->x_lo[0]=box->x_hi[0]=box->x[0];
+  box->x_lo[1]=box->x_hi[1]=box->y[0];
+  box->x_lo[2]=box->x_hi[2]=box->z[0];
+  for(jj=1;jj<box->np;jj++) {
+    box->x_lo[0]=MIN(box->x_lo[0],box->x[jj]);
+    box->x_hi[0]=MAX(box->x_hi[0],box->x[jj]);
+    box->x_lo[1]=MIN(box->x_lo[1],box->y[jj]);
+    box->x_hi[1]=MAX(box->x_hi[1],box->y[jj]);
+    box->x_lo[2]=MIN(box->x_lo[2],box->z[jj]);
+    box->x_hi[2]=MAX(box->x_hi[2],box->z[jj]);
+  }
+#ifdef _WITH_WEIGHTS
+  box->w_tot=0;
+  for(jj=0;jj<box->np;jj++)
+    box->w_tot+=box->w[jj];
+#endif //_WITH_WEIGHTS
+}
+
+static void mk_KDNode(KDTree *tree,int inode)
+{
+  //////
+  // Sets the bounds of node inode and, if it holds more than
+  // TREE_LEAF_NP objects, splits it at the median of its
+  // longest side and builds the two sub-nodes
+  KDNode *node=&(tree->nodes[inode]);
+  Box3D *box=&(node->box);
+  int ii,dim,nhalf,ison;
+
+  node->sons[0]=node->sons[1]=-1;
+  get_box_bounds(box);
+  if(box->np<=TREE_LEAF_NP)
+    return;
+
+  dim=0;
+  for(ii=1;ii<3;ii++) {
+    if(box->x_hi[ii]-box->x_lo[ii]>box->x_hi[dim]-box->x_lo[dim])
+      dim=ii;
+  }
+  select_median(box,dim);
+
+  nhalf=box->np/2;
+  for(ison=0;ison<2;ison++) {
+    int offset=ison*nhalf;
+    Box3D *bson;
+
+    node->sons[ison]=tree->n_nodes;
+    tree->n_nodes++;
+    bson=&(tree->nodes[node->sons[ison]].box);
+    bson->np=ison ? box->np-nhalf : nhalf;
+    bson->x=box->x+offset;
+    bson->y=box->y+offset;
+    bson->z=box->z+offset;
+#ifdef _WITH_WEIGHTS
+    bson->w=box->w+offset;
+#endif //_WITH_WEIGHTS
+    bson->reg=NULL;
+    mk_KDNode(tree,node->sons[ison]);
+  }
+}
+
+void free_KDTree(KDTree *tree)
+{
+  //////
+  // All particle data lives in a single arena
+  // starting at the root (see mk_KDTree_from_Catalog)
+  free(tree->nodes[0].box.x);
+  free(tree->nodes);
+  free(tree);
+}
+
+KDTree *mk_KDTree_from_Catalog(Catalog *cat)
+{
+  //////
+  // Builds a k-d tree from the (Cartesian) positions in cat.
+  // As for the 3D boxes, the objects are copied into a single
+  // aligned arena holding the N_POS arrays, which is then
+  // reordered so that every node owns a contiguous slice.
+  int ii,npad,nleaf_min,n_nodes_max;
+  double *arena;
+  KDTree *tree;
+
+  //Leaves hold at least (TREE_LEAF_NP+1)/2 objects,
+  //which bounds the number of nodes
+  nleaf_min=(TREE_LEAF_NP+1)/2;
+  n_nodes_max=2*(cat->np/nleaf_min+1);
+
+  tree=(KDTree *)my_malloc(sizeof(KDTree));
+  tree->nodes=(KDNode *)my_malloc(n_nodes_max*sizeof(KDNode));
+  tree->n_nodes=1;
+
+  npad=SIMD_ALIGN/sizeof(double);
+  npad=npad*((cat->np+npad-1)/npad);
+  arena=(double *)my_malloc_aligned(MAX(N_POS*npad,1)*sizeof(double));
+
+#pragma omp parallel for default(none) shared(cat,arena,npad)
+  for(ii=0;ii<cat->np;ii++) {
+    //red, cth and phi hold Cartesian coords after init_3D_params()
+    arena[ii]=cat->red[ii];
+    arena[npad+ii]=cat->cth[ii];
+    arena[2*npad+ii]=cat->phi[ii];
+#ifdef _WITH_WEIGHTS
+    arena[3*npad+ii]=cat->weight[ii];
+#endif //_WITH_WEIGHTS
+  }
+
+  tree->nodes[0].box.np=cat->np;
+  tree->nodes[0].box.x=arena;
+  tree->nodes[0].box.y=arena+npad;
+  tree->nodes[0].box.z=arena+2*npad;
+#ifdef _WITH_WEIGHTS
+  tree->nodes[0].box.w=arena+3*npad;
+#endif //_WITH_WEIGHTS
+  tree->nodes[0].box.reg=NULL; //Trees don't support jackknife regions
+  if(cat->np>0)
+    mk_KDNode(tree,0);
+  else {
+    tree->nodes[0].sons[0]=tree->nodes[0].sons[1]=-1;
+    tree->nodes[0].box.x_lo[0]=tree->nodes[0].box.x_lo[1]=tree->nodes[0].box.x_lo[2]=0;
+    tree->nodes[0].box.x_hi[0]=tree->nodes[0].box.x_hi[1]=tree->nodes[0].box.x_hi[2]=0;
+#ifdef _WITH_WEIGHTS
+    tree->nodes[0].box.w_tot=0;
+#endif //_WITH_WEIGHTS
+  }
+
+  print_info("  Tree with %d nodes for %d objects \n",tree->n_nodes,cat->np);
+
+  return tree;
+}
@@ -5,6 +5,7 @@
   #include "src/common.h"
   extern int runCUTEbox(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *random_catalog, Result *result, int verbose);
   extern Catalog *read_Catalog(char *fname);
+  extern void convert_catalog(char *fname_in,char *fname_out);
   extern void free_catalog(Catalog *cat);
   extern void read_run_params(char *paramfile);
   extern Result *make_empty_result_struct();
@@ -22,6 +23,7 @@
   extern void set_data_filename2(char *s);
   extern void set_random_filename(char *s);
   extern void set_input_format(int i);
+  extern void set_hdf5_datasets(char *s);
   extern void set_output_filename(char *s);
   extern void set_corr_type(int i);
   extern void set_use_pm(int i);
@@ -34,6 +36,8 @@
   extern void set_use_randoms(int i);
   extern void set_do_CCF(int i);
   extern void set_n_grid_side(int i);
+  extern void set_pm_assignment(int i);
+  extern void set_pm_interlacing(int i);
 
   struct Catalog{
   #ifdef _LONGIDS
@@ -42,6 +46,8 @@
     int np;
   #endif
     double *pos;
+    void *map;
+    size_t map_size;
   };
 
   struct Result {
@@ -65,6 +71,7 @@ import_array();
 #include "src/common.h"
 extern int runCUTEbox(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *random_catalog, Result *result, int verbose);
 extern Catalog *read_Catalog(char *fname);
+extern void convert_catalog(char *fname_in,char *fname_out);
 extern void free_catalog(Catalog *cat);
 extern void read_run_params(char *paramfile);
 extern Result *make_empty_result_struct();
@@ -82,6 +89,7 @@ void set_data_filename(char *s);
 void set_data_filename2(char *s);
 void set_random_filename(char *s);
 void set_input_format(int i);
+void set_hdf5_datasets(char *s);
 void set_output_filename(char *s);
 void set_corr_type(int i);
 void set_use_pm(int i);
@@ -94,6 +102,8 @@ void set_max_tree_nparts(int i);
 void set_use_randoms(int i);
 void set_do_CCF(int i);
 void set_n_grid_side(int i);
+void set_pm_assignment(int i);
+void set_pm_interlacing(int i);
 
 struct Catalog{
 #ifdef _LONGIDS
@@ -102,6 +112,8 @@ struct Catalog{
   int np;
 #endif
   double *pos;
+  void *map;
+  size_t map_size;
 };
 
 %extend Catalog{
@@ -137,6 +137,7 @@ def set_CUTEbox_parameters(
     reuse_randoms=0,
     num_lines="all",
     input_format=2,
+    hdf5_datasets="x,y,z",
     output_filename="",
     corr_type=1,
     use_pm=1,
@@ -145,7 +146,9 @@ def set_CUTEbox_parameters(
     max_tree_order=0,
     max_tree_nparts=0,
     do_CCF=0,
-    n_grid_side=0):
+    n_grid_side=0,
+    pm_assignment=0,
+    pm_interlacing=0):
 
   if(paramfile is not None):
     cutebox.read_run_params(paramfile)
@@ -157,6 +160,7 @@ def set_CUTEbox_parameters(
   cutebox.set_random_filename(random_filename);
   cutebox.set_output_filename(output_filename)
   cutebox.set_num_lines(num_lines)
+  cutebox.set_hdf5_datasets(hdf5_datasets)
 
   # Doubles
   cutebox.set_box_size(box_size)
@@ -172,6 +176,8 @@ def set_CUTEbox_parameters(
   cutebox.set_max_tree_nparts(max_tree_nparts)
   cutebox.set_do_CCF(do_CCF)
   cutebox.set_n_grid_side(n_grid_side)
+  cutebox.set_pm_assignment(pm_assignment)
+  cutebox.set_pm_interlacing(pm_interlacing)
 
   # Check if parameters are good
   err = cutebox.verify_parameters()
@@ -191,6 +197,16 @@ def readCatalog(filename,input_format,box_size):
   cutebox.set_box_size(box_size)
   return cutebox.read_Catalog(filename)
 
+"""
+ Use CUTE to convert catalog filename_in (read with the given input_format)
+ into the binary catalog filename_out, which readCatalog and runCUTEbox then
+ load by mapping it into memory
+"""
+def convertCatalog(filename_in,filename_out,input_format,box_size):
+  cutebox.set_input_format(input_format)
+  cutebox.set_box_size(box_size)
+  cutebox.convert_catalog(filename_in,filename_out)
+
 """
   Create a CUTE tracer catalog in C format from numpy arrays of X, Y, Z positions
 """
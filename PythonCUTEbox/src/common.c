@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "define.h"
 #include "common.h"
 
@@ -125,7 +126,9 @@ void free_catalog(Catalog *cat)
 {
   //////
   // Frees position arrays in catalog
-  if(cat->np>0)
+  if(cat->map!=NULL)
+    munmap(cat->map,cat->map_size);
+  else if(cat->np>0)
     free(cat->pos);
   free(cat);
 }
@@ -29,11 +29,6 @@
 #include "define.h"
 #include "common.h"
 
-//#define _DO_BATCHES
-#ifdef _DO_BATCHES
-#define COUNT_LIM 1000000000
-#endif //_DO_BATCHES
-
 static const double I_DR=I_R_MAX*NB_R;
 static const double R2_MAX=1./(I_R_MAX*I_R_MAX);
 
@@ -93,17 +88,28 @@ void corr_mono_box_bf(lint np,double *pos,
   } // end pragma omp parallel
 }
 
+static lint pm_offset(lint i)
+{
+  //////
+  // Returns the grid separation closest to 0
+  // among i+m*n_grid, for integer m
+  if(2*i<n_grid)
+    return i;
+  else
+    return i-n_grid;
+}
+
 void corr_mono_box_pm(double *grid,double corr[],double ercorr[],
     unsigned long long hh[])
 {
   //////
   // Correlator for monopole in the periodic-box case
-  // by using a particle mesh
-  int *ibin_box;
+  // by using a particle mesh. grid holds xi at every
+  // grid separation (see grid_2_xi and pos_2_xi), which
+  // is averaged in each bin. hh counts the pairs of
+  // grid points in each bin
   double agrid=l_box/n_grid;
-  double agrid2=agrid*agrid;
-  double r_max=MIN(1/I_R_MAX,l_box_half);
-  lint index_max=(int)(r_max/agrid)+1;
+  lint n_grid_tot=n_grid*((lint)(n_grid*n_grid));
   lint i;
 
   for(i=0;i<NB_R;i++) {
@@ -112,118 +118,188 @@ void corr_mono_box_pm(double *grid,double corr[],double ercorr[],
     ercorr[i]=0;
   }
 
-  printf("Using a distance cube of order %ld for r_max = %.3lf \n",
-      (long)index_max,r_max);
-  ibin_box=(int *)malloc(index_max*index_max*index_max*sizeof(int));
-  if (ibin_box==NULL) error_mem_out();
-
-  for(i=0;i<index_max;i++) {	// calculate distances for cells within the distance cube
-    lint j;
-    for(j=0;j<index_max;j++) {
-      lint k;
-      for(k=0;k<index_max;k++) {
-        lint ir2=i*i+j*j+k*k;
-        double r2=agrid2*ir2;
-        int ibin;
-        ibin=(int)(sqrt(r2)*I_DR);
-        ibin_box[k+index_max*(j+index_max*i)]=ibin;
-      }
+#pragma omp parallel default(none)			\
+  shared(n_grid,n_grid_tot,grid,agrid,corr,hh)
+  {
+    lint ii;
+    double corr_thr[NB_R];
+    unsigned long long hh_thr[NB_R];
+
+    for(ii=0;ii<NB_R;ii++) {
+      corr_thr[ii]=0;
+      hh_thr[ii]=0;
     }
-  }
 
-  for(i=-index_max+1;i<index_max;i++) {	// count number of cells in distance cube within distance bins
-    lint j;
-    for(j=-index_max+1;j<index_max;j++) {
-      lint k;
-      for(k=-index_max+1;k<index_max;k++) {
-        int ibin=ibin_box[labs(k)+index_max*
-          (labs(j)+index_max*labs(i))];
-        if(ibin<NB_R) hh[ibin]++;
+#pragma omp for nowait
+    for(ii=0;ii<n_grid_tot;ii++) {
+      double dx=agrid*pm_offset(ii%n_grid);
+      double dy=agrid*pm_offset((ii/n_grid)%n_grid);
+      double dz=agrid*pm_offset(ii/(n_grid*((lint)n_grid)));
+      double r2=dx*dx+dy*dy+dz*dz;
+      int ir;
+      if(r2>=R2_MAX) continue;
+#ifdef _LOGBIN
+      if(r2<=0) continue;
+      ir=(int)(N_LOGINT*(0.5*log10(r2)-LOG_R_MAX)+NB_R);
+      if((ir>=NB_R)||(ir<0)) continue;
+#else //_LOGBIN
+      ir=(int)(sqrt(r2)*I_DR);
+      if(ir>=NB_R) continue;
+#endif //_LOGBIN
+      corr_thr[ir]+=grid[ii];
+      hh_thr[ir]++;
+    } //end pragma omp for
+
+#pragma omp critical
+    {
+      for(ii=0;ii<NB_R;ii++) {
+        corr[ii]+=corr_thr[ii];
+        hh[ii]+=hh_thr[ii];
       }
+    } //end pragma omp critical
+  } //end pragma omp parallel
+
+  for(i=0;i<NB_R;i++) {
+    if(hh[i]>0) corr[i]/=hh[i];
+    else corr[i]=0;
+    hh[i]*=n_grid_tot;
+  }
+
+  return;
+}
+
+void corr_3d_ps_box_pm(double *grid,double corr[],double ercorr[],
+    unsigned long long hh[])
+{
+  //////
+  // Correlator for xi(pi,sigma) in the periodic-box case
+  // by using a particle mesh (see corr_mono_box_pm)
+  double agrid=l_box/n_grid;
+  lint n_grid_tot=n_grid*((lint)(n_grid*n_grid));
+  lint i;
+
+  for(i=0;i<NB_R*NB_R;i++) {
+    hh[i]=0;
+    corr[i]=0;
+    ercorr[i]=0;
+  }
+
+#pragma omp parallel default(none)			\
+  shared(n_grid,n_grid_tot,grid,agrid,corr,hh)
+  {
+    lint ii;
+    double corr_thr[NB_R*NB_R];
+    unsigned long long hh_thr[NB_R*NB_R];
+
+    for(ii=0;ii<NB_R*NB_R;ii++) {
+      corr_thr[ii]=0;
+      hh_thr[ii]=0;
     }
+
+#pragma omp for nowait
+    for(ii=0;ii<n_grid_tot;ii++) {
+      double dx=agrid*pm_offset(ii%n_grid);
+      double dy=agrid*pm_offset((ii/n_grid)%n_grid);
+      double dz=agrid*pm_offset(ii/(n_grid*((lint)n_grid)));
+      double rl=ABS(dz); //takes the l-o-s direction to be z-axis!!
+      double rt2=dx*dx+dy*dy;
+      int irl,irt;
+      if(rl*rl+rt2>=R2_MAX) continue;
+#ifdef _LOGBIN
+      if((rl<=0)||(rt2<=0)) continue;
+      irl=(int)(N_LOGINT*(log10(rl)-LOG_R_MAX)+NB_R);
+      irt=(int)(N_LOGINT*(0.5*log10(rt2)-LOG_R_MAX)+NB_R);
+      if((irl>=NB_R)||(irl<0)||(irt>=NB_R)||(irt<0)) continue;
+#else //_LOGBIN
+      irl=(int)(rl*I_DR);
+      irt=(int)(sqrt(rt2)*I_DR);
+      if((irl>=NB_R)||(irt>=NB_R)) continue;
+#endif //_LOGBIN
+      corr_thr[irl+NB_R*irt]+=grid[ii];
+      hh_thr[irl+NB_R*irt]++;
+    } //end pragma omp for
+
+#pragma omp critical
+    {
+      for(ii=0;ii<NB_R*NB_R;ii++) {
+        corr[ii]+=corr_thr[ii];
+        hh[ii]+=hh_thr[ii];
+      }
+    } //end pragma omp critical
+  } //end pragma omp parallel
+
+  for(i=0;i<NB_R*NB_R;i++) {
+    if(hh[i]>0) corr[i]/=hh[i];
+    else corr[i]=0;
+    hh[i]*=n_grid_tot;
+  }
+
+  return;
+}
+
+void corr_3d_rmu_box_pm(double *grid,double corr[],double ercorr[],
+    unsigned long long hh[])
+{
+  //////
+  // Correlator for xi(r,mu) in the periodic-box case
+  // by using a particle mesh (see corr_mono_box_pm)
+  double agrid=l_box/n_grid;
+  lint n_grid_tot=n_grid*((lint)(n_grid*n_grid));
+  lint i;
+
+  for(i=0;i<NB_R*NB_mu;i++) {
+    hh[i]=0;
+    corr[i]=0;
+    ercorr[i]=0;
   }
 
 #pragma omp parallel default(none)			\
-  shared(n_grid,grid,index_max,ibin_box,corr)
+  shared(n_grid,n_grid_tot,grid,agrid,corr,hh)
   {
     lint ii;
-    double corr_thr[NB_R];
-    lint n_grid2=n_grid*n_grid,index_max2=index_max*index_max;
-    int ngm1=n_grid-1;
-#ifdef _DO_BATCHES
-    double corr_batch[NB_R];
-    unsigned int hh_batch[NB_R];
-#endif //_DO_BATCHES
+    double corr_thr[NB_R*NB_mu];
+    unsigned long long hh_thr[NB_R*NB_mu];
 
-    for(ii=0;ii<NB_R;ii++) {
+    for(ii=0;ii<NB_R*NB_mu;ii++) {
       corr_thr[ii]=0;
-#ifdef _DO_BATCHES
-      corr_batch[ii]=0;
-      hh_batch[ii]=0;
-#endif //_DO_BATCHES
+      hh_thr[ii]=0;
     }
 
-#pragma omp for nowait schedule(dynamic)
-    for(ii=0;ii<n_grid2*n_grid;ii++) {
-      lint i1=ii/(n_grid2);
-      lint k1=ii%n_grid;
-      lint j1=(ii-k1-i1*n_grid2)/n_grid;
-      double d1=grid[ii];
-      lint ir;
-      for(ir=-index_max+1;ir<index_max;ir++) {
-        lint jr;
-        lint i2=(i1+ir)&ngm1;
-        lint irr=labs(ir)*index_max2;
-        i2*=n_grid2;
-        for(jr=-index_max+1;jr<index_max;jr++) {
-          lint kr;
-          lint j2=(j1+jr)&ngm1;
-          lint jrr=labs(jr)*index_max;
-          j2*=n_grid;
-          for(kr=-index_max+1;kr<index_max;kr++) {
-            int ibin=ibin_box[labs(kr)+jrr+irr];
-            if(ibin>=NB_R) continue;
-            else {
-              double d2;
-              lint k2=(k1+kr)&ngm1;
-              d2=d1*grid[k2+j2+i2];
-#ifdef _DO_BATCHES
-              corr_batch[ibin]+=d2;
-              hh_batch[ibin]++;
-              if(hh_batch[ibin]>COUNT_LIM) {
-                corr_thr[ibin]+=corr_batch[ibin];
-                hh_batch[ibin]=0;
-                corr_batch[ibin]=0;
-              }
-#else //_DO_BATCHES
-              corr_thr[ibin]+=d2;
-#endif //_DO_BATCHES
-            }
-          }
-        }
+#pragma omp for nowait
+    for(ii=0;ii<n_grid_tot;ii++) {
+      double dx=agrid*pm_offset(ii%n_grid);
+      double dy=agrid*pm_offset((ii/n_grid)%n_grid);
+      double dz=agrid*pm_offset(ii/(n_grid*((lint)n_grid)));
+      double r2=dx*dx+dy*dy+dz*dz;
+      int ir,imu;
+      if(r2>=R2_MAX) continue;
+      ir=(int)(sqrt(r2)*I_DR);
+      if(ir>=NB_R) continue;
+      if(r2==0) imu=0;
+      else {
+        double mu=ABS(dz)/sqrt(r2); //takes the l-o-s direction to be z-axis!!
+        //Separations along the l-o-s (mu=1) go to the last bin
+        imu=MIN((int)(mu*NB_mu),NB_mu-1);
       }
+      corr_thr[imu+NB_mu*ir]+=grid[ii];
+      hh_thr[imu+NB_mu*ir]++;
     } //end pragma omp for
 
-#ifdef _DO_BATCHES
-    for(ii=0;ii<NB_R;ii++)
-      corr_thr[ii]+=corr_batch[ii];
-#endif //_DO_BATCHES
-
 #pragma omp critical
     {
-      for(ii=0;ii<NB_R;ii++)
+      for(ii=0;ii<NB_R*NB_mu;ii++) {
         corr[ii]+=corr_thr[ii];
+        hh[ii]+=hh_thr[ii];
+      }
     } //end pragma omp critical
   } //end pragma omp parallel
 
-  for(i=0;i<NB_R;i++) {
-    hh[i]*=(n_grid*((lint)(n_grid*n_grid)));
+  for(i=0;i<NB_R*NB_mu;i++) {
     if(hh[i]>0) corr[i]/=hh[i];
     else corr[i]=0;
+    hh[i]*=n_grid_tot;
   }
 
-  free(ibin_box);
-
   return;
 }
 
@@ -494,9 +570,9 @@ void corr_mono_box_neighbors(int nside,NeighborBox *boxes,
               double xr[3];
               double r2;
               int ir;
-              xr[0]=fabs(x0-(boxes[ibox].pos)[3*jj]);
-              xr[1]=fabs(y0-(boxes[ibox].pos)[3*jj+1]);
-              xr[2]=fabs(z0-(boxes[ibox].pos)[3*jj+2]);
+              xr[0]=fabs(x0-boxes[ibox].x[jj]);
+              xr[1]=fabs(y0-boxes[ibox].y[jj]);
+              xr[2]=fabs(z0-boxes[ibox].z[jj]);
               if(iwrapx) xr[0]=l_box-xr[0];	//check PBC due to wrapping
               if(iwrapy) xr[1]=l_box-xr[1];
               if(iwrapz) xr[2]=l_box-xr[2];
@@ -567,13 +643,13 @@ void corr_mono_boxes(int nside,NeighborBox *boxes,
       if(boxes[ibox].np>0) {	//the sub-box is not empty
         np_box = boxes[ibox].np;
         for(ii=0;ii<np_box;ii++)  { 	//loop over particles in the sub-box
-          x0=(boxes[ibox].pos)[3*ii];				
-          y0=(boxes[ibox].pos)[3*ii+1];
-          z0=(boxes[ibox].pos)[3*ii+2];
+          x0=boxes[ibox].x[ii];				
+          y0=boxes[ibox].y[ii];
+          z0=boxes[ibox].z[ii];
           for(jj=ii+1;jj<np_box;jj++) { //loop over pairs; jj=ii+1 to start ensures each pair counted only once
-            xr[0]=fabs(x0-(boxes[ibox].pos)[3*jj]);
-            xr[1]=fabs(y0-(boxes[ibox].pos)[3*jj+1]);
-            xr[2]=fabs(z0-(boxes[ibox].pos)[3*jj+2]);
+            xr[0]=fabs(x0-boxes[ibox].x[jj]);
+            xr[1]=fabs(y0-boxes[ibox].y[jj]);
+            xr[2]=fabs(z0-boxes[ibox].z[jj]);
             r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
             if(r2>R2_MAX) continue;
 #ifdef _LOGBIN
@@ -629,13 +705,13 @@ void corr_mono_boxes(int nside,NeighborBox *boxes,
               if((this_box>ibox)&&(boxes[this_box].np>0)) {	//only count pairs of sub-boxes once
                 np_2box = boxes[this_box].np;
                 for(ii=0;ii<np_box;ii++)  {
-                  x0=(boxes[ibox].pos)[3*ii];				
-                  y0=(boxes[ibox].pos)[3*ii+1];
-                  z0=(boxes[ibox].pos)[3*ii+2];
+                  x0=boxes[ibox].x[ii];				
+                  y0=boxes[ibox].y[ii];
+                  z0=boxes[ibox].z[ii];
                   for(jj=0;jj<np_2box;jj++) { 
-                    xr[0]=fabs(x0-(boxes[this_box].pos)[3*jj]);
-                    xr[1]=fabs(y0-(boxes[this_box].pos)[3*jj+1]);
-                    xr[2]=fabs(z0-(boxes[this_box].pos)[3*jj+2]);
+                    xr[0]=fabs(x0-boxes[this_box].x[jj]);
+                    xr[1]=fabs(y0-boxes[this_box].y[jj]);
+                    xr[2]=fabs(z0-boxes[this_box].z[jj]);
                     if(iwrapx) xr[0]=l_box-xr[0];	//check PBC due to wrapping
                     if(iwrapy) xr[1]=l_box-xr[1];
                     if(iwrapz) xr[2]=l_box-xr[2];
@@ -747,13 +823,13 @@ void crosscorr_mono_box_neighbors(int nside,NeighborBox *boxes1,
             np1_box=boxes1[ibox].np;
             np2_box=boxes2[this_box].np;
             for(ii=0;ii<np1_box;ii++) { //otherwise, find distances to particle pairs in this box
-              x0=(boxes1[ibox].pos)[3*ii];				
-              y0=(boxes1[ibox].pos)[3*ii+1];
-              z0=(boxes1[ibox].pos)[3*ii+2];
+              x0=boxes1[ibox].x[ii];				
+              y0=boxes1[ibox].y[ii];
+              z0=boxes1[ibox].z[ii];
               for(jj=0;jj<np2_box;jj++) {	
-                xr[0]=fabs(x0-(boxes2[this_box].pos)[3*jj]);	//calculate distance between particles
-                xr[1]=fabs(y0-(boxes2[this_box].pos)[3*jj+1]);
-                xr[2]=fabs(z0-(boxes2[this_box].pos)[3*jj+2]);
+                xr[0]=fabs(x0-boxes2[this_box].x[jj]);	//calculate distance between particles
+                xr[1]=fabs(y0-boxes2[this_box].y[jj]);
+                xr[2]=fabs(z0-boxes2[this_box].z[jj]);
                 if(iwrapx) xr[0]=l_box-xr[0];	//check PBC due to wrapping
                 if(iwrapy) xr[1]=l_box-xr[1];
                 if(iwrapz) xr[2]=l_box-xr[2];
@@ -827,14 +903,14 @@ void auto_3d_ps_boxes(int nside,NeighborBox *boxes,
         np_box = boxes[ibox].np;
 
         for(ii=0;ii<np_box;ii++)  { 	//loop over particles in the sub-box
-          x0=(boxes[ibox].pos)[3*ii];
-          y0=(boxes[ibox].pos)[3*ii+1];
-          z0=(boxes[ibox].pos)[3*ii+2];
+          x0=boxes[ibox].x[ii];
+          y0=boxes[ibox].y[ii];
+          z0=boxes[ibox].z[ii];
 
           for(jj=ii+1;jj<np_box;jj++) { //loop over pairs; jj=ii+1 to start ensures each pair counted only once
-            xr[0]=x0-(boxes[ibox].pos)[3*jj];
-            xr[1]=y0-(boxes[ibox].pos)[3*jj+1];
-            xr[2]=z0-(boxes[ibox].pos)[3*jj+2];
+            xr[0]=x0-boxes[ibox].x[jj];
+            xr[1]=y0-boxes[ibox].y[jj];
+            xr[2]=z0-boxes[ibox].z[jj];
             r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
 
             if(r2<R2_MAX) {
@@ -907,13 +983,13 @@ void auto_3d_ps_boxes(int nside,NeighborBox *boxes,
               if((this_box>ibox)&&(boxes[this_box].np>0)) {	//only count pairs of sub-boxes once
                 np_2box = boxes[this_box].np;
                 for(ii=0;ii<np_box;ii++)  {
-                  x0=(boxes[ibox].pos)[3*ii];
-                  y0=(boxes[ibox].pos)[3*ii+1];
-                  z0=(boxes[ibox].pos)[3*ii+2];
+                  x0=boxes[ibox].x[ii];
+                  y0=boxes[ibox].y[ii];
+                  z0=boxes[ibox].z[ii];
                   for(jj=0;jj<np_2box;jj++) {
-                    xr[0]=fabs(x0-(boxes[this_box].pos)[3*jj]);
-                    xr[1]=fabs(y0-(boxes[this_box].pos)[3*jj+1]);
-                    xr[2]=fabs(z0-(boxes[this_box].pos)[3*jj+2]);
+                    xr[0]=fabs(x0-boxes[this_box].x[jj]);
+                    xr[1]=fabs(y0-boxes[this_box].y[jj]);
+                    xr[2]=fabs(z0-boxes[this_box].z[jj]);
                     if(iwrapx) xr[0]=l_box-xr[0];	//check PBC due to wrapping
                     if(iwrapy) xr[1]=l_box-xr[1];
                     if(iwrapz) xr[2]=l_box-xr[2];
@@ -1042,13 +1118,13 @@ void cross_3d_ps_boxes(int nside,NeighborBox *boxes1,
             np1_box=boxes1[ibox].np;
             np2_box=boxes2[this_box].np;
             for(ii=0;ii<np1_box;ii++) { //otherwise, find distances to particle pairs in this box
-              x0=(boxes1[ibox].pos)[3*ii];
-              y0=(boxes1[ibox].pos)[3*ii+1];
-              z0=(boxes1[ibox].pos)[3*ii+2];
+              x0=boxes1[ibox].x[ii];
+              y0=boxes1[ibox].y[ii];
+              z0=boxes1[ibox].z[ii];
               for(jj=0;jj<np2_box;jj++) {
-                xr[0]=fabs(x0-(boxes2[this_box].pos)[3*jj]);	//calculate distance between particles
-                xr[1]=fabs(y0-(boxes2[this_box].pos)[3*jj+1]);
-                xr[2]=fabs(z0-(boxes2[this_box].pos)[3*jj+2]);
+                xr[0]=fabs(x0-boxes2[this_box].x[jj]);	//calculate distance between particles
+                xr[1]=fabs(y0-boxes2[this_box].y[jj]);
+                xr[2]=fabs(z0-boxes2[this_box].z[jj]);
                 if(iwrapx) xr[0]=l_box-xr[0];	//check PBC due to wrapping
                 if(iwrapy) xr[1]=l_box-xr[1];
                 if(iwrapz) xr[2]=l_box-xr[2];
@@ -1138,14 +1214,14 @@ void auto_3d_rmu_boxes(int nside,NeighborBox *boxes,
         np_box = boxes[ibox].np;
 
         for(ii=0;ii<np_box;ii++)  { 	//loop over particles in the sub-box
-          x0=(boxes[ibox].pos)[3*ii];
-          y0=(boxes[ibox].pos)[3*ii+1];
-          z0=(boxes[ibox].pos)[3*ii+2];
+          x0=boxes[ibox].x[ii];
+          y0=boxes[ibox].y[ii];
+          z0=boxes[ibox].z[ii];
 
           for(jj=ii+1;jj<np_box;jj++) { //loop over pairs; jj=ii+1 to start ensures each pair counted only once
-            xr[0]=x0-(boxes[ibox].pos)[3*jj];
-            xr[1]=y0-(boxes[ibox].pos)[3*jj+1];
-            xr[2]=z0-(boxes[ibox].pos)[3*jj+2];
+            xr[0]=x0-boxes[ibox].x[jj];
+            xr[1]=y0-boxes[ibox].y[jj];
+            xr[2]=z0-boxes[ibox].z[jj];
             r2=xr[0]*xr[0]+xr[1]*xr[1]+xr[2]*xr[2];
 
             if(r2<R2_MAX) {
@@ -1204,13 +1280,13 @@ void auto_3d_rmu_boxes(int nside,NeighborBox *boxes,
               if((this_box>ibox)&&(boxes[this_box].np>0)) {	//only count pairs of sub-boxes once
                 np_2box = boxes[this_box].np;
                 for(ii=0;ii<np_box;ii++)  {
-                  x0=(boxes[ibox].pos)[3*ii];
-                  y0=(boxes[ibox].pos)[3*ii+1];
-                  z0=(boxes[ibox].pos)[3*ii+2];
+                  x0=boxes[ibox].x[ii];
+                  y0=boxes[ibox].y[ii];
+                  z0=boxes[ibox].z[ii];
                   for(jj=0;jj<np_2box;jj++) {
-                    xr[0] = x0 - (boxes[this_box].pos)[3*jj];
-                    xr[1] = y0 - (boxes[this_box].pos)[3*jj+1];
-                    xr[2] = z0 - (boxes[this_box].pos)[3*jj+2];
+                    xr[0] = x0 - boxes[this_box].x[jj];
+                    xr[1] = y0 - boxes[this_box].y[jj];
+                    xr[2] = z0 - boxes[this_box].z[jj];
                     if(fabs(xr[0])>l_box/2) xr[0] -= l_box*xr[0]/fabs(xr[0]);
                     if(fabs(xr[1])>l_box/2) xr[1] -= l_box*xr[1]/fabs(xr[1]);
                     if(fabs(xr[2])>l_box/2) xr[2] -= l_box*xr[2]/fabs(xr[2]);
@@ -1323,13 +1399,13 @@ void cross_3d_rmu_boxes(int nside,NeighborBox *boxes1,
             np1_box=boxes1[ibox].np;
             np2_box=boxes2[this_box].np;
             for(ii=0;ii<np1_box;ii++) { //otherwise, find distances to particle pairs in this box
-              x0=(boxes1[ibox].pos)[3*ii];
-              y0=(boxes1[ibox].pos)[3*ii+1];
-              z0=(boxes1[ibox].pos)[3*ii+2];
+              x0=boxes1[ibox].x[ii];
+              y0=boxes1[ibox].y[ii];
+              z0=boxes1[ibox].z[ii];
               for(jj=0;jj<np2_box;jj++) {
-                xr[0] = x0 - (boxes2[this_box].pos)[3*jj];
-                xr[1] = y0 - (boxes2[this_box].pos)[3*jj+1];
-                xr[2] = z0 - (boxes2[this_box].pos)[3*jj+2];
+                xr[0] = x0 - boxes2[this_box].x[jj];
+                xr[1] = y0 - boxes2[this_box].y[jj];
+                xr[2] = z0 - boxes2[this_box].z[jj];
                 if(fabs(xr[0])>l_box/2) xr[0] -= l_box*xr[0]/fabs(xr[0]);
                 if(fabs(xr[1])>l_box/2) xr[1] -= l_box*xr[1]/fabs(xr[1]);
                 if(fabs(xr[2])>l_box/2) xr[2] -= l_box*xr[2]/fabs(xr[2]);
@@ -29,6 +29,12 @@ void corr_mono_box_bf(lint np,double *pos,
 void corr_mono_box_pm(double *grid,double corr[],double ercorr[],
 		      unsigned long long DD[]);
 
+void corr_3d_ps_box_pm(double *grid,double corr[],double ercorr[],
+		       unsigned long long DD[]);
+
+void corr_3d_rmu_box_pm(double *grid,double corr[],double ercorr[],
+			unsigned long long DD[]);
+
 void corr_mono_box_tree(lint np,double *pos,
 			branch *tree,unsigned long long hh[]);
 
@@ -37,6 +37,7 @@ char fnameOut[256]="default";    //Output filename
 
 //File format
 int input_format=-1;
+char hdf5_datasets[256]="x,y,z"; //Position datasets (input_format 3)
 
 //Parameters
 float l_box=-1; //Box size
@@ -50,6 +51,8 @@ int max_tree_nparts=-1;
 //PM stuff
 int use_pm=-1;        //Should I use PM?
 int n_grid=-1;        //# cells per side (CUTE_box)
+int pm_assignment=0;  //Read grid (0) or paint it with NGP (1), CIC (2) or TSC (3)
+int pm_interlacing=0; //Should I interlace the painted grids?
 
 int cute_verbose = 1;
 
@@ -23,6 +23,8 @@
 #ifndef _CUTE_DEFINE_
 #define _CUTE_DEFINE_
 
+#include <stddef.h>
+
 #ifdef _LONGIDS
 typedef long lint;
 #else //_LONGIDS
@@ -34,6 +36,7 @@ extern char fnameData2[256];
 extern char fnameRand[256];
 extern char fnameOut[256];
 extern int input_format;
+extern char hdf5_datasets[256];
 extern int use_tree;
 extern int max_tree_order;
 extern int max_tree_nparts;
@@ -46,6 +49,8 @@ extern lint n_objects;
 extern float l_box;
 extern float l_box_half;
 extern int n_grid;
+extern int pm_assignment;
+extern int pm_interlacing;
 /*                MACROS            */
 // Other possible macros
 //_DEBUG, _VERBOSE, _TRUE_ACOS, _LOGBIN
@@ -53,6 +58,7 @@ extern int n_grid;
 #define MIN(a, b) (((a) < (b)) ? (a) : (b)) //Minimum of two numbers
 #define MAX(a, b) (((a) > (b)) ? (a) : (b)) //Maximum of two numbers
 #define ABS(a)   (((a) < 0) ? -(a) : (a)) //Absolute value
+#define SIMD_ALIGN 64 //Alignment (bytes) of particle arrays in neighbor boxes
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x))) //min(max(a,low),high)
 
 #ifndef N_LOGINT
@@ -78,6 +84,8 @@ extern int n_grid;
 typedef struct {
   lint np;          //#objects in the catalog
   double *pos;
+  void *map;        //Mapped binary catalog holding pos (NULL if none)
+  size_t map_size;
 } Catalog;         //Catalog (double precision)
 
 typedef struct branch {
@@ -90,7 +98,7 @@ typedef struct branch {
 
 typedef struct {
   int np;
-  double *pos;
+  double *x,*y,*z; //slices of the SIMD_ALIGN-aligned arena shared by all boxes
 } NeighborBox; //Neighbor box
 
 extern int cute_verbose;
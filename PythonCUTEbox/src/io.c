@@ -27,8 +27,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#ifdef _HAVE_OMP
+#include <omp.h>
+#endif //_HAVE_OMP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "define.h"
 #include "common.h"
+#ifdef _HAVE_HDF5
+#include <hdf5.h>
+#endif //_HAVE_HDF5
 
 #ifdef _CUTE_AS_PYTHON_MODULE
 static int param_errors = 0;
@@ -48,7 +58,10 @@ typedef struct {
   double Omega0;
   double OmegaLambda;
   double HubbleParam;
-  char fill[256-6*4-6*8-2*8-2*4-6*4-2*4-4*8];
+  int flag_stellarage;
+  int flag_metals;
+  unsigned int npartTotalHighWord[6];
+  char fill[256-6*4-6*8-2*8-2*4-6*4-2*4-4*8-2*4-6*4];
   // fills to 256 Bytes
 } gad_header;
 
@@ -57,6 +70,9 @@ typedef struct {
   int size;
 } gad_title;
 
+//#particles read at once from a snapshot by each thread
+#define GAD_CHUNK 1048576
+
 static double wrap_double(double x)
 {
   //////
@@ -623,11 +639,21 @@ static void check_params(void)
 #endif
   }
   //input format
-  if((input_format!=0)&&(input_format!=1)&&(input_format!=2)) {
+  if((input_format<0)||(input_format>3)) {
     fprintf(stderr,"CUTE: wrong input format. Using standard ASCII file \n");
     input_format=0;
   }
-  if((input_format>0)&&(n_objects!=-1)) {
+#ifndef _HAVE_HDF5
+  if(input_format==3) {
+    fprintf(stderr,"CUTE: HDF5 catalogs need CUTE_box compiled with HDF5 \n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+    exit(1);
+#else
+    param_errors++;
+#endif
+  }
+#endif //_HAVE_HDF5
+  if(((input_format==1)||(input_format==2))&&(n_objects!=-1)) {
     fprintf(stderr,"CUTE: can't select #objects for GADGET input format.");
     fprintf(stderr," Reading all objects \n");
     n_objects=-1;
@@ -730,6 +756,21 @@ static void check_params(void)
 #endif
     }
 
+    if((pm_assignment<0)||(pm_assignment>3)) {
+      fprintf(stderr,"CUTE: wrong PM mass assignment %d.",pm_assignment);
+      fprintf(stderr," Valid values are 0 (read grid), 1 (NGP), 2 (CIC) and 3 (TSC) \n");
+#ifndef _CUTE_AS_PYTHON_MODULE   
+      exit(1);
+#else
+      param_errors++;
+#endif
+    }
+    if((pm_interlacing)&&(pm_assignment==0)) {
+      fprintf(stderr,"CUTE: can't interlace a pre-computed PM grid.");
+      fprintf(stderr," Interlacing will be disabled \n");
+      pm_interlacing=0;
+    }
+
     //Check resolution
     double cellsize=l_box/n_grid;
 #ifdef _LOGBIN
@@ -758,6 +799,7 @@ void print_parameters(){
   printf(" reuse_randoms    = %i\n", reuse_randoms);
   printf(" num_lines        = %i\n", (int)n_objects);
   printf(" input_format     = %i\n", input_format);
+  printf(" hdf5_datasets    = %s\n", hdf5_datasets);
   printf(" output_filename  = %s\n", fnameOut);
   printf(" corr_type        = %i\n", corr_type);
   printf(" use_pm           = %i\n", use_pm);
@@ -767,6 +809,8 @@ void print_parameters(){
   printf(" max_tree_nparts  = %i\n", max_tree_nparts);
   printf(" do_CCF           = %i\n", do_CCF);
   printf(" n_grid_side      = %i\n", n_grid);
+  printf(" pm_assignment    = %i\n", pm_assignment);
+  printf(" pm_interlacing   = %i\n", pm_interlacing);
   printf("===================================\n\n");
 }
 #endif
@@ -807,6 +851,8 @@ void read_run_params(char *fname)
     }
     else if(!strcmp(s1,"input_format="))
       input_format=atoi(s2);
+    else if(!strcmp(s1,"hdf5_datasets="))
+      snprintf(hdf5_datasets,sizeof(hdf5_datasets),"%s",s2);
     else if(!strcmp(s1,"output_filename="))
       sprintf(fnameOut,"%s",s2);
     else if(!strcmp(s1,"box_size=")) {
@@ -831,6 +877,10 @@ void read_run_params(char *fname)
       corr_type=atoi(s2);
     else if(!strcmp(s1,"n_grid_side="))
       n_grid=atoi(s2);
+    else if(!strcmp(s1,"pm_assignment="))
+      pm_assignment=atoi(s2);
+    else if(!strcmp(s1,"pm_interlacing="))
+      pm_interlacing=atoi(s2);
     else
       fprintf(stderr,"CUTE: Unknown parameter %s\n",s1);
   }
@@ -879,23 +929,242 @@ static int gad_seek_block(FILE *snap,char name[])
   return 0;
 }
 
+/////////////////////////
+// Parallel ASCII reader
+// The file is mapped into memory (or read into it if it can't be
+// mapped) and split into chunks at line boundaries. The lines in
+// each chunk are counted in parallel, so that every thread then
+// knows where the objects in its chunks go.
+typedef struct {
+  char *buf;           //File contents
+  size_t size;
+  int mapped;          //Whether buf is a mapping
+  int n_chunks;
+  size_t *chunk_start; //Offset of the first line of each chunk (n_chunks+1)
+  long *chunk_line0;   //Index of the first line of each chunk (n_chunks+1)
+  long n_lines;
+} AsciiFile;
+
+static const double pow10_exact[23]={
+  1E0,1E1,1E2,1E3,1E4,1E5,1E6,1E7,1E8,1E9,1E10,1E11,
+  1E12,1E13,1E14,1E15,1E16,1E17,1E18,1E19,1E20,1E21,1E22};
+
+static int is_blank(char c)
+{
+  return (c==' ')||(c=='\t')||(c=='\r')||(c=='\v')||(c=='\f');
+}
+
+static char *next_token(char *s,char *end,char **tok_end)
+{
+  //////
+  // Returns the start of the first token in [s,end),
+  // or NULL if there is none, and sets tok_end to its end
+  while((s<end)&&is_blank(*s)) s++;
+  if(s>=end) return NULL;
+  *tok_end=s;
+  while((*tok_end<end)&&(!is_blank(**tok_end))) (*tok_end)++;
+  return s;
+}
+
+static int parse_double_slow(char *s,char *end,double *x)
+{
+  //////
+  // strtod on a null-terminated copy of the token
+  char tok[64],*tend;
+  size_t len=end-s;
+  if(len>=sizeof(tok)) return 1;
+  memcpy(tok,s,len);
+  tok[len]='\0';
+  *x=strtod(tok,&tend);
+  return (tend!=tok+len);
+}
+
+static int parse_double(char *s,char *end,double *x)
+{
+  //////
+  // Parses the token [s,end) into x, returning 0 on success.
+  // Decimal numbers with at most 19 significant digits whose
+  // mantissa and power of ten are exact doubles need a single
+  // correctly rounded operation, so they come out the same as
+  // with strtod. strtod takes care of anything else.
+  char *p=s;
+  unsigned long long m=0;
+  int neg=0,nd=0,ndig=0,e=0;
+
+  if((p<end)&&((*p=='-')||(*p=='+'))) {
+    neg=(*p=='-');
+    p++;
+  }
+  while((p<end)&&(*p>='0')&&(*p<='9')) {
+    if(m||(*p!='0')) {
+      if(nd==19) return parse_double_slow(s,end,x);
+      m=10*m+(*p-'0');
+      nd++;
+    }
+    ndig++;
+    p++;
+  }
+  if((p<end)&&(*p=='.')) {
+    p++;
+    while((p<end)&&(*p>='0')&&(*p<='9')) {
+      if(m||(*p!='0')) {
+	if(nd==19) return parse_double_slow(s,end,x);
+	m=10*m+(*p-'0');
+	nd++;
+      }
+      ndig++;
+      e--;
+      p++;
+    }
+  }
+  if(ndig==0) return parse_double_slow(s,end,x);
+  if((p<end)&&((*p=='e')||(*p=='E'))) {
+    int es=1,ev=0,ned=0;
+    p++;
+    if((p<end)&&((*p=='-')||(*p=='+'))) {
+      es=(*p=='-') ? -1 : 1;
+      p++;
+    }
+    while((p<end)&&(*p>='0')&&(*p<='9')) {
+      if(ev<100000) ev=10*ev+(*p-'0');
+      ned++;
+      p++;
+    }
+    if(ned==0) return parse_double_slow(s,end,x);
+    e+=es*ev;
+  }
+  if(p!=end) return parse_double_slow(s,end,x);
+
+  if(m==0)
+    *x=0;
+  else if((m<=(1ULL<<53))&&(e>=-22)&&(e<=22)) {
+    if(e<0)
+      *x=(double)m/pow10_exact[-e];
+    else
+      *x=(double)m*pow10_exact[e];
+  }
+  else
+    return parse_double_slow(s,end,x);
+  if(neg) *x=-(*x);
+
+  return 0;
+}
+
+static AsciiFile *open_ascii(char *fname)
+{
+  //////
+  // Loads fname and counts its lines
+  int fd,ic;
+  struct stat st;
+  AsciiFile *af=(AsciiFile *)malloc(sizeof(AsciiFile));
+  if(af==NULL)
+    error_mem_out();
+
+  fd=open(fname,O_RDONLY);
+  if(fd<0) error_open_file(fname);
+  if(fstat(fd,&st)<0) error_open_file(fname);
+  af->size=(S_ISREG(st.st_mode)) ? st.st_size : 0;
+  af->buf=NULL;
+  af->mapped=0;
+  if(af->size>0) {
+    af->buf=mmap(NULL,af->size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(af->buf==MAP_FAILED)
+      af->buf=NULL;
+    else
+      af->mapped=1;
+  }
+  if(af->buf==NULL) {
+    //Not a regular file (e.g. a pipe) or couldn't be mapped
+    size_t n_alloc=1<<20;
+    ssize_t nr;
+    af->size=0;
+    af->buf=malloc(n_alloc);
+    if(af->buf==NULL)
+      error_mem_out();
+    while((nr=read(fd,af->buf+af->size,n_alloc-af->size))!=0) {
+      if(nr<0) error_read_line(fname,1);
+      af->size+=nr;
+      if(af->size==n_alloc) {
+	n_alloc*=2;
+	af->buf=realloc(af->buf,n_alloc);
+	if(af->buf==NULL)
+	  error_mem_out();
+      }
+    }
+  }
+  close(fd);
+
+  //Split into chunks at line boundaries
+  af->n_chunks=1;
+#ifdef _HAVE_OMP
+  af->n_chunks=8*omp_get_max_threads();
+#endif //_HAVE_OMP
+  af->n_chunks=(int)(MIN((size_t)(af->n_chunks),af->size/65536+1));
+  af->chunk_start=(size_t *)malloc((af->n_chunks+1)*sizeof(size_t));
+  af->chunk_line0=(long *)malloc((af->n_chunks+1)*sizeof(long));
+  if((af->chunk_start==NULL)||(af->chunk_line0==NULL))
+    error_mem_out();
+  af->chunk_start[0]=0;
+  for(ic=1;ic<af->n_chunks;ic++) {
+    size_t i=MAX((af->size*ic)/af->n_chunks,af->chunk_start[ic-1]);
+    char *nl=(i<af->size) ? memchr(af->buf+i,'\n',af->size-i) : NULL;
+    af->chunk_start[ic]=(nl==NULL) ? af->size : (size_t)(nl-af->buf)+1;
+  }
+  af->chunk_start[af->n_chunks]=af->size;
+
+  //Count lines in each chunk (the last one may have no newline)
+#pragma omp parallel for default(none) shared(af) schedule(dynamic)
+  for(ic=0;ic<af->n_chunks;ic++) {
+    long nl=0;
+    char *p=af->buf+af->chunk_start[ic];
+    char *end=af->buf+af->chunk_start[ic+1];
+    while(p<end) {
+      char *q=memchr(p,'\n',end-p);
+      nl++;
+      if(q==NULL) break;
+      p=q+1;
+    }
+    af->chunk_line0[ic+1]=nl;
+  }
+  af->chunk_line0[0]=0;
+  for(ic=0;ic<af->n_chunks;ic++)
+    af->chunk_line0[ic+1]+=af->chunk_line0[ic];
+  af->n_lines=af->chunk_line0[af->n_chunks];
+
+  return af;
+}
+
+static void close_ascii(AsciiFile *af)
+{
+  if(af->mapped)
+    munmap(af->buf,af->size);
+  else
+    free(af->buf);
+  free(af->chunk_start);
+  free(af->chunk_line0);
+  free(af);
+}
+
 static Catalog *read_ascii(char *fname,lint *np)
 { 
   //////
-  // Reads catalog from ascii file with
-  // default format.
+  // Reads catalog from ascii file with default format.
+  // The lines are parsed in parallel (see AsciiFile).
   Catalog *cat = (Catalog *)malloc(sizeof(Catalog));
-  lint ii,n_lin;
-  FILE *fd;
+  AsciiFile *af;
+  lint n_lin;
+  long il_bad;
+  int ic;
 
-  //Open file and count lines
-  fd=fopen(fname,"r");
-  if(fd==NULL) error_open_file(fname);
+  //Load file and count lines
+  af=open_ascii(fname);
   if(n_objects==-1) 
-    n_lin=linecount(fd);
-  else
+    n_lin=(lint)(af->n_lines);
+  else {
+    if(n_objects>af->n_lines)
+      error_read_line(fname,(lint)(af->n_lines+1));
     n_lin=n_objects;
-  rewind(fd);
+  }
 
 #ifdef _VERBOSE
   printf("  %ld objects will be read \n",(long)n_lin);
@@ -908,22 +1177,37 @@ static Catalog *read_ascii(char *fname,lint *np)
   if(cat->pos==NULL)
     error_mem_out();
 
-  rewind(fd);
   //Read galaxies in mask
-  for(ii=0;ii<n_lin;ii++) {
-    double xx,yy,zz;
-    char s0[1024];
-    int sr;
-    if(fgets(s0,sizeof(s0),fd)==NULL)
-      error_read_line(fname,ii+1);
-    sr=sscanf(s0,"%lf %lf %lf",&xx,&yy,&zz);
-    if(sr!=3)
-      error_read_line(fname,ii+1);
-    cat->pos[3*ii]=xx;
-    cat->pos[3*ii+1]=yy;
-    cat->pos[3*ii+2]=zz;
+  il_bad=n_lin;
+#pragma omp parallel for default(none) shared(af,n_lin,cat)	\
+  reduction(min:il_bad) schedule(dynamic)
+  for(ic=0;ic<af->n_chunks;ic++) {
+    long il=af->chunk_line0[ic];
+    char *p=af->buf+af->chunk_start[ic];
+    char *end=af->buf+af->chunk_start[ic+1];
+
+    while((p<end)&&(il<n_lin)) {
+      char *s,*tend;
+      char *eol=memchr(p,'\n',end-p);
+      int ax;
+      if(eol==NULL) eol=end;
+      tend=p;
+      for(ax=0;ax<3;ax++) {
+	if(((s=next_token(tend,eol,&tend))==NULL)||
+	   parse_double(s,tend,&(cat->pos[3*il+ax])))
+	  break;
+      }
+      if(ax<3) {
+	il_bad=MIN(il_bad,il);
+	break;
+      }
+      il++;
+      p=eol+1;
+    }
   }
-  fclose(fd);
+  close_ascii(af);
+  if(il_bad<n_lin)
+    error_read_line(fname,(lint)(il_bad+1));
 
   return cat;
 }
@@ -967,30 +1251,187 @@ static int check_num_files(char *prefix)
   return -1;
 }
 
-static Catalog *read_snapshot_single(char *fname,lint *np,int input)
+typedef struct {
+  char fname[256];
+  lint np;           //#particles in this file
+  long pos_offset;   //Offset of its first position
+  lint ip0;          //Index of its first particle in the catalog
+} gad_file;
+
+static void gad_scan_file(gad_file *gf,int input,gad_header *head)
 {
   //////
-  // Creates catalog from a single snapshot file
-  Catalog *cat = (Catalog *)malloc(sizeof(Catalog));
+  // Reads the header of snapshot file gf->fname and
+  // finds and checks its block of positions
   lint ii;
-  gad_header head;
   int block1,block2;
 
-  FILE *snap=fopen(fname,"r");
-  if(snap==NULL) error_open_file(fname);
+  FILE *snap=fopen(gf->fname,"r");
+  if(snap==NULL) error_open_file(gf->fname);
 
   //Read header
   if(input==2)
     gad_seek_block(snap,"HEAD");
   my_fread(&block1,sizeof(int),1,snap);
-  my_fread(&head,sizeof(gad_header),1,snap);
+  my_fread(head,sizeof(gad_header),1,snap);
   my_fread(&block2,sizeof(int),1,snap);
   gad_check_block(block1,block2);
 
-  if(head.num_files!=1) {
+  gf->np=0;
+  for(ii=0;ii<6;ii++)
+    gf->np+=head->npart[ii];
+
+  //Positions block (block sizes are 32-bit, so they may wrap)
+  if(input==2)
+    gad_seek_block(snap,"POS");
+  my_fread(&block1,sizeof(int),1,snap);
+  if((unsigned int)block1!=(unsigned int)(3*sizeof(float)*gf->np)) {
+    fprintf(stderr,"CUTE: Corrupted block!\n");
+    exit(1);
+  }
+  gf->pos_offset=ftell(snap);
+  if(fseek(snap,gf->pos_offset+3*sizeof(float)*gf->np,SEEK_SET)) {
+    fprintf(stderr,"CUTE: error reading binary file \n");
+    exit(1);
+  }
+  my_fread(&block2,sizeof(int),1,snap);
+  gad_check_block(block1,block2);
+  fclose(snap);
+}
+
+static lint gad_total_np(gad_header *head)
+{
+  //////
+  // Total number of particles in the snapshot, including
+  // the high words used for more than 2^32 particles
+  int ii;
+  unsigned long long np_tot=0;
+
+  for(ii=0;ii<6;ii++) {
+    np_tot+=(unsigned int)(head->npartTotal[ii]);
+    np_tot+=((unsigned long long)(head->npartTotalHighWord[ii]))<<32;
+  }
+  if(np_tot!=(unsigned long long)((lint)np_tot)) {
+    fprintf(stderr,"CUTE: %llu particles are too many, compile with _LONGIDS\n",
+	    np_tot);
+    exit(1);
+  }
+
+  return (lint)np_tot;
+}
+
+static void my_pread(int fd,void *p,size_t nbytes,off_t offset)
+{
+  //////
+  // Self-checked pread
+  size_t nread=0;
+
+  while(nread<nbytes) {
+    ssize_t nr=pread(fd,((char *)p)+nread,nbytes-nread,offset+nread);
+    if(nr<=0) {
+      fprintf(stderr,"CUTE: error reading binary file \n");
+      exit(1);
+    }
+    nread+=nr;
+  }
+}
+
+static void gad_read_pos(int nfils,gad_file *gf,double *pos)
+{
+  //////
+  // Reads the positions in all snapshot files straight into
+  // their place in pos. Each file is split into chunks of
+  // GAD_CHUNK particles and the chunks of all files are read
+  // in parallel with pread.
+  int ifil,ic,n_chunks=0;
+  int *chunk_fil,*chunk_id;
+
+  for(ifil=0;ifil<nfils;ifil++)
+    n_chunks+=(int)((gf[ifil].np+GAD_CHUNK-1)/GAD_CHUNK);
+  chunk_fil=(int *)malloc(MAX(n_chunks,1)*sizeof(int));
+  chunk_id=(int *)malloc(MAX(n_chunks,1)*sizeof(int));
+  if((chunk_fil==NULL)||(chunk_id==NULL))
+    error_mem_out();
+  ic=0;
+  for(ifil=0;ifil<nfils;ifil++) {
+    int jc;
+    for(jc=0;jc<(gf[ifil].np+GAD_CHUNK-1)/GAD_CHUNK;jc++) {
+      chunk_fil[ic]=ifil;
+      chunk_id[ic]=jc;
+      ic++;
+    }
+  }
+
+#pragma omp parallel default(none)		\
+  shared(n_chunks,chunk_fil,chunk_id,gf,pos)
+  {
+    int jc;
+    float *buf=(float *)malloc(3*GAD_CHUNK*sizeof(float));
+    if(buf==NULL)
+      error_mem_out();
+
+#pragma omp for schedule(dynamic)
+    for(jc=0;jc<n_chunks;jc++) {
+      gad_file *g=&(gf[chunk_fil[jc]]);
+      lint ip0=(lint)chunk_id[jc]*GAD_CHUNK;
+      lint np=MIN(GAD_CHUNK,g->np-ip0);
+      lint ii;
+      int fd=open(g->fname,O_RDONLY);
+      if(fd<0) error_open_file(g->fname);
+      my_pread(fd,buf,3*sizeof(float)*np,g->pos_offset+3*sizeof(float)*ip0);
+      close(fd);
+
+      for(ii=0;ii<3*np;ii++)
+	pos[3*(size_t)(g->ip0+ip0)+ii]=(double)(buf[ii]);
+    }
+    free(buf);
+  } //end omp parallel
+
+  free(chunk_fil);
+  free(chunk_id);
+}
+
+static Catalog *read_gadget(char *prefix,lint *np,int input)
+{
+  //////
+  // Creates catalog from a snapshot, which may be split into
+  // several files. Headers are read first, so that the
+  // positions can then be read in parallel (see gad_read_pos)
+  Catalog *cat = (Catalog *)malloc(sizeof(Catalog));
+  lint ii,np_read;
+  gad_header head;
+  gad_file *gf;
+  int nfils=check_num_files(prefix);
+  if(nfils<=0) exit(1);
+
+#ifdef _VERBOSE
+  printf("  Reading from GADGET snapshot format \n");
+#endif //_VERBOSE
+
+  gf=(gad_file *)malloc(nfils*sizeof(gad_file));
+  if(gf==NULL)
+    error_mem_out();
+  if(nfils==1) {
+    printf("  Reading single snapshot file\n");
+    sprintf(gf[0].fname,"%s",prefix);
+  }
+  else {
+    printf("  Reading %d snapshot files \n",nfils);
+    sprintf(gf[0].fname,"%s.0",prefix);
+  }
+  gad_scan_file(&(gf[0]),input,&head);
+
+  if((nfils==1)&&(head.num_files!=1)) {
     fprintf(stderr,"CUTE: Multi-file input not expected \n");
     exit(1);
   }
+  if(head.num_files!=nfils) {
+    fprintf(stderr,
+	"CUTE: Header and existing files do not match %d != %d.\n",
+	nfils,head.num_files);
+    fprintf(stderr,"      There may be some files missing\n");
+    exit(1);
+  }
 
 #ifdef _VERBOSE
   printf("  The cosmological model is:\n");
@@ -1000,9 +1441,9 @@ static Catalog *read_snapshot_single(char *fname,lint *np,int input)
   printf("  This file contains: \n");
   for(ii=0;ii<6;ii++) {
     printf("   - %d particles of type %d with mass",
-        head.npart[ii],(int)ii);
+	head.npart[ii],(int)ii);
     printf(" %.3lE (%d in total)\n",
-        head.mass[ii],head.npartTotal[ii]);
+	head.mass[ii],head.npartTotal[ii]);
   }
   printf("  The box size is %.3lf\n",head.BoxSize);
   printf("  Redshift z = %.3lf \n",head.redshift);
@@ -1010,176 +1451,331 @@ static Catalog *read_snapshot_single(char *fname,lint *np,int input)
 
   l_box=head.BoxSize;
   l_box_half=l_box*0.5;
-  cat->np=0;
-  for(ii=0;ii<6;ii++) {
-    cat->np+=head.npart[ii];
-    if(head.npart[ii]!=head.npartTotal[ii]) {
-      fprintf(stderr,"CUTE: error reading snapshot \n");
+  cat->np=gad_total_np(&head);
+  *np=cat->np;
+  if(nfils==1) {
+    for(ii=0;ii<6;ii++) {
+      if((head.npart[ii]!=head.npartTotal[ii])||(head.npartTotalHighWord[ii])) {
+	fprintf(stderr,"CUTE: error reading snapshot \n");
+	exit(1);
+      }
+    }
+  }
+
+  //Find where the particles of each file go
+  np_read=0;
+  for(ii=0;ii<nfils;ii++) {
+    if(ii>0) {
+      sprintf(gf[ii].fname,"%s.%d",prefix,(int)ii);
+      gad_scan_file(&(gf[ii]),input,&head);
+    }
+    if(nfils>1)
+      printf("  %ld parts in file %ld \n",(long)(gf[ii].np),(long)ii);
+    gf[ii].ip0=np_read;
+    if(np_read+gf[ii].np>cat->np) {
+      fprintf(stderr,
+	  "CUTE: files seem to contain too many particles\n");
+      fprintf(stderr,"      file %s, %ld > %ld \n",
+	  gf[ii].fname,(long)(np_read+gf[ii].np),(long)(cat->np));
       exit(1);
     }
+    np_read+=gf[ii].np;
+  }
+  if(np_read!=cat->np) {
+    fprintf(stderr,
+	"CUTE: #particles read disagrees with header: %ld != %ld\n",
+	(long)np_read,(long)(cat->np));
+    exit(1);
   }
-  *np=cat->np;
 
-  cat->pos=(double *)malloc(3*cat->np*sizeof(double));
+  cat->pos=(double *)malloc(3*(size_t)(cat->np)*sizeof(double));
   if(cat->pos==NULL)
     error_mem_out();
+  gad_read_pos(nfils,gf,cat->pos);
+  free(gf);
 
-  if(input==2)
-    gad_seek_block(snap,"POS");
-  my_fread(&block1,sizeof(int),1,snap);
-  for(ii=0;ii<cat->np;ii++) {
-    float pos[3];
-    my_fread(pos,sizeof(float),3,snap);
-    cat->pos[3*ii]=(double)(pos[0]);
-    cat->pos[3*ii+1]=(double)(pos[1]);
-    cat->pos[3*ii+2]=(double)(pos[2]);
+  return cat;
+}
+
+/////////////////////////
+// HDF5 catalogs
+// input_format 3 reads the positions from the datasets named in
+// hdf5_datasets. This may be a single (N,3) dataset (e.g.
+// PartType1/Coordinates) or three one-dimensional datasets
+// "x,y,z" separated by commas.
+#ifdef _HAVE_HDF5
+//#rows read at once from each dataset
+#define HDF5_CHUNK 1048576
+
+static hid_t open_hdf5_dataset(hid_t file,char *fname,char *dname,
+			       int rank,hsize_t *n_rows)
+{
+  //////
+  // Opens dataset dname, checks its shape is (N) or (N,3)
+  // (for rank 1 or 2 respectively) and gets N
+  hid_t dset,space;
+  hsize_t dims[2];
+
+  dset=H5Dopen2(file,dname,H5P_DEFAULT);
+  if(dset<0) {
+    fprintf(stderr,"CUTE: can't find dataset %s in %s\n",dname,fname);
+    exit(1);
   }
-  my_fread(&block2,sizeof(int),1,snap);
-  gad_check_block(block1,block2);
-  fclose(snap);
+  space=H5Dget_space(dset);
+  if(H5Sget_simple_extent_ndims(space)!=rank) {
+    fprintf(stderr,"CUTE: dataset %s in %s should have rank %d\n",
+	    dname,fname,rank);
+    exit(1);
+  }
+  H5Sget_simple_extent_dims(space,dims,NULL);
+  H5Sclose(space);
+  if((rank==2)&&(dims[1]!=3)) {
+    fprintf(stderr,"CUTE: dataset %s in %s should have 3 columns\n",
+	    dname,fname);
+    exit(1);
+  }
+  *n_rows=dims[0];
 
-  return cat;
+  return dset;
 }
 
-static Catalog *read_gadget(char *prefix,lint *np,int input)
+static void read_hdf5_rows(hid_t dset,int rank,hsize_t i0,hsize_t n,
+			   double *buf,char *fname)
+{
+  //////
+  // Reads rows i0 to i0+n-1 of dset into buf through a
+  // hyperslab selection
+  hid_t fspace,mspace;
+  hsize_t start[2]={i0,0},count[2]={n,3};
+  herr_t st;
+
+  if(n==0) return;
+  fspace=H5Dget_space(dset);
+  H5Sselect_hyperslab(fspace,H5S_SELECT_SET,start,NULL,count,NULL);
+  mspace=H5Screate_simple(rank,count,NULL);
+  st=H5Dread(dset,H5T_NATIVE_DOUBLE,mspace,fspace,H5P_DEFAULT,buf);
+  H5Sclose(mspace);
+  H5Sclose(fspace);
+  if(st<0) {
+    fprintf(stderr,"CUTE: error reading HDF5 catalog %s\n",fname);
+    exit(1);
+  }
+}
+
+static Catalog *read_hdf5(char *fname,lint *np)
 {
+  //////
+  // Creates catalog from HDF5 file fname, reading it in
+  // chunks of HDF5_CHUNK rows
   Catalog *cat = (Catalog *)malloc(sizeof(Catalog));
-  int nfils=check_num_files(prefix);
-  if(nfils<=0) exit(1);
+  char names[3][256],list[256];
+  char *tok,*saveptr;
+  int ii,n_names=0,rank;
+  hid_t file,dset[3];
+  hsize_t n_rows;
+  lint ip;
+  double *buf;
+
+  //Dataset names
+  sprintf(list,"%s",hdf5_datasets);
+  tok=strtok_r(list,",",&saveptr);
+  while((tok!=NULL)&&(n_names<3)) {
+    sprintf(names[n_names],"%s",tok);
+    n_names++;
+    tok=strtok_r(NULL,",",&saveptr);
+  }
+  if((n_names!=1)&&(n_names!=3)) {
+    fprintf(stderr,"CUTE: hdf5_datasets should name 1 or 3 datasets\n");
+    exit(1);
+  }
+  rank=(n_names==1) ? 2 : 1;
+
+  file=H5Fopen(fname,H5F_ACC_RDONLY,H5P_DEFAULT);
+  if(file<0) error_open_file(fname);
+  for(ii=0;ii<n_names;ii++) {
+    hsize_t n;
+    dset[ii]=open_hdf5_dataset(file,fname,names[ii],rank,&n);
+    if(ii==0)
+      n_rows=n;
+    else if(n!=n_rows) {
+      fprintf(stderr,"CUTE: datasets %s and %s in %s have different lengths\n",
+	      names[0],names[ii],fname);
+      exit(1);
+    }
+  }
 
-#ifdef _VERBOSE
-  printf("  Reading from GADGET snapshot format \n");
-#endif //_VERBOSE
+  if(n_objects==-1)
+    cat->np=(lint)n_rows;
+  else {
+    if(n_objects>n_rows)
+      error_read_line(fname,(lint)(n_rows+1));
+    cat->np=n_objects;
+  }
+  if((hsize_t)(cat->np)!=n_rows)
+    printf("  %ld of %llu objects will be read \n",
+	   (long)(cat->np),(unsigned long long)n_rows);
+  *np=cat->np;
 
-  if(nfils==1) {
-    printf("  Reading single snapshot file\n");
-    cat=read_snapshot_single(prefix,np,input);
-    return cat;
+  cat->pos=(double *)malloc(3*(size_t)(MAX(cat->np,1))*sizeof(double));
+  if(cat->pos==NULL)
+    error_mem_out();
+
+  //An (N,3) dataset goes straight into pos, while
+  //separate coordinates are interleaved chunk by chunk
+  if(rank==2) {
+    for(ip=0;ip<cat->np;ip+=HDF5_CHUNK) {
+      lint n=MIN(HDF5_CHUNK,cat->np-ip);
+      read_hdf5_rows(dset[0],2,ip,n,&(cat->pos[3*ip]),fname);
+    }
   }
   else {
-    lint ii;
-    char fname[256];
-    gad_header head;
-    int block1,block2;
-    FILE *snap;
+    buf=(double *)malloc(MIN(MAX(cat->np,1),HDF5_CHUNK)*sizeof(double));
+    if(buf==NULL)
+      error_mem_out();
+    for(ip=0;ip<cat->np;ip+=HDF5_CHUNK) {
+      lint n=MIN(HDF5_CHUNK,cat->np-ip);
+      for(ii=0;ii<3;ii++) {
+	lint jj;
+	read_hdf5_rows(dset[ii],1,ip,n,buf,fname);
+#pragma omp parallel for default(none) shared(cat,ip,n,ii,buf)
+	for(jj=0;jj<n;jj++)
+	  cat->pos[3*(ip+jj)+ii]=buf[jj];
+      }
+    }
+    free(buf);
+  }
 
-    printf("  Reading %d snapshot files \n",nfils);
-    //    fprintf(stderr,"CUTE: multi-file input not supported \n");
-    //    exit(1);
-
-    sprintf(fname,"%s.0",prefix);
-    snap=fopen(fname,"r");
-    if(snap==NULL) error_open_file(fname);
-
-    //Read header
-    if(input==2)
-      gad_seek_block(snap,"HEAD");
-    my_fread(&block1,sizeof(int),1,snap);
-    my_fread(&head,sizeof(gad_header),1,snap);
-    my_fread(&block2,sizeof(int),1,snap);
-    gad_check_block(block1,block2);
+  for(ii=0;ii<n_names;ii++)
+    H5Dclose(dset[ii]);
+  H5Fclose(file);
 
-    if(head.num_files!=nfils) {
-      fprintf(stderr,
-          "CUTE: Header and existing files do not match %d != %d.\n",
-          nfils,head.num_files);
-      fprintf(stderr,"      There may be some files missing\n");
-      exit(1);
-    }
+  return cat;
+}
+#endif //_HAVE_HDF5
 
-#ifdef _VERBOSE
-    printf("  The cosmological model is:\n");
-    printf("   - Omega_M = %.3lf\n",head.Omega0);
-    printf("   - Omega_L = %.3lf\n",head.OmegaLambda);
-    printf("   - h = %.3lf\n",head.HubbleParam);
-    printf("  This file contains: \n");
-    for(ii=0;ii<6;ii++) {
-      printf("   - %d particles of type %d with mass %.3lE\n",
-          head.npartTotal[ii],(int)ii,head.mass[ii]);
-    }
-    printf("  The box size is %.3lf\n",head.BoxSize);
-    printf("  Redshift z = %.3lf \n",head.redshift);
-#endif //_VERBOSE
+/////////////////////////
+// Binary catalogs
+// A 64-byte header (magic and number of objects) followed
+// by the interleaved positions x,y,z of all objects, stored
+// as native-endian doubles.
+#define CATALOG_BIN_MAGIC "CUTEBOX1"
+#define CATALOG_BIN_HSIZE 64
 
-    l_box=head.BoxSize;
-    l_box_half=l_box*0.5;
-    cat->np=0;
-    for(ii=0;ii<6;ii++)
-      cat->np+=head.npartTotal[ii];
-    *np=cat->np;
+typedef struct {
+  char magic[8];
+  long long np;
+} CatalogBinHeader;
 
-    cat->pos=(double *)malloc(3*cat->np*sizeof(double));
-    if(cat->pos==NULL)
-      error_mem_out();
-    fclose(snap);
+static int is_catalog_bin(char *fname)
+{
+  //////
+  // Checks whether fname starts with the binary catalog magic.
+  // Only regular files are checked, so that nothing is consumed
+  // from pipes
+  char magic[8];
+  struct stat st;
+  FILE *fd;
+  if((stat(fname,&st)<0)||(!S_ISREG(st.st_mode)))
+    return 0;
+  fd=fopen(fname,"rb");
+  if(fd==NULL)
+    return 0;
+  if(fread(magic,1,8,fd)!=8) {
+    fclose(fd);
+    return 0;
+  }
+  fclose(fd);
 
-    lint np_read=0;
-    for(ii=0;ii<nfils;ii++) {
-      lint np_new;
-      lint jj;
+  return !memcmp(magic,CATALOG_BIN_MAGIC,8);
+}
 
-      sprintf(fname,"%s.%d",prefix,(int)ii);
-      snap=fopen(fname,"r");
-      if(snap==NULL) error_open_file(fname);
-#ifdef _VERBOSE
-      printf("  Reading file  %s \n",fname);
-#endif //_VERBOSE
+static Catalog *read_catalog_bin(char *fname,lint *np)
+{
+  //////
+  // Maps binary catalog fname into memory. The mapping is
+  // private, so positions can be modified in place without
+  // touching the file.
+  int fd;
+  struct stat st;
+  CatalogBinHeader head;
+  char *map;
+  Catalog *cat=(Catalog *)malloc(sizeof(Catalog));
+  if(cat==NULL)
+    error_mem_out();
 
-      //Read header
-      if(input==2)
-        gad_seek_block(snap,"HEAD");
-      my_fread(&block1,sizeof(int),1,snap);
-      my_fread(&head,sizeof(gad_header),1,snap);
-      my_fread(&block2,sizeof(int),1,snap);
-      gad_check_block(block1,block2);
-
-      np_new=0;
-      for(jj=0;jj<6;jj++)
-        np_new+=head.npart[jj];
-      printf("  %ld parts in file %ld \n",(long)np_new,(long)ii);
-
-      if(np_read+np_new>cat->np) {
-        fprintf(stderr,
-            "CUTE: files seem to contain too many particles\n");
-        fprintf(stderr,"      file %s, %ld > %ld \n",
-            fname,(long)(np_read+np_new),(long)(cat->np));
-        exit(1);
-      }
+  fd=open(fname,O_RDONLY);
+  if(fd<0) error_open_file(fname);
+  if((fstat(fd,&st)<0)||(st.st_size<CATALOG_BIN_HSIZE)) {
+    fprintf(stderr,"CUTE: error reading binary catalog %s\n",fname);
+    exit(1);
+  }
+  map=mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(map==MAP_FAILED) {
+    fprintf(stderr,"CUTE: couldn't map binary catalog %s\n",fname);
+    exit(1);
+  }
 
-      if(input==2)
-        gad_seek_block(snap,"POS");
-      my_fread(&block1,sizeof(int),1,snap);
-      for(jj=np_read;jj<np_read+np_new;jj++) {
-        float pos[3];
-        my_fread(pos,sizeof(float),3,snap);
-        cat->pos[3*jj]=(double)(pos[0]);
-        cat->pos[3*jj+1]=(double)(pos[1]);
-        cat->pos[3*jj+2]=(double)(pos[2]);
-      }
-      my_fread(&block2,sizeof(int),1,snap);
-      gad_check_block(block1,block2);
-      fclose(snap);
+  memcpy(&head,map,sizeof(CatalogBinHeader));
+  if((head.np<0)||
+     ((size_t)st.st_size!=CATALOG_BIN_HSIZE+3*head.np*sizeof(double))) {
+    fprintf(stderr,"CUTE: corrupted binary catalog %s\n",fname);
+    exit(1);
+  }
+  if(n_objects>head.np)
+    error_read_line(fname,(int)(head.np+1));
 
-      np_read+=np_new;
-    }
-    if(np_read!=cat->np) {
-      fprintf(stderr,
-          "CUTE: #particles read disagrees with header: %ld != %ld\n",
-          (long)np_read,(long)(cat->np));
-      exit(1);
-    }
+#ifdef _VERBOSE
+  printf("  Binary catalog with %lld objects\n",head.np);
+#endif
+
+  if(n_objects==-1)
+    cat->np=(lint)(head.np);
+  else
+    cat->np=n_objects;
+  *np=cat->np;
+  cat->pos=(double *)(map+CATALOG_BIN_HSIZE);
+  cat->map=map;
+  cat->map_size=st.st_size;
+
+  return cat;
+}
 
-    return cat;
+void write_catalog_bin(char *fname,Catalog *cat)
+{
+  //////
+  // Writes cat into fname as a binary catalog
+  FILE *fo;
+  char hbuf[CATALOG_BIN_HSIZE];
+  CatalogBinHeader head;
+  size_t n=3*cat->np;
+  int st=0;
+
+  memset(hbuf,0,CATALOG_BIN_HSIZE);
+  memset(&head,0,sizeof(CatalogBinHeader));
+  memcpy(head.magic,CATALOG_BIN_MAGIC,8);
+  head.np=cat->np;
+  memcpy(hbuf,&head,sizeof(CatalogBinHeader));
+
+  fo=fopen(fname,"wb");
+  if(fo==NULL) error_open_file(fname);
+  st|=(fwrite(hbuf,1,CATALOG_BIN_HSIZE,fo)!=CATALOG_BIN_HSIZE);
+  st|=(fwrite(cat->pos,sizeof(double),n,fo)!=n);
+  st|=fclose(fo);
+  if(st) {
+    fprintf(stderr,"CUTE: error writing binary catalog %s\n",fname);
+    exit(1);
   }
 }
 
 Catalog *read_catalog(char *fname,lint *np)
 {
   //////
-  // Creates catalog from file fname
+  // Creates catalog from file fname. Binary catalogs are
+  // recognized by their magic and mapped into memory
   lint ii;
   double x_mean=0,y_mean=0,z_mean=0;
-  Catalog *cat = (Catalog *)malloc(sizeof(Catalog));
+  Catalog *cat;
 
   printf("*** Reading catalog ");
 #ifdef _VERBOSE
@@ -1187,23 +1783,33 @@ Catalog *read_catalog(char *fname,lint *np)
 #endif
   printf("\n");
 
-  if(input_format)
-    cat=read_gadget(fname,np,input_format);
-  else
-    cat=read_ascii(fname,np);
+  if(is_catalog_bin(fname))
+    cat=read_catalog_bin(fname,np);
+  else {
+#ifdef _HAVE_HDF5
+    if(input_format==3)
+      cat=read_hdf5(fname,np);
+    else
+#endif //_HAVE_HDF5
+    if(input_format)
+      cat=read_gadget(fname,np,input_format);
+    else
+      cat=read_ascii(fname,np);
+    cat->map=NULL;
+    cat->map_size=0;
+  }
 
-  //Correct particles out of bounds and calculate CoM
+  //Correct particles out of bounds and calculate CoM.
+  //Only wrapped positions are written, so that the pages
+  //of a mapped catalog are not copied needlessly
   for(ii=0;ii<cat->np;ii++) {
     double xx,yy,zz;
     xx=cat->pos[3*ii];
     yy=cat->pos[3*ii+1];
     zz=cat->pos[3*ii+2];
-    if((xx<0)||(xx>=l_box)) xx=wrap_double(xx);
-    if((yy<0)||(yy>=l_box)) yy=wrap_double(yy);
-    if((zz<0)||(zz>=l_box)) zz=wrap_double(yy);
-    cat->pos[3*ii]=xx;
-    cat->pos[3*ii+1]=yy;
-    cat->pos[3*ii+2]=zz;
+    if((xx<0)||(xx>=l_box)) cat->pos[3*ii]=xx=wrap_double(xx);
+    if((yy<0)||(yy>=l_box)) cat->pos[3*ii+1]=yy=wrap_double(yy);
+    if((zz<0)||(zz>=l_box)) cat->pos[3*ii+2]=zz=wrap_double(zz);
     x_mean+=xx/cat->np;
     y_mean+=yy/cat->np;
     z_mean+=zz/cat->np;
@@ -1218,6 +1824,17 @@ Catalog *read_catalog(char *fname,lint *np)
   return cat;
 }
 
+void convert_catalog(char *fname_in,char *fname_out)
+{
+  //////
+  // Reads catalog fname_in (with the current input_format)
+  // and writes it into fname_out as a binary catalog
+  lint n;
+  Catalog *cat=read_catalog(fname_in,&n);
+  printf("*** Writing binary catalog %s\n",fname_out);
+  write_catalog_bin(fname_out,cat);
+  free_catalog(cat);
+}
 
 #ifdef _CUTE_AS_PYTHON_MODULE
 
@@ -1243,6 +1860,9 @@ void set_random_filename(char *s){
 void set_input_format(int i){
   input_format=i;
 }
+void set_hdf5_datasets(char *s){
+  snprintf(hdf5_datasets,sizeof(hdf5_datasets),"%s",s);
+}
 void set_output_filename(char *s){
   sprintf(fnameOut,"%s",s);
 }
@@ -1287,4 +1907,10 @@ void set_do_CCF(int i){
 void set_n_grid_side(int i){
   n_grid = i;
 }
+void set_pm_assignment(int i){
+  pm_assignment = i;
+}
+void set_pm_interlacing(int i){
+  pm_interlacing = i;
+}
 #endif
@@ -43,4 +43,8 @@ void read_run_params(char *fname);
 
 Catalog *read_catalog(char *fname,lint *np);
 
+void write_catalog_bin(char *fname,Catalog *cat);
+
+void convert_catalog(char *fname_in,char *fname_out);
+
 #endif //_CUTE_IO_BOX_
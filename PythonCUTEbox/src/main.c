@@ -393,11 +393,11 @@ void write_3d_CF(char *fname,double *corr,double *ercorr,unsigned long long *DD)
     for(ii=0;ii<NB_R;ii++) {
       for(jj=0;jj<NB_mu;jj++) {
         double r,mu;
-        int ind = ii+NB_R*jj; (void)ind;
+        int ind = jj+NB_mu*ii; (void)ind;
         r=(ii+0.5)/(NB_R*I_R_MAX);
         mu=(jj+0.5)/(NB_mu);
         fprintf(fo,"%lE %lE %lE %llu \n",
-            r,mu,corr[jj+NB_R*ii],DD[jj+NB_R*ii]);
+            r,mu,corr[ind],DD[ind]);
 #ifdef _CUTE_AS_PYTHON_MODULE
         set_result_2d(global_result, ii, jj, ind, r, mu, corr[ind],
             (double)DD[ind], 0.0, 0.0, 0.0,
@@ -1405,16 +1405,56 @@ void run_monopole_corr_tree(void)
   timer(5);
 }
 
+static double *get_xi_pm(void)
+{
+  //////
+  // Returns xi at every separation of the PM grid, which
+  // is either read from fnameData or painted from the data
+  // catalog with the mass assignment pm_assignment
+  double *grid;
+
+  if(pm_assignment==0) {
+    grid = read_grid();
+#ifdef _DEBUG
+    write_grid(grid,"debug_DatGrid.dat");
+#endif
+    printf("*** Calculating xi on the PM grid \n");
+    grid_2_xi(grid);
+  }
+  else {
+    lint n_dat;
+    Catalog *cat_dat;
+#ifdef _CUTE_AS_PYTHON_MODULE
+    if(global_galaxy_catalog == NULL){
+      cat_dat=read_catalog(fnameData,&n_dat);
+    } else {
+      cat_dat=global_galaxy_catalog;
+      n_dat=global_galaxy_catalog->np;
+    }
+#else
+    cat_dat=read_catalog(fnameData,&n_dat);
+#endif
+#ifdef _DEBUG
+    write_cat(cat_dat,"debug_DatCat.dat");
+#endif
+    printf("*** Calculating xi on the PM grid \n");
+    grid=pos_2_xi(*cat_dat);
+#ifdef _CUTE_AS_PYTHON_MODULE
+    if(global_galaxy_catalog == NULL)
+#endif
+      free_catalog(cat_dat);
+  }
+  printf("\n");
+
+  return grid;
+}
+
 void run_monopole_corr_pm(void)
 {
   //////
   // Main routine for monopole using pm
 
-  double *grid,*new_grid;
-  int new_n_grid;
-  //float *grid;
-  /*lint n_dat;
-    Catalog cat_dat;*/
+  double *grid;
   unsigned long long DD[NB_R];
   double corr[NB_R],ercorr[NB_R];
   timer(4);
@@ -1432,30 +1472,7 @@ void run_monopole_corr_pm(void)
   printf("\n");
 #endif
 
-
-  /*  //Read data
-      cat_dat=read_catalog(fnameData,&n_dat);
-      printf("*** Calculating PM grid \n");
-      grid=pos_2_tsc(cat_dat);
-      printf("\n");
-#ifdef _DEBUG
-write_cat(cat_dat,"debug_DatCat.dat");
-write_grid(grid,"debug_DatGrid.dat");
-#endif
-free_catalog(cat_dat);
-   */
-  grid = read_grid();
-  new_n_grid = 146; // (int)(l_box*I_R_MAX*NB_R);
-  if(new_n_grid<n_grid) {
-    printf("  Appropriate grid size: %d\n",new_n_grid);
-    new_grid = resize_grid(grid,new_n_grid);
-
-    n_grid = new_n_grid;
-    grid = new_grid;
-  }
-#ifdef _DEBUG
-  write_grid(grid,"debug_DatGrid.dat");
-#endif
+  grid = get_xi_pm();
 
   printf("*** Correlating\n");
   timer(0);
@@ -1473,6 +1490,82 @@ free_catalog(cat_dat);
 
 }
 
+void run_3d_ps_corr_pm(void)
+{
+  //////
+  // Main routine for xi(pi,sigma) using pm
+  double *grid;
+  unsigned long long DD[NB_R*NB_R];
+  double corr[NB_R*NB_R],ercorr[NB_R*NB_R];
+  timer(4);
+
+#ifdef _VERBOSE
+  printf("*** 3D correlation function (pi,sigma): \n");
+  printf(" - Range: (%.3lf,%.3lf) < (pi,sigma) < (%.3lf,%.3lf) Mpc/h\n",
+      0.,0.,1./I_R_MAX,1./I_R_MAX);
+  printf(" - #bins: (%d,%d)\n",NB_R,NB_R);
+#ifdef _LOGBIN
+  printf(" - Using logarithmic binning with %d bins per decade (log binning not recommended for (pi,sigma)!)\n",N_LOGINT);
+#else //_LOGBIN
+  printf(" - Resolution: Dr = %.3lf (Mpc/h)\n",1./(I_R_MAX*NB_R));
+#endif //_LOGBIN
+  printf(" - Using a PM approach\n");
+  printf("\n");
+#endif // _VERBOSE
+
+  grid = get_xi_pm();
+
+  printf("*** Correlating\n");
+  timer(0);
+  corr_3d_ps_box_pm(grid,corr,ercorr,DD);
+  timer(1);
+  printf("\n");
+
+  write_3d_CF(fnameOut,corr,ercorr,DD);
+
+  printf("*** Cleaning up \n");
+  free(grid);
+  printf("\n");
+
+  timer(5);
+}
+
+void run_3d_rmu_corr_pm(void)
+{
+  //////
+  // Main routine for xi(r,mu) using pm
+  double *grid;
+  unsigned long long DD[NB_R*NB_mu];
+  double corr[NB_R*NB_mu],ercorr[NB_R*NB_mu];
+  timer(4);
+
+#ifdef _VERBOSE
+  printf("*** 3D correlation function (r,mu): \n");
+  printf(" - Range: (%.3lf,%.3lf) < (r,mu) < (%.3lf,%.3lf) Mpc/h\n",
+      0.,0.,1./I_R_MAX,1.);
+  printf(" - #bins: (%d,%d)\n",NB_R,NB_mu);
+  printf(" - Resolution: Dr = %.3lf (Mpc/h)\n",1./(I_R_MAX*NB_R));
+  printf(" - Using a PM approach\n");
+  printf("\n");
+#endif // _VERBOSE
+
+  grid = get_xi_pm();
+
+  printf("*** Correlating\n");
+  timer(0);
+  corr_3d_rmu_box_pm(grid,corr,ercorr,DD);
+  timer(1);
+  printf("\n");
+
+  write_3d_CF(fnameOut,corr,ercorr,DD);
+
+  printf("*** Cleaning up \n");
+  free(grid);
+  printf("\n");
+
+  timer(5);
+}
+
 void run_monopole_corr_p3m(void)
 {
   //////
@@ -1492,11 +1585,20 @@ int runCUTEbox(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *rando
     // Main routine
     int ii;
     char fnameIn[128];
-    if(argc!=2) {
+    char *fname_cat_in=NULL,*fname_cat_out=NULL;
+    if((argc==5)&&(!strcmp(argv[1],"-c"))) {
+      //Convert a catalog into binary format
+      sprintf(fnameIn,"%s",argv[2]);
+      fname_cat_in=argv[3];
+      fname_cat_out=argv[4];
+    }
+    else if(argc==2)
+      sprintf(fnameIn,"%s",argv[1]);
+    else {
       printf("Usage ./CUTE_box <input file>\n");
+      printf("   or ./CUTE_box -c <input file> <catalog> <binary catalog>\n");
       exit(1);
     }
-    sprintf(fnameIn,"%s",argv[1]);
 
 #endif
 
@@ -1555,6 +1657,11 @@ int runCUTEbox(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *rando
 
 #ifndef _CUTE_AS_PYTHON_MODULE  
     read_run_params(fnameIn);
+    if(fname_cat_in!=NULL) {
+      convert_catalog(fname_cat_in,fname_cat_out);
+      printf("             Done !!!             \n\n");
+      return 0;
+    }
 #endif
 
     if(corr_type==1) {
@@ -1578,12 +1685,16 @@ int runCUTEbox(Catalog *galaxy_catalog, Catalog *galaxy_catalog2, Catalog *rando
     else if(corr_type==2) {
       if(do_CCF)
         run_3d_ps_cross_corr_boxes(use_randoms,reuse_randoms);
+      else if(use_pm==1)
+        run_3d_ps_corr_pm();
       else
         run_3d_ps_auto_corr_boxes(use_randoms);
     }
     else if(corr_type==3) {
       if(do_CCF)
         run_3d_rmu_cross_corr_boxes(use_randoms,reuse_randoms);
+      else if(use_pm==1)
+        run_3d_rmu_corr_pm();
       else {
         run_3d_rmu_auto_corr_boxes(use_randoms);
       }
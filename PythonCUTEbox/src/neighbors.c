@@ -26,6 +26,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#ifdef _HAVE_OMP
+#include <omp.h>
+#endif //_HAVE_OMP
 #include "define.h"
 #include "common.h"
 
@@ -33,68 +36,117 @@ void free_boxes(int nside,NeighborBox *boxes)
 {
   //////
   // Frees all memory associated with a box
-  // set of size nside
-  int ii;
-
-  for(ii=0;ii<nside*nside*nside;ii++) {
-    if(boxes[ii].np>0)
-      free(boxes[ii].pos);
-  }
-  
+  // set of size nside. All particle positions
+  // live in one arena starting at the first box.
+  free(boxes[0].x);
   free(boxes);
 }
 
 NeighborBox *catalog_to_boxes(int n_box_side,Catalog cat)
 {
   //////
-  // Creates boxes for nearest-neighbor searching
-  lint ii;
-  int nside;
+  // Creates boxes for nearest-neighbor searching.
+  // Particles are binned with a parallel counting sort:
+  // the catalog is split into chunks, each with its own
+  // histogram of box counts, which a prefix sum turns into
+  // the place in the arena where each chunk writes its
+  // particles for each box.
+  lint ii,npad,nbox;
+  int nside,ichunk,nchunk=1;
+  int *box_id;
+  lint *hists,*box_start;
+  double *arena;
   NeighborBox *boxes;
 
   printf("*** Building neighbor boxes \n");
   nside=n_box_side;
+  nbox=(lint)nside*nside*nside;
   printf("  There will be %d boxes per side with a size of %lf \n",
 	 nside,l_box/nside);
   
-  boxes=(NeighborBox *)malloc(nside*nside*nside*sizeof(NeighborBox));
+  boxes=(NeighborBox *)malloc(nbox*sizeof(NeighborBox));
   if(boxes==NULL) error_mem_out();
-  for(ii=0;ii<nside*nside*nside;ii++)
-    boxes[ii].np=0;
+  box_id=(int *)malloc(MAX(cat.np,1)*sizeof(int));
+  if(box_id==NULL) error_mem_out();
+  box_start=(lint *)malloc((nbox+1)*sizeof(lint));
+  if(box_start==NULL) error_mem_out();
 
-  for(ii=0;ii<cat.np;ii++) {	// count how many particles in each box
-    int ix,iy,iz;
+#ifdef _HAVE_OMP
+  nchunk=omp_get_max_threads();
+#endif //_HAVE_OMP
+  //cap #chunks so that the histograms don't outweigh the particles
+  nchunk=MIN(nchunk,MAX(1,(int)(4.*cat.np/nbox)));
+  hists=(lint *)calloc(nchunk*nbox,sizeof(lint));
+  if(hists==NULL) error_mem_out();
 
-    ix=(int)(cat.pos[3*ii]/l_box*nside);
-    iy=(int)(cat.pos[3*ii+1]/l_box*nside);
-    iz=(int)(cat.pos[3*ii+2]/l_box*nside);
+#pragma omp parallel for default(none) shared(cat,nside,nchunk,nbox,l_box,box_id,hists)
+  for(ichunk=0;ichunk<nchunk;ichunk++) {	// count how many particles in each box
+    lint ip;
+    lint *hist=&(hists[ichunk*nbox]);
+    lint i0=(cat.np*ichunk)/nchunk;
+    lint i1=(cat.np*(ichunk+1))/nchunk;
+    for(ip=i0;ip<i1;ip++) {
+      int ix,iy,iz;
 
-    (boxes[ix+nside*(iy+nside*iz)].np)++;
+      ix=(int)(cat.pos[3*ip]/l_box*nside);
+      iy=(int)(cat.pos[3*ip+1]/l_box*nside);
+      iz=(int)(cat.pos[3*ip+2]/l_box*nside);
+      box_id[ip]=ix+nside*(iy+nside*iz);
+
+      hist[box_id[ip]]++;
+    }
   }
 
-  for(ii=0;ii<nside*nside*nside;ii++) {	//allocate memory to store particle positions in each box 
-    int npar=boxes[ii].np;
-    if(npar>0) {
-      boxes[ii].pos=(double *)malloc(3*npar*sizeof(double));
-      if(boxes[ii].pos==NULL) error_mem_out();
-      boxes[ii].np=0;	//reset counter to zero
+#pragma omp parallel for default(none) shared(nchunk,nbox,hists,box_start)
+  for(ii=0;ii<nbox;ii++) {	// offset of each chunk within each box
+    int jchunk;
+    lint np=0;
+    for(jchunk=0;jchunk<nchunk;jchunk++) {
+      lint n=hists[jchunk*nbox+ii];
+      hists[jchunk*nbox+ii]=np;
+      np+=n;
     }
+    box_start[ii+1]=np;
   }
 
-  for(ii=0;ii<cat.np;ii++) {	//store box particle positions
-    int ix,iy,iz,index,offset;
+  box_start[0]=0;
+  for(ii=0;ii<nbox;ii++)	// prefix sum of box counts
+    box_start[ii+1]+=box_start[ii];
 
-    ix=(int)(cat.pos[3*ii]/l_box*nside);
-    iy=(int)(cat.pos[3*ii+1]/l_box*nside);
-    iz=(int)(cat.pos[3*ii+2]/l_box*nside);
-    index=ix+nside*(iy+nside*iz);
-    offset=3*boxes[index].np;
-    (boxes[index].pos)[offset]=cat.pos[3*ii];
-    (boxes[index].pos)[offset+1]=cat.pos[3*ii+1];
-    (boxes[index].pos)[offset+2]=cat.pos[3*ii+2];
-    (boxes[index].np)++;
+  //allocate one aligned arena for all particle positions: x, y and z
+  //arrays, each padded to a whole number of SIMD_ALIGN bytes
+  npad=SIMD_ALIGN/sizeof(double);
+  npad=npad*((cat.np+npad-1)/npad);
+  if(posix_memalign((void **)&arena,SIMD_ALIGN,MAX(3*npad,1)*sizeof(double)))
+    error_mem_out();
+
+  for(ii=0;ii<nbox;ii++) {	//point each box to its slice of the arena
+    boxes[ii].np=(int)(box_start[ii+1]-box_start[ii]);
+    boxes[ii].x=arena+box_start[ii];
+    boxes[ii].y=arena+npad+box_start[ii];
+    boxes[ii].z=arena+2*npad+box_start[ii];
   }
 
+#pragma omp parallel for default(none) shared(cat,nchunk,nbox,box_id,hists,box_start,arena,npad)
+  for(ichunk=0;ichunk<nchunk;ichunk++) {	//store box particle positions
+    lint ip;
+    lint *hist=&(hists[ichunk*nbox]);
+    lint i0=(cat.np*ichunk)/nchunk;
+    lint i1=(cat.np*(ichunk+1))/nchunk;
+    for(ip=i0;ip<i1;ip++) {
+      int index=box_id[ip];
+      lint offset=box_start[index]+hist[index];
+      arena[offset]=cat.pos[3*ip];
+      arena[npad+offset]=cat.pos[3*ip+1];
+      arena[2*npad+offset]=cat.pos[3*ip+2];
+      hist[index]++;
+    }
+  }
+
+  free(hists);
+  free(box_start);
+  free(box_id);
+
   printf("\n");
   
   return boxes;
@@ -438,3 +438,481 @@ double *pos_2_tsc(Catalog cat)
 
   return grid;
 }
+
+/*********************************************************************/
+//                 Fourier transforms of the mesh                    //
+/*********************************************************************/
+// The correlation of the mesh at every grid separation is found as
+//   xi(Delta)=<delta(x)*delta(x+Delta)>=sum_k |delta_k|^2 exp(i*k*Delta)/N^6
+// with N^3=n_grid^3 cells, at a cost ~N^3*log(N) instead of pairing
+// every cell with every other one. The FFTs below take any n_grid:
+// powers of 2 are transformed directly, other sizes with Bluestein's
+// algorithm on top of those.
+typedef struct {
+  int n;                 //Transform length
+  int n2;                //Length of the radix-2 transforms
+  double complex *tw;    //Twiddle factors of the radix-2 transforms
+  double complex *chirp; //exp(i*pi*j^2/n), NULL if n is a power of 2
+  double complex *chirp_ft; //Transform of the zero-padded chirp
+} FFTPlan;
+
+static void fft_radix2(int n,double complex *tw,double complex *z)
+{
+  //////
+  // In-place forward FFT of the n (a power of 2) complex
+  // numbers in z, with twiddle factors tw from mk_FFTPlan
+  int i,j,len;
+
+  for(i=1,j=0;i<n;i++) {
+    int bit=n>>1;
+    for(;j&bit;bit>>=1)
+      j^=bit;
+    j^=bit;
+    if(i<j) {
+      double complex tmp=z[i];
+      z[i]=z[j];
+      z[j]=tmp;
+    }
+  }
+
+  for(len=2;len<=n;len<<=1) {
+    int half=len/2;
+    int step=n/len;
+    for(i=0;i<n;i+=len) {
+      for(j=0;j<half;j++) {
+	double complex t=z[i+j+half]*tw[j*step];
+	z[i+j+half]=z[i+j]-t;
+	z[i+j]+=t;
+      }
+    }
+  }
+}
+
+static FFTPlan *mk_FFTPlan(int n)
+{
+  //////
+  // Prepares the FFTs of length n
+  int j;
+  FFTPlan *plan=(FFTPlan *)malloc(sizeof(FFTPlan));
+  if(plan==NULL) error_mem_out();
+
+  plan->n=n;
+  plan->n2=1;
+  if(n&(n-1)) {
+    while(plan->n2<2*n-1)
+      plan->n2<<=1;
+  }
+  else
+    plan->n2=n;
+
+  plan->tw=(double complex *)malloc(MAX(plan->n2/2,1)*sizeof(double complex));
+  if(plan->tw==NULL) error_mem_out();
+  for(j=0;j<plan->n2/2;j++)
+    plan->tw[j]=cos(2*M_PI*j/plan->n2)-I*sin(2*M_PI*j/plan->n2);
+
+  plan->chirp=NULL;
+  plan->chirp_ft=NULL;
+  if(plan->n2!=n) {
+    plan->chirp=(double complex *)malloc(n*sizeof(double complex));
+    plan->chirp_ft=(double complex *)calloc(plan->n2,sizeof(double complex));
+    if((plan->chirp==NULL)||(plan->chirp_ft==NULL)) error_mem_out();
+    for(j=0;j<n;j++) {
+      //j^2 is reduced mod 2n to keep the phase accurate
+      double ph=M_PI*(double)(((long)j*j)%(2*n))/n;
+      plan->chirp[j]=cos(ph)+I*sin(ph);
+    }
+    for(j=0;j<n;j++) {
+      plan->chirp_ft[j]=plan->chirp[j];
+      if(j>0) plan->chirp_ft[plan->n2-j]=plan->chirp[j];
+    }
+    fft_radix2(plan->n2,plan->tw,plan->chirp_ft);
+  }
+
+  return plan;
+}
+
+static void free_FFTPlan(FFTPlan *plan)
+{
+  free(plan->tw);
+  if(plan->chirp!=NULL) {
+    free(plan->chirp);
+    free(plan->chirp_ft);
+  }
+  free(plan);
+}
+
+static void fft_line(FFTPlan *plan,double complex *z,double complex *work)
+{
+  //////
+  // In-place forward FFT of the plan->n complex numbers in z.
+  // work must have room for plan->n2 complex numbers
+  int j,n=plan->n,n2=plan->n2;
+  double complex *c=plan->chirp;
+  double complex *cf=plan->chirp_ft;
+
+  if(c==NULL) {
+    fft_radix2(n,plan->tw,z);
+    return;
+  }
+
+  //X_k=c*_k sum_j (z_j c*_j) c_{k-j}, with the convolution done
+  //with radix-2 FFTs (the inverse one through conjugation)
+  for(j=0;j<n;j++)
+    work[j]=z[j]*conj(c[j]);
+  for(j=n;j<n2;j++)
+    work[j]=0;
+  fft_radix2(n2,plan->tw,work);
+  for(j=0;j<n2;j++)
+    work[j]=conj(work[j]*cf[j]);
+  fft_radix2(n2,plan->tw,work);
+  for(j=0;j<n;j++)
+    z[j]=conj(work[j])*conj(c[j])/n2;
+}
+
+static void fft_grid_yz(double complex *dk,FFTPlan *plan)
+{
+  //////
+  // Transforms the half-spectrum dk (see grid_r2k) along y and z
+  int nh=n_grid/2+1;
+  lint n_lines=nh*((lint)n_grid);
+
+#pragma omp parallel default(none)		\
+  shared(dk,plan,n_grid,nh,n_lines)
+  {
+    lint il;
+    lint stride_z=nh*((lint)n_grid);
+    double complex *line=(double complex *)malloc(n_grid*sizeof(double complex));
+    double complex *work=(double complex *)malloc(plan->n2*sizeof(double complex));
+    if((line==NULL)||(work==NULL)) error_mem_out();
+
+    //Lines along y, labelled by il=kx+nh*iz
+#pragma omp for
+    for(il=0;il<n_lines;il++) {
+      int j;
+      double complex *d0=&(dk[il%nh+stride_z*(il/nh)]);
+      for(j=0;j<n_grid;j++)
+	line[j]=d0[nh*j];
+      fft_line(plan,line,work);
+      for(j=0;j<n_grid;j++)
+	d0[nh*j]=line[j];
+    } //end omp for
+
+    //Lines along z, labelled by il=kx+nh*ky
+#pragma omp for
+    for(il=0;il<n_lines;il++) {
+      int j;
+      double complex *d0=&(dk[il]);
+      for(j=0;j<n_grid;j++)
+	line[j]=d0[stride_z*j];
+      fft_line(plan,line,work);
+      for(j=0;j<n_grid;j++)
+	d0[stride_z*j]=line[j];
+    } //end omp for
+
+    free(line);
+    free(work);
+  } //end omp parallel
+}
+
+static double complex *grid_r2k(double *grid,FFTPlan *plan)
+{
+  //////
+  // Returns the Fourier transform of the real grid (laid out
+  // as grid[ix+n_grid*(iy+n_grid*iz)]). Only kx<=n_grid/2 is
+  // kept, the rest being given by delta_{-k}=delta_k^*, so the
+  // result is stored as dk[kx+(n_grid/2+1)*(ky+n_grid*kz)]
+  int nh=n_grid/2+1;
+  lint n_lines=n_grid*((lint)n_grid);
+  double complex *dk=(double complex *)malloc(nh*n_lines*sizeof(double complex));
+  if(dk==NULL) error_mem_out();
+
+#pragma omp parallel default(none)		\
+  shared(dk,grid,plan,n_grid,nh,n_lines)
+  {
+    lint ip;
+    double complex *line=(double complex *)malloc(n_grid*sizeof(double complex));
+    double complex *work=(double complex *)malloc(plan->n2*sizeof(double complex));
+    if((line==NULL)||(work==NULL)) error_mem_out();
+
+    //Lines along x are real, so they are transformed in pairs
+    //as a+i*b, with a_k=(z_k+z*_{-k})/2 and b_k=(z_k-z*_{-k})/2i
+#pragma omp for
+    for(ip=0;ip<(n_lines+1)/2;ip++) {
+      int j;
+      lint il=2*ip;
+      double *ga=&(grid[n_grid*il]);
+      double *gb=&(grid[n_grid*(il+1)]);
+      if(il+1<n_lines) {
+	for(j=0;j<n_grid;j++)
+	  line[j]=ga[j]+I*gb[j];
+      }
+      else {
+	for(j=0;j<n_grid;j++)
+	  line[j]=ga[j];
+      }
+      fft_line(plan,line,work);
+      for(j=0;j<nh;j++) {
+	double complex zk=line[j];
+	double complex zmk=conj(line[(n_grid-j)%n_grid]);
+	dk[j+nh*il]=0.5*(zk+zmk);
+	if(il+1<n_lines)
+	  dk[j+nh*(il+1)]=-0.5*I*(zk-zmk);
+      }
+    } //end omp for
+
+    free(line);
+    free(work);
+  } //end omp parallel
+
+  fft_grid_yz(dk,plan);
+
+  return dk;
+}
+
+static void grid_k2r(double complex *dk,double *grid,FFTPlan *plan)
+{
+  //////
+  // Inverse of grid_r2k for a field that is even under k->-k
+  // (such as a power spectrum), for which forward and backward
+  // transforms coincide. The result is stored in grid and dk
+  // is overwritten
+  int nh=n_grid/2+1;
+  lint n_lines=n_grid*((lint)n_grid);
+
+  fft_grid_yz(dk,plan);
+
+#pragma omp parallel default(none)		\
+  shared(dk,grid,plan,n_grid,nh,n_lines)
+  {
+    lint ip;
+    double complex *line=(double complex *)malloc(n_grid*sizeof(double complex));
+    double complex *work=(double complex *)malloc(plan->n2*sizeof(double complex));
+    if((line==NULL)||(work==NULL)) error_mem_out();
+
+    //Lines along x are hermitian and their transforms real,
+    //so pairs of them are transformed together as a+i*b
+#pragma omp for
+    for(ip=0;ip<(n_lines+1)/2;ip++) {
+      int j;
+      lint il=2*ip;
+      int has_b=(il+1<n_lines);
+      double *ga=&(grid[n_grid*il]);
+      double *gb=&(grid[n_grid*(il+1)]);
+      for(j=0;j<nh;j++) {
+	double complex ak=dk[j+nh*il];
+	double complex bk=has_b ? dk[j+nh*(il+1)] : 0;
+	line[j]=ak+I*bk;
+	if((j>0)&&(2*j<n_grid))
+	  line[n_grid-j]=conj(ak)+I*conj(bk);
+      }
+      fft_line(plan,line,work);
+      for(j=0;j<n_grid;j++)
+	ga[j]=creal(line[j]);
+      if(has_b) {
+	for(j=0;j<n_grid;j++)
+	  gb[j]=cimag(line[j]);
+      }
+    } //end omp for
+
+    free(line);
+    free(work);
+  } //end omp parallel
+}
+
+static void dk_2_xi(double complex *dk,double *grid,FFTPlan *plan,
+		    int window_order,int interlaced,lint np)
+{
+  //////
+  // Stores in grid the correlation function of the field
+  // transformed into dk, which is overwritten. If window_order>0
+  // the field was painted from np particles with the mass
+  // assignment window W(k)=prod_i sinc(k_i*a_grid/2)^window_order
+  // (1 for NGP, 2 for CIC, 3 for TSC). The shot noise of the
+  // particles, aliased as sum_n W^2(k+2*pi*n/a_grid)/np, is then
+  // subtracted from the power spectrum before dividing it by
+  // W^2(k): its aliases are not shaped as W^2(k), and dividing
+  // them too would spread the self-pairs over nonzero lags.
+  // Interlaced grids (see interlace_dk) only keep the aliases
+  // with even n_x+n_y+n_z
+  int ii,nh=n_grid/2+1;
+  lint n_modes=nh*((lint)n_grid)*n_grid;
+  double n_grid_tot=(double)n_grid*n_grid*n_grid;
+  double norm=1./(n_grid_tot*n_grid_tot);
+  double shot=(window_order>0) ? 1./np : 0;
+  double *iw2=(double *)malloc(n_grid*sizeof(double));
+  double *sum_w2=(double *)malloc(n_grid*sizeof(double));
+  double *alt_w2=(double *)malloc(n_grid*sizeof(double));
+  if((iw2==NULL)||(sum_w2==NULL)||(alt_w2==NULL)) error_mem_out();
+
+  //1/W^2 along each axis, for the wavenumber k_i=2*pi*m/l_box
+  //with m=ii or ii-n_grid, whichever is closest to 0, and the
+  //sums of W^2 over its aliases, plain and with signs (-1)^n
+  for(ii=0;ii<n_grid;ii++) {
+    int m=(2*ii<=n_grid) ? ii : ii-n_grid;
+    double x=M_PI*m/n_grid;
+    double w=(m==0) ? 1 : pow(sin(x)/x,window_order);
+    double s2=sin(x)*sin(x),c=cos(x);
+    iw2[ii]=1./(w*w);
+    if(window_order==1) {
+      sum_w2[ii]=1;
+      alt_w2[ii]=c;
+    }
+    else if(window_order==2) {
+      sum_w2[ii]=1-2*s2/3;
+      alt_w2[ii]=c*(c*c+5)/6;
+    }
+    else {
+      sum_w2[ii]=1-s2+2*s2*s2/15;
+      alt_w2[ii]=c*(c*c*(c*c+58)+61)/120;
+    }
+  }
+
+#pragma omp parallel default(none)		\
+  shared(dk,n_modes,norm,nh,n_grid,iw2,sum_w2,alt_w2,shot,interlaced)
+  {
+    lint jj;
+#pragma omp for
+    for(jj=0;jj<n_modes;jj++) {
+      double complex d=dk[jj];
+      lint iyz=jj/nh;
+      int ix=jj%nh,iy=iyz%n_grid,iz=iyz/n_grid;
+      double iw2k=iw2[ix]*iw2[iy]*iw2[iz];
+      double sn=sum_w2[ix]*sum_w2[iy]*sum_w2[iz];
+      //The Nyquist planes are not interlaced
+      if(interlaced&&(2*ix!=n_grid)&&(2*iy!=n_grid)&&(2*iz!=n_grid))
+	sn=0.5*(sn+alt_w2[ix]*alt_w2[iy]*alt_w2[iz]);
+      if(jj==0) //The mean density carries no shot noise
+	sn=0;
+      dk[jj]=((creal(d)*creal(d)+cimag(d)*cimag(d))*norm-sn*shot)*iw2k;
+    }
+  } //end omp parallel
+
+  grid_k2r(dk,grid,plan);
+
+  free(iw2);
+  free(sum_w2);
+  free(alt_w2);
+}
+
+void grid_2_xi(double *grid)
+{
+  //////
+  // Replaces the overdensity field in grid by its
+  // correlation function at every grid separation,
+  // xi(Delta)=grid[ix+n_grid*(iy+n_grid*iz)] with
+  // Delta=(ix,iy,iz)*l_box/n_grid (mod l_box)
+  FFTPlan *plan=mk_FFTPlan(n_grid);
+  double complex *dk;
+
+  printf("  Fourier-transforming grid ...\n");
+  dk=grid_r2k(grid,plan);
+  dk_2_xi(dk,grid,plan,0,0,0);
+
+  free(dk);
+  free_FFTPlan(plan);
+}
+
+static double *pos_2_grid(Catalog cat)
+{
+  //////
+  // Returns the overdensity grid of the catalog
+  // for the mass assignment pm_assignment
+  if(pm_assignment==1)
+    return pos_2_ngp(cat);
+  else if(pm_assignment==2)
+    return pos_2_cic(cat);
+  else
+    return pos_2_tsc(cat);
+}
+
+static void interlace_dk(double complex *dk,Catalog cat,FFTPlan *plan)
+{
+  //////
+  // Paints the catalog shifted by s=(1,1,1)*a_grid/2,
+  // and averages its transform with dk as
+  //   delta_k=(delta_k+exp(i*k*s)*delta^s_k)/2,
+  // which cancels the aliases of odd order in each direction.
+  // The Nyquist planes (for even n_grid) are left as they are
+  int ii,nh=n_grid/2+1;
+  lint jj,n_modes=nh*((lint)n_grid)*n_grid;
+  double agrid=l_box/n_grid;
+  double complex *phase,*dk_s;
+  double *grid_s;
+  Catalog cat_s;
+
+  cat_s.np=cat.np;
+  cat_s.map=NULL;
+  cat_s.map_size=0;
+  cat_s.pos=(double *)malloc(3*cat.np*sizeof(double));
+  if(cat_s.pos==NULL) error_mem_out();
+  for(jj=0;jj<3*cat.np;jj++) {
+    double x=cat.pos[jj]+0.5*agrid;
+    if(x>=l_box) x-=l_box;
+    cat_s.pos[jj]=x;
+  }
+
+  printf("  Interlacing grid ...\n");
+  grid_s=pos_2_grid(cat_s);
+  free(cat_s.pos);
+  dk_s=grid_r2k(grid_s,plan);
+  free(grid_s);
+
+  //exp(i*k_i*a_grid/2) along each axis, 0 at the Nyquist frequency
+  phase=(double complex *)malloc(n_grid*sizeof(double complex));
+  if(phase==NULL) error_mem_out();
+  for(ii=0;ii<n_grid;ii++) {
+    int m=(2*ii<n_grid) ? ii : ii-n_grid;
+    if(2*ii==n_grid)
+      phase[ii]=0;
+    else
+      phase[ii]=cos(M_PI*m/n_grid)+I*sin(M_PI*m/n_grid);
+  }
+
+#pragma omp parallel default(none)		\
+  shared(dk,dk_s,n_modes,nh,n_grid,phase)
+  {
+    lint kk;
+#pragma omp for
+    for(kk=0;kk<n_modes;kk++) {
+      lint iyz=kk/nh;
+      double complex ph=phase[kk%nh]*phase[iyz%n_grid]*phase[iyz/n_grid];
+      if(ph!=0)
+	dk[kk]=0.5*(dk[kk]+ph*dk_s[kk]);
+    }
+  } //end omp parallel
+
+  free(phase);
+  free(dk_s);
+}
+
+double *pos_2_xi(Catalog cat)
+{
+  //////
+  // Returns the correlation function at every grid
+  // separation (laid out as in grid_2_xi) of the catalog
+  // painted with the mass assignment pm_assignment. The shot
+  // noise is subtracted and the assignment window deconvolved
+  // from the power spectrum (see dk_2_xi), and, if
+  // pm_interlacing is set, aliasing is reduced by interlacing
+  // two grids shifted by half a cell
+  FFTPlan *plan=mk_FFTPlan(n_grid);
+  double complex *dk;
+  double *grid;
+
+  grid=pos_2_grid(cat);
+  printf("  Fourier-transforming grid ...\n");
+  dk=grid_r2k(grid,plan);
+  free(grid);
+
+  if(pm_interlacing)
+    interlace_dk(dk,cat,plan);
+
+  grid=(double *)malloc(n_grid*((lint)(n_grid*n_grid))*sizeof(double));
+  if(grid==NULL) error_mem_out();
+  dk_2_xi(dk,grid,plan,pm_assignment,pm_interlacing,cat.np);
+
+  free(dk);
+  free_FFTPlan(plan);
+
+  return grid;
+}
@@ -33,4 +33,8 @@ double *read_grid(void);
 
 double *resize_grid(double *grid,int new_n_grid);
 
+void grid_2_xi(double *grid);
+
+double *pos_2_xi(Catalog cat);
+
 #endif //_CUTE_PM_
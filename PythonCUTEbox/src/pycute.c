@@ -135,6 +135,8 @@ Catalog *create_catalog_from_numpy(int n, double *x, int n1, double *y, int n2,
   Catalog *cat = malloc(sizeof(Catalog));
   cat->np = n;
   cat->pos=(double *)malloc(3*cat->np*sizeof(double));
+  cat->map=NULL;
+  cat->map_size=0;
   int i;
   for(i = 0; i < n; i++){
     cat->pos[3*i] = x[i];
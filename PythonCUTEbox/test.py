@@ -8,6 +8,7 @@ import numpy as np
  test_type = 3 : supply CUTE with a galaxy catalog from python and run with do_CFF = 0 and no randoms
  test_type = 4 : supply all catalogs from python and run with do_CFF = 0 and with randoms
  test_type = 5 : supply all catalogs from python and run with do_CFF = 1 and with randoms
+ test_type = 6 : run the PM algorithm on a uniform catalog painted with NGP, CIC and TSC
 '''
 def run_a_test(test_type):
   
@@ -178,6 +179,51 @@ def run_a_test(test_type):
   
     #############################################################################
 
+  elif(test_type == 6):
+
+    #############################################################################
+
+    # PM on a uniform catalog, for which xi should vanish at every r: the
+    # shot noise of painted grids must not leak into nonzero lags
+    np.random.seed(1234)
+    box_size = 200.0
+    n_grid_side = 32
+    pos = np.random.uniform(0, box_size, (3, 40000))
+    galaxy_catalog = pycutebox.createCatalogFromNumpy(pos[0], pos[1], pos[2])
+
+    for pm_assignment in [1, 2, 3]:
+      for pm_interlacing in [0, 1]:
+        pycutebox.set_CUTEbox_parameters(
+            data_filename="not_relevant_as_we_supply_it",
+            data_filename2="notdefault",
+            random_filename="notdefault",
+            use_randoms=0,
+            reuse_randoms=0,
+            num_lines="all",
+            input_format=0,
+            output_filename="test/corr.dat",
+            corr_type=1,
+            box_size=box_size,
+            use_tree=0,
+            max_tree_order=6,
+            max_tree_nparts=100,
+            do_CCF=0,
+            n_grid_side=n_grid_side,
+            use_pm=1,
+            pm_assignment=pm_assignment,
+            pm_interlacing=pm_interlacing)
+
+        x, corr, paircounts = pycutebox.runCUTEbox(galaxy_catalog = galaxy_catalog)
+
+        # Only separations of at least one cell are resolved
+        xi_max = np.max(np.fabs(corr[x > box_size / n_grid_side]))
+        print pm_assignment, pm_interlacing, xi_max
+        assert xi_max < 0.03
+
+    pycutebox.freeCatalog(galaxy_catalog)
+
+    #############################################################################
+
 
 #############################################################################
 # Test different ways of using the script
@@ -193,4 +239,6 @@ run_a_test(4)
 
 run_a_test(5)
 
+run_a_test(6)
+
 